@@ -11,6 +11,14 @@ enum {
   RFS_MCACHE   = (1 << 4)  ///< Cache content at client.
 };
 
+/// @brief Called when an asynchronous request completes.
+/// This is invoked on the rfs worker thread, so it must not block and must
+/// not call any of the blocking rfs_* functions. Submitting further
+/// asynchronous requests from it is allowed.
+/// @param [in] ret The result of the request; 0 on success, -errno on failure.
+/// @param [in] data The data pointer provided when the request was submitted.
+typedef void (*rfs_cb_t)(int ret, void* data);
+
 void rfs_init(void);
 
 void rfs_deinit(void);
@@ -25,6 +33,91 @@ int rfs_mount(int fd,
 
 int rfs_unmount(const char* name, const char* old);
 
+// The asynchronous variants below take the same arguments as the blocking
+// calls above. The arguments are copied before these functions return, so
+// the caller doesn't need to keep them alive while the request is in flight.
+// They return 0 once the request is queued, in which case cb will be called
+// exactly once with the result; or -errno if the request could not be queued
+// (-EAGAIN if too many requests are already outstanding), in which case cb
+// will not be called.
+
+int rfs_bind_async(const char* name,
+                   const char* old,
+                   int flags,
+                   rfs_cb_t cb,
+                   void* data);
+
+int rfs_mount_async(int fd,
+                    rfs_fd_t afd,
+                    const char* old,
+                    int flag,
+                    const char* aname,
+                    rfs_cb_t cb,
+                    void* data);
+
+int rfs_unmount_async(const char* name,
+                      const char* old,
+                      rfs_cb_t cb,
+                      void* data);
+
+
+/// @brief A batch of requests which are submitted to the worker together.
+/// The requests in a batch are executed in the order they were added, and
+/// the whole batch costs a single wakeup of the worker thread.
+/// The string arguments passed to rfs_batch_bind(), rfs_batch_mount() and
+/// rfs_batch_unmount() are not copied; they must remain valid until the
+/// batch has completed.
+typedef struct rfs_batch rfs_batch_t;
+
+/// @brief Create an empty batch.
+/// @return The new batch; NULL if out of memory.
+rfs_batch_t* rfs_batch_new(void);
+
+/// @brief Release a batch.
+/// The batch must not have a submission in flight.
+void rfs_batch_free(rfs_batch_t* batch);
+
+/// @brief Remove all requests from a batch so it can be reused.
+void rfs_batch_clear(rfs_batch_t* batch);
+
+/// @brief Add a bind request to the batch; see rfs_bind().
+/// @return The index of the request in the batch; -errno on failure.
+int rfs_batch_bind(rfs_batch_t* batch,
+                   const char* name,
+                   const char* old,
+                   int flags);
+
+/// @brief Add a mount request to the batch; see rfs_mount().
+/// @return The index of the request in the batch; -errno on failure.
+int rfs_batch_mount(rfs_batch_t* batch,
+                    int fd,
+                    rfs_fd_t afd,
+                    const char* old,
+                    int flag,
+                    const char* aname);
+
+/// @brief Add an unmount request to the batch; see rfs_unmount().
+/// @return The index of the request in the batch; -errno on failure.
+int rfs_batch_unmount(rfs_batch_t* batch, const char* name, const char* old);
+
+/// @brief Execute every request in the batch and wait for them to complete.
+/// @return 0 if every request succeeded; the result of the first failed
+/// request otherwise. Use rfs_batch_ret() for the results of each request.
+int rfs_batch_submit(rfs_batch_t* batch);
+
+/// @brief Queue every request in the batch for execution.
+/// cb is called once, after the last request in the batch has completed,
+/// with the value rfs_batch_submit() would have returned. The batch must
+/// not be modified or freed until then.
+/// @return 0 if the batch was queued; -errno on failure, in which case cb
+/// will not be called.
+int rfs_batch_submit_async(rfs_batch_t* batch, rfs_cb_t cb, void* data);
+
+/// @brief Retrieve the result of one request of a completed batch.
+/// @param [in] batch The completed batch.
+/// @param [in] idx The index returned when the request was added.
+/// @return 0 on success, -errno on failure.
+int rfs_batch_ret(const rfs_batch_t* batch, int idx);
 
 #endif
 
@@ -35,23 +35,23 @@ typedef struct rfs_qid {
 // which is the assumed size of an enum in C.
 
 /// @brief The entity is a directory.
-#define  RFS_DMDIR        = 0x80000000,
+#define  RFS_DMDIR        0x80000000U
 /// @brief The entity is an append-only file.
-#define  RFS_DMAPPEND     = 0x40000000,
+#define  RFS_DMAPPEND     0x40000000U
 /// @brief The entity is an exclusive use file.
-#define  RFS_DMEXCL       = 0x20000000,
+#define  RFS_DMEXCL       0x20000000U
 /// @brief The entity is a mounted channel.
-#define  RFS_DMMOUNT      = 0x10000000,
+#define  RFS_DMMOUNT      0x10000000U
 /// @brief The entity is an authentication file.
-#define  RFS_DMAUTH       = 0x08000000,
+#define  RFS_DMAUTH       0x08000000U
 /// @brief The entity is not backed up.
-#define  RFS_DMTMP        = 0x04000000,
+#define  RFS_DMTMP        0x04000000U
 /// @brief The read permission bit.
-#define  RFS_DMREAD       = 0x4,
+#define  RFS_DMREAD       0x4U
 /// @brief The write permission bit..
-#define  RFS_DMWRITE      = 0x2,
+#define  RFS_DMWRITE      0x2U
 /// @brief The execute permission bit.
-#define  RFS_DMEXEC       = 0x1
+#define  RFS_DMEXEC       0x1U
 
 /// @brief A directory entity. man 2 stat for more details.
 typedef struct rfs_dirent {
@@ -0,0 +1,139 @@
+#include "rfs_9p_ids.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "rfs_9p_wire.h"
+
+void rfs__9p_tags_init(rfs__9p_tags_t* tags) {
+  assert(tags != NULL);
+
+  for(size_t i = 0; i < RFS__9P_TAG_WORDS; ++i)
+    tags->l0[i] = ~(uint64_t) 0;
+
+  for(size_t i = 0; i < RFS__9P_TAG_WORDS / 64; ++i)
+    tags->l1[i] = ~(uint64_t) 0;
+
+  tags->l2 = ~(uint64_t) 0 >> (64 - RFS__9P_TAG_WORDS / 64);
+  tags->used = 0;
+
+  // NOTAG is the last bit of the last word, which remains non-empty
+  tags->l0[RFS__9P_NOTAG / 64] &= ~((uint64_t) 1 << (RFS__9P_NOTAG % 64));
+}
+
+uint16_t rfs__9p_tag_acquire(rfs__9p_tags_t* tags) {
+  assert(tags != NULL);
+
+  if(tags->l2 == 0)
+    return RFS__9P_NOTAG;
+
+  unsigned i2 = (unsigned) __builtin_ctzll(tags->l2);
+  unsigned i1 = i2 * 64 + (unsigned) __builtin_ctzll(tags->l1[i2]);
+  unsigned tag = i1 * 64 + (unsigned) __builtin_ctzll(tags->l0[i1]);
+
+  // clear the bit, and the summary bits above it if its word is now full
+  tags->l0[i1] &= tags->l0[i1] - 1;
+
+  if(tags->l0[i1] == 0) {
+    tags->l1[i2] &= ~((uint64_t) 1 << (i1 % 64));
+
+    if(tags->l1[i2] == 0)
+      tags->l2 &= ~((uint64_t) 1 << i2);
+  }
+
+  tags->used++;
+
+  return (uint16_t) tag;
+}
+
+void rfs__9p_tag_release(rfs__9p_tags_t* tags, uint16_t tag) {
+  assert(tags != NULL);
+  assert(tag != RFS__9P_NOTAG);
+
+  unsigned i1 = tag / 64;
+  unsigned i2 = i1 / 64;
+
+  assert((tags->l0[i1] & ((uint64_t) 1 << (tag % 64))) == 0);
+
+  tags->l0[i1] |= (uint64_t) 1 << (tag % 64);
+  tags->l1[i2] |= (uint64_t) 1 << (i1 % 64);
+  tags->l2 |= (uint64_t) 1 << i2;
+  tags->used--;
+}
+
+int rfs__9p_fids_init(rfs__9p_fids_t* fids, uint32_t nfids) {
+  assert(fids != NULL);
+  assert(nfids > 0);
+
+  size_t nwords = ((size_t) nfids + 63) / 64;
+
+  fids->words = calloc(nwords, sizeof(uint64_t));
+
+  if(fids->words == NULL)
+    return -ENOMEM;
+
+  // mark the bits past the end of the range as permanently in use; since
+  // nfids is at most NOFID, this also keeps NOFID from being allocated
+  if(nfids % 64 != 0)
+    fids->words[nwords - 1] = ~(uint64_t) 0 << (nfids % 64);
+
+  fids->nwords = nwords;
+  fids->hint = 0;
+
+  return 0;
+}
+
+void rfs__9p_fids_free(rfs__9p_fids_t* fids) {
+  assert(fids != NULL);
+
+  free(fids->words);
+  fids->words = NULL;
+  fids->nwords = 0;
+}
+
+uint32_t rfs__9p_fid_acquire(rfs__9p_fids_t* fids) {
+  assert(fids != NULL);
+
+  size_t start = __atomic_load_n(&(fids->hint), __ATOMIC_RELAXED);
+
+  for(size_t n = 0; n < fids->nwords; ++n) {
+    size_t w = (start + n) % fids->nwords;
+    uint64_t val = __atomic_load_n(&(fids->words[w]), __ATOMIC_RELAXED);
+
+    while(~val != 0) {
+      unsigned bit = (unsigned) __builtin_ctzll(~val);
+
+      // on failure val is reloaded, and the next free bit in it is tried
+      if(__atomic_compare_exchange_n(&(fids->words[w]), &val,
+                                     val | ((uint64_t) 1 << bit), true,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        if(w != start)
+          __atomic_store_n(&(fids->hint), w, __ATOMIC_RELAXED);
+
+        return (uint32_t) (w * 64 + bit);
+      }
+    }
+  }
+
+  return RFS__9P_NOFID;
+}
+
+void rfs__9p_fid_release(rfs__9p_fids_t* fids, uint32_t fid) {
+  assert(fids != NULL);
+  assert(fid / 64 < fids->nwords);
+
+  uint64_t mask = (uint64_t) 1 << (fid % 64);
+  uint64_t prev = __atomic_fetch_and(&(fids->words[fid / 64]), ~mask,
+                                     __ATOMIC_RELEASE);
+
+  assert((prev & mask) != 0);
+  (void) prev;
+
+  // steer searches back towards low fids so the bitmap stays dense
+  size_t hint = __atomic_load_n(&(fids->hint), __ATOMIC_RELAXED);
+
+  if(fid / 64 < hint)
+    __atomic_store_n(&(fids->hint), fid / 64, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,76 @@
+#ifndef RFS_9P_IDS_H
+#define RFS_9P_IDS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @file Allocators for the tags and fids used by a 9P session.
+/// Tags identify outstanding requests on one connection, and are only ever
+/// allocated and released by the thread running that connection, so the tag
+/// allocator is not synchronized. Fids may be taken by any number of client
+/// threads at once, so the fid allocator is lock-free.
+
+/// @brief The number of 64-bit words needed to track every tag.
+#define RFS__9P_TAG_WORDS         1024
+
+/// @brief A tag allocator.
+/// Free tags are tracked by a 3 level bitmap: a set bit in l0 is a free tag,
+/// a set bit in l1 is a word of l0 with a free tag, and a set bit in l2 is
+/// a word of l1 with a free tag. Finding a free tag is therefore 3 count
+/// trailing zero operations regardless of how many tags are in use.
+typedef struct rfs__9p_tags {
+  uint64_t l0[RFS__9P_TAG_WORDS]; ///< The free tags.
+  uint64_t l1[RFS__9P_TAG_WORDS / 64]; ///< The l0 words with a free tag.
+  uint64_t l2; ///< The l1 words with a free tag.
+  uint32_t used; ///< The number of tags currently allocated.
+} rfs__9p_tags_t;
+
+/// @brief Initialize a tag allocator with every tag free.
+/// NOTAG is never handed out, leaving 65535 usable tags.
+/// @param [in] tags The allocator to initialize.
+void rfs__9p_tags_init(rfs__9p_tags_t* tags);
+
+/// @brief Allocate the lowest free tag.
+/// @param [in] tags The allocator to allocate from.
+/// @return The tag; RFS__9P_NOTAG if every tag is in use.
+uint16_t rfs__9p_tag_acquire(rfs__9p_tags_t* tags);
+
+/// @brief Return a tag to the allocator.
+/// @param [in] tags The allocator the tag was acquired from.
+/// @param [in] tag The tag to release; must currently be allocated.
+void rfs__9p_tag_release(rfs__9p_tags_t* tags, uint16_t tag);
+
+/// @brief A lock-free fid allocator.
+/// Fids in use are tracked by a bitmap which threads claim bits of with a
+/// compare and swap. Threads start searching from the word the last
+/// allocation succeeded in, which keeps the search short while the low fids
+/// are busy.
+typedef struct rfs__9p_fids {
+  uint64_t* words; ///< The bitmap; a set bit is a fid in use.
+  size_t nwords; ///< The number of words in the bitmap.
+  size_t hint; ///< The word to start searching from.
+} rfs__9p_fids_t;
+
+/// @brief Initialize a fid allocator.
+/// @param [in] fids The allocator to initialize.
+/// @param [in] nfids The number of fids available; they are numbered from 0.
+/// @return 0 on success, -errno on failure.
+int rfs__9p_fids_init(rfs__9p_fids_t* fids, uint32_t nfids);
+
+/// @brief Free the memory held by a fid allocator.
+/// @param [in] fids The allocator to free.
+void rfs__9p_fids_free(rfs__9p_fids_t* fids);
+
+/// @brief Allocate a free fid.
+/// This may be called by any number of threads concurrently.
+/// @param [in] fids The allocator to allocate from.
+/// @return The fid; RFS__9P_NOFID if every fid is in use.
+uint32_t rfs__9p_fid_acquire(rfs__9p_fids_t* fids);
+
+/// @brief Return a fid to the allocator.
+/// This may be called by any number of threads concurrently.
+/// @param [in] fids The allocator the fid was acquired from.
+/// @param [in] fid The fid to release; must currently be allocated.
+void rfs__9p_fid_release(rfs__9p_fids_t* fids, uint32_t fid);
+
+#endif
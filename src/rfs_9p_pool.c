@@ -0,0 +1,111 @@
+#include "rfs_9p_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+/// @brief Reset a request to an empty state, releasing its allocations.
+/// @param [in] req The request to reset.
+static void req_reset(rfs__9p_req_t* req) {
+  rfs__9p_msg_init(&(req->msg));
+  rfs__9p_stat_init(&(req->stat));
+  rfs__arena_reset(&(req->arena));
+  req->next = NULL;
+}
+
+void rfs__9p_pool_init(rfs__9p_pool_t* pool, size_t maxfree, size_t chunksize) {
+  assert(pool != NULL);
+  assert(chunksize > 0);
+
+  pool->free = NULL;
+  pool->nfree = 0;
+  pool->maxfree = maxfree;
+  pool->chunksize = chunksize;
+}
+
+void rfs__9p_pool_free(rfs__9p_pool_t* pool) {
+  assert(pool != NULL);
+
+  while(pool->free != NULL) {
+    rfs__9p_req_t* req = pool->free;
+    pool->free = req->next;
+
+    rfs__arena_free(&(req->arena));
+    free(req);
+  }
+
+  pool->nfree = 0;
+}
+
+rfs__9p_req_t* rfs__9p_pool_get(rfs__9p_pool_t* pool) {
+  assert(pool != NULL);
+
+  rfs__9p_req_t* req = pool->free;
+
+  if(req != NULL) {
+    pool->free = req->next;
+    pool->nfree--;
+    req->next = NULL;
+    return req;
+  }
+
+  req = malloc(sizeof(rfs__9p_req_t));
+
+  if(req == NULL)
+    return NULL;
+
+  rfs__arena_init(&(req->arena), pool->chunksize);
+  req_reset(req);
+
+  return req;
+}
+
+void rfs__9p_pool_put(rfs__9p_pool_t* pool, rfs__9p_req_t* req) {
+  assert(pool != NULL);
+  assert(req != NULL);
+
+  if(pool->nfree >= pool->maxfree) {
+    rfs__arena_free(&(req->arena));
+    free(req);
+    return;
+  }
+
+  req_reset(req);
+  req->next = pool->free;
+  pool->free = req;
+  pool->nfree++;
+}
+
+int rfs__9p_req_unpack(rfs__9p_req_t* req,
+                       const unsigned char* frame,
+                       size_t framelen) {
+  assert(req != NULL);
+  assert(frame != NULL);
+
+  const unsigned char* copy = rfs__arena_dup(&(req->arena), frame, framelen);
+
+  if(copy == NULL)
+    return -ENOMEM;
+
+  if(framelen < RFS__9P_HDRSZ)
+    return -EBADMSG;
+
+  // the stat is decoded through the message's pointer rather than allocated,
+  // so point it at the request's own storage
+  rfs__9p_msg_init(&(req->msg));
+
+  switch(copy[4]) {
+    case RFS__9P_RSTAT:
+      req->msg.params.rstat.stat = &(req->stat);
+      break;
+
+    case RFS__9P_TWSTAT:
+      req->msg.params.twstat.stat = &(req->stat);
+      break;
+  }
+
+  if(rfs__9p_msg_unpack(copy, framelen, &(req->msg)) == 0)
+    return -EBADMSG;
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef RFS_9P_POOL_H
+#define RFS_9P_POOL_H
+
+#include <stddef.h>
+
+#include "rfs_9p_wire.h"
+#include "rfs_arena.h"
+
+/// @file Pooled storage for decoded 9P messages.
+/// A request owns its decoded message, the stat it may reference and an
+/// arena holding the frame the message was decoded from along with anything
+/// else allocated while the request is being processed. Returning the
+/// request to its pool releases all of that in O(1); the structure and the
+/// arena's chunks are kept for the next request.
+
+/// @brief A decoded message and all of the memory it references.
+typedef struct rfs__9p_req {
+  rfs__9p_msg_t msg; ///< The decoded message.
+  rfs__9p_stat_t stat; ///< Storage for the stat of Rstat and Twstat.
+  rfs__arena_t arena; ///< Owns the frame and any per-request allocations.
+  struct rfs__9p_req* next; ///< The next free request in the pool.
+} rfs__9p_req_t;
+
+/// @brief A free list of requests.
+/// Pools are not thread safe; each connection (or worker) keeps its own.
+typedef struct rfs__9p_pool {
+  rfs__9p_req_t* free; ///< The requests available for reuse.
+  size_t nfree; ///< The number of requests in the free list.
+  size_t maxfree; ///< The most requests kept in the free list.
+  size_t chunksize; ///< The arena chunk size of new requests.
+} rfs__9p_pool_t;
+
+/// @brief Initialize a pool.
+/// @param [in] pool The pool to initialize.
+/// @param [in] maxfree The most idle requests to keep; requests returned
+/// beyond this are freed.
+/// @param [in] chunksize The arena chunk size of each request. This should
+/// be at least the negotiated msize so a frame fits in a single chunk.
+void rfs__9p_pool_init(rfs__9p_pool_t* pool, size_t maxfree, size_t chunksize);
+
+/// @brief Free a pool and every idle request in it.
+/// Requests which are still in use must be returned first.
+/// @param [in] pool The pool to free.
+void rfs__9p_pool_free(rfs__9p_pool_t* pool);
+
+/// @brief Take a request from a pool, allocating one if the pool is empty.
+/// @param [in] pool The pool to take from.
+/// @return The initialized request; NULL if out of memory.
+rfs__9p_req_t* rfs__9p_pool_get(rfs__9p_pool_t* pool);
+
+/// @brief Return a request to its pool.
+/// All memory referenced by the request is released at once.
+/// @param [in] pool The pool to return to.
+/// @param [in] req The request to return.
+void rfs__9p_pool_put(rfs__9p_pool_t* pool, rfs__9p_req_t* req);
+
+/// @brief Decode a frame into a request.
+/// The frame is copied into the request's arena, so the caller's buffer may
+/// be reused as soon as this returns.
+/// @param [in] req The request to decode into.
+/// @param [in] frame The serialized message.
+/// @param [in] framelen The size of the frame.
+/// @return 0 on success, -errno on failure.
+int rfs__9p_req_unpack(rfs__9p_req_t* req,
+                       const unsigned char* frame,
+                       size_t framelen);
+
+#endif
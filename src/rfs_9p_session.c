@@ -0,0 +1,460 @@
+#include "rfs_9p_session.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief Take a send buffer from the session's free list.
+/// @param [in] session The session to take the buffer from.
+/// @return The send buffer; NULL if out of memory.
+static rfs__9p_send_t* session_send_get(rfs__9p_session_t* session) {
+  rfs__9p_send_t* send = session->sends;
+
+  if(send != NULL)
+    session->sends = send->next;
+  else if((send = malloc(sizeof(rfs__9p_send_t))) == NULL)
+    return NULL;
+
+  send->next = NULL;
+  send->buf = send->hdr;
+  send->req.data = session;
+
+  return send;
+}
+
+/// @brief Return a send buffer to the session's free list.
+/// @param [in] session The session the buffer was taken from.
+/// @param [in] send The send buffer to return.
+static void session_send_put(rfs__9p_session_t* session, rfs__9p_send_t* send) {
+  if(send->buf != send->hdr)
+    rfs__bufpool_put(session->pool, send->buf, send->size);
+
+  send->next = session->sends;
+  session->sends = send;
+}
+
+/// @brief Complete an outstanding request and release its tag.
+/// @param [in] session The session the request was sent on.
+/// @param [in] tag The tag of the request.
+/// @param [in] ret The result to pass to the request's callback.
+/// @param [in] reply The reply to pass to the request's callback.
+static void session_complete(rfs__9p_session_t* session,
+                             uint16_t tag,
+                             int ret,
+                             const rfs__9p_msg_t* reply) {
+  rfs__9p_call_t* call = session->calls[tag];
+
+  session->calls[tag] = NULL;
+  session->inflight--;
+  rfs__9p_tag_release(&(session->tags), tag);
+
+  call->cb(call, ret, reply);
+}
+
+/// @brief Fail the session, completing every request with an error.
+/// Requests submitted afterwards are rejected with the same error. This
+/// does nothing if the session has already failed.
+/// @param [in] session The session to fail.
+/// @param [in] error The error to complete the requests with.
+static void session_fail(rfs__9p_session_t* session, int error) {
+  assert(error < 0);
+
+  if(session->error != 0)
+    return;
+
+  session->error = error;
+  uv_read_stop((uv_stream_t*) &(session->pipe));
+
+  if(session->versioning) {
+    rfs__9p_session_version_cb cb = session->version_cb;
+
+    session->versioning = 0;
+    session->version_cb = NULL;
+
+    if(cb != NULL)
+      cb(session, error);
+  }
+
+  for(uint32_t tag = 0; tag < session->window; ++tag) {
+    if(session->calls != NULL && session->calls[tag] != NULL)
+      session_complete(session, (uint16_t) tag, error, NULL);
+  }
+
+  while(session->pending != NULL) {
+    rfs__9p_call_t* call = session->pending;
+    session->pending = call->next;
+    call->next = NULL;
+
+    call->cb(call, error, NULL);
+  }
+
+  session->pending_tail = NULL;
+}
+
+/// @brief Called once a message has been written to the transport.
+/// @param [in] req The write request of the message.
+/// @param [in] status 0 on success, or the error which occurred.
+static void session_on_write(uv_write_t* req, int status) {
+  rfs__9p_session_t* session = req->data;
+  rfs__9p_send_t* send = (rfs__9p_send_t*) req;
+
+  session_send_put(session, send);
+
+  if(status < 0)
+    session_fail(session, status);
+}
+
+/// @brief Pack a message and write it to the transport.
+/// @param [in] session The session to send the message on.
+/// @param [in] msg The message to send, with its tag already set.
+/// @return 0 on success, -errno on failure.
+static int session_write(rfs__9p_session_t* session, rfs__9p_msg_t* msg) {
+  rfs__9p_send_t* send = session_send_get(session);
+
+  if(send == NULL)
+    return -ENOMEM;
+
+  // payloads are referenced rather than copied, so only messages with a
+  // large string argument (such as a long walk) need a bigger buffer
+  struct iovec iov[2];
+  int n = rfs__9p_msg_pack_iov(msg, send->hdr, sizeof(send->hdr), iov);
+
+  if(n == 0) {
+    uint32_t size = rfs__9p_msg_size(msg);
+
+    if(size == 0
+    || (send->buf = rfs__bufpool_get(session->pool, size)) == NULL) {
+      send->buf = send->hdr;
+      session_send_put(session, send);
+      return (size == 0 ? -EINVAL : -ENOMEM);
+    }
+
+    send->size = size;
+    n = rfs__9p_msg_pack_iov(msg, send->buf, size, iov);
+    assert(n > 0);
+  }
+
+  uv_buf_t bufs[2];
+  for(int i = 0; i < n; ++i)
+    bufs[i] = uv_buf_init(iov[i].iov_base, (unsigned int) iov[i].iov_len);
+
+  int ret = uv_write(&(send->req), (uv_stream_t*) &(session->pipe),
+                     bufs, (unsigned int) n, session_on_write);
+
+  if(ret < 0)
+    session_send_put(session, send);
+
+  return ret;
+}
+
+/// @brief Assign a tag to a request and write it to the transport.
+/// The window must have room for the request.
+/// @param [in] session The session to send the request on.
+/// @param [in] call The request to send.
+/// @return 0 on success, -errno on failure.
+static int session_send(rfs__9p_session_t* session, rfs__9p_call_t* call) {
+  assert(session->inflight < session->window);
+
+  uint16_t tag = rfs__9p_tag_acquire(&(session->tags));
+  assert(tag < session->window);
+
+  call->msg->tag = tag;
+
+  int ret = session_write(session, call->msg);
+
+  if(ret < 0) {
+    rfs__9p_tag_release(&(session->tags), tag);
+    return ret;
+  }
+
+  session->calls[tag] = call;
+  session->inflight++;
+
+  return 0;
+}
+
+/// @brief Send waiting requests while there is room in the window.
+/// @param [in] session The session to send the requests on.
+static void session_pump(rfs__9p_session_t* session) {
+  while(session->error == 0 && !session->versioning
+     && session->pending != NULL && session->inflight < session->window) {
+    rfs__9p_call_t* call = session->pending;
+    session->pending = call->next;
+    call->next = NULL;
+
+    if(session->pending == NULL)
+      session->pending_tail = NULL;
+
+    int ret = session_send(session, call);
+
+    if(ret < 0)
+      call->cb(call, ret, NULL);
+  }
+}
+
+/// @brief Adopt the msize the server agreed to in its Rversion.
+/// @param [in] session The session the reply was received on.
+/// @param [in] reply The reply to the Tversion.
+static void session_on_version(rfs__9p_session_t* session,
+                               const rfs__9p_msg_t* reply) {
+  static const char version[] = RFS__9P_SESSION_VERSION;
+  int ret = 0;
+
+  if(reply->type != RFS__9P_RVERSION)
+    ret = -EPROTO;
+  else if(reply->params.version.version.len != sizeof(version) - 1
+       || memcmp(reply->params.version.version.str, version,
+                 sizeof(version) - 1) != 0)
+    ret = -EPROTONOSUPPORT;
+  else if(reply->params.version.msize > session->msize
+       || reply->params.version.msize <= RFS__9P_IOHDRSZ)
+    ret = -EPROTO;
+
+  if(ret < 0) {
+    session_fail(session, ret);
+    return;
+  }
+
+  rfs__9p_session_version_cb cb = session->version_cb;
+
+  session->msize = reply->params.version.msize;
+  session->dec.msize = session->msize;
+  session->versioning = 0;
+  session->version_cb = NULL;
+
+  if(cb != NULL)
+    cb(session, 0);
+}
+
+/// @brief Match a reply to its request and complete the request.
+/// @param [in] session The session the reply was received on.
+/// @param [in] frame The reply.
+/// @param [in] framelen The size of the reply.
+static void session_on_frame(rfs__9p_session_t* session,
+                             const unsigned char* frame,
+                             size_t framelen) {
+  rfs__9p_msg_t reply;
+  rfs__9p_stat_t stat;
+
+  rfs__9p_msg_init(&reply);
+
+  // the decoder guarantees a full header is present
+  if(frame[4] == RFS__9P_RSTAT)
+    reply.params.rstat.stat = &stat;
+
+  if(rfs__9p_msg_unpack(frame, framelen, &reply) == 0) {
+    session_fail(session, -EBADMSG);
+    return;
+  }
+
+  if(reply.tag == RFS__9P_NOTAG && session->versioning) {
+    session_on_version(session, &reply);
+    return;
+  }
+
+  // a reply to a tag with nothing outstanding means the stream is corrupt
+  if(reply.tag >= session->window || session->calls[reply.tag] == NULL) {
+    session_fail(session, -EBADMSG);
+    return;
+  }
+
+  const rfs__9p_msg_t* msg = session->calls[reply.tag]->msg;
+
+  if(reply.type == msg->type + 1 || reply.type == RFS__9P_RERROR)
+    session_complete(session, reply.tag, 0, &reply);
+  else
+    session_complete(session, reply.tag, -EBADMSG, NULL);
+}
+
+/// @brief Provide libuv with the buffer to read into.
+/// While a frame larger than the read buffer is arriving, the rest of it is
+/// read straight into the decoder rather than copied there.
+static void session_on_alloc(uv_handle_t* handle, size_t hint, uv_buf_t* buf) {
+  (void) hint;
+
+  rfs__9p_session_t* session = handle->data;
+  unsigned char* space;
+  size_t len = rfs__9p_decoder_space(&(session->dec), &space);
+
+  if(len >= RFS__9P_SESSION_READSZ)
+    *buf = uv_buf_init((char*) space, (unsigned int) len);
+  else
+    *buf = uv_buf_init((char*) session->rbuf, RFS__9P_SESSION_READSZ);
+}
+
+/// @brief Process bytes read from the transport.
+/// Every complete reply in the read is dispatched before any waiting
+/// requests are sent, so the freed window is refilled in one pass.
+static void session_on_read(uv_stream_t* stream,
+                            ssize_t nread,
+                            const uv_buf_t* buf) {
+  rfs__9p_session_t* session = stream->data;
+
+  if(nread < 0) {
+    session_fail(session, nread == UV_EOF ? -ECONNRESET : (int) nread);
+    return;
+  }
+
+  if(buf->base != (char*) session->rbuf)
+    rfs__9p_decoder_fill(&(session->dec), (size_t) nread);
+  else
+    rfs__9p_decoder_feed(&(session->dec), (const unsigned char*) buf->base,
+                         (size_t) nread);
+
+  while(session->error == 0) {
+    const unsigned char* frame;
+    size_t framelen;
+    int ret = rfs__9p_decoder_next(&(session->dec), &frame, &framelen);
+
+    if(ret == 0)
+      break;
+
+    if(ret < 0) {
+      session_fail(session, ret);
+      return;
+    }
+
+    session_on_frame(session, frame, framelen);
+  }
+
+  session_pump(session);
+}
+
+int rfs__9p_session_init(rfs__9p_session_t* session,
+                         uv_loop_t* loop,
+                         int fd,
+                         uint32_t window,
+                         uint32_t msize,
+                         rfs__bufpool_t* pool) {
+  assert(session != NULL);
+  assert(loop != NULL);
+  assert(window > 0 && window <= RFS__9P_NOTAG);
+  assert(msize > RFS__9P_IOHDRSZ && msize <= RFS__BUFPOOL_MAXSZ);
+
+  rfs__9p_decoder_init(&(session->dec), msize);
+  rfs__9p_tags_init(&(session->tags));
+
+  session->dec.pool = pool;
+
+  session->window = window;
+  session->inflight = 0;
+  session->pending = NULL;
+  session->pending_tail = NULL;
+  session->sends = NULL;
+  session->pool = pool;
+  session->msize = msize;
+  session->versioning = 0;
+  session->version_cb = NULL;
+  session->error = 0;
+  session->close_cb = NULL;
+
+  // this only fails for handle types the platform doesn't support
+  uv_pipe_init(loop, &(session->pipe), 0);
+  session->pipe.data = session;
+
+  session->calls = calloc(window, sizeof(rfs__9p_call_t*));
+  session->rbuf = rfs__bufpool_get(pool, RFS__9P_SESSION_READSZ);
+
+  int ret = -ENOMEM;
+
+  if(session->calls == NULL || session->rbuf == NULL
+  || (ret = uv_pipe_open(&(session->pipe), fd)) < 0
+  || (ret = uv_read_start((uv_stream_t*) &(session->pipe),
+                          session_on_alloc, session_on_read)) < 0) {
+    session->error = ret;
+    return ret;
+  }
+
+  return 0;
+}
+
+/// @brief Release a session's resources once its transport has closed.
+static void session_on_close(uv_handle_t* handle) {
+  rfs__9p_session_t* session = handle->data;
+
+  // libuv completes all queued writes before closing, so every send buffer
+  // is back in the free list
+  while(session->sends != NULL) {
+    rfs__9p_send_t* send = session->sends;
+    session->sends = send->next;
+    free(send);
+  }
+
+  free(session->calls);
+  rfs__bufpool_put(session->pool, session->rbuf, RFS__9P_SESSION_READSZ);
+  session->calls = NULL;
+  session->rbuf = NULL;
+
+  rfs__9p_decoder_reset(&(session->dec));
+
+  if(session->close_cb != NULL)
+    session->close_cb(session);
+}
+
+void rfs__9p_session_close(rfs__9p_session_t* session,
+                           rfs__9p_session_close_cb cb) {
+  assert(session != NULL);
+  assert(!uv_is_closing((uv_handle_t*) &(session->pipe)));
+
+  session->close_cb = cb;
+  session_fail(session, -ECANCELED);
+  uv_close((uv_handle_t*) &(session->pipe), session_on_close);
+}
+
+int rfs__9p_session_rpc(rfs__9p_session_t* session,
+                        rfs__9p_call_t* call,
+                        rfs__9p_msg_t* msg,
+                        rfs__9p_call_cb cb) {
+  assert(session != NULL);
+  assert(call != NULL);
+  assert(msg != NULL);
+  assert(cb != NULL);
+
+  if(session->error != 0)
+    return session->error;
+
+  call->msg = msg;
+  call->cb = cb;
+  call->next = NULL;
+
+  // keep requests in submission order behind any which are already waiting
+  if(session->pending == NULL && !session->versioning
+  && session->inflight < session->window)
+    return session_send(session, call);
+
+  if(session->pending_tail != NULL)
+    session->pending_tail->next = call;
+  else
+    session->pending = call;
+
+  session->pending_tail = call;
+
+  return 0;
+}
+
+int rfs__9p_session_version(rfs__9p_session_t* session,
+                            rfs__9p_session_version_cb cb) {
+  assert(session != NULL);
+  assert(!session->versioning);
+  assert(session->inflight == 0 && session->pending == NULL);
+
+  if(session->error != 0)
+    return session->error;
+
+  rfs__9p_msg_init(&(session->vmsg));
+  session->vmsg.type = RFS__9P_TVERSION;
+  session->vmsg.tag = RFS__9P_NOTAG;
+  session->vmsg.params.version.msize = session->msize;
+  session->vmsg.params.version.version = rfs__9p_str(RFS__9P_SESSION_VERSION);
+
+  int ret = session_write(session, &(session->vmsg));
+
+  if(ret < 0)
+    return ret;
+
+  session->versioning = 1;
+  session->version_cb = cb;
+
+  return 0;
+}
@@ -0,0 +1,174 @@
+#ifndef RFS_9P_SESSION_H
+#define RFS_9P_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "rfs_9p_ids.h"
+#include "rfs_9p_wire.h"
+
+/// @file A client 9P session multiplexing many requests over one transport.
+/// Requests are tagged and written as soon as there is room in the window of
+/// outstanding requests, without waiting for earlier replies; replies are
+/// matched back to their request by tag, in whatever order the server sends
+/// them. Requests submitted while the window is full wait in a FIFO.
+/// Before any other request, the session may negotiate the msize with
+/// Tversion; requests made meanwhile wait until the server has answered.
+/// A session belongs to one event loop (normally the client worker's), and
+/// all of its functions must be called from the thread running that loop.
+
+/// @brief The default number of requests which may be outstanding at once.
+#define RFS__9P_SESSION_WINDOW    64
+
+/// @brief The size of the buffer each read from the transport is made into.
+/// The rest of a frame larger than this is read straight into the frame.
+#define RFS__9P_SESSION_READSZ    65536
+
+/// @brief The protocol version the session speaks.
+#define RFS__9P_SESSION_VERSION   "9P2000"
+
+struct rfs__9p_call;
+struct rfs__9p_session;
+
+/// @brief Called when a request completes.
+/// @param [in] call The request which completed. It may be reused or freed
+/// from within the callback.
+/// @param [in] ret 0 if a reply was received; -EBADMSG if the reply was
+/// neither the matching R-message nor Rerror; -ECANCELED if the session was
+/// closed first; otherwise the error which broke the transport.
+/// @param [in] reply The reply, which may be Rerror; NULL if ret is nonzero.
+/// The reply and the strings and data it references are only valid for the
+/// duration of the callback.
+typedef void (*rfs__9p_call_cb)(struct rfs__9p_call* call,
+                                int ret,
+                                const rfs__9p_msg_t* reply);
+
+/// @brief Called when the version negotiation completes.
+/// @param [in] session The session negotiated on.
+/// @param [in] ret 0 if the server agreed, in which case session->msize is
+/// the negotiated msize; -EPROTONOSUPPORT if it doesn't speak 9P2000;
+/// -EPROTO if its reply was invalid; otherwise the error which failed the
+/// session. On failure the session has failed too.
+typedef void (*rfs__9p_session_version_cb)(struct rfs__9p_session* session,
+                                           int ret);
+
+/// @brief Called once a closed session's resources have been released.
+/// @param [in] session The session which has closed.
+typedef void (*rfs__9p_session_close_cb)(struct rfs__9p_session* session);
+
+/// @brief A request made on a session.
+/// The caller owns this structure, and must keep it and the message it
+/// refers to valid until the callback is invoked.
+typedef struct rfs__9p_call {
+  void* data; ///< Available for the caller's use.
+
+  // private
+  rfs__9p_msg_t* msg; ///< The T-message; its tag is set by the session.
+  rfs__9p_call_cb cb; ///< The completion callback.
+  struct rfs__9p_call* next; ///< The next request waiting for the window.
+} rfs__9p_call_t;
+
+/// @brief A buffer holding a packed T-message while it's being written.
+/// Writes are decoupled from calls because a reply (and so the call's
+/// completion) may be processed before libuv reports the write complete.
+typedef struct rfs__9p_send {
+  uv_write_t req; ///< The libuv write request.
+  struct rfs__9p_send* next; ///< The next send in the session's free list.
+  unsigned char* buf; ///< The packed message; hdr unless it didn't fit.
+  uint32_t size; ///< The size buf was taken from the pool with.
+
+  /// @brief Inline storage, sized to hold every message without a large
+  /// string or payload argument.
+  unsigned char hdr[256];
+} rfs__9p_send_t;
+
+/// @brief The session structure.
+typedef struct rfs__9p_session {
+  void* data; ///< Available for the caller's use.
+
+  // private
+  uv_pipe_t pipe; ///< The transport.
+  rfs__9p_decoder_t dec; ///< Splits the transport's byte stream into frames.
+  rfs__9p_tags_t tags; ///< The tags of the outstanding requests.
+
+  /// @brief The outstanding requests, indexed by tag.
+  /// Tags are allocated lowest first, so while no more than window requests
+  /// are outstanding every tag is less than window.
+  rfs__9p_call_t** calls;
+  uint32_t window; ///< The most requests which may be outstanding.
+  uint32_t inflight; ///< The number of requests outstanding.
+
+  rfs__9p_call_t* pending; ///< The first request waiting for the window.
+  rfs__9p_call_t* pending_tail; ///< The last request waiting for the window.
+
+  rfs__9p_send_t* sends; ///< Free send buffers.
+  unsigned char* rbuf; ///< The buffer transport reads are made into.
+  rfs__bufpool_t* pool; ///< Where large buffers come from; may be NULL.
+
+  uint32_t msize; ///< The largest message either side may send.
+
+  /// @brief Set while a Tversion is outstanding; requests wait until the
+  /// Rversion arrives.
+  int versioning;
+  rfs__9p_session_version_cb version_cb; ///< Called on the Rversion.
+  rfs__9p_msg_t vmsg; ///< The Tversion.
+
+  int error; ///< Set once the transport has failed or the session closed.
+  rfs__9p_session_close_cb close_cb; ///< Called once the session is closed.
+} rfs__9p_session_t;
+
+/// @brief Start a session on a connected transport.
+/// @param [in] session The session to initialize.
+/// @param [in] loop The loop which will run the session.
+/// @param [in] fd The transport; a connected socket or pipe. Once this
+/// succeeds the session owns it, closing it when the session closes.
+/// @param [in] window The most requests to have outstanding at once; at most
+/// RFS__9P_NOTAG.
+/// @param [in] msize The largest reply which will be accepted, and the
+/// msize proposed by rfs__9p_session_version(); at most RFS__BUFPOOL_MAXSZ.
+/// @param [in] pool The pool the session's buffers come from; may be NULL.
+/// It must outlive the session.
+/// @return 0 on success, -errno on failure. The session must be closed
+/// with rfs__9p_session_close() whether or not this succeeds.
+int rfs__9p_session_init(rfs__9p_session_t* session,
+                         uv_loop_t* loop,
+                         int fd,
+                         uint32_t window,
+                         uint32_t msize,
+                         rfs__bufpool_t* pool);
+
+/// @brief Negotiate the msize and protocol version with the server.
+/// This sends Tversion proposing session->msize, which the server may
+/// lower; replies are then limited to what it agreed to. It must be the
+/// first request on the session. Requests made before it completes are
+/// held, and sent once it succeeds.
+/// @param [in] session The session to negotiate on.
+/// @param [in] cb Called with the result; may be NULL.
+/// @return 0 if the Tversion was sent; -errno if the session has failed, in
+/// which case cb will not be called.
+int rfs__9p_session_version(rfs__9p_session_t* session,
+                            rfs__9p_session_version_cb cb);
+
+/// @brief Close a session.
+/// Every outstanding and waiting request completes with -ECANCELED before
+/// this returns. The session's memory must remain valid until cb is called.
+/// @param [in] session The session to close.
+/// @param [in] cb Called once the session has closed; may be NULL.
+void rfs__9p_session_close(rfs__9p_session_t* session,
+                           rfs__9p_session_close_cb cb);
+
+/// @brief Send a request on a session.
+/// @param [in] session The session to send the request on.
+/// @param [in] call The request structure.
+/// @param [in] msg The T-message to send; its tag is overwritten.
+/// @param [in] cb Called when the reply is received or the request fails.
+/// @return 0 if the request was queued; -errno if the session has failed
+/// or closed, in which case cb will not be called.
+int rfs__9p_session_rpc(rfs__9p_session_t* session,
+                        rfs__9p_call_t* call,
+                        rfs__9p_msg_t* msg,
+                        rfs__9p_call_cb cb);
+
+#endif
@@ -1,16 +1,17 @@
 #include "rfs_9p_wire.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
 static inline size_t uint8_pack(uint8_t val,
                                 unsigned char* buf,
-                                size_t bufsize) {
-  if(sizeof(val) > bufsize)
-    return 0;
+                                size_t bufsize,
+                                size_t off) {
+  if(off + sizeof(val) <= bufsize)
+    buf[off] = val;
 
-  buf[0] = val;
   return sizeof(val);
 }
 
@@ -26,12 +27,14 @@ static inline size_t uint8_unpack(const unsigned char* buf,
 
 static inline size_t uint16_pack(uint16_t val,
                                  unsigned char* buf,
-                                 size_t bufsize) {
-  if(sizeof(val) > bufsize)
-    return 0;
+                                 size_t bufsize,
+                                 size_t off) {
+  if(off + sizeof(val) <= bufsize) {
+    buf += off;
+    buf[0] = (0xFF & val);
+    buf[1] = (0xFF & (val >> 8));
+  }
 
-  buf[0] = (0xFF & val);
-  buf[1] = (0xFF & (val >> 8));
   return sizeof(val);
 }
 
@@ -48,14 +51,16 @@ static inline size_t uint16_unpack(const unsigned char* buf,
 
 static inline size_t uint32_pack(uint32_t val,
                                  unsigned char* buf,
-                                 size_t bufsize) {
-  if(sizeof(val) > bufsize)
-    return 0;
+                                 size_t bufsize,
+                                 size_t off) {
+  if(off + sizeof(val) <= bufsize) {
+    buf += off;
+    buf[0] = (0xFF & val);
+    buf[1] = (0xFF & (val >> 8));
+    buf[2] = (0xFF & (val >> 16));
+    buf[3] = (0xFF & (val >> 24));
+  }
 
-  buf[0] = (0xFF & val);
-  buf[1] = (0xFF & (val >> 8));
-  buf[2] = (0xFF & (val >> 16));
-  buf[3] = (0xFF & (val >> 24));
   return sizeof(val);
 }
 
@@ -68,24 +73,26 @@ static inline size_t uint32_unpack(const unsigned char* buf,
   *val = (uint8_t) buf[0];
   *val |= ((uint8_t) buf[1]) << 8;
   *val |= ((uint8_t) buf[2]) << 16;
-  *val |= ((uint8_t) buf[3]) << 24;
+  *val |= (uint32_t)((uint8_t) buf[3]) << 24;
   return sizeof(*val);
 }
 
 static inline size_t uint64_pack(uint64_t val,
                                  unsigned char* buf,
-                                 size_t bufsize) {
-  if(sizeof(val) > bufsize)
-    return 0;
+                                 size_t bufsize,
+                                 size_t off) {
+  if(off + sizeof(val) <= bufsize) {
+    buf += off;
+    buf[0] = (0xFF & val);
+    buf[1] = (0xFF & (val >> 8));
+    buf[2] = (0xFF & (val >> 16));
+    buf[3] = (0xFF & (val >> 24));
+    buf[4] = (0xFF & (val >> 32));
+    buf[5] = (0xFF & (val >> 40));
+    buf[6] = (0xFF & (val >> 48));
+    buf[7] = (0xFF & (val >> 56));
+  }
 
-  buf[0] = (0xFF & val);
-  buf[1] = (0xFF & (val >> 8));
-  buf[2] = (0xFF & (val >> 16));
-  buf[3] = (0xFF & (val >> 24));
-  buf[4] = (0xFF & (val >> 32));
-  buf[5] = (0xFF & (val >> 40));
-  buf[6] = (0xFF & (val >> 48));
-  buf[7] = (0xFF & (val >> 56));
   return sizeof(val);
 }
 
@@ -98,7 +105,7 @@ static inline size_t uint64_unpack(const unsigned char* buf,
   *val = (uint8_t) buf[0];
   *val |= ((uint8_t) buf[1]) << 8;
   *val |= ((uint8_t) buf[2]) << 16;
-  *val |= ((uint8_t) buf[3]) << 24;
+  *val |= (uint64_t)((uint8_t) buf[3]) << 24;
   *val |= (uint64_t)((uint8_t) buf[4]) << 32;
   *val |= (uint64_t)((uint8_t) buf[5]) << 40;
   *val |= (uint64_t)((uint8_t) buf[6]) << 48;
@@ -112,14 +119,12 @@ static inline size_t qid_size(void) {
 
 static inline size_t qid_pack(const rfs_qid_t* val,
                               unsigned char* buf,
-                              size_t bufsize) {
-  if(qid_size() > bufsize)
-    return 0;
-
+                              size_t bufsize,
+                              size_t off) {
   size_t used = 0;
-  used += uint8_pack(val->type, buf + used, bufsize - used);
-  used += uint32_pack(val->vers, buf + used, bufsize - used);
-  used += uint64_pack(val->path, buf + used, bufsize - used);
+  used += uint8_pack (val->type, buf, bufsize, off + used);
+  used += uint32_pack(val->vers, buf, bufsize, off + used);
+  used += uint64_pack(val->path, buf, bufsize, off + used);
   return used;
 }
 
@@ -136,66 +141,62 @@ static inline size_t qid_unpack(const unsigned char* buf,
   return used;
 }
 
-static inline size_t str_size(const char* val) {
-  if(!val)
-    return sizeof(uint16_t);
-
-  return sizeof(uint16_t) + strlen(val);
-}
-
-static inline size_t str_pack(const char* val,
+static inline size_t str_pack(rfs__9p_str_t val,
                               unsigned char* buf,
-                              size_t bufsize) {
-
-  // It is valid to send null strings, it is necessary to encode 0 length
-  // to handle that case.
-  if(!val)
-    return uint16_pack(0, buf, bufsize);
+                              size_t bufsize,
+                              size_t off) {
+  size_t used = uint16_pack(val.len, buf, bufsize, off);
 
-  size_t slen = strlen(val);
+  // It is valid to send empty strings, in which case only the 0 length
+  // is encoded.
+  if(val.len > 0 && off + used + val.len <= bufsize)
+    memcpy(buf + off + used, val.str, val.len);
 
-  if(sizeof(uint16_t) + slen > bufsize)
-    return 0;
-
-  size_t ret = 0;
+  return used + val.len;
+}
 
-  ret += uint16_pack(slen, buf, bufsize);
-  strncpy((char*) buf + ret, val, slen);
-  ret += slen;
+static inline size_t mem_pack(const unsigned char* val,
+                              uint32_t len,
+                              unsigned char* buf,
+                              size_t bufsize,
+                              size_t off) {
+  if(len > 0 && off + len <= bufsize)
+    memcpy(buf + off, val, len);
 
-  return ret;
+  return len;
 }
 
 /// @brief This unpacks a string from a buffer, without allocating more space
-/// for the string. This means that this function cannot be called twice given
-/// the same input buf, since the length prefix will have been modified by
-/// the first call.
-static inline size_t str_unpack(unsigned char* buf,
+/// for the string or modifying the buffer; the resulting string references
+/// the characters in place.
+static inline size_t str_unpack(const unsigned char* buf,
                                 size_t bufsize,
-                                char** val) {
-  if(sizeof(uint16_t) > bufsize)
-    return 0;
-
+                                rfs__9p_str_t* val) {
   uint16_t slen;
-  assert(uint16_unpack(buf, bufsize, &slen) == sizeof(uint16_t));
+
+  if(uint16_unpack(buf, bufsize, &slen) == 0)
+    return 0;
 
   if(sizeof(uint16_t) + slen > bufsize)
     return 0;
 
-  if(slen < 1)
-    return sizeof(uint16_t);
+  val->str = (const char*) (buf + sizeof(uint16_t));
+  val->len = slen;
 
-  // here we move the string 'down' 1 byte, so that we can use the last byte
-  // as the terminating null.
-  unsigned char* str = buf + sizeof(uint16_t) - 1;
+  return sizeof(uint16_t) + slen;
+}
 
-  // the string starts at (buf + 2), will be moved to (buf + 1)
-  memmove(str, buf + sizeof(uint16_t), slen);
+rfs__9p_str_t rfs__9p_str(const char* cstr) {
+  rfs__9p_str_t str = { .str = cstr, .len = 0 };
 
-  str[slen] = '\0';
-  *val = (char*) str;
+  if(cstr != NULL) {
+    size_t len = strlen(cstr);
+    assert(len <= UINT16_MAX);
 
-  return sizeof(uint16_t) + slen;
+    str.len = (uint16_t) len;
+  }
+
+  return str;
 }
 
 void rfs__9p_stat_init(rfs__9p_stat_t* stat) {
@@ -210,59 +211,59 @@ void rfs__9p_stat_init(rfs__9p_stat_t* stat) {
   stat->atime = 0;
   stat->mtime = 0;
   stat->length = 0;
-  stat->name = NULL;
-  stat->uid = NULL;
-  stat->gid = NULL;
-  stat->muid = NULL;
+
+  rfs__9p_str_t empty = { .str = NULL, .len = 0 };
+  stat->name = empty;
+  stat->uid = empty;
+  stat->gid = empty;
+  stat->muid = empty;
 }
 
 void rfs__9p_stat_reset(rfs__9p_stat_t* stat) {
   assert(stat != NULL);
 
-  free(stat->name);
-
-  free(stat->uid);
-
-  free(stat->gid);
+  rfs__9p_stat_init(stat);
+}
 
-  free(stat->muid);
+/// @brief Serialize a stat structure, or calculate its serialized size.
+/// Every field is written only if it fits within bufsize; the full size is
+/// returned regardless. This lets the size and the serialized form be
+/// produced in one walk over the structure, and lets a NULL buf with a
+/// bufsize of 0 be used to calculate the size alone.
+/// @param [in] stat The structure to serialize.
+/// @param [in] buf The buffer to serialize the stat to.
+/// @param [in] bufsize The size of buf.
+/// @param [in] off The offset in buf to start writing at.
+/// @return The serialized size of the stat structure.
+static size_t stat_encode(const rfs__9p_stat_t* stat,
+                          unsigned char* buf,
+                          size_t bufsize,
+                          size_t off) {
+  size_t used = 0;
+  used += uint16_pack(0, buf, bufsize, off + used); // size, filled in below
+  used += uint16_pack(stat->type, buf, bufsize, off + used);
+  used += uint32_pack(stat->dev, buf, bufsize, off + used);
+  used += qid_pack   (&(stat->qid), buf, bufsize, off + used);
+  used += uint32_pack(stat->mode, buf, bufsize, off + used);
+  used += uint32_pack(stat->atime, buf, bufsize, off + used);
+  used += uint32_pack(stat->mtime, buf, bufsize, off + used);
+  used += uint64_pack(stat->length, buf, bufsize, off + used);
+  used += str_pack   (stat->name, buf, bufsize, off + used);
+  used += str_pack   (stat->uid, buf, bufsize, off + used);
+  used += str_pack   (stat->gid, buf, bufsize, off + used);
+  used += str_pack   (stat->muid, buf, bufsize, off + used);
+
+  assert(used <= UINT16_MAX);
+  uint16_pack((uint16_t) used, buf, bufsize, off);
 
-  rfs__9p_stat_init(stat);
+  return used;
 }
 
 uint16_t rfs__9p_stat_size(const rfs__9p_stat_t* stat) {
   assert(stat != NULL);
-  assert((str_size(stat->name)
-        + str_size(stat->uid)
-        + str_size(stat->gid)
-        + str_size(stat->muid))
-        < (UINT16_MAX
-         - sizeof(uint16_t)
-         - sizeof(uint16_t)
-         - sizeof(uint32_t)
-         - qid_size()
-         - sizeof(uint32_t)
-         - sizeof(uint32_t)
-         - sizeof(uint32_t)
-         - sizeof(uint64_t)));
-
-  uint16_t size = 0;
-
-  size += sizeof(uint16_t); // size
-  size += sizeof(uint16_t); // type
-  size += sizeof(uint32_t); // dev
-  size += qid_size(); // qid
-  size += sizeof(uint32_t); // mode
-  size += sizeof(uint32_t); // atime
-  size += sizeof(uint32_t); // mtime
-  size += sizeof(uint64_t); // length
-  size += str_size(stat->name);
-  size += str_size(stat->uid);
-  size += str_size(stat->gid);
-  size += str_size(stat->muid);
 
-  return size;
-} 
+  return (uint16_t) stat_encode(stat, NULL, 0, 0);
+}
 
 size_t rfs__9p_stat_pack(rfs__9p_stat_t* stat,
                          unsigned char* buf,
@@ -270,40 +271,21 @@ size_t rfs__9p_stat_pack(rfs__9p_stat_t* stat,
   assert(stat != NULL);
   assert(buf != NULL);
 
-  stat->size = rfs__9p_stat_size(stat);
+  size_t used = stat_encode(stat, buf, bufsize, 0);
+  stat->size = (uint16_t) used;
 
-  if(stat->size > bufsize)
+  if(used > bufsize)
     return 0;
 
-  size_t used = 0;
-  used += uint16_pack(stat->size, buf + used, bufsize - used);
-  used += uint16_pack(stat->type, buf + used, bufsize - used);
-  used += uint32_pack(stat->dev, buf + used, bufsize - used);
-  used += qid_pack   (&(stat->qid), buf + used, bufsize - used);
-  used += uint32_pack(stat->mode, buf + used, bufsize - used);
-  used += uint32_pack(stat->atime, buf + used, bufsize - used);
-  used += uint32_pack(stat->mtime, buf + used, bufsize - used);
-  used += uint64_pack(stat->length, buf + used, bufsize - used);
-  used += str_pack   (stat->name, buf + used, bufsize - used);
-  used += str_pack   (stat->uid, buf + used, bufsize - used);
-  used += str_pack   (stat->gid, buf + used, bufsize - used);
-  used += str_pack   (stat->muid, buf + used, bufsize - used);
-
-  assert(used == stat->size);
-  assert(used <= bufsize);
-
   return used;
 }
 
-size_t rfs__9p_stat_unpack(unsigned char* buf,
+size_t rfs__9p_stat_unpack(const unsigned char* buf,
                            size_t bufsize,
                            rfs__9p_stat_t* stat) {
   assert(buf != NULL);
   assert(stat != NULL);
 
-  // release any previously contained data
-  rfs__9p_stat_reset(stat);
-
   size_t used = 0;
   used += uint16_unpack(buf + used, bufsize - used, &(stat->size));
   used += uint16_unpack(buf + used, bufsize - used, &(stat->type));
@@ -321,204 +303,323 @@ size_t rfs__9p_stat_unpack(unsigned char* buf,
   return used;
 }
 
-void rfs__9p_msg_init(rfs__9p_msg_t* msg) {
-  assert(msg != NULL);
+/// @brief Decode the next stat record of a directory read.
+/// @param [in] buf The directory data.
+/// @param [in] bufsize The size of buf.
+/// @param [out] stat The structure to decode the record into.
+/// @return The size of the record; 0 if buf is empty, -EBADMSG if the
+/// record is truncated or malformed.
+static int dirent_next(const unsigned char* buf,
+                       size_t bufsize,
+                       rfs__9p_stat_t* stat) {
+  uint16_t size;
+
+  if(bufsize == 0)
+    return 0;
 
-  msg->size = 0;
-  msg->type = 0;
-  msg->tag = 0;
+  if(uint16_unpack(buf, bufsize, &size) == 0 || size > bufsize)
+    return -EBADMSG;
 
-  memset(&(msg->params), 0, sizeof(msg->params));
+  // the record must account for exactly the bytes its size claims
+  if(rfs__9p_stat_unpack(buf, size, stat) != size)
+    return -EBADMSG;
+
+  return size;
 }
 
-void rfs__9p_msg_reset(rfs__9p_msg_t* msg) {
-  assert(msg != NULL);
+/// @brief Copy a counted string into an arena as a null terminated string.
+/// @param [in] str The string to copy.
+/// @param [in] arena The start of the free space in the arena.
+/// @return The copy.
+static char* dirent_str(rfs__9p_str_t str, char* arena) {
+  if(str.len > 0)
+    memcpy(arena, str.str, str.len);
 
-  switch(msg->type) {
-    case RFS__9P_TVERSION:
-    case RFS__9P_RVERSION:
-      free(msg->params.version.version);
-      break;
+  arena[str.len] = '\0';
+  return arena;
+}
 
-    case RFS__9P_TAUTH:
-      free(msg->params.tauth.uname);
-      free(msg->params.tauth.aname);
-      break;
+int rfs__9p_dirent_count(const unsigned char* buf,
+                         size_t bufsize,
+                         size_t* strsize) {
+  assert(buf != NULL || bufsize == 0);
+  assert(strsize != NULL);
 
-    case RFS__9P_RERROR:
-      free(msg->params.rerror.ename);
-      break;
+  size_t used = 0;
+  int count = 0;
+  int ret;
+  rfs__9p_stat_t stat;
 
-    case RFS__9P_TATTACH:
-      free(msg->params.tattach.uname);
-      free(msg->params.tattach.aname);
-      break;
+  *strsize = 0;
 
-    case RFS__9P_TWALK:
-      for(uint16_t i = 0; i < msg->params.twalk.nwname; ++i) {
-        free(msg->params.twalk.wname[i]);
-      }
-      break;
+  while((ret = dirent_next(buf + used, bufsize - used, &stat)) > 0) {
+    used += (size_t) ret;
+    count++;
 
-    case RFS__9P_TCREATE:
-      free(msg->params.tcreate.name);
-      break;
+    *strsize += stat.name.len + stat.uid.len + stat.gid.len + stat.muid.len;
+    *strsize += 4; // null terminators
+  }
 
-    default:
-      break;
+  return (ret < 0 ? ret : count);
+}
+
+int rfs__9p_dirent_unpack(const unsigned char* buf,
+                          size_t bufsize,
+                          rfs_dirent_t* ents,
+                          size_t nents,
+                          char* arena,
+                          size_t arenasize,
+                          size_t* used) {
+  assert(buf != NULL || bufsize == 0);
+  assert(ents != NULL || nents == 0);
+  assert(arena != NULL || arenasize == 0);
+  assert(used != NULL);
+
+  size_t arenaused = 0;
+  size_t count = 0;
+  rfs__9p_stat_t stat;
+
+  *used = 0;
+
+  while(count < nents && count < INT32_MAX) {
+    int ret = dirent_next(buf + *used, bufsize - *used, &stat);
+
+    if(ret < 0)
+      return ret;
+    else if(ret == 0)
+      break;
+
+    size_t strsize = stat.name.len + stat.uid.len + stat.gid.len
+                   + stat.muid.len + 4;
+
+    if(arenaused + strsize > arenasize)
+      break;
+
+    rfs_dirent_t* ent = &(ents[count]);
+    ent->type = stat.type;
+    ent->dev = stat.dev;
+    ent->qid = stat.qid;
+    ent->mode = stat.mode;
+    ent->atime = stat.atime;
+    ent->mtime = stat.mtime;
+    ent->length = stat.length;
+
+    ent->name = dirent_str(stat.name, arena + arenaused);
+    arenaused += stat.name.len + 1;
+    ent->uid = dirent_str(stat.uid, arena + arenaused);
+    arenaused += stat.uid.len + 1;
+    ent->gid = dirent_str(stat.gid, arena + arenaused);
+    arenaused += stat.gid.len + 1;
+    ent->muid = dirent_str(stat.muid, arena + arenaused);
+    arenaused += stat.muid.len + 1;
+
+    *used += (size_t) ret;
+    count++;
   }
 
-  rfs__9p_msg_init(msg);
+  return (int) count;
 }
 
-uint32_t rfs__9p_msg_size(const rfs__9p_msg_t* msg) {
+void rfs__9p_msg_init(rfs__9p_msg_t* msg) {
   assert(msg != NULL);
 
-  size_t size = 0;
+  msg->size = 0;
+  msg->type = 0;
+  msg->tag = 0;
 
-  // size of the size + type + tag fields
-  size += sizeof(uint32_t);
-  size += sizeof(uint8_t);
-  size += sizeof(uint16_t);
+  memset(&(msg->params), 0, sizeof(msg->params));
+}
+
+void rfs__9p_msg_reset(rfs__9p_msg_t* msg) {
+  assert(msg != NULL);
+
+  rfs__9p_msg_init(msg);
+}
+
+/// @brief Serialize a message, or calculate its serialized size.
+/// This follows the same conventions as stat_encode(): fields are written
+/// only if they fit within bufsize, and the full size is always returned.
+/// @param [in] msg The structure to serialize.
+/// @param [in] buf The buffer to serialize the message to.
+/// @param [in] bufsize The size of buf.
+/// @return The serialized size of the message; 0 if the type is unknown.
+static size_t msg_encode(const rfs__9p_msg_t* msg,
+                         unsigned char* buf,
+                         size_t bufsize) {
+  size_t used = 0;
+  used += uint32_pack(0, buf, bufsize, used); // size, filled in below
+  used += uint8_pack (msg->type, buf, bufsize, used);
+  used += uint16_pack(msg->tag, buf, bufsize, used);
 
   switch(msg->type) {
     case RFS__9P_TVERSION:
     case RFS__9P_RVERSION:
-      size += sizeof(uint32_t); // msize
-      size += str_size(msg->params.version.version);
+      // per man 5 version, tag must be set to NOTAG
+      assert(msg->tag == RFS__9P_NOTAG);
+
+      // per man 5 version, the version field must start with 9P
+      // unless there is a error in the response, then it must be unknown
+      assert(msg->params.version.version.len >= 2);
+
+      if(msg->type == RFS__9P_TVERSION)
+        assert(strncmp(msg->params.version.version.str, "9P", 2) == 0);
+      else
+        assert(strncmp(msg->params.version.version.str, "9P", 2) == 0
+            || (msg->params.version.version.len == 7
+              && strncmp(msg->params.version.version.str, "unknown", 7) == 0));
+
+      used += uint32_pack(msg->params.version.msize, buf, bufsize, used);
+      used += str_pack   (msg->params.version.version, buf, bufsize, used);
       break;
 
     case RFS__9P_TAUTH:
-      size += sizeof(uint32_t); // afid
-      size += str_size(msg->params.tauth.uname);
-      size += str_size(msg->params.tauth.aname);
+      used += uint32_pack(msg->params.tauth.afid, buf, bufsize, used);
+      used += str_pack   (msg->params.tauth.uname, buf, bufsize, used);
+      used += str_pack   (msg->params.tauth.aname, buf, bufsize, used);
       break;
 
     case RFS__9P_RAUTH:
-      size += sizeof(rfs_qid_t);
+      used += qid_pack(&(msg->params.rauth.aqid), buf, bufsize, used);
       break;
 
     case RFS__9P_RERROR:
-      size += str_size(msg->params.rerror.ename);
+      used += str_pack(msg->params.rerror.ename, buf, bufsize, used);
       break;
 
     case RFS__9P_TFLUSH:
-      size += sizeof(uint16_t); // oldtag
+      used += uint16_pack(msg->params.tflush.oldtag, buf, bufsize, used);
       break;
 
     case RFS__9P_RFLUSH:
       break;
 
     case RFS__9P_TATTACH:
-      size += sizeof(uint32_t); // fid;
-      size += sizeof(uint32_t); // afid;
-      size += str_size(msg->params.tattach.uname);
-      size += str_size(msg->params.tattach.aname);
+      used += uint32_pack(msg->params.tattach.fid, buf, bufsize, used);
+      used += uint32_pack(msg->params.tattach.afid, buf, bufsize, used);
+      used += str_pack   (msg->params.tattach.uname, buf, bufsize, used);
+      used += str_pack   (msg->params.tattach.aname, buf, bufsize, used);
       break;
 
     case RFS__9P_RATTACH:
-      size += sizeof(rfs_qid_t);
+      used += qid_pack(&(msg->params.rattach.qid), buf, bufsize, used);
       break;
 
     case RFS__9P_TWALK:
-      size += sizeof(uint32_t); // fid
-      size += sizeof(uint32_t); // newfid
-      size += sizeof(uint16_t); // nwname
+      used += uint32_pack(msg->params.twalk.fid, buf, bufsize, used);
+      used += uint32_pack(msg->params.twalk.newfid, buf, bufsize, used);
+      used += uint16_pack(msg->params.twalk.nwname, buf, bufsize, used);
 
       assert(msg->params.twalk.nwname <= RFS__9P_MAXWELEM);
 
       for(uint16_t i = 0; i < msg->params.twalk.nwname; ++i) {
-        size += str_size(msg->params.twalk.wname[i]);
-      }      
+        // Per man 5 walk, the path '.' is not used in the 9P protocol
+        assert(msg->params.twalk.wname[i].len != 1
+            || *(msg->params.twalk.wname[i].str) != '.');
+
+        used += str_pack(msg->params.twalk.wname[i], buf, bufsize, used);
+      }
       break;
 
     case RFS__9P_RWALK:
-      size += sizeof(uint16_t); // nwqid
+      used += uint16_pack(msg->params.rwalk.nwqid, buf, bufsize, used);
 
       assert(msg->params.rwalk.nwqid <= RFS__9P_MAXWELEM);
 
-      size += (qid_size() * msg->params.rwalk.nwqid);
+      for(uint16_t i = 0; i < msg->params.rwalk.nwqid; ++i) {
+        used += qid_pack(&(msg->params.rwalk.wqid[i]), buf, bufsize, used);
+      }
       break;
 
     case RFS__9P_TOPEN:
-      size += sizeof(uint32_t); // fid
-      size += sizeof(uint8_t); // mode
+      used += uint32_pack(msg->params.topen.fid, buf, bufsize, used);
+      used += uint8_pack (msg->params.topen.mode, buf, bufsize, used);
       break;
 
     case RFS__9P_ROPEN:
-      size += sizeof(rfs_qid_t); // qid
-      size += sizeof(uint32_t); // iounit
+      used += qid_pack   (&(msg->params.ropen.qid), buf, bufsize, used);
+      used += uint32_pack(msg->params.ropen.iounit, buf, bufsize, used);
       break;
 
     case RFS__9P_TCREATE:
-      size += sizeof(uint32_t); // fid
-      size += str_size(msg->params.tcreate.name);
-      size += sizeof(uint32_t); // perm
-      size += sizeof(uint8_t); // mode
+      used += uint32_pack(msg->params.tcreate.fid, buf, bufsize, used);
+      used += str_pack   (msg->params.tcreate.name, buf, bufsize, used);
+      used += uint32_pack(msg->params.tcreate.perm, buf, bufsize, used);
+      used += uint8_pack (msg->params.tcreate.mode, buf, bufsize, used);
       break;
 
     case RFS__9P_RCREATE:
-      size += sizeof(rfs_qid_t); // qid
-      size += sizeof(uint32_t); // iounit
+      used += qid_pack   (&(msg->params.rcreate.qid), buf, bufsize, used);
+      used += uint32_pack(msg->params.rcreate.iounit, buf, bufsize, used);
       break;
 
     case RFS__9P_TREAD:
-      size += sizeof(uint32_t); // fid
-      size += sizeof(uint64_t); // offset
-      size += sizeof(uint32_t); // count
+      used += uint32_pack(msg->params.tread.fid, buf, bufsize, used);
+      used += uint64_pack(msg->params.tread.offset, buf, bufsize, used);
+      used += uint32_pack(msg->params.tread.count, buf, bufsize, used);
       break;
 
     case RFS__9P_RREAD:
-      size += sizeof(uint32_t); // count
-      size += msg->params.rread.count; // data
+      used += uint32_pack(msg->params.rread.count, buf, bufsize, used);
+      used += mem_pack   (msg->params.rread.data, msg->params.rread.count,
+                          buf, bufsize, used);
       break;
 
     case RFS__9P_TWRITE:
-      size += sizeof(uint32_t); // fid
-      size += sizeof(uint64_t); // offset
-      size += sizeof(uint32_t); // count
-      size += msg->params.twrite.count; // data
+      used += uint32_pack(msg->params.twrite.fid, buf, bufsize, used);
+      used += uint64_pack(msg->params.twrite.offset, buf, bufsize, used);
+      used += uint32_pack(msg->params.twrite.count, buf, bufsize, used);
+      used += mem_pack   (msg->params.twrite.data, msg->params.twrite.count,
+                          buf, bufsize, used);
       break;
 
     case RFS__9P_RWRITE:
-      size += sizeof(uint32_t); // count
+      used += uint32_pack(msg->params.rwrite.count, buf, bufsize, used);
       break;
 
     case RFS__9P_TCLUNK:
-      size += sizeof(uint32_t); // fid
+      used += uint32_pack(msg->params.tclunk.fid, buf, bufsize, used);
       break;
 
     case RFS__9P_RCLUNK:
-      break; // empty
+      break;
 
     case RFS__9P_TREMOVE:
-      size += sizeof(uint32_t); // fid
+      used += uint32_pack(msg->params.tremove.fid, buf, bufsize, used);
       break;
 
     case RFS__9P_RREMOVE:
-      break; // empty
+      break;
 
     case RFS__9P_TSTAT:
-      size += sizeof(uint32_t); // fid
+      used += uint32_pack(msg->params.tstat.fid, buf, bufsize, used);
       break;
 
     case RFS__9P_RSTAT:
-      size += rfs__9p_stat_size(msg->params.rstat.stat);
+      used += stat_encode(msg->params.rstat.stat, buf, bufsize, used);
       break;
 
     case RFS__9P_TWSTAT:
-      size += sizeof(uint32_t); // fid
-      size += rfs__9p_stat_size(msg->params.twstat.stat);
+      used += uint32_pack(msg->params.twstat.fid, buf, bufsize, used);
+      used += stat_encode(msg->params.twstat.stat, buf, bufsize, used);
       break;
 
     case RFS__9P_RWSTAT:
-      break; // empty
+      break;
 
     default:
       return 0;
   }
 
-  return size;
+  assert(used <= UINT32_MAX);
+  uint32_pack((uint32_t) used, buf, bufsize, 0);
+
+  return used;
+}
+
+uint32_t rfs__9p_msg_size(const rfs__9p_msg_t* msg) {
+  assert(msg != NULL);
+
+  return (uint32_t) msg_encode(msg, NULL, 0);
 }
 
 size_t rfs__9p_msg_pack(rfs__9p_msg_t* msg,
@@ -527,187 +628,82 @@ size_t rfs__9p_msg_pack(rfs__9p_msg_t* msg,
   assert(msg != NULL);
   assert(buf != NULL);
 
-  msg->size = rfs__9p_msg_size(msg);
+  size_t used = msg_encode(msg, buf, bufsize);
+  msg->size = (uint32_t) used;
 
-  if(msg->size > bufsize)
+  if(used > bufsize)
     return 0;
 
-  size_t used = 0;
-  used += uint32_pack(msg->size, buf + used, bufsize - used);
-  used += uint8_pack (msg->type, buf + used, bufsize - used);
-  used += uint16_pack(msg->tag, buf + used, bufsize - used);
-
-  switch(msg->type) {
-    case RFS__9P_TVERSION:
-    case RFS__9P_RVERSION:
-      // per man 5 version, tag must be set to NOTAG
-      assert(msg->tag == RFS__9P_NOTAG);
-
-      // per man 5 version, the version field must start with 9P
-      // unless there is a error in the response, then it must be unknown
-      assert(msg->params.version.version != NULL);
-      assert(strlen(msg->params.version.version) >= 2);
-
-      if(msg->type == RFS__9P_TVERSION)
-        assert(strncmp(msg->params.version.version, "9P", 2) == 0);
-      else
-        assert(strncmp(msg->params.version.version, "9P", 2) == 0
-            || (strlen(msg->params.version.version) == 7
-              && strncmp(msg->params.version.version, "unknown", 7) == 0));
-
-      used += uint32_pack(msg->params.version.msize, buf + used, bufsize - used);
-      used += str_pack   (msg->params.version.version, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_TAUTH:
-      used += uint32_pack(msg->params.tauth.afid, buf + used, bufsize - used);
-      used += str_pack   (msg->params.tauth.uname, buf + used, bufsize - used);
-      used += str_pack   (msg->params.tauth.aname, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_RAUTH:
-      used += qid_pack(&(msg->params.rauth.aqid), buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_RERROR:
-      used += str_pack(msg->params.rerror.ename, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_TFLUSH:
-      used += uint16_pack(msg->params.tflush.oldtag, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_RFLUSH:
-      break;
-
-    case RFS__9P_TATTACH:
-      used += uint32_pack(msg->params.tattach.fid, buf + used, bufsize - used);
-      used += uint32_pack(msg->params.tattach.afid, buf + used, bufsize - used);
-      used += str_pack   (msg->params.tattach.uname, buf + used, bufsize - used);
-      used += str_pack   (msg->params.tattach.aname, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_RATTACH:
-      used += qid_pack(&(msg->params.rattach.qid), buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_TWALK:
-      used += uint32_pack(msg->params.twalk.fid, buf + used, bufsize - used);
-      used += uint32_pack(msg->params.twalk.newfid, buf + used, bufsize - used);
-      used += uint16_pack(msg->params.twalk.nwname, buf + used, bufsize - used);
-
-      assert(msg->params.twalk.nwname <= RFS__9P_MAXWELEM);
-
-      for(uint16_t i = 0; i < msg->params.twalk.nwname; ++i) {
-        // Can't walk to a null dirent
-        assert(msg->params.twalk.wname[i] != NULL);
-        // Per man 5 walk, the path '.' is not used in the 9P protocol
-        assert(strlen(msg->params.twalk.wname[i]) > 1
-            || *(msg->params.twalk.wname[i]) != '.');
-
-        used += str_pack(msg->params.twalk.wname[i], buf + used, bufsize - used);
-      }
-      break;
-
-    case RFS__9P_RWALK:
-      used += uint16_pack(msg->params.rwalk.nwqid, buf + used, bufsize - used);
-
-      assert(msg->params.rwalk.nwqid <= RFS__9P_MAXWELEM);
-
-      for(uint16_t i = 0; i < msg->params.rwalk.nwqid; ++i) {
-        used += qid_pack(&(msg->params.rwalk.wqid[i]), buf + used, bufsize - used);
-      }
-      break;
-
-    case RFS__9P_TOPEN:
-      used += uint32_pack(msg->params.topen.fid, buf + used, bufsize - used);
-      used += uint8_pack (msg->params.topen.mode, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_ROPEN:
-      used += qid_pack   (&(msg->params.ropen.qid), buf + used, bufsize - used);
-      used += uint32_pack(msg->params.ropen.iounit, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_TCREATE:
-      used += uint32_pack(msg->params.tcreate.fid, buf + used, bufsize - used);
-      used += str_pack   (msg->params.tcreate.name, buf + used, bufsize - used);
-      used += uint32_pack(msg->params.tcreate.perm, buf + used, bufsize - used);
-      used += uint8_pack (msg->params.tcreate.mode, buf + used, bufsize - used);
-      break;
+  return used;
+}
 
-    case RFS__9P_RCREATE:
-      used += qid_pack   (&(msg->params.rcreate.qid), buf + used, bufsize - used);
-      used += uint32_pack(msg->params.rcreate.iounit, buf + used, bufsize - used);
-      break;
+int rfs__9p_msg_pack_iov(rfs__9p_msg_t* msg,
+                         unsigned char* buf,
+                         size_t bufsize,
+                         struct iovec iov[2]) {
+  assert(msg != NULL);
+  assert(buf != NULL);
+  assert(iov != NULL);
 
-    case RFS__9P_TREAD:
-      used += uint32_pack(msg->params.tread.fid, buf + used, bufsize - used);
-      used += uint64_pack(msg->params.tread.offset, buf + used, bufsize - used);
-      used += uint32_pack(msg->params.tread.count, buf + used, bufsize - used);
-      break;
+  uint32_t count;
+  const unsigned char* data;
 
+  switch(msg->type) {
     case RFS__9P_RREAD:
-      used += uint32_pack(msg->params.rread.count, buf + used, bufsize - used);
-      memcpy(buf + used, msg->params.rread.data, msg->params.rread.count);
-      used += msg->params.rread.count;
+      count = msg->params.rread.count;
+      data = msg->params.rread.data;
       break;
 
     case RFS__9P_TWRITE:
-      used += uint32_pack(msg->params.twrite.fid, buf + used, bufsize - used);
-      used += uint64_pack(msg->params.twrite.offset, buf + used, bufsize - used);
-      used += uint32_pack(msg->params.twrite.count, buf + used, bufsize - used);
-      memcpy(buf + used, msg->params.twrite.data, msg->params.twrite.count);
-      used += msg->params.twrite.count;
-      break;
-
-    case RFS__9P_RWRITE:
-      used += uint32_pack(msg->params.rwrite.count, buf + used, bufsize - used);
+      count = msg->params.twrite.count;
+      data = msg->params.twrite.data;
       break;
 
-    case RFS__9P_TCLUNK:
-      used += uint32_pack(msg->params.tclunk.fid, buf + used, bufsize - used);
-      break;
+    default: {
+      size_t used = rfs__9p_msg_pack(msg, buf, bufsize);
 
-    case RFS__9P_RCLUNK:
-      break;
+      if(used == 0)
+        return 0;
 
-    case RFS__9P_TREMOVE:
-      used += uint32_pack(msg->params.tremove.fid, buf + used, bufsize - used);
-      break;
-
-    case RFS__9P_RREMOVE:
-      break;
+      iov[0].iov_base = buf;
+      iov[0].iov_len = used;
+      return 1;
+    }
+  }
 
-    case RFS__9P_TSTAT:
-      used += uint32_pack(msg->params.tstat.fid, buf + used, bufsize - used);
-      break;
+  size_t used = 0;
+  used += uint32_pack(0, buf, bufsize, used); // size, filled in below
+  used += uint8_pack (msg->type, buf, bufsize, used);
+  used += uint16_pack(msg->tag, buf, bufsize, used);
 
-    case RFS__9P_RSTAT:
-      used += rfs__9p_stat_pack(msg->params.rstat.stat,
-                                buf + used, bufsize - used);
-      break;
+  if(msg->type == RFS__9P_RREAD) {
+    used += uint32_pack(count, buf, bufsize, used);
+  }
+  else {
+    used += uint32_pack(msg->params.twrite.fid, buf, bufsize, used);
+    used += uint64_pack(msg->params.twrite.offset, buf, bufsize, used);
+    used += uint32_pack(count, buf, bufsize, used);
+  }
 
-    case RFS__9P_TWSTAT:
-      used += uint32_pack(msg->params.twstat.fid, buf + used, bufsize - used);
-      used += rfs__9p_stat_pack(msg->params.twstat.stat,
-                                buf + used, bufsize - used);
-      break;
+  if(used > bufsize || (uint64_t) used + count > UINT32_MAX)
+    return 0;
 
-    case RFS__9P_RWSTAT:
-      break;
+  msg->size = (uint32_t) (used + count);
+  uint32_pack(msg->size, buf, bufsize, 0);
 
-    default:
-      return 0;
-  }
+  iov[0].iov_base = buf;
+  iov[0].iov_len = used;
 
-  assert(used == msg->size);
-  assert(used <= bufsize);
+  if(count == 0)
+    return 1;
 
-  return used;
+  // writev() doesn't modify the payload, the iovec just isn't const-qualified
+  iov[1].iov_base = (void*) (uintptr_t) data;
+  iov[1].iov_len = count;
+  return 2;
 }
 
-size_t rfs__9p_msg_unpack(unsigned char* buf,
+size_t rfs__9p_msg_unpack(const unsigned char* buf,
                           size_t bufsize,
                           rfs__9p_msg_t* msg) {
   assert(buf != NULL);
@@ -715,9 +711,12 @@ size_t rfs__9p_msg_unpack(unsigned char* buf,
 
   size_t used = uint32_unpack(buf, bufsize, &(msg->size));
 
-  if(msg->size < bufsize)
+  if(used == 0 || msg->size > bufsize || msg->size < RFS__9P_HDRSZ)
     return 0;
 
+  // ignore anything in the buffer beyond this message
+  bufsize = msg->size;
+
   used += uint8_unpack (buf + used, bufsize - used, &(msg->type));
   used += uint16_unpack(buf + used, bufsize - used, &(msg->tag));
 
@@ -781,8 +780,9 @@ size_t rfs__9p_msg_unpack(unsigned char* buf,
       used += uint16_unpack(buf + used, bufsize - used,
                             &(msg->params.twalk.nwname));
 
-      // todo: error checking
-      assert(msg->params.twalk.nwname <= RFS__9P_MAXWELEM);
+      // the elements are decoded into a fixed array, so more is malformed
+      if(msg->params.twalk.nwname > RFS__9P_MAXWELEM)
+        return 0;
 
       for(uint16_t i = 0; i < msg->params.twalk.nwname; ++i) {
         used += str_unpack (buf + used, bufsize - used,
@@ -794,8 +794,9 @@ size_t rfs__9p_msg_unpack(unsigned char* buf,
       used += uint16_unpack(buf + used, bufsize - used,
                             &(msg->params.rwalk.nwqid));
 
-      // todo: error checking
-      assert(msg->params.rwalk.nwqid <= RFS__9P_MAXWELEM);
+      // the elements are decoded into a fixed array, so more is malformed
+      if(msg->params.rwalk.nwqid > RFS__9P_MAXWELEM)
+        return 0;
 
       for(uint16_t i = 0; i < msg->params.rwalk.nwqid; ++i) {
         used += qid_unpack (buf + used, bufsize - used,
@@ -911,5 +912,205 @@ size_t rfs__9p_msg_unpack(unsigned char* buf,
       return 0;
   }
 
+  if(used != msg->size)
+    return 0;
+
   return used;
 }
+
+void rfs__9p_decoder_init(rfs__9p_decoder_t* dec, uint32_t msize) {
+  assert(dec != NULL);
+
+  dec->msize = msize;
+  dec->pool = NULL;
+  dec->chunk = NULL;
+  dec->chunklen = 0;
+  dec->buf = NULL;
+  dec->buflen = 0;
+  dec->bufcap = 0;
+  dec->bufdone = 0;
+}
+
+void rfs__9p_decoder_reset(rfs__9p_decoder_t* dec) {
+  assert(dec != NULL);
+
+  rfs__bufpool_t* pool = dec->pool;
+
+  if(pool != NULL)
+    rfs__bufpool_put(pool, dec->buf, dec->bufcap);
+  else
+    free(dec->buf);
+
+  rfs__9p_decoder_init(dec, dec->msize);
+  dec->pool = pool;
+}
+
+void rfs__9p_decoder_feed(rfs__9p_decoder_t* dec,
+                          const unsigned char* chunk,
+                          size_t len) {
+  assert(dec != NULL);
+  assert(chunk != NULL || len == 0);
+  assert(dec->chunklen == 0);
+
+  dec->chunk = chunk;
+  dec->chunklen = len;
+}
+
+size_t rfs__9p_decoder_space(rfs__9p_decoder_t* dec, unsigned char** space) {
+  assert(dec != NULL);
+  assert(space != NULL);
+  assert(dec->chunklen == 0);
+
+  if(dec->bufdone || dec->buflen < sizeof(uint32_t))
+    return 0;
+
+  uint32_t size;
+  uint32_unpack(dec->buf, dec->buflen, &size);
+
+  // the buffer is only grown to the frame once its size has been checked
+  if(size > dec->bufcap || size <= dec->buflen)
+    return 0;
+
+  *space = dec->buf + dec->buflen;
+
+  return size - dec->buflen;
+}
+
+void rfs__9p_decoder_fill(rfs__9p_decoder_t* dec, size_t len) {
+  assert(dec != NULL);
+  assert(dec->buflen + len <= dec->bufcap);
+
+  dec->buflen += len;
+}
+
+/// @brief Check the size field of a frame header against the limits.
+/// @param [in] dec The decoder the frame is being read by.
+/// @param [in] size The size field of the frame.
+/// @return 0 if the size is acceptable, -errno otherwise.
+static int decoder_check_size(const rfs__9p_decoder_t* dec, uint32_t size) {
+  if(size < RFS__9P_HDRSZ)
+    return -EBADMSG;
+  else if(size > dec->msize)
+    return -EMSGSIZE;
+
+  return 0;
+}
+
+/// @brief Move up to want bytes from the current chunk into the buffer.
+/// @param [in] dec The decoder to move the bytes in.
+/// @param [in] want The number of bytes the buffer should end up holding.
+/// @return 0 on success, -ENOMEM if the buffer couldn't be grown.
+static int decoder_take(rfs__9p_decoder_t* dec, size_t want) {
+  if(want > dec->bufcap && dec->pool == NULL) {
+    unsigned char* buf = realloc(dec->buf, want);
+
+    if(buf == NULL)
+      return -ENOMEM;
+
+    dec->buf = buf;
+    dec->bufcap = want;
+  }
+  else if(want > dec->bufcap) {
+    unsigned char* buf = rfs__bufpool_get(dec->pool, want);
+
+    if(buf == NULL)
+      return -ENOMEM;
+
+    if(dec->buflen > 0)
+      memcpy(buf, dec->buf, dec->buflen);
+
+    rfs__bufpool_put(dec->pool, dec->buf, dec->bufcap);
+    dec->buf = buf;
+    dec->bufcap = rfs__bufpool_size(want);
+  }
+
+  size_t take = want - dec->buflen;
+
+  if(take > dec->chunklen)
+    take = dec->chunklen;
+
+  memcpy(dec->buf + dec->buflen, dec->chunk, take);
+  dec->buflen += take;
+  dec->chunk += take;
+  dec->chunklen -= take;
+
+  return 0;
+}
+
+int rfs__9p_decoder_next(rfs__9p_decoder_t* dec,
+                         const unsigned char** frame,
+                         size_t* framelen) {
+  assert(dec != NULL);
+  assert(frame != NULL);
+  assert(framelen != NULL);
+
+  uint32_t size;
+  int ret;
+
+  if(dec->bufdone) {
+    dec->buflen = 0;
+    dec->bufdone = 0;
+
+    // split frames are rare enough that the pool can hold the buffer
+    if(dec->pool != NULL) {
+      rfs__bufpool_put(dec->pool, dec->buf, dec->bufcap);
+      dec->buf = NULL;
+      dec->bufcap = 0;
+    }
+  }
+
+  // complete a frame which was split across chunks
+  if(dec->buflen > 0) {
+    if(dec->buflen < sizeof(uint32_t)) {
+      if((ret = decoder_take(dec, sizeof(uint32_t))) < 0)
+        return ret;
+
+      if(dec->buflen < sizeof(uint32_t))
+        return 0;
+    }
+
+    uint32_unpack(dec->buf, dec->buflen, &size);
+
+    if((ret = decoder_check_size(dec, size)) < 0)
+      return ret;
+
+    if((ret = decoder_take(dec, size)) < 0)
+      return ret;
+
+    if(dec->buflen < size)
+      return 0;
+
+    *frame = dec->buf;
+    *framelen = size;
+    dec->bufdone = 1;
+    return 1;
+  }
+
+  if(dec->chunklen == 0)
+    return 0;
+
+  // the common case: the whole frame is in the chunk, return it in place
+  if(dec->chunklen >= sizeof(uint32_t)) {
+    uint32_unpack(dec->chunk, dec->chunklen, &size);
+
+    if((ret = decoder_check_size(dec, size)) < 0)
+      return ret;
+
+    if(dec->chunklen >= size) {
+      *frame = dec->chunk;
+      *framelen = size;
+      dec->chunk += size;
+      dec->chunklen -= size;
+      return 1;
+    }
+
+    // reserve the whole frame up front to avoid growing the buffer again
+    if((ret = decoder_take(dec, size)) < 0)
+      return ret;
+  }
+  else if((ret = decoder_take(dec, sizeof(uint32_t))) < 0) {
+    return ret;
+  }
+
+  return 0;
+}
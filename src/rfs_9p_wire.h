@@ -2,7 +2,10 @@
 #ifndef RFS_9P_WIRE_H
 #define RFS_9P_WIRE_H
 
+#include <sys/uio.h>
+
 #include "rfs/types.h"
+#include "rfs_bufpool.h"
 
 /// @file The Plan 9 wire protocol functions.
 /// The types and functions to serialize and deserialize P9 messages.
@@ -63,15 +66,43 @@ enum {
   RFS__9P_RWSTAT
 };
 
+/// @brief The modes of Topen and Tcreate; the low 2 bits are the access.
+enum {
+  RFS__9P_OREAD = 0, ///< Open for reading.
+  RFS__9P_OWRITE = 1, ///< Open for writing.
+  RFS__9P_ORDWR = 2, ///< Open for reading and writing.
+  RFS__9P_OEXEC = 3, ///< Open for execution; checked as reading.
+  RFS__9P_OTRUNC = 0x10, ///< Truncate the file first.
+  RFS__9P_ORCLOSE = 0x40 ///< Remove the file when the fid is clunked.
+};
+
 /// @brief The maximum number of values to return in 1 walk request
 #define RFS__9P_MAXWELEM          16
 
+/// @brief The size of the fields common to all messages: size, type and tag.
+#define RFS__9P_HDRSZ             7
+
+/// @brief The size of the fields preceding the data of a Twrite message.
+/// This is the largest header of any message carrying a data payload, so a
+/// buffer of this size is always sufficient for rfs__9p_msg_pack_iov()
+/// when packing Twrite and Rread messages.
+#define RFS__9P_IOHDRSZ           23
+
 /// @brief An invalid tag
 #define RFS__9P_NOTAG             (uint16_t) ~0U
 
 /// @brief An invalid fid
 #define RFS__9P_NOFID             (uint32_t) ~0U
 
+/// @brief A counted string, as it appears on the wire.
+/// The characters are not null terminated, and are not owned by the
+/// structure: after unpacking they point directly into the buffer the
+/// message was unpacked from; when packing they may point anywhere.
+typedef struct rfs__9p_str {
+  const char* str; ///< The characters of the string; may be NULL if len is 0.
+  uint16_t len; ///< The number of characters in str.
+} rfs__9p_str_t;
+
 /// @brief The struct which stat data will be serialized to/from.
 /// Users transmitting this field should fill in everything except for
 /// size (which will be overwritten during serialization), then call
@@ -89,10 +120,10 @@ typedef struct rfs__9p_stat {
   uint32_t atime; ///< The last access time, seconds since epoch.
   uint32_t mtime; ///< The last modification time, seconds since epoch.
   uint64_t length; ///< The length of the file, in bytes.
-  char* name; ///< The last entry in the path. Must be / for root directories.
-  char* uid; ///< Name of the owner.
-  char* gid; ///< Name of the group.
-  char* muid; ///< Name of the last user to modify the file.
+  rfs__9p_str_t name; ///< The last entry in the path. Must be / for root directories.
+  rfs__9p_str_t uid; ///< Name of the owner.
+  rfs__9p_str_t gid; ///< Name of the group.
+  rfs__9p_str_t muid; ///< Name of the last user to modify the file.
 } rfs__9p_stat_t;
 
 /// @brief The structure which 9P messages will be serialized to/from.
@@ -115,13 +146,13 @@ typedef struct rfs__9p_msg {
   union {
     struct {
       uint32_t msize; ///< The maximum supported size of the message.
-      char* version; ///< The version string.
+      rfs__9p_str_t version; ///< The version string.
     } version; ///< The content of the T and Rversion messages.
 
     struct {
       uint32_t afid; ///< The authentication fid.
-      char* uname; ///< The username of the auth request.
-      char* aname; ///< The name of the file tree to be authenticating to.
+      rfs__9p_str_t uname; ///< The username of the auth request.
+      rfs__9p_str_t aname; ///< The name of the file tree to be authenticating to.
     } tauth; ///< The content of the Tauth message.
 
     struct {
@@ -129,7 +160,7 @@ typedef struct rfs__9p_msg {
     } rauth; ///< The content of the Rauth message.
 
     struct {
-      char* ename; ///< The error string describing why a request failed.
+      rfs__9p_str_t ename; ///< The error string describing why a request failed.
     } rerror; ///< The content of the Rerror message.
 
     struct {
@@ -141,8 +172,8 @@ typedef struct rfs__9p_msg {
     struct {
       uint32_t fid; ///< The fid to save as the root of the file system.
       uint32_t afid; ///< The previously obtained auth fid from attach.
-      char* uname; ///< The name of the user to attach as.
-      char* aname; ///< The name of the file tree to access.
+      rfs__9p_str_t uname; ///< The name of the user to attach as.
+      rfs__9p_str_t aname; ///< The name of the file tree to access.
     } tattach; ///< The content of the Tattach message.
 
     struct {
@@ -153,7 +184,7 @@ typedef struct rfs__9p_msg {
       uint32_t fid; ///< The fid to start the walk from.
       uint32_t newfid; ///< The fid to represent the result as.
       uint16_t nwname; ///< The number of elements in the walk request.
-      char* wname[RFS__9P_MAXWELEM]; ///< The path elements to walk.
+      rfs__9p_str_t wname[RFS__9P_MAXWELEM]; ///< The path elements to walk.
     } twalk; ///< The content of the Twalk message.
 
     struct {
@@ -173,7 +204,7 @@ typedef struct rfs__9p_msg {
 
     struct {
       uint32_t fid; ///< The fid of the directory to create the file in.
-      char* name; ///< The name of the file to create (last entry in path).
+      rfs__9p_str_t name; ///< The name of the file to create (last entry in path).
       uint32_t perm; ///< The permissions to give to the file.
       uint8_t mode; ///< The mode to open the file with.
     } tcreate; ///< The content of the Tcreate message.
@@ -186,14 +217,14 @@ typedef struct rfs__9p_msg {
 
     struct {
       uint32_t count; ///< The number of bytes read.
-      unsigned char* data; ///< The data read from the file.
+      const unsigned char* data; ///< The data read from the file.
     } rread; ///< The contents of the Rread message.
 
     struct {
       uint32_t fid; ///< The fid of the file to write.
       uint64_t offset; ///< The offset of the file to write as.
       uint32_t count; ///< The number of bytes to write.
-      unsigned char* data; ///< The data to write to the file.
+      const unsigned char* data; ///< The data to write to the file.
     } twrite; ///< The contents of the Twrite message.
 
     struct {
@@ -220,13 +251,45 @@ typedef struct rfs__9p_msg {
 
 } rfs__9p_msg_t;
 
+/// @brief A resumable decoder which splits a byte stream into 9P frames.
+/// Bytes are fed to the decoder in whatever chunks the transport delivers
+/// them, and complete frames are then retrieved one at a time.
+/// Frames which are entirely contained in a chunk are returned in place,
+/// pointing into the chunk, so they are never copied. Only a frame which
+/// is split across chunks is reassembled into the decoder's own buffer;
+/// the transport may read the rest of such a frame straight into that
+/// buffer, so large frames aren't copied either.
+typedef struct rfs__9p_decoder {
+  uint32_t msize; ///< The largest frame which will be accepted.
+
+  /// @brief The pool reassembly buffers are taken from; if NULL they are
+  /// malloc'd. A pooled buffer is returned as soon as its frame is done.
+  rfs__bufpool_t* pool;
+
+  const unsigned char* chunk; ///< The unconsumed part of the current chunk.
+  size_t chunklen; ///< The number of unconsumed bytes at chunk.
+
+  unsigned char* buf; ///< The buffer used to reassemble a split frame.
+  size_t buflen; ///< The number of bytes of the split frame in buf.
+  size_t bufcap; ///< The allocated size of buf.
+
+  /// @brief Set when the frame in buf has been returned to the caller;
+  /// it is discarded on the next call to rfs__9p_decoder_next().
+  int bufdone;
+} rfs__9p_decoder_t;
+
+/// @brief Create a counted string referencing a null terminated string.
+/// @param [in] cstr The string to reference; may be NULL.
+/// @return The counted string; the characters are not copied.
+rfs__9p_str_t rfs__9p_str(const char* cstr);
+
 /// @brief Initializes a stat structure.
-/// @note This will not free any allocated strings!
 /// @param [in] stat The structure to initialize.
 void rfs__9p_stat_init(rfs__9p_stat_t* stat);
 
-/// @brief Resets all values to initial, freeing any allocated strings.
-/// @note Do not call on strings you cannot free - i.e. from stat_unpack.
+/// @brief Resets all values to initial.
+/// The strings referenced by the structure are not owned by it, so they
+/// are not released.
 /// @param [in] stat The structure to reset.
 void rfs__9p_stat_reset(rfs__9p_stat_t* stat);
 
@@ -245,22 +308,60 @@ size_t rfs__9p_stat_pack(rfs__9p_stat_t* stat,
                          size_t bufsize);
 
 /// @brief Deserializes a stat structure from the provided buffer.
-/// @param [in] buf The buffer to retrieve the data from.
-/// This is modified so that the stat structure can reference included strings.
+/// @param [in] buf The buffer to retrieve the data from. This is not
+/// modified; the strings of the stat structure reference it, so it must
+/// outlive the structure.
 /// @param [in] bufsize The size of the buffer.
 /// @param [in] stat The structure to deserialize into.
 /// @return The number of bytes processed from buf; 0 on error.
-size_t rfs__9p_stat_unpack(unsigned char* buf,
+size_t rfs__9p_stat_unpack(const unsigned char* buf,
                            size_t bufsize,
                            rfs__9p_stat_t* stat);
 
+/// @brief Count the stat records in the data of a directory read.
+/// A read of a directory returns an integral number of concatenated stat
+/// records. This walks them without decoding the strings, so the caller can
+/// size the arrays passed to rfs__9p_dirent_unpack() in one allocation each.
+/// @param [in] buf The data returned by one or more reads of a directory.
+/// @param [in] bufsize The size of buf.
+/// @param [out] strsize Set to the number of bytes of string storage
+/// needed to unpack every record, null terminators included.
+/// @return The number of stat records in buf; -EBADMSG if a record is
+/// truncated or malformed.
+int rfs__9p_dirent_count(const unsigned char* buf,
+                         size_t bufsize,
+                         size_t* strsize);
+
+/// @brief Decode the stat records in the data of a directory read.
+/// Each record fills one entry of ents. The name, uid, gid and muid strings
+/// of every entry are copied, null terminated, into the single arena
+/// provided by the caller; no memory is allocated.
+/// Decoding stops when buf is exhausted, ents is full, or the next entry's
+/// strings don't fit in the arena; used indicates where to resume.
+/// @param [in] buf The data returned by one or more reads of a directory.
+/// @param [in] bufsize The size of buf.
+/// @param [out] ents The array of entries to fill.
+/// @param [in] nents The number of entries in ents.
+/// @param [out] arena The storage the entries' strings are copied to.
+/// @param [in] arenasize The size of arena.
+/// @param [out] used Set to the number of bytes of buf decoded.
+/// @return The number of entries filled; -EBADMSG if a record is
+/// truncated or malformed.
+int rfs__9p_dirent_unpack(const unsigned char* buf,
+                          size_t bufsize,
+                          rfs_dirent_t* ents,
+                          size_t nents,
+                          char* arena,
+                          size_t arenasize,
+                          size_t* used);
+
 /// @brief Initializes a message structure.
-/// @note This will not free any allocated strings!
 /// @param [in] msg The structure to initialize.
 void rfs__9p_msg_init(rfs__9p_msg_t* msg);
 
-/// @brief Resets all values to initial, freeing any allocated strings.
-/// @note Do not call on strings you cannot free - i.e. from msg_unpack.
+/// @brief Resets all values to initial.
+/// The strings and data referenced by the structure are not owned by it,
+/// so they are not released.
 /// @param [in] msg The structure to reset.
 void rfs__9p_msg_reset(rfs__9p_msg_t* msg);
 
@@ -278,15 +379,87 @@ size_t rfs__9p_msg_pack(rfs__9p_msg_t* msg,
                         unsigned char* buf,
                         size_t bufsize);
 
+/// @brief Serialize the msg structure without copying its data payload.
+/// For Twrite and Rread messages, the fields preceding the data are written
+/// to buf, and iov is set to reference buf followed by the message's data
+/// pointer, so the message can be sent with writev() (or uv_write()) without
+/// the payload ever being copied. The data must remain valid until the
+/// write completes.
+/// All other messages are serialized entirely into buf, and referenced by
+/// a single iov entry.
+/// @param [in] msg The structure to serialize.
+/// @param [in] buf The buffer to serialize the message header to.
+/// @param [in] bufsize The maximum amount of data which can be written.
+/// @param [out] iov The vector describing the serialized message.
+/// @return The number of iov entries used (1 or 2); 0 on error.
+int rfs__9p_msg_pack_iov(rfs__9p_msg_t* msg,
+                         unsigned char* buf,
+                         size_t bufsize,
+                         struct iovec iov[2]);
+
 /// @brief Deserializes a message structure from the provided buffer.
-/// @param [in] buf The buffer to retrieve the data from.
-/// This is modified so that the msg structure can reference included strings.
-/// @param [in] bufsize The size of the buffer.
+/// @param [in] buf The buffer to retrieve the data from. This is not
+/// modified, so the same buffer can be decoded any number of times, from any
+/// number of threads. The strings and data of the msg structure reference
+/// it, so it must outlive the structure.
+/// @param [in] bufsize The size of the buffer. This may be larger than the
+/// message; only the number of bytes given by the size field is processed.
 /// @param [in] msg The structure to deserialize into.
 /// @return The number of bytes processed from buf; 0 on error.
-size_t rfs__9p_msg_unpack(unsigned char* buf,
+size_t rfs__9p_msg_unpack(const unsigned char* buf,
                           size_t bufsize,
                           rfs__9p_msg_t* msg);
 
+/// @brief Initializes a frame decoder.
+/// @param [in] dec The decoder to initialize.
+/// @param [in] msize The largest frame size which will be accepted.
+void rfs__9p_decoder_init(rfs__9p_decoder_t* dec, uint32_t msize);
+
+/// @brief Resets a frame decoder, discarding any buffered data.
+/// @param [in] dec The decoder to reset.
+void rfs__9p_decoder_reset(rfs__9p_decoder_t* dec);
+
+/// @brief Provide the next chunk of the byte stream to the decoder.
+/// The previous chunk must have been fully consumed, i.e.
+/// rfs__9p_decoder_next() must have returned 0 since it was fed.
+/// Frames returned from this chunk point into it, so the chunk must remain
+/// valid until they have been processed.
+/// @param [in] dec The decoder to feed.
+/// @param [in] chunk The bytes received from the transport.
+/// @param [in] len The number of bytes in chunk.
+void rfs__9p_decoder_feed(rfs__9p_decoder_t* dec,
+                          const unsigned char* chunk,
+                          size_t len);
+
+/// @brief Find where the rest of a split frame belongs.
+/// Once the header of a frame split across chunks has been read, its
+/// remaining bytes can be read directly into the decoder's buffer and
+/// recorded with rfs__9p_decoder_fill(), instead of being fed as a chunk.
+/// The previous chunk must have been fully consumed.
+/// @param [in] dec The decoder to query.
+/// @param [out] space Set to where the next byte of the frame belongs.
+/// @return The number of bytes the frame is still missing; 0 if no frame
+/// with a known size is partly buffered.
+size_t rfs__9p_decoder_space(rfs__9p_decoder_t* dec, unsigned char** space);
+
+/// @brief Record bytes read into the space given by rfs__9p_decoder_space().
+/// @param [in] dec The decoder read into.
+/// @param [in] len The number of bytes read; at most the space's size.
+void rfs__9p_decoder_fill(rfs__9p_decoder_t* dec, size_t len);
+
+/// @brief Retrieve the next complete frame from the decoder.
+/// The frame remains valid until the next call to rfs__9p_decoder_next()
+/// or rfs__9p_decoder_reset(), or until the chunk it points into is released.
+/// @param [in] dec The decoder to retrieve the frame from.
+/// @param [out] frame Set to the start of the frame.
+/// @param [out] framelen Set to the size of the frame.
+/// @return 1 if a frame was returned; 0 if more data is required;
+/// -EMSGSIZE if a frame is larger than msize, -EBADMSG if a frame is smaller
+/// than the minimum message size, -ENOMEM if reassembly failed. After an
+/// error the stream can't be resynchronized and should be closed.
+int rfs__9p_decoder_next(rfs__9p_decoder_t* dec,
+                         const unsigned char** frame,
+                         size_t* framelen);
+
 #endif
 
@@ -0,0 +1,241 @@
+#include "rfs_acache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief The index used to terminate hash chains and the free list.
+#define ACACHE_NIL UINT32_MAX
+
+/// @brief Hash a file within a mount.
+static uint64_t acache_hash(uint64_t mnt, uint64_t qpath) {
+  uint64_t h = (mnt * 0x9e3779b97f4a7c15ULL) ^ qpath;
+
+  h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 29)) * 0x94d049bb133111ebULL;
+
+  return h ^ (h >> 32);
+}
+
+int rfs__acache_init(rfs__acache_t* cache, uint32_t cap) {
+  assert(cache != NULL);
+  assert(cap > 0 && cap < ACACHE_NIL);
+
+  uint32_t buckets = 1;
+  while(buckets < cap * 2 && buckets < (1U << 31))
+    buckets <<= 1;
+
+  cache->ents = calloc(cap, sizeof(rfs__acache_ent_t));
+  cache->buckets = malloc(sizeof(uint32_t) * buckets);
+
+  if(cache->ents == NULL || cache->buckets == NULL) {
+    free(cache->ents);
+    free(cache->buckets);
+    return -ENOMEM;
+  }
+
+  for(uint32_t i = 0; i < buckets; ++i)
+    cache->buckets[i] = ACACHE_NIL;
+
+  for(uint32_t i = 0; i < cap; ++i)
+    cache->ents[i].next = (i + 1 < cap ? i + 1 : ACACHE_NIL);
+
+  cache->cap = cap;
+  cache->mask = buckets - 1;
+  cache->free = 0;
+  cache->hand = 0;
+  cache->count = 0;
+
+  return 0;
+}
+
+void rfs__acache_free(rfs__acache_t* cache) {
+  assert(cache != NULL);
+
+  for(uint32_t i = 0; i < cache->cap; ++i)
+    free(cache->ents[i].dirent.name);
+
+  free(cache->ents);
+  free(cache->buckets);
+  cache->ents = NULL;
+  cache->buckets = NULL;
+  cache->cap = 0;
+  cache->count = 0;
+}
+
+/// @brief Find the entry for a file.
+/// @return The index of the entry; ACACHE_NIL if there isn't one.
+static uint32_t acache_find(const rfs__acache_t* cache,
+                            uint64_t mnt,
+                            uint64_t qpath) {
+  uint32_t idx = cache->buckets[acache_hash(mnt, qpath) & cache->mask];
+
+  while(idx != ACACHE_NIL) {
+    const rfs__acache_ent_t* ent = &(cache->ents[idx]);
+
+    if(ent->dirent.qid.path == qpath && ent->mnt == mnt)
+      return idx;
+
+    idx = ent->next;
+  }
+
+  return ACACHE_NIL;
+}
+
+/// @brief Remove an entry from its hash chain and add it to the free list.
+static void acache_remove(rfs__acache_t* cache, uint32_t idx) {
+  rfs__acache_ent_t* ent = &(cache->ents[idx]);
+  uint64_t hash = acache_hash(ent->mnt, ent->dirent.qid.path);
+  uint32_t* link = &(cache->buckets[hash & cache->mask]);
+
+  while(*link != idx)
+    link = &(cache->ents[*link].next);
+
+  *link = ent->next;
+
+  free(ent->dirent.name);
+  memset(&(ent->dirent), 0, sizeof(ent->dirent));
+  ent->mnt = 0;
+  ent->next = cache->free;
+  cache->free = idx;
+  cache->count--;
+}
+
+/// @brief Take an unused entry, evicting one if there are none.
+/// @return The index of the entry.
+static uint32_t acache_alloc(rfs__acache_t* cache) {
+  // the hand always finds a victim within two revolutions, since it clears
+  // the reference bits it passes
+  while(cache->free == ACACHE_NIL) {
+    uint32_t idx = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->cap;
+
+    if(cache->ents[idx].ref)
+      cache->ents[idx].ref = 0;
+    else
+      acache_remove(cache, idx);
+  }
+
+  uint32_t idx = cache->free;
+  cache->free = cache->ents[idx].next;
+
+  return idx;
+}
+
+const rfs_dirent_t* rfs__acache_get(rfs__acache_t* cache,
+                                    const rfs__ns_mnt_t* mnt,
+                                    uint64_t qpath,
+                                    uint64_t now) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+
+  uint32_t idx = acache_find(cache, mnt->id, qpath);
+
+  if(idx == ACACHE_NIL)
+    return NULL;
+
+  rfs__acache_ent_t* ent = &(cache->ents[idx]);
+
+  if(ent->gen != mnt->gen || now >= ent->expires) {
+    acache_remove(cache, idx);
+    return NULL;
+  }
+
+  ent->ref = 1;
+
+  return &(ent->dirent);
+}
+
+/// @brief Copy a counted string into a NUL-terminated one.
+/// @return The byte after the copy's terminator.
+static char* acache_str(char** dst, char* pos, const rfs__9p_str_t* src) {
+  if(src->len > 0)
+    memcpy(pos, src->str, src->len);
+
+  pos[src->len] = '\0';
+  *dst = pos;
+
+  return pos + src->len + 1;
+}
+
+int rfs__acache_put(rfs__acache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const rfs__9p_stat_t* stat,
+                    uint64_t now) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(stat != NULL);
+
+  if(mnt->attrttl == 0)
+    return 0;
+
+  char* strs = malloc((size_t) stat->name.len + stat->uid.len + stat->gid.len
+                      + stat->muid.len + 4);
+
+  if(strs == NULL)
+    return -ENOMEM;
+
+  uint32_t idx = acache_find(cache, mnt->id, stat->qid.path);
+
+  if(idx == ACACHE_NIL) {
+    idx = acache_alloc(cache);
+
+    uint64_t hash = acache_hash(mnt->id, stat->qid.path);
+    rfs__acache_ent_t* ent = &(cache->ents[idx]);
+    ent->mnt = mnt->id;
+    ent->ref = 0;
+    ent->next = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = idx;
+    cache->count++;
+  }
+
+  rfs__acache_ent_t* ent = &(cache->ents[idx]);
+  rfs_dirent_t* dirent = &(ent->dirent);
+
+  free(dirent->name);
+
+  ent->gen = mnt->gen;
+  ent->expires = now + (uint64_t) mnt->attrttl * 1000000;
+
+  dirent->type = stat->type;
+  dirent->dev = stat->dev;
+  dirent->qid = stat->qid;
+  dirent->mode = stat->mode;
+  dirent->atime = stat->atime;
+  dirent->mtime = stat->mtime;
+  dirent->length = stat->length;
+
+  // name comes first, so it is the start of the allocation
+  char* pos = acache_str(&(dirent->name), strs, &(stat->name));
+  pos = acache_str(&(dirent->uid), pos, &(stat->uid));
+  pos = acache_str(&(dirent->gid), pos, &(stat->gid));
+  acache_str(&(dirent->muid), pos, &(stat->muid));
+
+  return 0;
+}
+
+void rfs__acache_validate(rfs__acache_t* cache,
+                          const rfs__ns_mnt_t* mnt,
+                          const rfs_qid_t* qid) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(qid != NULL);
+
+  uint32_t idx = acache_find(cache, mnt->id, qid->path);
+
+  if(idx != ACACHE_NIL && cache->ents[idx].dirent.qid.vers != qid->vers)
+    acache_remove(cache, idx);
+}
+
+void rfs__acache_drop(rfs__acache_t* cache,
+                      const rfs__ns_mnt_t* mnt,
+                      uint64_t qpath) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+
+  uint32_t idx = acache_find(cache, mnt->id, qpath);
+
+  if(idx != ACACHE_NIL)
+    acache_remove(cache, idx);
+}
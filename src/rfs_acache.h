@@ -0,0 +1,108 @@
+#ifndef RFS_ACACHE_H
+#define RFS_ACACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs/types.h"
+#include "rfs_9p_wire.h"
+#include "rfs_ns.h"
+
+/// @file A cache of file attributes.
+/// This maps a file, identified by its qid path within a mount, to the
+/// attributes the last Rstat returned for it, so that repeated stats of the
+/// same file are answered without a round trip. Entries are dropped when:
+///  - they are older than the mount's attribute time-to-live,
+///  - a newer version of the file's qid is seen, such as in a Ropen or Rwalk,
+///  - the client changes the file itself (write, wstat, remove),
+///  - the mount is unmounted (its generation changes),
+///  - they are evicted to make room; the cache holds a fixed number of
+///    entries and evicts with the CLOCK algorithm.
+/// Mounts with a time-to-live of 0 aren't cached at all.
+/// The client worker has no stat path yet, so nothing calls the cache and
+/// only a mount's time-to-live is set from it; it is meant to be driven from
+/// that path once it exists. The cache isn't synchronized; it is only meant
+/// for the client worker.
+
+/// @brief The default attribute time-to-live for cached mounts, in ms.
+#define RFS__ACACHE_TTL 1000
+
+/// @brief A cached set of attributes.
+typedef struct rfs__acache_ent {
+  uint64_t mnt; ///< The id of the mount; 0 if the entry is unused.
+  uint32_t gen; ///< The generation of the mount when cached.
+  uint8_t ref; ///< Set on use; cleared as the CLOCK hand passes.
+  uint32_t next; ///< The next entry in the hash chain or the free list.
+  uint64_t expires; ///< When the entry stops being valid, in ns.
+
+  /// @brief The attributes; the strings share one allocation, owned by the
+  /// entry.
+  rfs_dirent_t dirent;
+} rfs__acache_ent_t;
+
+/// @brief The cache structure.
+typedef struct rfs__acache {
+  rfs__acache_ent_t* ents; ///< The entries.
+  uint32_t cap; ///< The number of entries.
+  uint32_t* buckets; ///< The first entry in each hash chain.
+  uint32_t mask; ///< The number of buckets minus 1.
+  uint32_t free; ///< The first unused entry.
+  uint32_t hand; ///< The position of the CLOCK hand.
+  uint32_t count; ///< The number of entries in use.
+} rfs__acache_t;
+
+/// @brief Initialize a cache.
+/// @param [in] cache The cache to initialize.
+/// @param [in] cap The most entries to hold.
+/// @return 0 on success, -errno on failure.
+int rfs__acache_init(rfs__acache_t* cache, uint32_t cap);
+
+/// @brief Free a cache.
+/// @param [in] cache The cache to free.
+void rfs__acache_free(rfs__acache_t* cache);
+
+/// @brief Look up the attributes of a file.
+/// @param [in] cache The cache to search.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qpath The qid path of the file.
+/// @param [in] now The current time in ns, such as from uv_hrtime().
+/// @return The attributes, valid until the cache is next changed; NULL if
+/// they must be fetched from the server.
+const rfs_dirent_t* rfs__acache_get(rfs__acache_t* cache,
+                                    const rfs__ns_mnt_t* mnt,
+                                    uint64_t qpath,
+                                    uint64_t now);
+
+/// @brief Record the attributes an Rstat returned.
+/// @param [in] cache The cache to add to.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] stat The attributes.
+/// @param [in] now The time the Tstat was sent, in ns; the time-to-live runs
+/// from when the server may have produced the attributes.
+/// @return 0 on success, -errno on failure.
+int rfs__acache_put(rfs__acache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const rfs__9p_stat_t* stat,
+                    uint64_t now);
+
+/// @brief Check a file's cached attributes against a fresh qid.
+/// This must be called whenever the file's qid is seen (on open, walk or
+/// create); if its version has changed, the attributes are dropped.
+/// @param [in] cache The cache holding the file.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qid The qid returned by the server.
+void rfs__acache_validate(rfs__acache_t* cache,
+                          const rfs__ns_mnt_t* mnt,
+                          const rfs_qid_t* qid);
+
+/// @brief Drop a file's cached attributes.
+/// This must be called when the client changes a file, since its length,
+/// times or mode may no longer match.
+/// @param [in] cache The cache holding the file.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qpath The qid path of the file.
+void rfs__acache_drop(rfs__acache_t* cache,
+                      const rfs__ns_mnt_t* mnt,
+                      uint64_t qpath);
+
+#endif
@@ -0,0 +1,101 @@
+#include "rfs_arena.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+void rfs__arena_init(rfs__arena_t* arena, size_t chunksize) {
+  assert(arena != NULL);
+  assert(chunksize > 0);
+
+  arena->head = NULL;
+  arena->cur = NULL;
+  arena->off = 0;
+  arena->chunksize = chunksize;
+}
+
+void rfs__arena_free(rfs__arena_t* arena) {
+  assert(arena != NULL);
+
+  while(arena->head != NULL) {
+    rfs__arena_chunk_t* chunk = arena->head;
+    arena->head = chunk->next;
+    free(chunk);
+  }
+
+  rfs__arena_init(arena, arena->chunksize);
+}
+
+void rfs__arena_reset(rfs__arena_t* arena) {
+  assert(arena != NULL);
+
+  arena->cur = arena->head;
+  arena->off = 0;
+}
+
+/// @brief Allocate a new chunk and link it in after the current chunk.
+/// @param [in] arena The arena to add the chunk to.
+/// @param [in] size The minimum usable size of the chunk.
+/// @return The new chunk; NULL if out of memory.
+static rfs__arena_chunk_t* arena_chunk_new(rfs__arena_t* arena, size_t size) {
+  if(size < arena->chunksize)
+    size = arena->chunksize;
+
+  rfs__arena_chunk_t* chunk = malloc(sizeof(rfs__arena_chunk_t) + size);
+
+  if(chunk == NULL)
+    return NULL;
+
+  chunk->size = size;
+
+  if(arena->cur == NULL) {
+    chunk->next = arena->head;
+    arena->head = chunk;
+  }
+  else {
+    chunk->next = arena->cur->next;
+    arena->cur->next = chunk;
+  }
+
+  return chunk;
+}
+
+void* rfs__arena_alloc(rfs__arena_t* arena, size_t size) {
+  assert(arena != NULL);
+
+  size = (size + RFS__ARENA_ALIGN - 1) & ~((size_t) RFS__ARENA_ALIGN - 1);
+
+  if(arena->cur != NULL && arena->off + size <= arena->cur->size) {
+    void* ptr = arena->cur->data + arena->off;
+    arena->off += size;
+    return ptr;
+  }
+
+  // move on to the next retained chunk if it is large enough; otherwise
+  // insert a new chunk ahead of it
+  rfs__arena_chunk_t* next = (arena->cur == NULL ? arena->head
+                                                 : arena->cur->next);
+
+  if(next == NULL || next->size < size) {
+    next = arena_chunk_new(arena, size);
+
+    if(next == NULL)
+      return NULL;
+  }
+
+  arena->cur = next;
+  arena->off = size;
+
+  return next->data;
+}
+
+void* rfs__arena_dup(rfs__arena_t* arena, const void* src, size_t size) {
+  assert(src != NULL || size == 0);
+
+  void* dst = rfs__arena_alloc(arena, size);
+
+  if(dst != NULL && size > 0)
+    memcpy(dst, src, size);
+
+  return dst;
+}
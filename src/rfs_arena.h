@@ -0,0 +1,61 @@
+#ifndef RFS_ARENA_H
+#define RFS_ARENA_H
+
+#include <stddef.h>
+
+/// @file A bump allocator for memory with a shared lifetime.
+/// Allocations are carved sequentially out of large chunks and are never
+/// freed individually; instead the whole arena is reset at once, which
+/// keeps the chunks for reuse. This suits anything tied to one request,
+/// where everything is released together when the request completes.
+
+/// @brief The alignment of every allocation made from an arena.
+#define RFS__ARENA_ALIGN 16
+
+/// @brief One block of memory owned by an arena.
+typedef struct rfs__arena_chunk {
+  struct rfs__arena_chunk* next; ///< The next chunk in the arena.
+  size_t size; ///< The number of usable bytes in data.
+  /// @brief The memory allocations are made from.
+  /// The header is two words, so this starts 16 bytes into the malloc'd
+  /// block and keeps malloc's alignment.
+  unsigned char data[];
+} rfs__arena_chunk_t;
+
+/// @brief The arena structure.
+typedef struct rfs__arena {
+  rfs__arena_chunk_t* head; ///< The first chunk.
+  rfs__arena_chunk_t* cur; ///< The chunk allocations are being made from.
+  size_t off; ///< The offset of the first free byte in cur.
+  size_t chunksize; ///< The size of chunks allocated by the arena.
+} rfs__arena_t;
+
+/// @brief Initialize an arena; no memory is allocated until first use.
+/// @param [in] arena The arena to initialize.
+/// @param [in] chunksize The size of the chunks to allocate. Allocations
+/// larger than this are given a chunk of their own.
+void rfs__arena_init(rfs__arena_t* arena, size_t chunksize);
+
+/// @brief Release all memory held by an arena.
+/// @param [in] arena The arena to free.
+void rfs__arena_free(rfs__arena_t* arena);
+
+/// @brief Release every allocation made from an arena at once.
+/// This is O(1): the chunks are kept, and reused by later allocations.
+/// @param [in] arena The arena to reset.
+void rfs__arena_reset(rfs__arena_t* arena);
+
+/// @brief Allocate memory from an arena.
+/// @param [in] arena The arena to allocate from.
+/// @param [in] size The number of bytes to allocate.
+/// @return The memory, aligned to RFS__ARENA_ALIGN; NULL if out of memory.
+void* rfs__arena_alloc(rfs__arena_t* arena, size_t size);
+
+/// @brief Copy memory into an arena.
+/// @param [in] arena The arena to allocate from.
+/// @param [in] src The memory to copy.
+/// @param [in] size The number of bytes to copy.
+/// @return The copy; NULL if out of memory.
+void* rfs__arena_dup(rfs__arena_t* arena, const void* src, size_t size);
+
+#endif
@@ -0,0 +1,542 @@
+#include "rfs_bcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfs/rfs.h"
+
+/// @brief The index used to terminate hash chains and free lists.
+#define BCACHE_NIL UINT32_MAX
+
+/// @brief Hash up to 3 words into one.
+static uint64_t bcache_hash(uint64_t a, uint64_t b, uint64_t c) {
+  uint64_t h = (a * 0x9e3779b97f4a7c15ULL) ^ b;
+
+  h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+  h ^= c;
+  h = (h ^ (h >> 29)) * 0x94d049bb133111ebULL;
+
+  return h ^ (h >> 32);
+}
+
+int rfs__bcache_init(rfs__bcache_t* cache, size_t bytes, uint32_t bsize) {
+  assert(cache != NULL);
+  assert(bsize > 0 && (bsize & (bsize - 1)) == 0);
+  assert(bytes / bsize > 0 && bytes / bsize < BCACHE_NIL / 2);
+
+  cache->bsize = bsize;
+  cache->nblks = (uint32_t) (bytes / bsize);
+  cache->nfiles = (cache->nblks < 16 ? 16 : cache->nblks);
+
+  uint32_t buckets = 1;
+  while(buckets < cache->nfiles * 2)
+    buckets <<= 1;
+
+  cache->mask = buckets - 1;
+  cache->data = malloc((size_t) cache->nblks * bsize);
+  cache->blks = calloc(cache->nblks, sizeof(rfs__bcache_blk_t));
+  cache->files = calloc(cache->nfiles, sizeof(rfs__bcache_file_t));
+  cache->blkbuckets = malloc(sizeof(uint32_t) * buckets);
+  cache->filebuckets = malloc(sizeof(uint32_t) * buckets);
+
+  if(cache->data == NULL || cache->blks == NULL || cache->files == NULL
+  || cache->blkbuckets == NULL || cache->filebuckets == NULL) {
+    rfs__bcache_free(cache);
+    return -ENOMEM;
+  }
+
+  for(uint32_t i = 0; i < buckets; ++i) {
+    cache->blkbuckets[i] = BCACHE_NIL;
+    cache->filebuckets[i] = BCACHE_NIL;
+  }
+
+  for(uint32_t i = 0; i < cache->nblks; ++i)
+    cache->blks[i].next = (i + 1 < cache->nblks ? i + 1 : BCACHE_NIL);
+
+  for(uint32_t i = 0; i < cache->nfiles; ++i)
+    cache->files[i].next = (i + 1 < cache->nfiles ? i + 1 : BCACHE_NIL);
+
+  cache->blkfree = 0;
+  cache->filefree = 0;
+  cache->hand = 0;
+  cache->filehand = 0;
+  cache->epochs = 0;
+  cache->disk = NULL;
+
+  return 0;
+}
+
+void rfs__bcache_free(rfs__bcache_t* cache) {
+  assert(cache != NULL);
+
+  free(cache->data);
+  free(cache->blks);
+  free(cache->files);
+  free(cache->blkbuckets);
+  free(cache->filebuckets);
+
+  cache->data = NULL;
+  cache->blks = NULL;
+  cache->files = NULL;
+  cache->blkbuckets = NULL;
+  cache->filebuckets = NULL;
+}
+
+/// @brief Find the record of a file.
+/// @return The index of the record; BCACHE_NIL if there isn't one.
+static uint32_t bcache_file_find(const rfs__bcache_t* cache,
+                                 uint64_t mnt,
+                                 uint64_t qpath) {
+  uint32_t idx = cache->filebuckets[bcache_hash(mnt, qpath, 0) & cache->mask];
+
+  while(idx != BCACHE_NIL) {
+    const rfs__bcache_file_t* file = &(cache->files[idx]);
+
+    if(file->mnt == mnt && file->qpath == qpath)
+      return idx;
+
+    idx = file->next;
+  }
+
+  return BCACHE_NIL;
+}
+
+/// @brief Remove a file record; its blocks are left to be evicted.
+static void bcache_file_remove(rfs__bcache_t* cache, uint32_t idx) {
+  rfs__bcache_file_t* file = &(cache->files[idx]);
+  uint64_t hash = bcache_hash(file->mnt, file->qpath, 0);
+  uint32_t* link = &(cache->filebuckets[hash & cache->mask]);
+
+  while(*link != idx)
+    link = &(cache->files[*link].next);
+
+  *link = file->next;
+
+  file->epoch = 0;
+  file->next = cache->filefree;
+  cache->filefree = idx;
+}
+
+/// @brief Find the record of a file whose cached content is current.
+/// @return The record; NULL if there isn't one.
+static rfs__bcache_file_t* bcache_file_get(rfs__bcache_t* cache,
+                                           const rfs__ns_mnt_t* mnt,
+                                           const rfs_qid_t* qid) {
+  uint32_t idx = bcache_file_find(cache, mnt->id, qid->path);
+
+  if(idx == BCACHE_NIL)
+    return NULL;
+
+  rfs__bcache_file_t* file = &(cache->files[idx]);
+
+  if(file->gen != mnt->gen || file->vers != qid->vers)
+    return NULL;
+
+  return file;
+}
+
+/// @brief Find or create the record of a file, starting a new epoch if
+/// the cached content isn't current.
+/// @return The record.
+static rfs__bcache_file_t* bcache_file_put(rfs__bcache_t* cache,
+                                           const rfs__ns_mnt_t* mnt,
+                                           const rfs_qid_t* qid) {
+  uint32_t idx = bcache_file_find(cache, mnt->id, qid->path);
+  rfs__bcache_file_t* file;
+
+  if(idx != BCACHE_NIL) {
+    file = &(cache->files[idx]);
+
+    if(file->gen == mnt->gen && file->vers == qid->vers)
+      return file;
+  }
+  else {
+    // records are small, so rather than tracking their use the oldest
+    // slot is reused; the evicted file's blocks become unreachable
+    if(cache->filefree == BCACHE_NIL) {
+      bcache_file_remove(cache, cache->filehand);
+      cache->filehand = (cache->filehand + 1) % cache->nfiles;
+    }
+
+    idx = cache->filefree;
+    file = &(cache->files[idx]);
+    cache->filefree = file->next;
+
+    uint64_t hash = bcache_hash(mnt->id, qid->path, 0);
+    file->mnt = mnt->id;
+    file->qpath = qid->path;
+    file->next = cache->filebuckets[hash & cache->mask];
+    cache->filebuckets[hash & cache->mask] = idx;
+  }
+
+  file->epoch = ++cache->epochs;
+  file->gen = mnt->gen;
+  file->vers = qid->vers;
+  file->known = 0;
+  file->length = 0;
+
+  return file;
+}
+
+/// @brief Find a block.
+/// @return The index of the block; BCACHE_NIL if there isn't one.
+static uint32_t bcache_blk_find(const rfs__bcache_t* cache,
+                                const rfs__bcache_file_t* file,
+                                uint64_t blkno) {
+  uint64_t hash = bcache_hash(file->mnt, file->qpath, blkno);
+  uint32_t idx = cache->blkbuckets[hash & cache->mask];
+
+  while(idx != BCACHE_NIL) {
+    const rfs__bcache_blk_t* blk = &(cache->blks[idx]);
+
+    if(blk->blkno == blkno && blk->qpath == file->qpath
+    && blk->mnt == file->mnt)
+      return idx;
+
+    idx = blk->next;
+  }
+
+  return BCACHE_NIL;
+}
+
+/// @brief Remove a block from its hash chain and add it to the free list.
+static void bcache_blk_remove(rfs__bcache_t* cache, uint32_t idx) {
+  rfs__bcache_blk_t* blk = &(cache->blks[idx]);
+  uint64_t hash = bcache_hash(blk->mnt, blk->qpath, blk->blkno);
+  uint32_t* link = &(cache->blkbuckets[hash & cache->mask]);
+
+  while(*link != idx)
+    link = &(cache->blks[*link].next);
+
+  *link = blk->next;
+
+  blk->epoch = 0;
+  blk->next = cache->blkfree;
+  cache->blkfree = idx;
+}
+
+/// @brief Find a current block of a file.
+/// A block left over from an earlier epoch of the file is removed.
+/// @return The index of the block; BCACHE_NIL if there isn't one.
+static uint32_t bcache_blk_get(rfs__bcache_t* cache,
+                               const rfs__bcache_file_t* file,
+                               uint64_t blkno) {
+  uint32_t idx = bcache_blk_find(cache, file, blkno);
+
+  if(idx == BCACHE_NIL)
+    return BCACHE_NIL;
+
+  if(cache->blks[idx].epoch != file->epoch) {
+    bcache_blk_remove(cache, idx);
+    return BCACHE_NIL;
+  }
+
+  cache->blks[idx].ref = 1;
+
+  return idx;
+}
+
+/// @brief Find or add a block of a file, evicting a block if necessary.
+/// @return The index of the block.
+static uint32_t bcache_blk_put(rfs__bcache_t* cache,
+                               const rfs__bcache_file_t* file,
+                               uint64_t blkno) {
+  uint32_t idx = bcache_blk_find(cache, file, blkno);
+
+  if(idx != BCACHE_NIL) {
+    cache->blks[idx].epoch = file->epoch;
+    return idx;
+  }
+
+  // the hand always finds a victim within two revolutions, since it clears
+  // the reference bits it passes
+  while(cache->blkfree == BCACHE_NIL) {
+    uint32_t victim = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->nblks;
+
+    if(cache->blks[victim].ref)
+      cache->blks[victim].ref = 0;
+    else
+      bcache_blk_remove(cache, victim);
+  }
+
+  idx = cache->blkfree;
+
+  rfs__bcache_blk_t* blk = &(cache->blks[idx]);
+  uint64_t hash = bcache_hash(file->mnt, file->qpath, blkno);
+
+  cache->blkfree = blk->next;
+  blk->mnt = file->mnt;
+  blk->qpath = file->qpath;
+  blk->blkno = blkno;
+  blk->epoch = file->epoch;
+  blk->ref = 0;
+  blk->next = cache->blkbuckets[hash & cache->mask];
+  cache->blkbuckets[hash & cache->mask] = idx;
+
+  return idx;
+}
+
+/// @brief Bring a block in from the persistent cache.
+/// @return The index of the block; BCACHE_NIL if it isn't on disk either.
+static uint32_t bcache_blk_load(rfs__bcache_t* cache,
+                                const rfs__ns_mnt_t* mnt,
+                                const rfs_qid_t* qid,
+                                rfs__bcache_file_t* file,
+                                uint64_t blkno) {
+  if(cache->disk == NULL || mnt->srvkey == 0)
+    return BCACHE_NIL;
+
+  uint32_t idx = bcache_blk_put(cache, file, blkno);
+  size_t len;
+  int eof;
+
+  // the disk holds the same blocks as memory: whole ones, or the last one
+  if(!rfs__dcache_get(cache->disk, mnt->srvkey, qid, blkno,
+                      cache->data + (size_t) idx * cache->bsize, &len, &eof)
+  || (len < cache->bsize && !eof)) {
+    bcache_blk_remove(cache, idx);
+    return BCACHE_NIL;
+  }
+
+  if(eof) {
+    file->length = blkno * cache->bsize + len;
+    file->known = 1;
+  }
+
+  return idx;
+}
+
+/// @brief Save a block to the persistent cache.
+/// @param [in] idx The index of the block in memory; BCACHE_NIL if the
+/// block isn't in memory, in which case any copy on disk is dropped.
+static void bcache_blk_store(rfs__bcache_t* cache,
+                             const rfs__ns_mnt_t* mnt,
+                             const rfs_qid_t* qid,
+                             const rfs__bcache_file_t* file,
+                             uint64_t blkno,
+                             uint32_t idx) {
+  if(cache->disk == NULL || mnt->srvkey == 0)
+    return;
+
+  if(idx == BCACHE_NIL) {
+    rfs__dcache_drop(cache->disk, mnt->srvkey, qid, blkno);
+    return;
+  }
+
+  uint64_t start = blkno * cache->bsize;
+  uint64_t valid = cache->bsize;
+
+  if(file->known && file->length - start < valid)
+    valid = file->length - start;
+
+  rfs__dcache_put(cache->disk, mnt->srvkey, qid, blkno,
+                  cache->data + (size_t) idx * cache->bsize, (size_t) valid,
+                  file->known && start + valid == file->length);
+}
+
+void rfs__bcache_set_disk(rfs__bcache_t* cache, rfs__dcache_t* disk) {
+  assert(cache != NULL);
+  assert(disk == NULL || disk->bsize == cache->bsize);
+
+  cache->disk = disk;
+}
+
+void rfs__bcache_validate(rfs__bcache_t* cache,
+                          const rfs__ns_mnt_t* mnt,
+                          const rfs_qid_t* qid,
+                          const uint64_t* length) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(qid != NULL);
+
+  if(!(mnt->flags & RFS_MCACHE))
+    return;
+
+  rfs__bcache_file_t* file = bcache_file_put(cache, mnt, qid);
+
+  if(length != NULL) {
+    file->length = *length;
+    file->known = 1;
+  }
+}
+
+size_t rfs__bcache_read(rfs__bcache_t* cache,
+                        const rfs__ns_mnt_t* mnt,
+                        const rfs_qid_t* qid,
+                        uint64_t offset,
+                        void* buf,
+                        size_t count,
+                        int* eof) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(qid != NULL);
+  assert(buf != NULL || count == 0);
+  assert(eof != NULL);
+
+  *eof = 0;
+
+  if(!(mnt->flags & RFS_MCACHE))
+    return 0;
+
+  rfs__bcache_file_t* file = bcache_file_get(cache, mnt, qid);
+
+  // content from an earlier process may be on disk, though nothing of the
+  // file has been cached in memory yet
+  if(file == NULL) {
+    if(cache->disk == NULL || mnt->srvkey == 0)
+      return 0;
+
+    file = bcache_file_put(cache, mnt, qid);
+  }
+
+  size_t done = 0;
+
+  while(done < count) {
+    if(file->known && offset >= file->length) {
+      *eof = 1;
+      break;
+    }
+
+    uint64_t blkno = offset / cache->bsize;
+    uint32_t idx = bcache_blk_get(cache, file, blkno);
+
+    if(idx == BCACHE_NIL)
+      idx = bcache_blk_load(cache, mnt, qid, file, blkno);
+
+    if(idx == BCACHE_NIL)
+      break;
+
+    // the block loaded may have revealed the end of the file
+    if(file->known && offset >= file->length) {
+      *eof = 1;
+      break;
+    }
+
+    uint64_t start = blkno * cache->bsize;
+    uint64_t valid = cache->bsize;
+
+    if(file->known && file->length - start < valid)
+      valid = file->length - start;
+
+    size_t n = (size_t) (valid - (offset - start));
+
+    if(n > count - done)
+      n = count - done;
+
+    memcpy((unsigned char*) buf + done,
+           cache->data + (size_t) idx * cache->bsize + (offset - start), n);
+
+    done += n;
+    offset += n;
+  }
+
+  return done;
+}
+
+void rfs__bcache_fill(rfs__bcache_t* cache,
+                      const rfs__ns_mnt_t* mnt,
+                      const rfs_qid_t* qid,
+                      uint64_t offset,
+                      const void* data,
+                      size_t count,
+                      size_t requested) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(qid != NULL);
+  assert(data != NULL || count == 0);
+  assert(count <= requested);
+
+  if(!(mnt->flags & RFS_MCACHE))
+    return;
+
+  rfs__bcache_file_t* file = bcache_file_put(cache, mnt, qid);
+  uint64_t end = offset + count;
+
+  if(count < requested) {
+    file->length = end;
+    file->known = 1;
+  }
+
+  // a block only part of which was read can't be cached, unless the rest
+  // of it is past the end of the file
+  uint64_t blkno = (offset + cache->bsize - 1) / cache->bsize;
+
+  for(;; ++blkno) {
+    uint64_t start = blkno * cache->bsize;
+    size_t n = cache->bsize;
+
+    if(start + n > end) {
+      if(!file->known || end != file->length || start >= end)
+        break;
+
+      n = (size_t) (end - start);
+    }
+
+    uint32_t idx = bcache_blk_put(cache, file, blkno);
+    memcpy(cache->data + (size_t) idx * cache->bsize,
+           (const unsigned char*) data + (start - offset), n);
+    bcache_blk_store(cache, mnt, qid, file, blkno, idx);
+  }
+}
+
+void rfs__bcache_write(rfs__bcache_t* cache,
+                       const rfs__ns_mnt_t* mnt,
+                       const rfs_qid_t* qid,
+                       uint64_t offset,
+                       const void* data,
+                       size_t count) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(qid != NULL);
+  assert(data != NULL || count == 0);
+
+  if(!(mnt->flags & RFS_MCACHE))
+    return;
+
+  rfs__bcache_file_t* file = bcache_file_get(cache, mnt, qid);
+
+  if(file == NULL)
+    return;
+
+  uint64_t end = offset + count;
+  uint64_t length = file->length;
+
+  if(file->known && end > file->length)
+    file->length = end;
+
+  // writing past the end leaves a hole which reads back as zeros, so clear
+  // whatever follows the end in the final cached block
+  if(file->known && offset > length) {
+    uint64_t blkno = length / cache->bsize;
+    uint32_t idx = bcache_blk_get(cache, file, blkno);
+    size_t from = (size_t) (length % cache->bsize);
+
+    if(idx != BCACHE_NIL)
+      memset(cache->data + (size_t) idx * cache->bsize + from, 0,
+             cache->bsize - from);
+
+    if(blkno < offset / cache->bsize)
+      bcache_blk_store(cache, mnt, qid, file, blkno, idx);
+  }
+
+  // blocks which aren't in memory are dropped from disk, rather than read
+  // in to be updated
+  for(uint64_t blkno = offset / cache->bsize;
+      blkno * cache->bsize < end; ++blkno) {
+    uint32_t idx = bcache_blk_get(cache, file, blkno);
+
+    if(idx != BCACHE_NIL) {
+      uint64_t start = blkno * cache->bsize;
+      uint64_t from = (offset > start ? offset : start);
+      uint64_t to = (end < start + cache->bsize ? end : start + cache->bsize);
+
+      memcpy(cache->data + (size_t) idx * cache->bsize + (from - start),
+             (const unsigned char*) data + (from - offset), to - from);
+    }
+
+    bcache_blk_store(cache, mnt, qid, file, blkno, idx);
+  }
+}
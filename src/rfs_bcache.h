@@ -0,0 +1,161 @@
+#ifndef RFS_BCACHE_H
+#define RFS_BCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs/types.h"
+#include "rfs_dcache.h"
+#include "rfs_ns.h"
+
+/// @file A cache of file content, meant for mounts made with RFS_MCACHE.
+/// Content is cached in fixed-size blocks keyed by the file's qid path and
+/// the block's position in the file. Coherency follows Plan 9's cfs: the
+/// version of each file's qid is remembered, and when a qid with a different
+/// version is seen every cached block of the file is discarded. Writes made
+/// through the cache update it, so a client sees its own writes.
+/// The memory used for blocks is fixed when the cache is created; blocks are
+/// evicted with the CLOCK algorithm once it is full.
+/// A persistent cache may be placed behind the cache: blocks missing from
+/// memory are then looked for on disk, and blocks read or written are saved
+/// there, for mounts whose server has a stable identity (a nonzero srvkey).
+/// Every function does nothing for mounts made without RFS_MCACHE.
+/// The client worker has no open, read or write path yet, so nothing calls
+/// the cache and RFS_MCACHE doesn't yet keep reads in the process; it will
+/// be driven from those paths once they exist.
+/// The cache isn't synchronized; it is only meant for the client worker.
+
+/// @brief What the cache knows about a file.
+/// Blocks belong to a particular epoch of a file; the epoch is replaced
+/// whenever the file's cached content is invalidated, which discards every
+/// block of the old epoch in O(1).
+typedef struct rfs__bcache_file {
+  uint64_t mnt; ///< The id of the mount.
+  uint64_t qpath; ///< The qid path of the file.
+  uint64_t epoch; ///< The current epoch; 0 if the record is unused.
+  uint64_t length; ///< The length of the file, if known.
+  uint32_t gen; ///< The generation of the mount when recorded.
+  uint32_t vers; ///< The qid version the cached content is of.
+  uint32_t next; ///< The next record in the hash chain or free list.
+  uint8_t known; ///< Nonzero if length is known.
+} rfs__bcache_file_t;
+
+/// @brief A cached block of a file.
+typedef struct rfs__bcache_blk {
+  uint64_t mnt; ///< The id of the mount.
+  uint64_t qpath; ///< The qid path of the file.
+  uint64_t blkno; ///< The offset of the block divided by the block size.
+  uint64_t epoch; ///< The epoch of the file it holds; 0 if unused.
+  uint32_t next; ///< The next block in the hash chain or free list.
+  uint8_t ref; ///< Set on use; cleared as the CLOCK hand passes.
+} rfs__bcache_blk_t;
+
+/// @brief The cache structure.
+typedef struct rfs__bcache {
+  unsigned char* data; ///< The content of every block, bsize bytes each.
+  uint32_t bsize; ///< The size of a block; a power of 2.
+
+  rfs__bcache_blk_t* blks; ///< The blocks.
+  uint32_t nblks; ///< The number of blocks.
+  uint32_t* blkbuckets; ///< The first block in each hash chain.
+  uint32_t blkfree; ///< The first unused block.
+  uint32_t hand; ///< The position of the CLOCK hand.
+
+  rfs__bcache_file_t* files; ///< The file records.
+  uint32_t nfiles; ///< The number of file records.
+  uint32_t* filebuckets; ///< The first file record in each hash chain.
+  uint32_t filefree; ///< The first unused file record.
+  uint32_t filehand; ///< The next file record to evict.
+
+  uint32_t mask; ///< The number of buckets in each table minus 1.
+  uint64_t epochs; ///< The last epoch handed out.
+
+  rfs__dcache_t* disk; ///< The persistent cache behind this one, or NULL.
+} rfs__bcache_t;
+
+/// @brief Initialize a cache.
+/// @param [in] cache The cache to initialize.
+/// @param [in] bytes The memory to use for content.
+/// @param [in] bsize The size of a block; a power of 2. This is best set to
+/// the iounit of the mounts, so one read fills one block.
+/// @return 0 on success, -errno on failure.
+int rfs__bcache_init(rfs__bcache_t* cache, size_t bytes, uint32_t bsize);
+
+/// @brief Free a cache.
+/// @param [in] cache The cache to free.
+void rfs__bcache_free(rfs__bcache_t* cache);
+
+/// @brief Place a persistent cache behind a cache.
+/// @param [in] cache The cache.
+/// @param [in] disk The persistent cache, with the same block size as cache;
+/// NULL to stop using one. It must stay open while the cache uses it.
+void rfs__bcache_set_disk(rfs__bcache_t* cache, rfs__dcache_t* disk);
+
+/// @brief Check a file's cached content against a fresh qid.
+/// This must be called whenever the file's qid is seen (on open, walk or
+/// stat); if its version has changed, the file's cached content is dropped.
+/// @param [in] cache The cache holding the file.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qid The qid returned by the server.
+/// @param [in] length The length of the file if known (such as from a
+/// stat); otherwise NULL.
+void rfs__bcache_validate(rfs__bcache_t* cache,
+                          const rfs__ns_mnt_t* mnt,
+                          const rfs_qid_t* qid,
+                          const uint64_t* length);
+
+/// @brief Read a file's content from the cache.
+/// Reading stops at the first byte which isn't cached in memory or on disk;
+/// blocks found on disk are brought into memory.
+/// @param [in] cache The cache to read from.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qid The qid of the open file.
+/// @param [in] offset The offset to read from.
+/// @param [out] buf The buffer to read into.
+/// @param [in] count The number of bytes to read.
+/// @param [out] eof Set to 1 if the read stopped at the end of the file,
+/// otherwise 0.
+/// @return The number of bytes read from the cache.
+size_t rfs__bcache_read(rfs__bcache_t* cache,
+                        const rfs__ns_mnt_t* mnt,
+                        const rfs_qid_t* qid,
+                        uint64_t offset,
+                        void* buf,
+                        size_t count,
+                        int* eof);
+
+/// @brief Add content read from the server to the cache.
+/// Only whole blocks are cached, and the final part of a block if it's the
+/// end of the file.
+/// @param [in] cache The cache to add to.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qid The qid of the open file.
+/// @param [in] offset The offset of the Tread.
+/// @param [in] data The data of the Rread.
+/// @param [in] count The number of bytes of data.
+/// @param [in] requested The count of the Tread; a shorter reply marks
+/// the end of the file.
+void rfs__bcache_fill(rfs__bcache_t* cache,
+                      const rfs__ns_mnt_t* mnt,
+                      const rfs_qid_t* qid,
+                      uint64_t offset,
+                      const void* data,
+                      size_t count,
+                      size_t requested);
+
+/// @brief Apply a successful write to the cache.
+/// Cached blocks the write overlaps are updated; the rest aren't added.
+/// @param [in] cache The cache to update.
+/// @param [in] mnt The mount holding the file.
+/// @param [in] qid The qid of the open file.
+/// @param [in] offset The offset of the Twrite.
+/// @param [in] data The data written.
+/// @param [in] count The number of bytes the server reported written.
+void rfs__bcache_write(rfs__bcache_t* cache,
+                       const rfs__ns_mnt_t* mnt,
+                       const rfs_qid_t* qid,
+                       uint64_t offset,
+                       const void* data,
+                       size_t count);
+
+#endif
@@ -0,0 +1,129 @@
+#include "rfs_bufpool.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+/// @brief The alignment of every buffer.
+#define BUFPOOL_ALIGN ((size_t) 1 << RFS__BUFPOOL_MINSHIFT)
+
+/// @brief Find the size class of a request.
+/// @return The class; RFS__BUFPOOL_CLASSES if the request is too large.
+static unsigned bufpool_class(size_t size) {
+  unsigned c = 0;
+
+  while(c < RFS__BUFPOOL_CLASSES
+     && ((size_t) 1 << (RFS__BUFPOOL_MINSHIFT + c)) < size)
+    c++;
+
+  return c;
+}
+
+/// @brief Allocate a buffer of a class.
+static void* bufpool_alloc(int flags, unsigned c) {
+  size_t size = (size_t) 1 << (RFS__BUFPOOL_MINSHIFT + c);
+
+  if(size < RFS__BUFPOOL_HUGESZ) {
+    void* buf;
+    return (posix_memalign(&buf, BUFPOOL_ALIGN, size) == 0 ? buf : NULL);
+  }
+
+  void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if(buf == MAP_FAILED)
+    return NULL;
+
+#ifdef MADV_HUGEPAGE
+  // advisory only; the buffer works either way
+  if(flags & RFS__BUFPOOL_HUGE)
+    madvise(buf, size, MADV_HUGEPAGE);
+#else
+  (void) flags;
+#endif
+
+  return buf;
+}
+
+/// @brief Release a buffer of a class.
+static void bufpool_release(void* buf, unsigned c) {
+  size_t size = (size_t) 1 << (RFS__BUFPOOL_MINSHIFT + c);
+
+  if(size < RFS__BUFPOOL_HUGESZ)
+    free(buf);
+  else
+    munmap(buf, size);
+}
+
+void rfs__bufpool_init(rfs__bufpool_t* pool, uint32_t maxfree, int flags) {
+  assert(pool != NULL);
+
+  for(unsigned c = 0; c < RFS__BUFPOOL_CLASSES; ++c) {
+    pool->free[c] = NULL;
+    pool->nfree[c] = 0;
+  }
+
+  pool->maxfree = maxfree;
+  pool->flags = flags;
+}
+
+void rfs__bufpool_free(rfs__bufpool_t* pool) {
+  assert(pool != NULL);
+
+  for(unsigned c = 0; c < RFS__BUFPOOL_CLASSES; ++c) {
+    while(pool->free[c] != NULL) {
+      rfs__bufpool_buf_t* buf = pool->free[c];
+      pool->free[c] = buf->next;
+      bufpool_release(buf, c);
+    }
+
+    pool->nfree[c] = 0;
+  }
+}
+
+size_t rfs__bufpool_size(size_t size) {
+  unsigned c = bufpool_class(size);
+
+  if(c == RFS__BUFPOOL_CLASSES)
+    return 0;
+
+  return (size_t) 1 << (RFS__BUFPOOL_MINSHIFT + c);
+}
+
+void* rfs__bufpool_get(rfs__bufpool_t* pool, size_t size) {
+  unsigned c = bufpool_class(size);
+
+  if(c == RFS__BUFPOOL_CLASSES)
+    return NULL;
+
+  if(pool == NULL)
+    return bufpool_alloc(0, c);
+
+  rfs__bufpool_buf_t* buf = pool->free[c];
+
+  if(buf == NULL)
+    return bufpool_alloc(pool->flags, c);
+
+  pool->free[c] = buf->next;
+  pool->nfree[c]--;
+
+  return buf;
+}
+
+void rfs__bufpool_put(rfs__bufpool_t* pool, void* buf, size_t size) {
+  if(buf == NULL)
+    return;
+
+  unsigned c = bufpool_class(size);
+  assert(c < RFS__BUFPOOL_CLASSES);
+
+  if(pool == NULL || pool->nfree[c] >= pool->maxfree) {
+    bufpool_release(buf, c);
+    return;
+  }
+
+  rfs__bufpool_buf_t* b = buf;
+  b->next = pool->free[c];
+  pool->free[c] = b;
+  pool->nfree[c]++;
+}
@@ -0,0 +1,80 @@
+#ifndef RFS_BUFPOOL_H
+#define RFS_BUFPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @file Pooled, page-aligned buffers for 9P frames.
+/// Buffers are handed out in power of 2 size classes, from a page up to the
+/// largest msize which will be negotiated, and returned buffers are kept in
+/// a free list per class for reuse. Every buffer is page aligned, so the
+/// kernel can copy into it a page at a time; classes of RFS__BUFPOOL_HUGESZ
+/// and up are mapped directly and, if the pool asks for it, backed by
+/// transparent huge pages to save TLB misses on multi-MiB frames.
+/// Pools are not thread safe; each event loop keeps its own.
+
+/// @brief The log2 of the smallest size class; one page.
+#define RFS__BUFPOOL_MINSHIFT 12
+
+/// @brief The number of size classes; the largest is 64 MiB.
+#define RFS__BUFPOOL_CLASSES 15
+
+/// @brief The largest buffer a pool hands out.
+#define RFS__BUFPOOL_MAXSZ \
+  ((size_t) 1 << (RFS__BUFPOOL_MINSHIFT + RFS__BUFPOOL_CLASSES - 1))
+
+/// @brief The smallest class which is mapped rather than malloc'd.
+#define RFS__BUFPOOL_HUGESZ ((size_t) 2 << 20)
+
+/// @brief Flags changing how a pool allocates.
+enum {
+  /// @brief Ask for mapped classes to be backed by huge pages; ignored
+  /// where transparent huge pages aren't supported.
+  RFS__BUFPOOL_HUGE = 1
+};
+
+/// @brief An idle buffer; the link is stored in the buffer itself.
+typedef struct rfs__bufpool_buf {
+  struct rfs__bufpool_buf* next; ///< The next idle buffer of its class.
+} rfs__bufpool_buf_t;
+
+/// @brief The pool structure.
+typedef struct rfs__bufpool {
+  rfs__bufpool_buf_t* free[RFS__BUFPOOL_CLASSES]; ///< Idle buffers by class.
+  uint32_t nfree[RFS__BUFPOOL_CLASSES]; ///< The length of each free list.
+  uint32_t maxfree; ///< The most idle buffers kept per class.
+  int flags; ///< The RFS__BUFPOOL_* flags the pool was created with.
+} rfs__bufpool_t;
+
+/// @brief Initialize a pool; no memory is allocated until first use.
+/// @param [in] pool The pool to initialize.
+/// @param [in] maxfree The most idle buffers to keep per size class;
+/// buffers returned beyond this are freed.
+/// @param [in] flags Any RFS__BUFPOOL_* flags.
+void rfs__bufpool_init(rfs__bufpool_t* pool, uint32_t maxfree, int flags);
+
+/// @brief Free a pool and every idle buffer in it.
+/// Buffers which are still in use must be returned first.
+/// @param [in] pool The pool to free.
+void rfs__bufpool_free(rfs__bufpool_t* pool);
+
+/// @brief Find the capacity of the buffer a request is given.
+/// @param [in] size The number of bytes requested.
+/// @return The size of its class; 0 if it's larger than RFS__BUFPOOL_MAXSZ.
+size_t rfs__bufpool_size(size_t size);
+
+/// @brief Take a buffer from a pool, allocating one if its class is empty.
+/// @param [in] pool The pool to take from; if NULL, the buffer is allocated
+/// and must be returned with a NULL pool too.
+/// @param [in] size The number of bytes required; the buffer holds
+/// rfs__bufpool_size(size).
+/// @return The page-aligned buffer; NULL if out of memory or too large.
+void* rfs__bufpool_get(rfs__bufpool_t* pool, size_t size);
+
+/// @brief Return a buffer to a pool.
+/// @param [in] pool The pool the buffer was taken from.
+/// @param [in] buf The buffer; may be NULL.
+/// @param [in] size The size it was requested with, or its capacity.
+void rfs__bufpool_put(rfs__bufpool_t* pool, void* buf, size_t size);
+
+#endif
@@ -1,30 +1,40 @@
 #ifndef RFS_CLIENT_H
 #define RFS_CLIENT_H
 
-#include "rfs/types.h"
+#include "rfs/rfs.h"
 
 /// @brief Different function calls supported across the RFS client channel.
 /// The RFS client API can be accessed by multiple threads, and these requests
-/// are serialized across a local socket to a single worker thread.
+/// are passed through an in-process ring to a single worker thread.
 /// These are the supported API calls.
 typedef enum rfs__client_func_type {
   RFS__CLIENT_FUNC_BIND = 1, ///< bind()
   RFS__CLIENT_FUNC_MOUNT = 2, ///< mount()
   RFS__CLIENT_FUNC_UNMOUNT = 3, ///< unmount()
+  RFS__CLIENT_FUNC_BATCH = 4, ///< execute an array of the above, in order.
   RFS__CLIENT_SHUTDOWN = 254 ///< shut down the worker thread.
 } rfs__client_func_type_t;
 
-/// @brief A function, 'serialized' across the local socket.
-/// This function structure refers to pointers managed by the calling thread.
-/// This is safe because the calling thread is blocked waiting for the
-/// worker thread to respond. However, this is NOT SAFE for use in an async
-/// program structure.
+/// @brief A function, passed by pointer through the submission ring.
+/// For blocking calls (cb is NULL) this function structure refers to pointers
+/// managed by the calling thread. This is safe because the calling thread is
+/// blocked waiting for the worker thread to respond.
+/// For asynchronous calls (cb is set) the structure and the strings it refers
+/// to are a single heap allocation made by rfs__client_func_dup(); ownership
+/// passes to the worker thread on submission, which frees it after calling cb.
 /// The function call is made by setting the type and the appropriate fields
 /// in the struct associated with that function type. Upon completion, the
-/// ret field is set and the structure is passed back.
+/// ret field is set and either cb is called or the done field is set to 1.
 typedef struct rfs__client_func {
   int ret; ///< The return code from this function's execution.
 
+  /// @brief Set to 1 by the worker thread once ret is valid.
+  /// The calling thread waits on this word with rfs__futex_wait().
+  uint32_t done;
+
+  rfs_cb_t cb; ///< The completion callback; NULL for blocking calls.
+  void* data; ///< The user data passed to cb.
+
   rfs__client_func_type_t type; ///< The type of function being executed.
 
   /// @brief Documentation of the behaviour of each argument to each of the
@@ -50,27 +60,53 @@ typedef struct rfs__client_func {
       const char* name;
       const char* old;
     } unmount;
+
+    /// @brief The requests in a batch are executed in order by the worker
+    /// within one wakeup; each has its ret field set, and the batch's ret is
+    /// set to the first failure (or 0). Batches can't be nested, and the
+    /// requests in them are never completed individually.
+    struct {
+      struct rfs__client_func* funcs;
+      size_t count;
+    } batch;
   } args;
 } rfs__client_func_t;
 
 /// @brief Execute the function request.
 /// This function can be called by any thread (except for the worker thread).
-/// If there is no active  connection from the current thread to the worker
-/// thread it will create one, then pass this request to the worker thread.
+/// The request is passed to the worker thread and the calling thread is
+/// blocked until the worker thread has set func->ret.
 /// @param [in] func The function request structure to invoke.
 /// @return 0 on success, -errno on failure.
 int rfs__client_invoke(rfs__client_func_t* func);
 
+/// @brief Copy a function request onto the heap for asynchronous use.
+/// The copy includes all strings referenced by the request's arguments, so
+/// the copy is independent of the caller's memory. It is released with a
+/// single free().
+/// @param [in] func The function request to copy.
+/// @param [in] cb The completion callback to set in the copy.
+/// @param [in] data The user data to set in the copy.
+/// @return The copy; NULL if out of memory.
+rfs__client_func_t* rfs__client_func_dup(const rfs__client_func_t* func,
+                                         rfs_cb_t cb,
+                                         void* data);
+
+/// @brief Queue the function request for the worker thread.
+/// This is safe to call from any number of threads concurrently. It doesn't
+/// wait for the request to be executed; the worker thread will either call
+/// func->cb, or set func->done and wake any waiters on it, once complete.
+/// @param [in] func The function request structure to queue.
+/// @return 0 on success, -EAGAIN if the submission ring is full,
+/// -ENOTCONN if the worker thread isn't running.
+int rfs__client_submit(rfs__client_func_t* func);
+
 /// @brief Start the RFS client worker thread.
-void rfs__client_start(void);
+/// @return 0 on success, -errno on failure.
+int rfs__client_start(void);
 
-/// @brief Exposes in a thread-safe way the worker thread's local socket path.
-/// This path is used by calls from accessor threads to initialize a connection
-/// to the worker thread.
-/// @todo Support abstract sockets on Linux (requires len field)
-/// @return NULL if the processing thread isn't initialized; local socket path
-/// the processing thread is listening on once it is started.
-const char* rfs__client_get_path(void);
+/// @brief Wait for the RFS client worker thread to exit and release it.
+/// This must be called after a RFS__CLIENT_SHUTDOWN request completes.
+void rfs__client_join(void);
 
 #endif
-
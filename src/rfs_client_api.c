@@ -1,131 +1,144 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
 
 #include "rfs/rfs.h"
 #include "rfs_client.h"
 #include "rfs_util.h"
 
-/// @brief Data fields required by an accessor thread.
-typedef struct rfs__client_ctx_thread {
-  int sfd; ///< The socket descriptor to the worker thread.
-} rfs__client_ctx_thread_t;
+/// @brief Collect the string arguments of a function request.
+/// @param [in] func The function request to inspect.
+/// @param [out] strs Set to the addresses of the string arguments.
+/// @return The number of entries of strs which were set.
+static size_t rfs__client_func_strs(rfs__client_func_t* func,
+                                    const char** strs[2]) {
+  switch(func->type) {
+    case RFS__CLIENT_FUNC_BIND:
+      strs[0] = &(func->args.bind.name);
+      strs[1] = &(func->args.bind.old);
+      return 2;
+
+    case RFS__CLIENT_FUNC_MOUNT:
+      strs[0] = &(func->args.mount.old);
+      strs[1] = &(func->args.mount.aname);
+      return 2;
+
+    case RFS__CLIENT_FUNC_UNMOUNT:
+      strs[0] = &(func->args.unmount.name);
+      strs[1] = &(func->args.unmount.old);
+      return 2;
+
+    default:
+      return 0;
+  }
+}
+
+rfs__client_func_t* rfs__client_func_dup(const rfs__client_func_t* func,
+                                         rfs_cb_t cb,
+                                         void* data) {
+  assert(func != NULL);
+
+  rfs__client_func_t tmp = *func;
+  const char** strs[2];
+  size_t nstrs = rfs__client_func_strs(&tmp, strs);
 
-/// @brief The current thread's context.
-/// This contains, if already initialized, the connection to the
-/// worker thread.
-__thread rfs__client_ctx_thread_t* _tctx = NULL;
+  size_t len = sizeof(rfs__client_func_t);
+  for(size_t i = 0; i < nstrs; ++i) {
+    if(*(strs[i]) != NULL)
+      len += strlen(*(strs[i])) + 1;
+  }
 
-/// @brief Initialize a connection to the worker thread.
-/// @param [in] t The thread context to store the socket descriptor in.
-/// @return 0 on success, -errno on failure.
-static int rfs__client_init_thread_ctx(rfs__client_ctx_thread_t* t) {
-  assert(t != NULL);
+  rfs__client_func_t* dup = malloc(len);
 
-  const char* path = rfs__client_get_path();
-  assert(path != NULL);
+  if(dup == NULL)
+    return NULL;
 
-  if(t->sfd >= 0)
-    return 0;
+  *dup = tmp;
+  dup->cb = cb;
+  dup->data = data;
+  nstrs = rfs__client_func_strs(dup, strs);
 
-  struct sockaddr_un sun = { .sun_family = AF_LOCAL };
-  size_t pathlen = strlen(path);
+  // the strings are stored immediately after the structure
+  char* pos = (char*) (dup + 1);
+  for(size_t i = 0; i < nstrs; ++i) {
+    if(*(strs[i]) == NULL)
+      continue;
 
-  if(pathlen > sizeof(sun.sun_path)) {
-    // log error
-    return -ENAMETOOLONG;
+    size_t slen = strlen(*(strs[i])) + 1;
+    memcpy(pos, *(strs[i]), slen);
+    *(strs[i]) = pos;
+    pos += slen;
   }
 
-  strncpy(sun.sun_path, path, pathlen);
-  sun.sun_path[pathlen] = '\0';
-  socklen_t slen = sizeof(sun);
+  return dup;
+}
 
-  int ret = socket(AF_LOCAL, SOCK_STREAM, 0);
+/// @brief Copy and queue a function request for asynchronous execution.
+/// @param [in] func The function request to copy and queue.
+/// @param [in] cb The callback to invoke upon completion.
+/// @param [in] data The user data to pass to cb.
+/// @return 0 on success, -errno on failure; cb is only called on success.
+static int rfs__client_invoke_async(const rfs__client_func_t* func,
+                                    rfs_cb_t cb,
+                                    void* data) {
+  assert(func != NULL);
 
-  if(ret < 0) {
-    // log error
-    return -errno;
-  }
+  if(cb == NULL)
+    return -EINVAL;
 
-  t->sfd = ret;
+  rfs__client_func_t* dup = rfs__client_func_dup(func, cb, data);
 
-  ret = connect(t->sfd, (struct sockaddr*) &sun, slen);
+  if(dup == NULL)
+    return -ENOMEM;
 
-  if(ret < 0) {
-    // log error
-    close(t->sfd);
-    t->sfd = -1;
+  int ret = rfs__client_submit(dup);
 
-    return -errno;
-  }
+  if(ret < 0)
+    free(dup);
 
-  return 0;
+  return ret;
 }
 
 int rfs__client_invoke(rfs__client_func_t* func) {
   assert(func != NULL);
 
-  if(_tctx == NULL) {
-    _tctx = malloc(sizeof(rfs__client_ctx_thread_t));
-    assert(_tctx != NULL);
-
-    _tctx->sfd = -1;
-  }
-
-  int ret = 0;
-  if(_tctx->sfd < 0) {
-    ret = rfs__client_init_thread_ctx(_tctx);
+  func->cb = NULL;
+  func->data = NULL;
+  func->done = 0;
 
-    if(ret < 0)
-      return ret;
+  int ret;
+  while((ret = rfs__client_submit(func)) == -EAGAIN) {
+    // the ring is full; let the worker thread catch up
+    sched_yield();
   }
 
-  uintptr_t req = (uintptr_t) func;
-  ret = send(_tctx->sfd, &req, sizeof(req), 0);
-
   if(ret < 0)
-    return -errno;
+    return ret;
 
-  uintptr_t resp;
-  ret = recv(_tctx->sfd, &resp, sizeof(resp), 0);
-
-  if(ret < 0) {
-    fprintf(stderr, "Error receiving response: %d (%s)\n",
-            errno, strerror(errno));
-    return -errno;
-  }
-  else if(ret == 0) {
-    fprintf(stderr, "pipe closed connection\n");
-    return -ECONNRESET;
-  }
-  else if(ret != sizeof(resp)) {
-    fprintf(stderr, "pipe didn't read appropriate size: %d\n", ret);
-    return -EMSGSIZE;
-  }
-
-  if(req != resp) {
-    fprintf(stderr, "pipe returned different ptr\n");
-    return -EBADMSG;
-  }
+  while(__atomic_load_n(&(func->done), __ATOMIC_ACQUIRE) == 0)
+    rfs__futex_wait(&(func->done), 0);
 
   return 0;
 }
 
 void rfs_init(void) {
-  rfs__client_start();
+  int ret = rfs__client_start();
+
+  if(ret < 0) {
+    fprintf(stderr, "Unable to start client: %d (%s)\n", ret, strerror(-ret));
+  }
 }
 
 void rfs_deinit(void) {
   rfs__client_func_t func;
   func.type = RFS__CLIENT_SHUTDOWN;
 
-  rfs__client_invoke(&func);
+  if(rfs__client_invoke(&func) == 0)
+    rfs__client_join();
 }
 
 int rfs_bind(const char* name, const char* old, int flags) {
@@ -169,3 +182,194 @@ int rfs_unmount(const char* name, const char* old) {
   return (ret == 0 ? func.ret : ret);
 }
 
+
+int rfs_bind_async(const char* name,
+                   const char* old,
+                   int flags,
+                   rfs_cb_t cb,
+                   void* data) {
+  rfs__client_func_t func;
+  func.type = RFS__CLIENT_FUNC_BIND;
+  func.args.bind.name = name;
+  func.args.bind.old = old;
+  func.args.bind.flags = flags;
+
+  return rfs__client_invoke_async(&func, cb, data);
+}
+
+int rfs_mount_async(int fd,
+                    rfs_fd_t afd,
+                    const char* old,
+                    int flags,
+                    const char* aname,
+                    rfs_cb_t cb,
+                    void* data) {
+  rfs__client_func_t func;
+  func.type = RFS__CLIENT_FUNC_MOUNT;
+  func.args.mount.fd = fd;
+  func.args.mount.afd = afd;
+  func.args.mount.old = old;
+  func.args.mount.flags = flags;
+  func.args.mount.aname = aname;
+
+  return rfs__client_invoke_async(&func, cb, data);
+}
+
+int rfs_unmount_async(const char* name,
+                      const char* old,
+                      rfs_cb_t cb,
+                      void* data) {
+  rfs__client_func_t func;
+  func.type = RFS__CLIENT_FUNC_UNMOUNT;
+  func.args.unmount.name = name;
+  func.args.unmount.old = old;
+
+  return rfs__client_invoke_async(&func, cb, data);
+}
+
+/// @brief The internal representation of a public batch.
+struct rfs_batch {
+  rfs__client_func_t func; ///< The batch request passed to the worker.
+  rfs__client_func_t* funcs; ///< The requests in the batch.
+  size_t count; ///< The number of requests in funcs.
+  size_t cap; ///< The number of requests funcs has room for.
+};
+
+/// @brief Reserve the next request slot in a batch.
+/// @param [in] batch The batch to add a request to.
+/// @param [in] type The type of the request being added.
+/// @return The new request; NULL if out of memory.
+static rfs__client_func_t* rfs__client_batch_add(rfs_batch_t* batch,
+                                                 rfs__client_func_type_t type) {
+  assert(batch != NULL);
+
+  if(batch->count >= INT32_MAX)
+    return NULL;
+
+  if(batch->count == batch->cap) {
+    size_t cap = (batch->cap == 0 ? 16 : batch->cap * 2);
+    rfs__client_func_t* funcs = realloc(batch->funcs,
+                                        sizeof(rfs__client_func_t) * cap);
+
+    if(funcs == NULL)
+      return NULL;
+
+    batch->funcs = funcs;
+    batch->cap = cap;
+  }
+
+  rfs__client_func_t* func = &(batch->funcs[batch->count++]);
+  func->ret = 0;
+  func->type = type;
+
+  return func;
+}
+
+rfs_batch_t* rfs_batch_new(void) {
+  rfs_batch_t* batch = malloc(sizeof(rfs_batch_t));
+
+  if(batch == NULL)
+    return NULL;
+
+  batch->funcs = NULL;
+  batch->count = 0;
+  batch->cap = 0;
+
+  return batch;
+}
+
+void rfs_batch_free(rfs_batch_t* batch) {
+  if(batch == NULL)
+    return;
+
+  free(batch->funcs);
+  free(batch);
+}
+
+void rfs_batch_clear(rfs_batch_t* batch) {
+  assert(batch != NULL);
+
+  batch->count = 0;
+}
+
+int rfs_batch_bind(rfs_batch_t* batch,
+                   const char* name,
+                   const char* old,
+                   int flags) {
+  rfs__client_func_t* func = rfs__client_batch_add(batch,
+                                                   RFS__CLIENT_FUNC_BIND);
+
+  if(func == NULL)
+    return -ENOMEM;
+
+  func->args.bind.name = name;
+  func->args.bind.old = old;
+  func->args.bind.flags = flags;
+
+  return (int) (batch->count - 1);
+}
+
+int rfs_batch_mount(rfs_batch_t* batch,
+                    int fd,
+                    rfs_fd_t afd,
+                    const char* old,
+                    int flags,
+                    const char* aname) {
+  rfs__client_func_t* func = rfs__client_batch_add(batch,
+                                                   RFS__CLIENT_FUNC_MOUNT);
+
+  if(func == NULL)
+    return -ENOMEM;
+
+  func->args.mount.fd = fd;
+  func->args.mount.afd = afd;
+  func->args.mount.old = old;
+  func->args.mount.flags = flags;
+  func->args.mount.aname = aname;
+
+  return (int) (batch->count - 1);
+}
+
+int rfs_batch_unmount(rfs_batch_t* batch, const char* name, const char* old) {
+  rfs__client_func_t* func = rfs__client_batch_add(batch,
+                                                   RFS__CLIENT_FUNC_UNMOUNT);
+
+  if(func == NULL)
+    return -ENOMEM;
+
+  func->args.unmount.name = name;
+  func->args.unmount.old = old;
+
+  return (int) (batch->count - 1);
+}
+
+int rfs_batch_submit(rfs_batch_t* batch) {
+  assert(batch != NULL);
+
+  batch->func.type = RFS__CLIENT_FUNC_BATCH;
+  batch->func.args.batch.funcs = batch->funcs;
+  batch->func.args.batch.count = batch->count;
+
+  int ret = rfs__client_invoke(&(batch->func));
+
+  return (ret == 0 ? batch->func.ret : ret);
+}
+
+int rfs_batch_submit_async(rfs_batch_t* batch, rfs_cb_t cb, void* data) {
+  assert(batch != NULL);
+
+  batch->func.type = RFS__CLIENT_FUNC_BATCH;
+  batch->func.args.batch.funcs = batch->funcs;
+  batch->func.args.batch.count = batch->count;
+
+  // only the batch header is copied; the requests stay in the batch so
+  // their results can be retrieved after completion.
+  return rfs__client_invoke_async(&(batch->func), cb, data);
+}
+
+int rfs_batch_ret(const rfs_batch_t* batch, int idx) {
+  assert(batch != NULL);
+  assert(idx >= 0 && (size_t) idx < batch->count);
+
+  return batch->funcs[idx].ret;
+}
@@ -1,161 +1,204 @@
-#ifdef __linux__
-#define _GNU_SOURCE
-#endif
 
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
-#include <sys/queue.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/un.h>
-#include <unistd.h>
 
 #include <stdio.h> // @todo remove this
 
-#ifdef __APPLE__
-#include <sys/ucred.h>
-#endif
-
 #include <uv.h>
 
+#include "rfs_9p_session.h"
+#include "rfs_acache.h"
+#include "rfs_bufpool.h"
 #include "rfs_client.h"
+#include "rfs_dcache.h"
+#include "rfs_mpsc.h"
+#include "rfs_ns.h"
 #include "rfs_util.h"
 
-#ifndef UNIX_PATH_MAX
- #if defined(__APPLE__)
-#define UNIX_PATH_MAX 104
- #elif defined(__linux__)
-#define UNIX_PATH_MAX 108
- #endif
-#endif
-
-/// @brief A structure representing one incoming API connection.
-/// This corresponds on a 1:1 basis with an accept()ed pipe.
-typedef struct rfs__client_conn {
-  LIST_ENTRY(rfs__client_conn) conns; ///< The list of connections.
-
-  uv_pipe_t pipe; ///< The accept()ed pipe this connection is using.
-
-  char* data; ///< The buffer being used for data.
-  size_t datalen; ///< The size of data
-  size_t dataoff; ///< The current offset of used bytes in data.
-
-  time_t conn_time; ///< The time this connection was accepted.
-} rfs__client_conn_t;
-
-/// @brief A structure representing one API endpoint.
-/// This corresponds on a 1:1 basis with a listening pipe.
-typedef struct rfs__client_listener {
-  char* path; ///< The path that the pipe is listening on
-  uv_pipe_t pipe; ///< The pipe listening for connections.
-
-  /// @brief The beginning of the list of clients.
-  LIST_HEAD(rfs__client_conn_head, rfs__client_conn) conns_head;
-} rfs__client_listener_t;
-
-/// @brief The listener currently active.
-static rfs__client_listener_t* _listener;
-
-/// @brief Free an allocated connection.
-/// If this is being called from a uv_close_cb then we will not close
-/// the pipe in this function (it has already been closed), otherwise
-/// the pipe will be closed.
-/// @param [in] conn The connection to close.
-static void rfs__client_conn_free(rfs__client_conn_t* conn) {
-  if(conn == NULL)
-    return;
+/// @brief The number of requests which can be queued for the worker thread.
+/// Producers which find the ring full will yield until there is space.
+#define RFS__CLIENT_RING_SIZE 4096
+
+/// @brief The msize proposed to mounted servers; the largest message
+/// accepted from them. Large messages let a single Tread or Twrite move
+/// several MiB, so bulk transfers aren't bound by round trips.
+#define RFS__CLIENT_MSIZE ((8 << 20) + RFS__9P_IOHDRSZ)
+
+/// @brief The most idle buffers the worker keeps of each size.
+#define RFS__CLIENT_MAXFREE 16
+
+/// @brief A structure representing the worker thread.
+/// API threads push function requests into the ring and ring the doorbell;
+/// the worker thread drains the ring from its event loop.
+typedef struct rfs__client_worker {
+  uv_loop_t loop; ///< The event loop run by the worker thread.
+  uv_async_t doorbell; ///< Signalled by API threads after a push.
+  uv_thread_t thread; ///< The worker thread.
+
+  rfs__mpsc_t ring; ///< The requests waiting to be executed.
+  rfs__ns_t ns; ///< The namespace built by bind, mount and unmount.
+  rfs__bufpool_t pool; ///< The buffers the mounts' sessions use.
+
+  /// @brief Set once a shutdown request has been executed.
+  /// Anything left in the ring after that point is cancelled.
+  int closing;
+} rfs__client_worker_t;
+
+/// @brief The worker currently active.
+static rfs__client_worker_t* _worker;
+
+/// @brief The number of threads inside rfs__client_submit().
+/// Each counts itself before looking at the worker, so once the worker is
+/// closing (or gone) and the count has been seen at 0, nothing can touch
+/// its ring or doorbell again.
+static uint32_t _submitters;
+
+/// @brief Wait until every thread inside rfs__client_submit() has left it.
+static void rfs__client_quiesce(void) {
+  while(__atomic_load_n(&_submitters, __ATOMIC_SEQ_CST) > 0)
+    sched_yield();
+}
 
-  if(uv_is_closing((uv_handle_t*) &(conn->pipe)) == 0) {
-    uv_close((uv_handle_t*) &(conn->pipe), NULL);
+/// @brief Mark a function request as complete and notify its caller.
+/// Asynchronous requests have their callback invoked and are then freed.
+/// The request must not be touched after this returns, since either it has
+/// been freed or the caller owns its memory and may already have released it.
+/// @param [in] func The function request which has completed.
+static void rfs__client_complete(rfs__client_func_t* func) {
+  assert(func != NULL);
+
+  if(func->cb != NULL) {
+    func->cb(func->ret, func->data);
+    free(func);
+    return;
   }
 
-  LIST_REMOVE(conn, conns);
+  __atomic_store_n(&(func->done), 1, __ATOMIC_RELEASE);
+  rfs__futex_wake(&(func->done));
+}
 
-  if(conn->data != NULL)
-    free(conn->data);
+/// @brief Shut down the worker thread.
+/// This will close the doorbell so that the event loop exits once it has
+/// finished processing the current batch of requests.
+/// @param [in] worker The worker to shut down.
+static void rfs__client_shutdown(rfs__client_worker_t* worker) {
+  assert(worker != NULL);
 
-  free(conn);
-}
+  fprintf(stdout, "Shuting down tid %ld\n", rfs__gettid());
 
-/// @brief Free an allocated listener.
-/// This will close and free all of the connected conns as well.
-/// This will not clean up the event loop.
-/// @param [in] data The object to free.
-static void rfs__client_listener_free(rfs__client_listener_t* listener) {
-  if(listener == NULL)
-    return;
+  __atomic_store_n(&(worker->closing), 1, __ATOMIC_SEQ_CST);
 
-  uv_close((uv_handle_t*) &(listener->pipe), NULL);
+  // a submitter which saw the worker open may still be ringing the
+  // doorbell; what it pushed is cancelled when the ring is next drained
+  rfs__client_quiesce();
 
-  while(!LIST_EMPTY(&(listener->conns_head))) {
-    rfs__client_conn_free(LIST_FIRST(&(listener->conns_head)));
-  }
+  // this closes the session of every mount, which the loop then finishes
+  rfs__ns_free(&(worker->ns));
+  uv_close((uv_handle_t*) &(worker->doorbell), NULL);
+}
 
-  free(listener->path);
-  free(listener);
+/// @brief Free a mounted server's session once it has closed.
+/// @param [in] session The session which closed.
+static void rfs__client_on_session_close(rfs__9p_session_t* session) {
+  free(session);
 }
 
-/// @brief Shut down the worker thread.
-/// This will close the listener plus all connected clients.
-/// Any clients, including the one making the request, will not receive
-/// further responses, so they will need to interpret a 'sock closed'
-/// as a sign the thread shut down.
-/// @param [in] loop The event loop which the worker thread is running.
-static void rfs__client_shutdown(uv_loop_t* loop) {
-  assert(loop != NULL);
-  assert(loop->data != NULL);
+/// @brief Close the session of a mount which is no longer in the namespace.
+/// @param [in] mnt The mount being released.
+static void rfs__client_on_mnt_release(rfs__ns_mnt_t* mnt) {
+  rfs__9p_session_close(mnt->data, rfs__client_on_session_close);
+}
+
+/// @brief Report a failed version negotiation.
+/// The session has failed, so the mount's requests fail with the same error.
+/// @param [in] session The session which was negotiated on.
+/// @param [in] ret The result of the negotiation.
+static void rfs__client_on_version(rfs__9p_session_t* session, int ret) {
+  (void) session;
 
-  rfs__client_listener_t* listener = loop->data;
+  if(ret < 0 && ret != -ECANCELED)
+    fprintf(stderr, "Unable to negotiate version: %d\n", ret);
+}
 
-  fprintf(stdout, "Shuting down tid %ld, listener at %s closing\n", rfs__gettid(), listener->path);
+/// @brief Identify the server connected to a descriptor, so content cached
+/// on disk can be found again by later processes.
+/// @param [in] fd The connection to the server.
+/// @param [in] aname The file tree attached to.
+/// @return The key; 0 if the peer has no stable address, such as one end of
+/// a socketpair.
+static uint64_t rfs__client_srvkey(int fd, const char* aname) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
 
-  uv_shutdown_t sreq;
-  uv_shutdown(&sreq, (uv_stream_t*) &(listener->pipe), NULL);
+  memset(&addr, 0, sizeof(addr));
 
-  uv_fs_t ulreq; // this doesn't need any args for unlink to succeed
-  uv_fs_unlink(loop, &ulreq, listener->path, NULL);
+  if(getpeername(fd, (struct sockaddr*) &addr, &len) < 0)
+    return 0;
 
-  rfs__client_listener_free(listener);
-  _listener = NULL;
+  if(addr.ss_family == AF_UNIX) {
+    const struct sockaddr_un* un = (const struct sockaddr_un*) &addr;
 
-  uv_stop(loop);
-  free(loop);
+    if(len <= offsetof(struct sockaddr_un, sun_path)
+    || un->sun_path[0] == '\0')
+      return 0;
+  }
+  else if(addr.ss_family != AF_INET && addr.ss_family != AF_INET6) {
+    return 0;
+  }
+
+  return rfs__dcache_key(&addr, len, aname);
 }
 
-/// @brief Allocate a buffer to be used for reading data.
-/// If the connection doesn't have a buffer, it will allocate a buffer and
-/// return the entire new buffer for use.
-/// If the connection has a buffer, it will return a pointer to the first
-/// unused byte of the connection's existing buffer.
-/// @param [in] hdl The handle that needs the buffer.
-/// @param [in] suggested_size The requested buffer size; less may be provided.
-/// @param [in] buf The buffer storing the memory reference.
-static void rfs__client_alloc_buf(uv_handle_t* hdl,
-                                  size_t suggested_size,
-                                  uv_buf_t* buf) {
-  assert(hdl != NULL);
-  assert(hdl->data != NULL);
-  assert(buf != NULL);
-
-  rfs__client_conn_t* conn = hdl->data;
-
-  if(conn->data == NULL) {
-    conn->data = malloc(suggested_size);
-
-    if(conn->data == NULL) {
-      // log error
-      rfs__client_conn_free(conn);
-
-      buf->base = NULL;
-      buf->len = 0;
-      return;
-    }
-
-    conn->datalen = suggested_size;
-    conn->dataoff = 0;
+/// @brief Mount a server into the namespace.
+/// A session is started on the server's fd, and every target the mount
+/// appears in shares it. The version is negotiated in the background;
+/// requests made on the mount meanwhile wait for it.
+/// @note Authentication isn't supported yet, so afd is ignored.
+/// @param [in] worker The worker executing the request.
+/// @param [in] func The mount request.
+/// @return 0 on success, -errno on failure.
+static int rfs__client_mount(rfs__client_worker_t* worker,
+                             rfs__client_func_t* func) {
+  rfs__9p_session_t* session = malloc(sizeof(rfs__9p_session_t));
+
+  if(session == NULL)
+    return -ENOMEM;
+
+  int ret = rfs__9p_session_init(session, &(worker->loop), func->args.mount.fd,
+                                 RFS__9P_SESSION_WINDOW, RFS__CLIENT_MSIZE,
+                                 &(worker->pool));
+
+  if(ret == 0)
+    ret = rfs__9p_session_version(session, rfs__client_on_version);
+
+  if(ret < 0) {
+    rfs__9p_session_close(session, rfs__client_on_session_close);
+    return ret;
   }
 
-  buf->base = conn->data + conn->dataoff;
-  buf->len = conn->datalen - conn->dataoff;
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(func->args.mount.flags,
+                                       func->args.mount.aname, session);
+
+  if(mnt == NULL) {
+    rfs__9p_session_close(session, rfs__client_on_session_close);
+    return -ENOMEM;
+  }
+
+  mnt->srvkey = rfs__client_srvkey(func->args.mount.fd, mnt->aname);
+  mnt->attrttl = (mnt->flags & RFS_MCACHE ? RFS__ACACHE_TTL : 0);
+
+  ret = rfs__ns_mount(&(worker->ns), mnt, func->args.mount.old,
+                      func->args.mount.flags);
+  rfs__ns_mnt_unref(&(worker->ns), mnt);
+
+  return ret;
 }
 
 /// @brief Invoke the requested function within the worker.
@@ -168,258 +211,184 @@ static void rfs__client_alloc_buf(uv_handle_t* hdl,
 /// @note This will set the ret field in the function request when execution
 /// of the function is complete; callers should check func->ret for success
 /// or failure details.
-/// @todo Modify connections to hold references to their outstanding requests.
-/// @param [in] loop The event loop which the request came in from.
+/// @param [in] worker The worker executing the request.
 /// @param [in] func The function data to use while executing the request.
-static void rfs__client_on_invoke(uv_loop_t* loop, rfs__client_func_t* func) {
-  assert(loop != NULL);
+static void rfs__client_on_invoke(rfs__client_worker_t* worker,
+                                  rfs__client_func_t* func) {
+  assert(worker != NULL);
   assert(func != NULL);
 
   switch(func->type) {
     case RFS__CLIENT_SHUTDOWN:
-      rfs__client_shutdown(loop);
-      break;
-
-    case RFS__CLIENT_FUNC_BIND:
-      fprintf(stdout, "bind() called with name '%s', old '%s', flags %d\n",
-                      func->args.bind.name, func->args.bind.old,
-                      func->args.bind.flags);
-
+      rfs__client_shutdown(worker);
       func->ret = 0;
       break;
 
-    default:
-      fprintf(stdout, "%d called\n", func->type);
+    case RFS__CLIENT_FUNC_BATCH:
       func->ret = 0;
-      break;
-  }
-}
 
-/// @brief Read available data from one of the connection pipes.
-/// This will parse out the API protocol (i.e. the sending of uintptr values
-/// directly over the pipe) and upon receiving a pointer to a function request
-/// invoke it.
-/// In case some data is only partially read, the connection object keeps
-/// unused bytes at the beginning of its buffer; so don't start reading from
-/// the argument buf's start, start from the connection's data start instead.
-/// @param [in] sconn The connection which read the data.
-/// @param [in] nread The number of bytes read, -1 on error. 0 is normal, and
-/// unlike a POSIX socket doesn't imply that the connection should be closed.
-/// @param [in] buf The buffer with the read data.
-static void rfs__client_on_read(uv_stream_t* sconn,
-                                ssize_t nread,
-                                const uv_buf_t* buf) {
-  assert(sconn != NULL);
-  assert(sconn->data != NULL);
-  assert(buf != NULL);
-
-  rfs__client_conn_t* conn = sconn->data;
-
-  if(nread < 0) {
-    // log error
-
-    rfs__client_conn_free(conn);
-    return;
-  }
+      for(size_t i = 0; i < func->args.batch.count; ++i) {
+        rfs__client_func_t* entry = &(func->args.batch.funcs[i]);
 
-  // the start of the conn's buffer, plus the saved offset, should be there
-  // the read buffer starts.
-  assert((conn->data + conn->dataoff) == buf->base);
+        if(entry->type == RFS__CLIENT_FUNC_BATCH
+        || entry->type == RFS__CLIENT_SHUTDOWN)
+          entry->ret = -EINVAL;
+        else
+          rfs__client_on_invoke(worker, entry);
 
-  size_t to_process = conn->dataoff + (size_t) nread;
-  assert(to_process <= conn->datalen);
+        if(func->ret == 0)
+          func->ret = entry->ret;
+      }
+      break;
 
-  size_t processed = 0;
-  for(; processed < to_process; processed += sizeof(uintptr_t) ) {
-    uintptr_t func;
-    memcpy(&func, &(conn->data[processed]), sizeof(uintptr_t));
+    case RFS__CLIENT_FUNC_BIND:
+      func->ret = rfs__ns_bind(&(worker->ns), func->args.bind.name,
+                               func->args.bind.old, func->args.bind.flags);
+      break;
 
-    rfs__client_on_invoke(sconn->loop, (rfs__client_func_t*) func);
+    case RFS__CLIENT_FUNC_MOUNT:
+      func->ret = rfs__client_mount(worker, func);
+      break;
 
-    uv_buf_t resp[] = { { .base = (char*) &func, .len = sizeof(func) } };
+    case RFS__CLIENT_FUNC_UNMOUNT:
+      func->ret = rfs__ns_unmount(&(worker->ns), func->args.unmount.name,
+                                  func->args.unmount.old);
+      break;
 
-    uv_write_t req;
-    uv_write(&req, sconn, resp, 1, NULL);
+    default:
+      fprintf(stdout, "%d called\n", func->type);
+      func->ret = 0;
+      break;
   }
-
-  conn->dataoff = to_process - processed;
-  memmove(conn->data, conn->data + processed, conn->dataoff);
 }
 
-/// @brief Handle an incoming connection on the listening pipe.
-/// This will create a new connection object and store it in the listener.
-/// @param [in] slistener The listener which has available clients.
-/// @param [in] status The status of the listener.
-static void rfs__client_on_connect(uv_stream_t* slistener, int status) {
-  assert(slistener != NULL);
-  assert(slistener->loop->data != NULL);
-
-  if(status < 0) {
-    fprintf(stderr, "Error on connect: %d (%s)\n", status, uv_strerror(status));
-    return;
-  }
-
-  rfs__client_listener_t* listener = slistener->loop->data;
-  rfs__client_conn_t* conn = malloc(sizeof(rfs__client_conn_t));
-
-  if(conn == NULL) {
-    fprintf(stderr, "Unable to allocate memory\n");
-    return;
-  }
-
-  uv_pipe_init(slistener->loop, &(conn->pipe), 0);
-  LIST_INSERT_HEAD(&(listener->conns_head), conn, conns);
-  conn->conn_time = time(NULL);
-  conn->pipe.data = conn;
-
-  int ret;
-  if((ret = uv_accept(slistener, (uv_stream_t*) &(conn->pipe))) < 0) {
-    fprintf(stderr, "Error on accept: %d (%s)\n", ret, uv_strerror(ret));
-
-    rfs__client_conn_free(conn);
-    return;
+/// @brief Drain the submission ring.
+/// This is called on the worker thread whenever the doorbell has been rung
+/// at least once since the last call; multiple rings are coalesced into one
+/// callback, so every request currently in the ring is executed.
+/// @param [in] doorbell The doorbell which was rung.
+static void rfs__client_on_doorbell(uv_async_t* doorbell) {
+  assert(doorbell != NULL);
+  assert(doorbell->data != NULL);
+
+  rfs__client_worker_t* worker = doorbell->data;
+  rfs__client_func_t* func;
+
+  while((func = rfs__mpsc_pop(&(worker->ring))) != NULL) {
+    if(worker->closing)
+      func->ret = -ECANCELED;
+    else
+      rfs__client_on_invoke(worker, func);
+
+    rfs__client_complete(func);
   }
-
-  uv_os_fd_t cfd;
-
-  if((ret = uv_fileno((uv_handle_t*) &(conn->pipe), &cfd)) < 0) {
-    fprintf(stderr, "Error getting fileno of stream: %d (%s)\n",
-            ret, uv_strerror(ret));
-
-    rfs__client_conn_free(conn);
-    return;
-  }
-
-#ifdef __APPLE__
-  static const int so_lvl = SOL_LOCAL;
-  static const int so_opt = LOCAL_PEERCRED;
-  struct xucred cred;
-  uid_t* uid = &cred.cr_uid;
-#else
-  static const int so_lvl = SOL_SOCKET;
-  static const int so_opt = SO_PEERCRED;
-  struct ucred cred;
-  uid_t* uid = &cred.uid;
-#endif
-
-  socklen_t clen = sizeof(cred);
-
-  if((ret = getsockopt(cfd, so_lvl, so_opt, &cred, &clen)) < 0) {
-    fprintf(stderr, "Error getting cred opt: %d (%s)\n",
-            errno, strerror(errno));
-
-    rfs__client_conn_free(conn);
-    return;
-  }
-
-  if(*uid != getuid()) {
-    fprintf(stderr, "Unauthenticated connection: our uid %d, inc uid %d\n",
-            getuid(), *uid);
-
-    rfs__client_conn_free(conn);
-    return;
-  }
-
-  uv_read_start((uv_stream_t*) &(conn->pipe),
-                rfs__client_alloc_buf,
-                rfs__client_on_read);
 }
 
-/// @brief Start and run the worker thread.
+/// @brief Run the worker thread.
 /// This function should be invoked as the function provided to a new thread;
 /// once started it will run until it receives a RFS__CLIENT_SHUTDOWN function
-/// request over its listening socket. It is a blocking call, so don't expect
-/// anything run after uv_run to be executed.
-/// @param [in] args Unused for now.
+/// request through the submission ring.
+/// @param [in] args The worker to run.
 static void rfs__client_run(void* args) {
-  (void) args;
+  assert(args != NULL);
 
-  uv_loop_t* loop = malloc(sizeof(uv_loop_t));
+  rfs__client_worker_t* worker = args;
 
-  if(loop == NULL) {
-    // log out of memory
-    return;
-  }
+  uv_run(&(worker->loop), UV_RUN_DEFAULT);
+}
 
-  rfs__client_listener_t* listener = malloc(sizeof(rfs__client_listener_t));
+int rfs__client_submit(rfs__client_func_t* func) {
+  assert(func != NULL);
 
-  if(listener == NULL) {
-    // log out of memory
-    free(loop);
-    return;
-  }
+  __atomic_add_fetch(&_submitters, 1, __ATOMIC_SEQ_CST);
 
-  listener->path = malloc(sizeof(char) * UNIX_PATH_MAX);
+  rfs__client_worker_t* worker = __atomic_load_n(&_worker, __ATOMIC_SEQ_CST);
+  int ret = -ENOTCONN;
 
-  if(listener->path == NULL) {
-    // log out of memory
-    free(listener);
-    free(loop);
-    return;
+  if(worker != NULL
+  && !__atomic_load_n(&(worker->closing), __ATOMIC_SEQ_CST)
+  && (ret = rfs__mpsc_push(&(worker->ring), func)) == 0) {
+    // uv_async_send coalesces; it only writes to the loop's eventfd if the
+    // doorbell isn't already pending.
+    uv_async_send(&(worker->doorbell));
   }
 
-  uv_loop_init(loop);
-  uv_pipe_init(loop, &(listener->pipe), 0);
-  LIST_INIT(&(listener->conns_head));
+  __atomic_sub_fetch(&_submitters, 1, __ATOMIC_SEQ_CST);
 
-  loop->data = listener;
-  _listener = listener;
+  return ret;
+}
 
-  int plen = snprintf(listener->path,
-                      UNIX_PATH_MAX,
-                      "/tmp/rfsct_%ld",
-                      rfs__getpid());
+int rfs__client_start(void) {
 
-  if(plen < 0) {
-    // log error
-    rfs__client_listener_free(listener);
-    free(loop);
-    return;
-  }
+  // Ignore signal events
+  signal(SIGPIPE, SIG_IGN);
 
-  // First, we remove the path, in case it was left over
-  uv_fs_t req; // this doesn't need any args for unlink to succeed
-  uv_fs_unlink(loop, &req, listener->path, NULL);
+  rfs__client_worker_t* worker = malloc(sizeof(rfs__client_worker_t));
 
-  int ret;
-  if((ret = uv_pipe_bind(&(listener->pipe), listener->path)) < 0) {
-    fprintf(stderr, "Unable to bind to %s: %d (%s)\n",
-            listener->path, ret, uv_strerror(ret));
+  if(worker == NULL)
+    return -ENOMEM;
 
-    rfs__client_listener_free(listener);
-    free(loop);
-    return;
+  int ret = rfs__mpsc_init(&(worker->ring), RFS__CLIENT_RING_SIZE);
+
+  if(ret < 0) {
+    free(worker);
+    return ret;
   }
 
-  if((ret = uv_listen((uv_stream_t*) &(listener->pipe), 128,
-      rfs__client_on_connect)) < 0) {
-    fprintf(stderr, "Unable to listen: %d (%s)\n", ret, uv_strerror(ret));
-    rfs__client_listener_free(listener);
-    free(loop);
-    return;
+  // The loop and doorbell are set up before the thread starts, so requests
+  // can be submitted as soon as this returns.
+  if((ret = uv_loop_init(&(worker->loop))) < 0) {
+    rfs__mpsc_free(&(worker->ring));
+    free(worker);
+    return ret;
   }
-  else {
-    fprintf(stdout, "Listening for API calls on %s\n", listener->path);
+
+  uv_async_init(&(worker->loop), &(worker->doorbell), rfs__client_on_doorbell);
+  worker->doorbell.data = worker;
+  worker->closing = 0;
+  rfs__bufpool_init(&(worker->pool), RFS__CLIENT_MAXFREE, RFS__BUFPOOL_HUGE);
+  rfs__ns_init(&(worker->ns), rfs__client_on_mnt_release);
+
+  if((ret = uv_thread_create(&(worker->thread), rfs__client_run, worker)) < 0) {
+    fprintf(stderr, "Unable to start worker: %d (%s)\n", ret, uv_strerror(ret));
+
+    uv_close((uv_handle_t*) &(worker->doorbell), NULL);
+    uv_run(&(worker->loop), UV_RUN_DEFAULT);
+    uv_loop_close(&(worker->loop));
+    rfs__bufpool_free(&(worker->pool));
+    rfs__mpsc_free(&(worker->ring));
+    free(worker);
+    return ret;
   }
 
-  uv_run(loop, UV_RUN_DEFAULT);
+  __atomic_store_n(&_worker, worker, __ATOMIC_SEQ_CST);
+
+  return 0;
 }
 
-void rfs__client_start(void) {
+void rfs__client_join(void) {
+  rfs__client_worker_t* worker = _worker;
 
-  // Ignore signal events
-  signal(SIGPIPE, SIG_IGN);
+  if(worker == NULL)
+    return;
 
-  // Create new thread for processing
-  uv_thread_t client_thread;
-  uv_thread_create(&client_thread, rfs__client_run, NULL);  
+  uv_thread_join(&(worker->thread));
 
-  sleep(1);
-}
+  // once no submitter can still be using the worker, nothing more can be
+  // pushed, so this drain is the last
+  __atomic_store_n(&_worker, NULL, __ATOMIC_SEQ_CST);
+  rfs__client_quiesce();
 
-const char* rfs__client_get_path(void) {
-  if(_listener == NULL)
-    return NULL;
+  // cancel anything which raced with the shutdown request
+  rfs__client_func_t* func;
+  while((func = rfs__mpsc_pop(&(worker->ring))) != NULL) {
+    func->ret = -ECANCELED;
+    rfs__client_complete(func);
+  }
 
-  return _listener->path;
+  // the sessions returned their buffers as the loop closed them
+  uv_loop_close(&(worker->loop));
+  rfs__bufpool_free(&(worker->pool));
+  rfs__mpsc_free(&(worker->ring));
+  free(worker);
 }
@@ -0,0 +1,415 @@
+#include "rfs_dcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// @brief Identifies a cache file: "RFSDCACH" read as a little-endian word.
+#define DCACHE_MAGIC 0x4843414344534652ULL
+
+/// @brief The layout version of the cache file.
+#define DCACHE_VERSION 1
+
+/// @brief The number of times a reader retries a slot being written.
+#define DCACHE_RETRIES 4
+
+/// @brief Hash the key of a block into a set index.
+static uint64_t dcache_hash(uint64_t srv, uint64_t qpath, uint64_t blkno) {
+  uint64_t h = (srv * 0x9e3779b97f4a7c15ULL) ^ qpath;
+
+  h = (h ^ (h >> 31)) * 0xbf58476d1ce4e5b9ULL;
+  h ^= blkno;
+  h = (h ^ (h >> 29)) * 0x94d049bb133111ebULL;
+
+  return h ^ (h >> 32);
+}
+
+/// @brief Create an empty cache file with a layout and move it to path.
+/// Processes which already have the old file mapped keep using it, since
+/// it's replaced rather than changed; resizing it would leave their
+/// mappings reading another layout or past its end.
+/// @param [out] hdr Set to the new file's header.
+/// @return The new file, open for reading and writing, on success; -errno
+/// on failure.
+static int dcache_create(const char* path,
+                         uint32_t nslots,
+                         uint32_t bsize,
+                         rfs__dcache_hdr_t* hdr) {
+  size_t pathlen = strlen(path);
+  char* tmp = malloc(pathlen + sizeof(".XXXXXX"));
+
+  if(tmp == NULL)
+    return -ENOMEM;
+
+  memcpy(tmp, path, pathlen);
+  memcpy(tmp + pathlen, ".XXXXXX", sizeof(".XXXXXX"));
+
+  int fd = mkstemp(tmp);
+
+  if(fd < 0) {
+    int ret = -errno;
+    free(tmp);
+    return ret;
+  }
+
+  size_t meta = sizeof(rfs__dcache_hdr_t)
+              + sizeof(rfs__dcache_slot_t) * nslots;
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = DCACHE_MAGIC;
+  hdr->version = DCACHE_VERSION;
+  hdr->bsize = bsize;
+  hdr->nslots = nslots;
+  hdr->dataoff = (meta + 4095) & ~(uint64_t) 4095;
+
+  // a new file is zeroed, i.e. has every slot empty; the header is written
+  // before the file appears at path, so nothing maps it half laid out
+  int ret = 0;
+
+  if(fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fchmod(fd, 0644) < 0
+  || ftruncate(fd, (off_t) (hdr->dataoff
+                          + (uint64_t) nslots * bsize)) < 0)
+    ret = -errno;
+  else if(pwrite(fd, hdr, sizeof(*hdr), 0) != (ssize_t) sizeof(*hdr))
+    ret = -EIO;
+  else if(rename(tmp, path) < 0)
+    ret = -errno;
+
+  if(ret < 0) {
+    unlink(tmp);
+    close(fd);
+    fd = ret;
+  }
+
+  free(tmp);
+
+  return fd;
+}
+
+/// @brief Lay out and map an open cache file.
+/// The caller holds a lock on the file for the duration.
+/// @return 0 on success, -errno on failure.
+static int dcache_map(rfs__dcache_t* cache,
+                      int fd,
+                      const char* path,
+                      size_t bytes,
+                      uint32_t bsize,
+                      int writable) {
+  struct stat st;
+  rfs__dcache_hdr_t hdr;
+  int mapfd = fd;
+
+  if(fstat(fd, &st) < 0)
+    return -errno;
+
+  int have = (pread(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr)
+           && hdr.magic == DCACHE_MAGIC && hdr.version == DCACHE_VERSION
+           && hdr.nslots > 0 && hdr.nslots % RFS__DCACHE_WAYS == 0
+           && hdr.bsize > 0
+           && (uint64_t) st.st_size == hdr.dataoff
+                                     + (uint64_t) hdr.nslots * hdr.bsize);
+
+  if(writable) {
+    uint32_t nslots = (uint32_t) (bytes / bsize);
+    nslots -= nslots % RFS__DCACHE_WAYS;
+
+    if(nslots == 0)
+      return -EINVAL;
+
+    // a file laid out differently is replaced by a new one
+    if((!have || hdr.bsize != bsize || hdr.nslots != nslots)
+    && (mapfd = dcache_create(path, nslots, bsize, &hdr)) < 0)
+      return mapfd;
+  }
+  else if(!have) {
+    return -EINVAL;
+  }
+
+  size_t size = (size_t) (hdr.dataoff + (uint64_t) hdr.nslots * hdr.bsize);
+  int prot = PROT_READ | (writable ? PROT_WRITE : 0);
+  void* map = mmap(NULL, size, prot, MAP_SHARED, mapfd, 0);
+  int ret = -errno;
+
+  if(mapfd != fd)
+    close(mapfd);
+
+  if(map == MAP_FAILED)
+    return ret;
+
+  cache->map = map;
+  cache->size = size;
+  cache->slots = (rfs__dcache_slot_t*) (void*) (cache->map + sizeof(hdr));
+  cache->data = cache->map + hdr.dataoff;
+  cache->bsize = hdr.bsize;
+  cache->nsets = hdr.nslots / RFS__DCACHE_WAYS;
+  cache->victim = 0;
+  cache->writable = writable;
+
+  return 0;
+}
+
+int rfs__dcache_open(rfs__dcache_t* cache,
+                     const char* path,
+                     size_t bytes,
+                     uint32_t bsize,
+                     int writable) {
+  assert(cache != NULL);
+  assert(path != NULL);
+  assert(!writable || bsize > 0);
+
+  int fd;
+  int ret;
+
+  // the lock keeps writers from replacing the file at once; a file which
+  // was replaced while waiting for it is reopened, so nobody lays out, or
+  // maps, a file no longer at path; once mapped, the file is only ever
+  // accessed through the slot locks, and the mapping holds the file open,
+  // so the lock must be dropped explicitly
+  for(;;) {
+    struct stat held;
+    struct stat cur;
+
+    fd = open(path, writable ? O_RDWR | O_CREAT | O_CLOEXEC
+                             : O_RDONLY | O_CLOEXEC, 0644);
+
+    if(fd < 0)
+      return -errno;
+
+    if(flock(fd, writable ? LOCK_EX : LOCK_SH) < 0) {
+      ret = -errno;
+      close(fd);
+      return ret;
+    }
+
+    if(fstat(fd, &held) == 0 && stat(path, &cur) == 0
+    && held.st_dev == cur.st_dev && held.st_ino == cur.st_ino)
+      break;
+
+    close(fd);
+  }
+
+  ret = dcache_map(cache, fd, path, bytes, bsize, writable);
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  return ret;
+}
+
+void rfs__dcache_close(rfs__dcache_t* cache) {
+  assert(cache != NULL);
+
+  if(cache->map != NULL)
+    munmap(cache->map, cache->size);
+
+  cache->map = NULL;
+  cache->slots = NULL;
+  cache->data = NULL;
+}
+
+uint64_t rfs__dcache_key(const void* addr, size_t addrlen, const char* aname) {
+  assert(addr != NULL || addrlen == 0);
+
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char* bytes = addr;
+
+  for(size_t i = 0; i < addrlen; ++i)
+    h = (h ^ bytes[i]) * 1099511628211ULL;
+
+  // separate the address from the name, so they can't run together
+  h = (h ^ 0xff) * 1099511628211ULL;
+
+  for(const char* c = aname; c != NULL && *c != '\0'; ++c)
+    h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+
+  return (h != 0 ? h : 1);
+}
+
+/// @brief Check whether a slot's key matches a block.
+/// The fields may be changing underneath the caller; a match must be
+/// confirmed by checking the slot's sequence afterwards.
+static int dcache_match(const rfs__dcache_slot_t* slot,
+                        uint64_t srv,
+                        uint64_t qpath,
+                        uint64_t blkno) {
+  return (__atomic_load_n(&(slot->flags), __ATOMIC_RELAXED)
+          & RFS__DCACHE_VALID)
+      && __atomic_load_n(&(slot->srv), __ATOMIC_RELAXED) == srv
+      && __atomic_load_n(&(slot->qpath), __ATOMIC_RELAXED) == qpath
+      && __atomic_load_n(&(slot->blkno), __ATOMIC_RELAXED) == blkno;
+}
+
+int rfs__dcache_get(rfs__dcache_t* cache,
+                    uint64_t srv,
+                    const rfs_qid_t* qid,
+                    uint64_t blkno,
+                    void* buf,
+                    size_t* len,
+                    int* eof) {
+  assert(cache != NULL && cache->map != NULL);
+  assert(qid != NULL);
+  assert(buf != NULL);
+  assert(len != NULL);
+  assert(eof != NULL);
+
+  uint64_t set = dcache_hash(srv, qid->path, blkno) % cache->nsets;
+
+  for(uint32_t way = 0; way < RFS__DCACHE_WAYS; ++way) {
+    uint64_t idx = set * RFS__DCACHE_WAYS + way;
+    rfs__dcache_slot_t* slot = &(cache->slots[idx]);
+
+    for(int attempt = 0; attempt < DCACHE_RETRIES; ++attempt) {
+      uint32_t seq = __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE);
+
+      if(seq & 1)
+        continue;
+
+      if(!dcache_match(slot, srv, qid->path, blkno))
+        break;
+
+      uint32_t vers = __atomic_load_n(&(slot->vers), __ATOMIC_RELAXED);
+      uint32_t flags = __atomic_load_n(&(slot->flags), __ATOMIC_RELAXED);
+      uint32_t n = __atomic_load_n(&(slot->len), __ATOMIC_RELAXED);
+
+      if(n > cache->bsize)
+        continue;
+
+      if(vers == qid->vers)
+        memcpy(buf, cache->data + idx * cache->bsize, n);
+
+      // the copy is only good if no writer touched the slot meanwhile
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+      if(__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) != seq)
+        continue;
+
+      if(vers != qid->vers)
+        return 0;
+
+      *len = n;
+      *eof = ((flags & RFS__DCACHE_EOF) != 0);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/// @brief Lock the slot a block is, or should be, stored in.
+/// @param [in] any Nonzero to choose a slot for the block if it isn't
+/// already cached; otherwise only a slot holding the block is locked.
+/// @param [out] seq Set to the slot's sequence before locking.
+/// @return The locked slot; NULL if there isn't one or it's in use.
+static rfs__dcache_slot_t* dcache_lock(rfs__dcache_t* cache,
+                                       uint64_t srv,
+                                       uint64_t qpath,
+                                       uint64_t blkno,
+                                       int any,
+                                       uint64_t* idx,
+                                       uint32_t* seq) {
+  uint64_t set = dcache_hash(srv, qpath, blkno) % cache->nsets;
+  uint64_t first = set * RFS__DCACHE_WAYS;
+  uint64_t chosen = UINT64_MAX;
+
+  for(uint32_t way = 0; way < RFS__DCACHE_WAYS; ++way) {
+    rfs__dcache_slot_t* slot = &(cache->slots[first + way]);
+
+    if(dcache_match(slot, srv, qpath, blkno)) {
+      chosen = first + way;
+      break;
+    }
+
+    if(any && chosen == UINT64_MAX
+    && __atomic_load_n(&(slot->flags), __ATOMIC_RELAXED) == 0)
+      chosen = first + way;
+  }
+
+  if(chosen == UINT64_MAX) {
+    if(!any)
+      return NULL;
+
+    chosen = first + (cache->victim++ % RFS__DCACHE_WAYS);
+  }
+
+  rfs__dcache_slot_t* slot = &(cache->slots[chosen]);
+  uint32_t cur = __atomic_load_n(&(slot->seq), __ATOMIC_RELAXED);
+
+  // another process is writing this slot; it's a cache, so just skip it
+  if((cur & 1) || !__atomic_compare_exchange_n(&(slot->seq), &cur, cur + 1,
+                                                0, __ATOMIC_ACQUIRE,
+                                                __ATOMIC_RELAXED))
+    return NULL;
+
+  // readers must see the odd sequence before any of the changes
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  *idx = chosen;
+  *seq = cur;
+
+  return slot;
+}
+
+void rfs__dcache_put(rfs__dcache_t* cache,
+                     uint64_t srv,
+                     const rfs_qid_t* qid,
+                     uint64_t blkno,
+                     const void* data,
+                     size_t len,
+                     int eof) {
+  assert(cache != NULL && cache->map != NULL);
+  assert(qid != NULL);
+  assert(data != NULL || len == 0);
+  assert(len <= cache->bsize);
+
+  if(!cache->writable)
+    return;
+
+  uint64_t idx;
+  uint32_t seq;
+  rfs__dcache_slot_t* slot = dcache_lock(cache, srv, qid->path, blkno, 1,
+                                         &idx, &seq);
+
+  if(slot == NULL)
+    return;
+
+  memcpy(cache->data + idx * cache->bsize, data, len);
+
+  __atomic_store_n(&(slot->len), (uint32_t) len, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->srv), srv, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->qpath), qid->path, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->blkno), blkno, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->vers), qid->vers, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->flags), RFS__DCACHE_VALID
+                                 | (eof ? RFS__DCACHE_EOF : 0),
+                   __ATOMIC_RELAXED);
+
+  __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+void rfs__dcache_drop(rfs__dcache_t* cache,
+                      uint64_t srv,
+                      const rfs_qid_t* qid,
+                      uint64_t blkno) {
+  assert(cache != NULL && cache->map != NULL);
+  assert(qid != NULL);
+
+  if(!cache->writable)
+    return;
+
+  uint64_t idx;
+  uint32_t seq;
+  rfs__dcache_slot_t* slot = dcache_lock(cache, srv, qid->path, blkno, 0,
+                                         &idx, &seq);
+
+  if(slot == NULL)
+    return;
+
+  __atomic_store_n(&(slot->flags), 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&(slot->seq), seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,138 @@
+#ifndef RFS_DCACHE_H
+#define RFS_DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs/types.h"
+
+/// @file A persistent cache of file content, kept in a memory-mapped file.
+/// The file holds a fixed number of block-sized slots indexed by server,
+/// qid path and block number; each slot also records the qid version its
+/// content belongs to, so content outlives the process which cached it
+/// but is never returned for a different version of the file.
+/// The file may be mapped by any number of processes at once, some of them
+/// read-only. Each slot is guarded by a sequence lock: writers make the
+/// sequence odd while they change the slot, and readers retry or give up if
+/// the sequence changed while they were copying, so readers never block
+/// and never see a torn block.
+/// Nothing opens a cache file yet: it's placed behind the block cache with
+/// rfs__bcache_set_disk(), which the client worker doesn't use, and there's
+/// no setting for where the file lives. Mounts only compute their srvkey.
+
+/// @brief The number of slots a block may be stored in.
+#define RFS__DCACHE_WAYS 4
+
+/// @brief The header at the start of the cache file.
+typedef struct rfs__dcache_hdr {
+  uint64_t magic; ///< Identifies the file as a cache.
+  uint32_t version; ///< The layout version of the file.
+  uint32_t bsize; ///< The size of each block.
+  uint32_t nslots; ///< The number of slots; a multiple of the ways.
+  uint32_t pad0;
+  uint64_t dataoff; ///< The offset of the first slot's content.
+  uint64_t pad1[4];
+} rfs__dcache_hdr_t;
+
+/// @brief The metadata of one slot, as stored in the file.
+typedef struct rfs__dcache_slot {
+  uint32_t seq; ///< The sequence lock; odd while being written.
+  uint32_t len; ///< The number of valid bytes of content.
+  uint64_t srv; ///< The key of the server the content is from.
+  uint64_t qpath; ///< The qid path of the file.
+  uint64_t blkno; ///< The offset of the block divided by the block size.
+  uint32_t vers; ///< The qid version the content is of.
+  uint32_t flags; ///< RFS__DCACHE_* flags; 0 if the slot is empty.
+  uint64_t pad[3];
+} rfs__dcache_slot_t;
+
+enum {
+  RFS__DCACHE_VALID = (1 << 0), ///< The slot holds content.
+  RFS__DCACHE_EOF = (1 << 1) ///< The content ends at the end of the file.
+};
+
+/// @brief An open cache file.
+typedef struct rfs__dcache {
+  unsigned char* map; ///< The mapping of the whole file.
+  size_t size; ///< The size of the mapping.
+  rfs__dcache_slot_t* slots; ///< The slot metadata.
+  unsigned char* data; ///< The content of the first slot.
+  uint32_t bsize; ///< The size of each block.
+  uint32_t nsets; ///< The number of sets of RFS__DCACHE_WAYS slots.
+  uint32_t victim; ///< Rotates the slot chosen when a set is full.
+  int writable; ///< Nonzero if this process may add content.
+} rfs__dcache_t;
+
+/// @brief Open a cache file, creating it if necessary.
+/// A file with a different size or layout is replaced by a new, empty one
+/// if opened writable; processes which have the old one mapped keep using
+/// it, and don't see what's added to the new one until they reopen it.
+/// @param [in] cache The cache to open.
+/// @param [in] path The path of the cache file.
+/// @param [in] bytes The memory to use for content; ignored if read-only.
+/// @param [in] bsize The size of a block; ignored if read-only.
+/// @param [in] writable Nonzero to allow content to be added.
+/// @return 0 on success, -errno on failure.
+int rfs__dcache_open(rfs__dcache_t* cache,
+                     const char* path,
+                     size_t bytes,
+                     uint32_t bsize,
+                     int writable);
+
+/// @brief Unmap a cache file; its content remains for future processes.
+/// @param [in] cache The cache to close.
+void rfs__dcache_close(rfs__dcache_t* cache);
+
+/// @brief Compute a key identifying a server across processes.
+/// @param [in] addr The address of the server, such as from getpeername().
+/// @param [in] addrlen The size of addr.
+/// @param [in] aname The file tree attached to.
+/// @return The key; never 0.
+uint64_t rfs__dcache_key(const void* addr, size_t addrlen, const char* aname);
+
+/// @brief Read a block from the cache.
+/// @param [in] cache The cache to read from.
+/// @param [in] srv The key of the server.
+/// @param [in] qid The current qid of the file.
+/// @param [in] blkno The block to read.
+/// @param [out] buf The buffer to read into; at least bsize bytes.
+/// @param [out] len Set to the number of bytes read.
+/// @param [out] eof Set to 1 if the block ends at the end of the file.
+/// @return 1 if the block was read, 0 if it isn't cached.
+int rfs__dcache_get(rfs__dcache_t* cache,
+                    uint64_t srv,
+                    const rfs_qid_t* qid,
+                    uint64_t blkno,
+                    void* buf,
+                    size_t* len,
+                    int* eof);
+
+/// @brief Add a block to the cache, replacing any older copy.
+/// This does nothing if the cache is read-only, or if another process is
+/// writing the slot the block would go in.
+/// @param [in] cache The cache to add to.
+/// @param [in] srv The key of the server.
+/// @param [in] qid The qid of the file the content is of.
+/// @param [in] blkno The block being added.
+/// @param [in] data The content of the block.
+/// @param [in] len The number of bytes of content; at most bsize.
+/// @param [in] eof Nonzero if the content ends at the end of the file.
+void rfs__dcache_put(rfs__dcache_t* cache,
+                     uint64_t srv,
+                     const rfs_qid_t* qid,
+                     uint64_t blkno,
+                     const void* data,
+                     size_t len,
+                     int eof);
+
+/// @brief Remove a block from the cache.
+/// @param [in] cache The cache to remove from.
+/// @param [in] srv The key of the server.
+/// @param [in] qid The qid of the file.
+/// @param [in] blkno The block to remove.
+void rfs__dcache_drop(rfs__dcache_t* cache,
+                      uint64_t srv,
+                      const rfs_qid_t* qid,
+                      uint64_t blkno);
+
+#endif
@@ -0,0 +1,94 @@
+#include "rfs_mpsc.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+int rfs__mpsc_init(rfs__mpsc_t* q, size_t size) {
+  assert(q != NULL);
+  assert(size > 0);
+
+  size_t slots = 1;
+  while(slots < size)
+    slots <<= 1;
+
+  q->cells = malloc(sizeof(rfs__mpsc_cell_t) * slots);
+
+  if(q->cells == NULL)
+    return -ENOMEM;
+
+  // each slot starts out owned by the producer which will claim position i
+  for(size_t i = 0; i < slots; ++i) {
+    q->cells[i].seq = i;
+    q->cells[i].data = NULL;
+  }
+
+  q->mask = slots - 1;
+  q->head = 0;
+  q->tail = 0;
+
+  return 0;
+}
+
+void rfs__mpsc_free(rfs__mpsc_t* q) {
+  assert(q != NULL);
+
+  free(q->cells);
+  q->cells = NULL;
+  q->mask = 0;
+}
+
+int rfs__mpsc_push(rfs__mpsc_t* q, void* data) {
+  assert(q != NULL);
+  assert(data != NULL);
+
+  rfs__mpsc_cell_t* cell;
+  size_t pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+
+  for(;;) {
+    cell = &(q->cells[pos & q->mask]);
+    size_t seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+
+    if(dif == 0) {
+      // the slot is free for this position; try to claim it
+      if(__atomic_compare_exchange_n(&(q->tail), &pos, pos + 1, true,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if(dif < 0) {
+      // the consumer hasn't released this slot from the previous lap
+      return -EAGAIN;
+    }
+    else {
+      // another producer claimed this position first
+      pos = __atomic_load_n(&(q->tail), __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->data = data;
+  __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+void* rfs__mpsc_pop(rfs__mpsc_t* q) {
+  assert(q != NULL);
+
+  size_t pos = q->head;
+  rfs__mpsc_cell_t* cell = &(q->cells[pos & q->mask]);
+  size_t seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+
+  // the producer owning this position hasn't finished writing it yet
+  if(seq != pos + 1)
+    return NULL;
+
+  void* data = cell->data;
+
+  // hand the slot to the producer which will claim it on the next lap
+  __atomic_store_n(&(cell->seq), pos + q->mask + 1, __ATOMIC_RELEASE);
+  q->head = pos + 1;
+
+  return data;
+}
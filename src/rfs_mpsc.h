@@ -0,0 +1,60 @@
+#ifndef RFS_MPSC_H
+#define RFS_MPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @file A bounded, lock-free, multi-producer single-consumer ring.
+/// Any number of threads may push pointers into the ring concurrently; only
+/// one thread (the worker) may pop them. Each slot carries a sequence number
+/// which producers and the consumer use to hand ownership of the slot back
+/// and forth, so neither side takes a lock.
+/// This is the bounded queue described by Dmitry Vyukov, specialized for a
+/// single consumer.
+
+/// @brief One slot of the ring.
+typedef struct rfs__mpsc_cell {
+  size_t seq; ///< The sequence number which determines who owns the slot.
+  void* data; ///< The pointer stored in this slot.
+} rfs__mpsc_cell_t;
+
+/// @brief The ring structure.
+/// The producer and consumer positions are kept on separate cache lines
+/// so producers don't invalidate the consumer's line on every push.
+typedef struct rfs__mpsc {
+  rfs__mpsc_cell_t* cells; ///< The slots, of which there are mask + 1.
+  size_t mask; ///< The number of slots minus 1; slots are a power of 2.
+
+  char pad0[64];
+  size_t head; ///< The next position to pop; only used by the consumer.
+
+  char pad1[64];
+  size_t tail; ///< The next position to push; shared by the producers.
+  char pad2[64];
+} rfs__mpsc_t;
+
+/// @brief Initialize a ring.
+/// @param [in] q The ring to initialize.
+/// @param [in] size The number of slots; rounded up to a power of 2.
+/// @return 0 on success, -errno on failure.
+int rfs__mpsc_init(rfs__mpsc_t* q, size_t size);
+
+/// @brief Release the memory held by a ring.
+/// Any pointers still in the ring are not touched.
+/// @param [in] q The ring to free.
+void rfs__mpsc_free(rfs__mpsc_t* q);
+
+/// @brief Add a pointer to the ring.
+/// This may be called by any number of threads concurrently.
+/// @param [in] q The ring to add to.
+/// @param [in] data The pointer to add; must not be NULL.
+/// @return 0 on success, -EAGAIN if the ring is full.
+int rfs__mpsc_push(rfs__mpsc_t* q, void* data);
+
+/// @brief Remove the oldest pointer from the ring.
+/// This must only be called by the consuming thread.
+/// @param [in] q The ring to remove from.
+/// @return The oldest pointer; NULL if the ring is empty.
+void* rfs__mpsc_pop(rfs__mpsc_t* q);
+
+#endif
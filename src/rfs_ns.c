@@ -0,0 +1,787 @@
+#include "rfs_ns.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "rfs/rfs.h"
+
+size_t rfs__ns_clean(char* path) {
+  assert(path != NULL);
+
+  size_t len = strlen(path);
+
+  if(path[0] != '/') {
+    memmove(path + 1, path, len + 1);
+    path[0] = '/';
+    len++;
+  }
+
+  // the output is built at the front of the buffer; it never overtakes the
+  // input, since every element written was preceded by at least one slash
+  size_t w = 1;
+
+  for(size_t r = 1; r < len;) {
+    if(path[r] == '/') {
+      r++;
+      continue;
+    }
+
+    size_t end = r;
+    while(end < len && path[end] != '/')
+      end++;
+
+    size_t n = end - r;
+
+    if(n == 2 && path[r] == '.' && path[r + 1] == '.') {
+      while(w > 1 && path[w - 1] != '/')
+        w--;
+
+      if(w > 1)
+        w--;
+    }
+    else if(n != 1 || path[r] != '.') {
+      if(w > 1)
+        path[w++] = '/';
+
+      memmove(path + w, path + r, n);
+      w += n;
+    }
+
+    r = end;
+  }
+
+  path[w] = '\0';
+
+  return w;
+}
+
+/// @brief Copy and clean a path.
+/// @param [in] path The path to copy.
+/// @param [out] len Set to the length of the cleaned path.
+/// @return The cleaned path, to be freed by the caller; NULL if out of memory.
+static char* ns_clean_dup(const char* path, size_t* len) {
+  size_t size = strlen(path) + 2;
+  char* copy = malloc(size);
+
+  if(copy == NULL)
+    return NULL;
+
+  memcpy(copy, path, size - 1);
+  *len = rfs__ns_clean(copy);
+
+  return copy;
+}
+
+/// @brief Allocate a trie node.
+/// @param [in] label The label of the edge into the node.
+/// @param [in] len The length of label.
+/// @return The node; NULL if out of memory.
+static rfs__ns_node_t* node_new(const char* label, size_t len) {
+  rfs__ns_node_t* node = malloc(sizeof(rfs__ns_node_t));
+
+  if(node == NULL)
+    return NULL;
+
+  if((node->label = malloc(len + 1)) == NULL) {
+    free(node);
+    return NULL;
+  }
+
+  memcpy(node->label, label, len);
+  node->label[len] = '\0';
+  node->len = len;
+  node->point = NULL;
+  node->parent = NULL;
+  node->kids = NULL;
+  node->nkids = 0;
+
+  return node;
+}
+
+/// @brief Free a trie node; its children and mount point must be gone.
+/// @param [in] node The node to free.
+static void node_free(rfs__ns_node_t* node) {
+  free(node->kids);
+  free(node->label);
+  free(node);
+}
+
+/// @brief Find the child of a node whose label starts with a byte.
+/// @param [in] node The node to search.
+/// @param [in] c The first byte of the label.
+/// @param [out] found Set to 1 if the child exists, 0 otherwise.
+/// @return The index of the child; or where it would be inserted.
+static size_t node_find(const rfs__ns_node_t* node, char c, int* found) {
+  size_t lo = 0;
+  size_t hi = node->nkids;
+
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    unsigned char k = (unsigned char) node->kids[mid]->label[0];
+
+    if(k < (unsigned char) c)
+      lo = mid + 1;
+    else if(k > (unsigned char) c)
+      hi = mid;
+    else {
+      *found = 1;
+      return mid;
+    }
+  }
+
+  *found = 0;
+  return lo;
+}
+
+/// @brief Add a child to a node.
+/// @param [in] node The parent node.
+/// @param [in] kid The child to add.
+/// @param [in] pos The index to add it at, from node_find().
+/// @return 0 on success, -ENOMEM if out of memory.
+static int node_add(rfs__ns_node_t* node, rfs__ns_node_t* kid, size_t pos) {
+  rfs__ns_node_t** kids = realloc(node->kids,
+                                  sizeof(rfs__ns_node_t*) * (node->nkids + 1));
+
+  if(kids == NULL)
+    return -ENOMEM;
+
+  memmove(kids + pos + 1, kids + pos,
+          sizeof(rfs__ns_node_t*) * (node->nkids - pos));
+  kids[pos] = kid;
+
+  node->kids = kids;
+  node->nkids++;
+  kid->parent = node;
+
+  return 0;
+}
+
+/// @brief Find or create the node for a key.
+/// @param [in] ns The namespace to insert into.
+/// @param [in] key The cleaned path of the mount point.
+/// @param [in] len The length of key.
+/// @return The node; NULL if out of memory.
+static rfs__ns_node_t* node_insert(rfs__ns_t* ns, const char* key, size_t len) {
+  rfs__ns_node_t* node = &(ns->root);
+  size_t i = 0;
+
+  while(i < len) {
+    int found;
+    size_t pos = node_find(node, key[i], &found);
+
+    if(!found) {
+      rfs__ns_node_t* leaf = node_new(key + i, len - i);
+
+      if(leaf == NULL)
+        return NULL;
+
+      if(node_add(node, leaf, pos) < 0) {
+        node_free(leaf);
+        return NULL;
+      }
+
+      return leaf;
+    }
+
+    rfs__ns_node_t* kid = node->kids[pos];
+    size_t k = 1;
+
+    while(k < kid->len && i + k < len && kid->label[k] == key[i + k])
+      k++;
+
+    // the key diverges part way along the edge, so split it
+    if(k < kid->len) {
+      rfs__ns_node_t* mid = node_new(kid->label, k);
+      char* label = malloc(kid->len - k + 1);
+      rfs__ns_node_t** kids = malloc(sizeof(rfs__ns_node_t*));
+
+      if(mid == NULL || label == NULL || kids == NULL) {
+        if(mid != NULL)
+          node_free(mid);
+
+        free(label);
+        free(kids);
+        return NULL;
+      }
+
+      memcpy(label, kid->label + k, kid->len - k + 1);
+      free(kid->label);
+      kid->label = label;
+      kid->len -= k;
+
+      kids[0] = kid;
+      mid->kids = kids;
+      mid->nkids = 1;
+      mid->parent = node;
+      kid->parent = mid;
+      node->kids[pos] = mid;
+
+      kid = mid;
+    }
+
+    node = kid;
+    i += k;
+  }
+
+  return node;
+}
+
+/// @brief Find the node for a key.
+/// @param [in] ns The namespace to search.
+/// @param [in] key The cleaned path of the mount point.
+/// @param [in] len The length of key.
+/// @return The node; NULL if there isn't one.
+static rfs__ns_node_t* node_lookup(rfs__ns_t* ns, const char* key, size_t len) {
+  rfs__ns_node_t* node = &(ns->root);
+  size_t i = 0;
+
+  while(i < len) {
+    int found;
+    size_t pos = node_find(node, key[i], &found);
+
+    if(!found)
+      return NULL;
+
+    node = node->kids[pos];
+
+    if(node->len > len - i || memcmp(node->label, key + i, node->len) != 0)
+      return NULL;
+
+    i += node->len;
+  }
+
+  return node;
+}
+
+/// @brief Remove nodes made redundant by removing a mount point.
+/// Nodes without a mount point are removed if they have no children, and
+/// merged into their child if they have only one.
+/// @param [in] ns The namespace the node is in.
+/// @param [in] node The node which no longer has a mount point.
+static void node_prune(rfs__ns_t* ns, rfs__ns_node_t* node) {
+  while(node != &(ns->root) && node->point == NULL) {
+    rfs__ns_node_t* parent = node->parent;
+
+    if(node->nkids == 0) {
+      int found;
+      size_t pos = node_find(parent, node->label[0], &found);
+      assert(found);
+
+      memmove(parent->kids + pos, parent->kids + pos + 1,
+              sizeof(rfs__ns_node_t*) * (parent->nkids - pos - 1));
+      parent->nkids--;
+
+      node_free(node);
+      node = parent;
+      continue;
+    }
+
+    if(node->nkids == 1) {
+      rfs__ns_node_t* kid = node->kids[0];
+      char* label = malloc(node->len + kid->len + 1);
+
+      // leaving the node unmerged is harmless, just slower to search
+      if(label == NULL)
+        return;
+
+      memcpy(label, node->label, node->len);
+      memcpy(label + node->len, kid->label, kid->len + 1);
+
+      free(node->label);
+      free(node->kids);
+      node->label = label;
+      node->len += kid->len;
+      node->point = kid->point;
+      node->kids = kid->kids;
+      node->nkids = kid->nkids;
+
+      for(size_t i = 0; i < node->nkids; ++i)
+        node->kids[i]->parent = node;
+
+      kid->kids = NULL;
+      node_free(kid);
+    }
+
+    return;
+  }
+}
+
+rfs__ns_mnt_t* rfs__ns_mnt_new(int flags, const char* aname, void* data) {
+  rfs__ns_mnt_t* mnt = malloc(sizeof(rfs__ns_mnt_t));
+
+  if(mnt == NULL)
+    return NULL;
+
+  mnt->aname = strdup(aname != NULL ? aname : "");
+
+  if(mnt->aname == NULL) {
+    free(mnt);
+    return NULL;
+  }
+
+  static uint64_t ids = 0;
+
+  mnt->id = ++ids;
+  mnt->gen = 0;
+  mnt->refs = 1;
+  mnt->flags = flags;
+  mnt->srvkey = 0;
+  mnt->attrttl = 0;
+  mnt->data = data;
+
+  return mnt;
+}
+
+void rfs__ns_mnt_unref(rfs__ns_t* ns, rfs__ns_mnt_t* mnt) {
+  assert(ns != NULL);
+  assert(mnt != NULL);
+  assert(mnt->refs > 0);
+
+  if(--mnt->refs > 0)
+    return;
+
+  if(ns->release != NULL)
+    ns->release(mnt);
+
+  free(mnt->aname);
+  free(mnt);
+}
+
+/// @brief Release the path and mount reference of a target.
+static void target_clear(rfs__ns_t* ns, rfs__ns_target_t* target) {
+  if(target->mnt != NULL)
+    rfs__ns_mnt_unref(ns, target->mnt);
+
+  free(target->path);
+}
+
+/// @brief Remove a target from a mount point's union.
+/// This differs from target_clear() in that the mount is told it has been
+/// unmounted, so that anything cached about it is discarded.
+static void target_unmount(rfs__ns_t* ns, rfs__ns_target_t* target) {
+  if(target->mnt != NULL)
+    target->mnt->gen++;
+
+  target_clear(ns, target);
+}
+
+/// @brief Release an array of targets.
+static void targets_free(rfs__ns_t* ns, rfs__ns_target_t* targets, size_t n) {
+  for(size_t i = 0; i < n; ++i)
+    target_clear(ns, &targets[i]);
+
+  free(targets);
+}
+
+/// @brief Join a target's path with the remainder of a lookup.
+/// @return The joined path; NULL if out of memory.
+static char* path_join(const char* base, const char* rest, size_t restlen) {
+  size_t baselen = strlen(base);
+
+  // the root is the only path ending in a slash
+  if(baselen == 1)
+    baselen = 0;
+
+  if(baselen == 0 && restlen == 0)
+    return strdup("/");
+
+  char* path = malloc(baselen + restlen + 1);
+
+  if(path == NULL)
+    return NULL;
+
+  memcpy(path, base, baselen);
+  memcpy(path + baselen, rest, restlen);
+  path[baselen + restlen] = '\0';
+
+  return path;
+}
+
+/// @brief Resolve a cleaned path through the namespace.
+/// A path beneath a mount point resolves to every member of its union, in
+/// order; otherwise it resolves to itself in the base namespace.
+/// @param [in] ns The namespace to resolve through.
+/// @param [in] path The cleaned path.
+/// @param [in] len The length of path.
+/// @param [out] targets Set to the resolved targets, to be released with
+/// targets_free().
+/// @return The number of targets; -ENOMEM if out of memory.
+static ssize_t ns_resolve(rfs__ns_t* ns,
+                          const char* path,
+                          size_t len,
+                          rfs__ns_target_t** targets) {
+  size_t rest = 0;
+  const rfs__ns_point_t* point = rfs__ns_lookup(ns, path, len, &rest);
+  size_t n = (point != NULL ? point->count : 1);
+
+  rfs__ns_target_t* out = calloc(n, sizeof(rfs__ns_target_t));
+
+  if(out == NULL)
+    return -ENOMEM;
+
+  for(size_t i = 0; i < n; ++i) {
+    if(point == NULL) {
+      out[i].path = strdup(path);
+    }
+    else {
+      out[i].path = path_join(point->targets[i].path, path + rest, len - rest);
+      out[i].mnt = point->targets[i].mnt;
+      out[i].create = point->targets[i].create;
+    }
+
+    if(out[i].path == NULL) {
+      out[i].mnt = NULL;
+      targets_free(ns, out, i);
+      return -ENOMEM;
+    }
+
+    if(out[i].mnt != NULL)
+      out[i].mnt->refs++;
+  }
+
+  *targets = out;
+
+  return (ssize_t) n;
+}
+
+/// @brief Insert targets into a mount point's union list.
+/// On success the point owns the targets; the array itself isn't taken.
+/// @return 0 on success, -ENOMEM if out of memory.
+static int point_insert(rfs__ns_point_t* point,
+                        size_t pos,
+                        const rfs__ns_target_t* targets,
+                        size_t n) {
+  if(point->count + n > point->cap) {
+    size_t cap = point->cap * 2;
+
+    if(cap < point->count + n)
+      cap = point->count + n;
+
+    rfs__ns_target_t* grown = realloc(point->targets,
+                                      sizeof(rfs__ns_target_t) * cap);
+
+    if(grown == NULL)
+      return -ENOMEM;
+
+    point->targets = grown;
+    point->cap = cap;
+  }
+
+  memmove(point->targets + pos + n, point->targets + pos,
+          sizeof(rfs__ns_target_t) * (point->count - pos));
+  memcpy(point->targets + pos, targets, sizeof(rfs__ns_target_t) * n);
+  point->count += n;
+
+  return 0;
+}
+
+/// @brief Remove a mount point from a node and free it.
+static void point_remove(rfs__ns_t* ns, rfs__ns_node_t* node) {
+  rfs__ns_point_t* point = node->point;
+
+  for(size_t i = 0; i < point->count; ++i)
+    target_unmount(ns, &(point->targets[i]));
+
+  free(point->targets);
+  free(point->path);
+  free(point);
+
+  node->point = NULL;
+  ns->npoints--;
+
+  node_prune(ns, node);
+}
+
+/// @brief Add targets to the union at old, as bind and mount do.
+/// The targets are consumed whether or not this succeeds.
+/// @param [in] ns The namespace to change.
+/// @param [in] targets The targets to add.
+/// @param [in] n The number of targets.
+/// @param [in] old The mount point to add them to.
+/// @param [in] flags The bind or mount flags.
+/// @return 0 on success, -errno on failure.
+static int ns_attach(rfs__ns_t* ns,
+                     rfs__ns_target_t* targets,
+                     size_t n,
+                     const char* old,
+                     int flags) {
+  int mode = flags & (RFS_MREPL | RFS_MBEFORE | RFS_MAFTER);
+  int ret = -ENOMEM;
+
+  if(mode == 0)
+    mode = RFS_MREPL;
+
+  if((mode & (mode - 1)) != 0) {
+    targets_free(ns, targets, n);
+    return -EINVAL;
+  }
+
+  for(size_t i = 0; i < n; ++i)
+    targets[i].create = ((flags & RFS_MCREATE) != 0);
+
+  size_t len;
+  char* path = ns_clean_dup(old, &len);
+  rfs__ns_node_t* node = (path != NULL ? node_insert(ns, path, len) : NULL);
+
+  if(node == NULL)
+    goto fail;
+
+  rfs__ns_point_t* point = node->point;
+
+  if(point == NULL) {
+    if((point = calloc(1, sizeof(rfs__ns_point_t))) == NULL)
+      goto fail;
+
+    // a new union starts out holding the file which was at old
+    if(mode != RFS_MREPL) {
+      rfs__ns_target_t* seed;
+      ssize_t nseed = ns_resolve(ns, path, len, &seed);
+
+      if(nseed < 0 || point_insert(point, 0, seed, (size_t) nseed) < 0) {
+        if(nseed >= 0)
+          targets_free(ns, seed, (size_t) nseed);
+
+        free(point);
+        goto fail;
+      }
+
+      free(seed);
+    }
+
+    point->path = path;
+    path = NULL;
+    node->point = point;
+    ns->npoints++;
+  }
+
+  size_t pos = (mode == RFS_MAFTER ? point->count : 0);
+
+  if((ret = point_insert(point, pos, targets, n)) < 0) {
+    if(point->count == 0)
+      point_remove(ns, node);
+
+    node = NULL;
+    goto fail;
+  }
+
+  if(mode == RFS_MREPL) {
+    for(size_t i = n; i < point->count; ++i)
+      target_unmount(ns, &(point->targets[i]));
+
+    point->count = n;
+  }
+
+  free(targets);
+  free(path);
+
+  return 0;
+
+fail:
+  if(node != NULL && node->point == NULL)
+    node_prune(ns, node);
+
+  targets_free(ns, targets, n);
+  free(path);
+
+  return ret;
+}
+
+void rfs__ns_init(rfs__ns_t* ns, rfs__ns_release_cb release) {
+  assert(ns != NULL);
+
+  ns->root.label = NULL;
+  ns->root.len = 0;
+  ns->root.point = NULL;
+  ns->root.parent = NULL;
+  ns->root.kids = NULL;
+  ns->root.nkids = 0;
+  ns->npoints = 0;
+  ns->release = release;
+}
+
+/// @brief Free a subtree of the trie, including its mount points.
+static void ns_free_node(rfs__ns_t* ns, rfs__ns_node_t* node) {
+  for(size_t i = 0; i < node->nkids; ++i)
+    ns_free_node(ns, node->kids[i]);
+
+  node->nkids = 0;
+
+  if(node->point != NULL) {
+    rfs__ns_point_t* point = node->point;
+
+    for(size_t i = 0; i < point->count; ++i)
+      target_clear(ns, &(point->targets[i]));
+
+    free(point->targets);
+    free(point->path);
+    free(point);
+    node->point = NULL;
+  }
+
+  if(node != &(ns->root))
+    node_free(node);
+}
+
+void rfs__ns_free(rfs__ns_t* ns) {
+  assert(ns != NULL);
+
+  ns_free_node(ns, &(ns->root));
+  free(ns->root.kids);
+
+  rfs__ns_init(ns, ns->release);
+}
+
+int rfs__ns_bind(rfs__ns_t* ns, const char* name, const char* old, int flags) {
+  assert(ns != NULL);
+
+  if(name == NULL || old == NULL)
+    return -EINVAL;
+
+  size_t len;
+  char* path = ns_clean_dup(name, &len);
+
+  if(path == NULL)
+    return -ENOMEM;
+
+  rfs__ns_target_t* targets;
+  ssize_t n = ns_resolve(ns, path, len, &targets);
+  free(path);
+
+  if(n < 0)
+    return (int) n;
+
+  return ns_attach(ns, targets, (size_t) n, old, flags);
+}
+
+int rfs__ns_mount(rfs__ns_t* ns, rfs__ns_mnt_t* mnt, const char* old, int flags) {
+  assert(ns != NULL);
+  assert(mnt != NULL);
+
+  if(old == NULL)
+    return -EINVAL;
+
+  rfs__ns_target_t* target = malloc(sizeof(rfs__ns_target_t));
+
+  if(target == NULL || (target->path = strdup("/")) == NULL) {
+    free(target);
+    return -ENOMEM;
+  }
+
+  target->mnt = mnt;
+  mnt->refs++;
+
+  return ns_attach(ns, target, 1, old, flags);
+}
+
+int rfs__ns_unmount(rfs__ns_t* ns, const char* name, const char* old) {
+  assert(ns != NULL);
+
+  if(old == NULL)
+    return -EINVAL;
+
+  size_t len;
+  char* path = ns_clean_dup(old, &len);
+
+  if(path == NULL)
+    return -ENOMEM;
+
+  rfs__ns_node_t* node = node_lookup(ns, path, len);
+  free(path);
+
+  if(node == NULL || node->point == NULL)
+    return -ENOENT;
+
+  if(name == NULL) {
+    point_remove(ns, node);
+    return 0;
+  }
+
+  if((path = ns_clean_dup(name, &len)) == NULL)
+    return -ENOMEM;
+
+  rfs__ns_target_t* targets;
+  ssize_t n = ns_resolve(ns, path, len, &targets);
+  free(path);
+
+  if(n < 0)
+    return (int) n;
+
+  // drop every member of the union which name resolved to
+  rfs__ns_point_t* point = node->point;
+  size_t kept = 0;
+
+  for(size_t i = 0; i < point->count; ++i) {
+    rfs__ns_target_t* target = &(point->targets[i]);
+    int match = 0;
+
+    for(ssize_t j = 0; j < n && !match; ++j)
+      match = (target->mnt == targets[j].mnt
+            && strcmp(target->path, targets[j].path) == 0);
+
+    if(match)
+      target_unmount(ns, target);
+    else
+      point->targets[kept++] = *target;
+  }
+
+  targets_free(ns, targets, (size_t) n);
+
+  if(kept == point->count)
+    return -ENOENT;
+
+  point->count = kept;
+
+  if(kept == 0)
+    point_remove(ns, node);
+
+  return 0;
+}
+
+const rfs__ns_point_t* rfs__ns_lookup(const rfs__ns_t* ns,
+                                      const char* path,
+                                      size_t len,
+                                      size_t* rest) {
+  assert(ns != NULL);
+  assert(path != NULL);
+  assert(rest != NULL);
+
+  const rfs__ns_node_t* node = &(ns->root);
+  const rfs__ns_point_t* best = NULL;
+  size_t i = 0;
+
+  for(;;) {
+    // a mount point only matches on a whole path element
+    if(node->point != NULL
+    && (i == len || path[i] == '/' || (i > 0 && path[i - 1] == '/'))) {
+      best = node->point;
+
+      // the root's key is its only one to end in a slash, which belongs to
+      // the remainder
+      *rest = (i > 0 && path[i - 1] == '/' ? i - 1 : i);
+
+      if(len == 1)
+        *rest = len;
+    }
+
+    if(i == len)
+      break;
+
+    int found;
+    size_t pos = node_find(node, path[i], &found);
+
+    if(!found)
+      break;
+
+    node = node->kids[pos];
+
+    if(node->len > len - i || memcmp(node->label, path + i, node->len) != 0)
+      break;
+
+    i += node->len;
+  }
+
+  return best;
+}
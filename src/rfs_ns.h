@@ -0,0 +1,150 @@
+#ifndef RFS_NS_H
+#define RFS_NS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// @file The per-process namespace built by bind, mount and unmount.
+/// Each mount point holds a union list: the files which are searched, in
+/// order, for names beneath it. Mount points are kept in a compressed radix
+/// trie keyed by their cleaned path, so finding the mount point governing a
+/// path (the longest mount point which is a whole-component prefix of it)
+/// takes time proportional to the length of the path, however many mount
+/// points there are.
+/// The namespace isn't synchronized; it is only used by the client worker.
+
+/// @brief A server attached to the namespace by mount.
+/// Mounts are reference counted, since the same server may be reachable from
+/// many mount points once bound elsewhere.
+typedef struct rfs__ns_mnt {
+  uint64_t id; ///< Unique to this mount for the life of the process.
+
+  /// @brief Incremented whenever the mount is unmounted from a mount point,
+  /// invalidating anything cached about it.
+  uint32_t gen;
+
+  uint32_t refs; ///< The number of references to the mount.
+  int flags; ///< The flags given when the server was mounted.
+
+  /// @brief Identifies the server and file tree across processes, for the
+  /// persistent content cache, which no mount uses yet; 0 if the server
+  /// has no stable identity.
+  uint64_t srvkey;
+
+  /// @brief How long the attributes of files on the server may be cached,
+  /// in ms; 0 if they aren't cached.
+  uint32_t attrttl;
+
+  char* aname; ///< The file tree of the server which was attached to.
+  void* data; ///< Owned by the client; released by the namespace's hook.
+} rfs__ns_mnt_t;
+
+/// @brief One member of a union list.
+/// A target refers to a path in either a mounted server or, if mnt is NULL,
+/// in the base namespace beneath all mounts.
+typedef struct rfs__ns_target {
+  rfs__ns_mnt_t* mnt; ///< The server the path is in; NULL for the base.
+  char* path; ///< The cleaned path within the server or base namespace.
+  int create; ///< Nonzero if files may be created in this target.
+} rfs__ns_target_t;
+
+/// @brief A mount point and its union list.
+typedef struct rfs__ns_point {
+  char* path; ///< The cleaned path of the mount point.
+  rfs__ns_target_t* targets; ///< The union list, in search order.
+  size_t count; ///< The number of targets.
+  size_t cap; ///< The allocated size of targets.
+} rfs__ns_point_t;
+
+/// @brief A node of the mount point trie.
+typedef struct rfs__ns_node {
+  char* label; ///< The bytes of the path on the edge into this node.
+  size_t len; ///< The length of label.
+  rfs__ns_point_t* point; ///< The mount point ending here; may be NULL.
+  struct rfs__ns_node* parent; ///< The parent node; NULL for the root.
+  struct rfs__ns_node** kids; ///< The children, sorted by first byte.
+  size_t nkids; ///< The number of children.
+} rfs__ns_node_t;
+
+/// @brief Called when the last reference to a mount is dropped.
+/// This should release mnt->data; the namespace frees the rest.
+typedef void (*rfs__ns_release_cb)(rfs__ns_mnt_t* mnt);
+
+/// @brief The namespace structure.
+typedef struct rfs__ns {
+  rfs__ns_node_t root; ///< The root of the trie; its label is empty.
+  size_t npoints; ///< The number of mount points.
+  rfs__ns_release_cb release; ///< Called as mounts are released.
+} rfs__ns_t;
+
+/// @brief Clean a path in place, as Plan 9's cleanname does.
+/// Repeated slashes and . elements are removed, .. elements remove the
+/// element before them (and are dropped at the root), and the result always
+/// starts with a slash and never ends with one, unless it is the root.
+/// @param [in] path The path to clean; it must have room for one more byte,
+/// since a relative path is made absolute.
+/// @return The length of the cleaned path.
+size_t rfs__ns_clean(char* path);
+
+/// @brief Initialize an empty namespace.
+/// @param [in] ns The namespace to initialize.
+/// @param [in] release Called to release a mount's data; may be NULL.
+void rfs__ns_init(rfs__ns_t* ns, rfs__ns_release_cb release);
+
+/// @brief Remove every mount point from a namespace and free it.
+/// @param [in] ns The namespace to free.
+void rfs__ns_free(rfs__ns_t* ns);
+
+/// @brief Create a mount with a single reference, owned by the caller.
+/// @param [in] flags The flags the server is being mounted with.
+/// @param [in] aname The file tree being attached to; may be NULL.
+/// @param [in] data The client's data for the mount.
+/// @return The mount; NULL if out of memory.
+rfs__ns_mnt_t* rfs__ns_mnt_new(int flags, const char* aname, void* data);
+
+/// @brief Drop a reference to a mount, releasing it if it was the last.
+/// @param [in] ns The namespace the mount's release hook is taken from.
+/// @param [in] mnt The mount to release.
+void rfs__ns_mnt_unref(rfs__ns_t* ns, rfs__ns_mnt_t* mnt);
+
+/// @brief Make the file at name visible at old.
+/// name is resolved through the namespace when this is called, so later
+/// changes to the namespace don't affect what was bound.
+/// @param [in] ns The namespace to change.
+/// @param [in] name The file to bind.
+/// @param [in] old The mount point to bind it to.
+/// @param [in] flags One of RFS_MREPL, RFS_MBEFORE or RFS_MAFTER (0 is taken
+/// as RFS_MREPL), optionally with RFS_MCREATE.
+/// @return 0 on success, -errno on failure.
+int rfs__ns_bind(rfs__ns_t* ns, const char* name, const char* old, int flags);
+
+/// @brief Make the root of a mounted server visible at old.
+/// @param [in] ns The namespace to change.
+/// @param [in] mnt The mount; the namespace takes its own reference.
+/// @param [in] old The mount point to mount the server on.
+/// @param [in] flags As for rfs__ns_bind().
+/// @return 0 on success, -errno on failure.
+int rfs__ns_mount(rfs__ns_t* ns, rfs__ns_mnt_t* mnt, const char* old, int flags);
+
+/// @brief Undo a bind or mount.
+/// @param [in] ns The namespace to change.
+/// @param [in] name The file to remove from the union at old; if NULL,
+/// everything bound or mounted at old is removed.
+/// @param [in] old The mount point to remove from.
+/// @return 0 on success, -ENOENT if old isn't a mount point or name isn't
+/// in its union, or -errno on failure.
+int rfs__ns_unmount(rfs__ns_t* ns, const char* name, const char* old);
+
+/// @brief Find the mount point governing a path.
+/// @param [in] ns The namespace to search.
+/// @param [in] path A cleaned path.
+/// @param [in] len The length of path.
+/// @param [out] rest Set to the offset in path of the remainder to walk
+/// from the mount point's targets; path + *rest is empty or starts with /.
+/// @return The mount point; NULL if the path isn't beneath any mount point.
+const rfs__ns_point_t* rfs__ns_lookup(const rfs__ns_t* ns,
+                                      const char* path,
+                                      size_t len,
+                                      size_t* rest);
+
+#endif
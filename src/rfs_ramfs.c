@@ -0,0 +1,1736 @@
+#include "rfs_ramfs.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// @brief The number of nodes the slab starts with.
+#define RAMFS_MINNODES 64
+
+/// @brief The number of slots the name table starts with.
+#define RAMFS_MINNAMES 64
+
+/// @brief The number of slots a directory's index starts with.
+#define RAMFS_MINSLOTS 8
+
+/// @brief The largest file.
+#define RAMFS_MAXFILE ((uint64_t) 1 << 32)
+
+/// @brief The smallest allocation for a file's contents.
+#define RAMFS_MINDATA 64
+
+/// @brief The mode bits which aren't those of a plain file.
+#define RAMFS_DMTYPE (RFS_DMDIR | RFS__RAMFS_DMTOPIC | RFS__RAMFS_DMSTATS)
+
+/// @brief The most a line of a stats file takes, besides the topic's name.
+#define RAMFS_STATLINE 96
+
+/// @brief The number of messages a subscriber's queue starts with room for.
+#define RAMFS_MINQUEUE 8
+
+/// @brief The states of a subscriber.
+enum {
+  RAMFS_SUB_LIVE, ///< Messages are delivered to it.
+  RAMFS_SUB_CUT, ///< It fell behind, and its connection is to be closed.
+  RAMFS_SUB_HUNGUP ///< Its connection is closing.
+};
+
+/// @brief A fid subscribed to a topic.
+typedef struct rfs__ramfs_sub {
+  uint32_t topic; ///< The topic, which its fid holds a ref on.
+  uint32_t fid; ///< The client's number for its fid.
+  rfs__srv_conn_t* conn; ///< The connection its fid belongs to.
+  int state; ///< One of RAMFS_SUB_*.
+
+  rfs__ramfs_data_t** queue; ///< The messages pending, which it holds.
+  uint32_t head; ///< The index of the oldest message pending.
+  uint32_t len; ///< The number of messages pending.
+  uint32_t mask; ///< The size of queue minus 1; 0 until it's allocated.
+
+  /// @brief The reads waiting for a message, oldest first, linked through
+  /// their data.
+  rfs__srv_req_t* reads;
+
+  uint32_t hwm; ///< The most messages it has had pending.
+  uint64_t delivered; ///< The number of messages its reads have returned.
+  uint64_t dropped; ///< The number of messages it had no room for.
+
+  struct rfs__ramfs_sub* prev; ///< The previous subscriber of the topic.
+  struct rfs__ramfs_sub* next; ///< The next subscriber of the topic.
+} ramfs_sub_t;
+
+/// @brief The state of a fid of the tree, kept in its aux.
+typedef struct ramfs_fid {
+  uint32_t node; ///< The node it refers to, which it holds a ref on.
+  uint32_t dirpos; ///< The next child a directory read returns.
+  uint64_t diroff; ///< The offset the next directory read must be at.
+  ramfs_sub_t* sub; ///< Set if it's open for reading a topic.
+  rfs__ramfs_data_t* snap; ///< Set if it's open for reading a stats file.
+} ramfs_fid_t;
+
+static void ramfs_unblock(rfs__ramfs_t* fs, uint32_t idx);
+
+static uint32_t ramfs_now(void) {
+  return (uint32_t) time(NULL);
+}
+
+/// @brief Hash a name; FNV-1a, with the bits mixed so the low ones can be
+/// used as a table index.
+static uint32_t ramfs_hash(const char* str, uint16_t len) {
+  uint32_t h = 2166136261U;
+
+  for(uint16_t i = 0; i < len; ++i) {
+    h ^= (unsigned char) str[i];
+    h *= 16777619U;
+  }
+
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+
+  return h;
+}
+
+/// @brief Check whether the entry at j of a linear probing table, which
+/// hashes to home, may move back into the hole at i.
+static int ramfs_shiftable(uint32_t home, uint32_t i, uint32_t j,
+                           uint32_t mask) {
+  return (((j - home) & mask) >= ((j - i) & mask));
+}
+
+/// @brief Find an interned name.
+/// @return The name; NULL if no node has it.
+static rfs__ramfs_name_t* ramfs_name_find(const rfs__ramfs_t* fs,
+                                          const char* str,
+                                          uint16_t len,
+                                          uint32_t hash) {
+  for(uint32_t i = hash & fs->namemask;; i = (i + 1) & fs->namemask) {
+    rfs__ramfs_name_t* name = fs->names[i];
+
+    if(name == NULL)
+      return NULL;
+
+    if(name->hash == hash && name->len == len
+    && memcmp(name->str, str, len) == 0)
+      return name;
+  }
+}
+
+/// @brief Double the size of the name table.
+static int ramfs_names_grow(rfs__ramfs_t* fs) {
+  uint32_t nslots = (fs->namemask + 1) * 2;
+  rfs__ramfs_name_t** names = calloc(nslots, sizeof(rfs__ramfs_name_t*));
+
+  if(names == NULL)
+    return -ENOMEM;
+
+  for(uint32_t i = 0; i <= fs->namemask; ++i) {
+    rfs__ramfs_name_t* name = fs->names[i];
+
+    if(name == NULL)
+      continue;
+
+    uint32_t j = name->hash & (nslots - 1);
+    while(names[j] != NULL)
+      j = (j + 1) & (nslots - 1);
+
+    names[j] = name;
+  }
+
+  free(fs->names);
+  fs->names = names;
+  fs->namemask = nslots - 1;
+
+  return 0;
+}
+
+/// @brief Take a reference to a name, interning it if it's new.
+/// @return The name; NULL if out of memory.
+static rfs__ramfs_name_t* ramfs_name_get(rfs__ramfs_t* fs,
+                                         const char* str,
+                                         uint16_t len) {
+  uint32_t hash = ramfs_hash(str, len);
+  rfs__ramfs_name_t* name = ramfs_name_find(fs, str, len, hash);
+
+  if(name != NULL) {
+    name->refs++;
+    return name;
+  }
+
+  // the table is kept at most half full so probe sequences stay short
+  if((fs->nnames + 1) * 2 > fs->namemask + 1 && ramfs_names_grow(fs) < 0)
+    return NULL;
+
+  if((name = malloc(sizeof(rfs__ramfs_name_t) + len + 1)) == NULL)
+    return NULL;
+
+  name->hash = hash;
+  name->refs = 1;
+  name->len = len;
+  memcpy(name->str, str, len);
+  name->str[len] = '\0';
+
+  uint32_t i = hash & fs->namemask;
+  while(fs->names[i] != NULL)
+    i = (i + 1) & fs->namemask;
+
+  fs->names[i] = name;
+  fs->nnames++;
+
+  return name;
+}
+
+/// @brief Release a reference to a name, freeing it with the last.
+static void ramfs_name_put(rfs__ramfs_t* fs, rfs__ramfs_name_t* name) {
+  if(--name->refs > 0)
+    return;
+
+  uint32_t mask = fs->namemask;
+  uint32_t i = name->hash & mask;
+
+  while(fs->names[i] != name)
+    i = (i + 1) & mask;
+
+  // shift the rest of the probe sequence back over the hole
+  for(uint32_t j = (i + 1) & mask; fs->names[j] != NULL; j = (j + 1) & mask) {
+    if(ramfs_shiftable(fs->names[j]->hash & mask, i, j, mask)) {
+      fs->names[i] = fs->names[j];
+      i = j;
+    }
+  }
+
+  fs->names[i] = NULL;
+  fs->nnames--;
+  free(name);
+}
+
+static void ramfs_data_unref(void* arg) {
+  rfs__ramfs_data_t* data = arg;
+
+  if(data != NULL && --data->refs == 0)
+    free(data);
+}
+
+/// @brief Check whether a node stores contents, rather than being a
+/// directory, a topic or a stats file.
+static int ramfs_isfile(const rfs__ramfs_node_t* node) {
+  return !(node->mode & RAMFS_DMTYPE);
+}
+
+/// @brief Make a file's contents private to it and able to hold size bytes.
+static int ramfs_reserve(rfs__ramfs_node_t* node, uint64_t size) {
+  rfs__ramfs_data_t* old = node->u.file.data;
+
+  if(old != NULL && old->refs == 1 && old->cap >= size)
+    return 0;
+
+  size_t cap = (old != NULL && old->cap > RAMFS_MINDATA
+              ? old->cap : RAMFS_MINDATA);
+
+  while(cap < size)
+    cap *= 2;
+
+  rfs__ramfs_data_t* data = malloc(sizeof(rfs__ramfs_data_t) + cap);
+
+  if(data == NULL)
+    return -ENOMEM;
+
+  data->refs = 1;
+  data->cap = cap;
+
+  if(old != NULL) {
+    uint64_t keep = node->u.file.length;
+    memcpy(data->bytes, old->bytes, (size_t) (keep < size ? keep : size));
+    ramfs_data_unref(old);
+  }
+
+  node->u.file.data = data;
+
+  return 0;
+}
+
+/// @brief Set the length of a file, zero filling it if it grows.
+static int ramfs_truncate(rfs__ramfs_node_t* node, uint64_t length) {
+  uint64_t old = node->u.file.length;
+
+  if(length > RAMFS_MAXFILE)
+    return -EFBIG;
+
+  if(length > old) {
+    if(ramfs_reserve(node, length) < 0)
+      return -ENOMEM;
+
+    memset(node->u.file.data->bytes + old, 0, (size_t) (length - old));
+  }
+  else if(length == 0) {
+    ramfs_data_unref(node->u.file.data);
+    node->u.file.data = NULL;
+  }
+
+  // bytes past a shorter length are never read again, so even contents an
+  // Rread still references can be shortened in place
+  node->u.file.length = length;
+  node->vers++;
+  node->mtime = ramfs_now();
+
+  return 0;
+}
+
+/// @brief Take a slot of the slab.
+/// @return The slot; RFS__RAMFS_NIL if out of memory.
+static uint32_t ramfs_node_new(rfs__ramfs_t* fs) {
+  uint32_t idx = fs->free;
+
+  if(idx != RFS__RAMFS_NIL) {
+    fs->free = fs->nodes[idx].parent;
+    return idx;
+  }
+
+  if(fs->nnodes == fs->cap) {
+    if(fs->cap >= RFS__RAMFS_NIL / 2)
+      return RFS__RAMFS_NIL;
+
+    rfs__ramfs_node_t* nodes = realloc(fs->nodes, sizeof(rfs__ramfs_node_t)
+                                                  * fs->cap * 2);
+
+    if(nodes == NULL)
+      return RFS__RAMFS_NIL;
+
+    fs->nodes = nodes;
+    fs->cap *= 2;
+  }
+
+  idx = fs->nnodes++;
+  fs->nodes[idx].gen = 0;
+
+  return idx;
+}
+
+/// @brief Release a reference to a node, freeing its slot with the last.
+static void ramfs_node_unref(rfs__ramfs_t* fs, uint32_t idx) {
+  rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  assert(node->refs > 0);
+
+  if(--node->refs > 0)
+    return;
+
+  // the tree's own reference is only dropped once it's removed
+  assert(node->pos == RFS__RAMFS_NIL);
+
+  if(node->mode & RFS_DMDIR) {
+    assert(node->u.dir.nchildren == 0);
+    free(node->u.dir.children);
+    free(node->u.dir.slots);
+  }
+  else if(node->mode & RFS__RAMFS_DMTOPIC) {
+    // each subscriber's fid, and each waiting write's, holds a reference
+    assert(node->u.topic.subs == NULL);
+    assert(node->u.topic.writes == NULL);
+  }
+  else if(ramfs_isfile(node)) {
+    ramfs_data_unref(node->u.file.data);
+  }
+
+  ramfs_name_put(fs, node->name);
+  node->name = NULL;
+  node->gen++;
+  node->parent = fs->free;
+  fs->free = idx;
+}
+
+/// @brief Complete a read of a topic.
+/// @param [in] req The read.
+/// @param [in] msg The message to return, whose reference passes to the
+/// reply; NULL for the end of the file.
+static void ramfs_sub_reply(rfs__srv_req_t* req, rfs__ramfs_data_t* msg) {
+  uint32_t count = req->ifcall->params.tread.count;
+
+  // a read too small for the message returns the start of it
+  if(msg == NULL)
+    count = 0;
+  else if(count > msg->cap)
+    count = (uint32_t) msg->cap;
+
+  req->ofcall.params.rread.count = count;
+
+  if(msg != NULL) {
+    req->ofcall.params.rread.data = msg->bytes;
+    req->release = ramfs_data_unref;
+    req->release_data = msg;
+  }
+
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Queue a message for a subscriber with no read waiting.
+/// @return 0 on success, -ENOMEM.
+static int ramfs_sub_push(ramfs_sub_t* sub, rfs__ramfs_data_t* msg) {
+  if(sub->mask == 0 || sub->len == sub->mask + 1) {
+    uint32_t size = (sub->mask == 0 ? RAMFS_MINQUEUE : (sub->mask + 1) * 2);
+    rfs__ramfs_data_t** queue = malloc(sizeof(rfs__ramfs_data_t*) * size);
+
+    if(queue == NULL)
+      return -ENOMEM;
+
+    for(uint32_t i = 0; i < sub->len; ++i)
+      queue[i] = sub->queue[(sub->head + i) & sub->mask];
+
+    free(sub->queue);
+    sub->queue = queue;
+    sub->head = 0;
+    sub->mask = size - 1;
+  }
+
+  msg->refs++;
+  sub->queue[(sub->head + sub->len++) & sub->mask] = msg;
+
+  if(sub->len > sub->hwm)
+    sub->hwm = sub->len;
+
+  return 0;
+}
+
+/// @brief Take the oldest message pending for a subscriber.
+/// @return The message, whose reference passes to the caller; NULL if
+/// there is none.
+static rfs__ramfs_data_t* ramfs_sub_pop(ramfs_sub_t* sub) {
+  if(sub->len == 0)
+    return NULL;
+
+  rfs__ramfs_data_t* msg = sub->queue[sub->head];
+
+  sub->head = (sub->head + 1) & sub->mask;
+  sub->len--;
+
+  return msg;
+}
+
+/// @brief Take the oldest read waiting on a subscriber.
+/// @return The read; NULL if there is none.
+static rfs__srv_req_t* ramfs_sub_read(ramfs_sub_t* sub) {
+  rfs__srv_req_t* req = sub->reads;
+
+  if(req != NULL)
+    sub->reads = req->data;
+
+  return req;
+}
+
+/// @brief Drop everything pending for a subscriber which has fallen too far
+/// behind, marking its connection to be closed.
+static void ramfs_sub_cut(ramfs_sub_t* sub) {
+  rfs__ramfs_data_t* msg;
+
+  while((msg = ramfs_sub_pop(sub)) != NULL) {
+    ramfs_data_unref(msg);
+    sub->dropped++;
+  }
+
+  sub->state = RAMFS_SUB_CUT;
+}
+
+/// @brief Queue a message for a subscriber with no read waiting, applying
+/// the topic's policy if it has no room.
+static void ramfs_sub_queue(const rfs__ramfs_node_t* topic,
+                            ramfs_sub_t* sub,
+                            rfs__ramfs_data_t* msg) {
+  if(sub->len >= topic->u.topic.depth) {
+    switch(topic->u.topic.policy) {
+      case RFS__RAMFS_DROP_OLDEST:
+        ramfs_data_unref(ramfs_sub_pop(sub));
+        sub->dropped++;
+        break;
+
+      case RFS__RAMFS_DROP_NEWEST:
+        sub->dropped++;
+        return;
+
+      case RFS__RAMFS_DISCONNECT:
+        ramfs_sub_cut(sub);
+        sub->dropped++;
+        return;
+
+      default:
+        // publishing waits for room, unless the depth was lowered since
+        break;
+    }
+  }
+
+  // a subscriber with no memory to queue the message misses it
+  if(ramfs_sub_push(sub, msg) < 0)
+    sub->dropped++;
+}
+
+/// @brief Check whether publishing to a topic must wait for a subscriber.
+static int ramfs_topic_blocked(const rfs__ramfs_node_t* topic) {
+  if(topic->u.topic.policy != RFS__RAMFS_BLOCK)
+    return 0;
+
+  const ramfs_sub_t* sub = topic->u.topic.subs;
+
+  for(; sub != NULL; sub = sub->next) {
+    if(sub->state == RAMFS_SUB_LIVE && sub->len >= topic->u.topic.depth)
+      return 1;
+  }
+
+  return 0;
+}
+
+/// @brief Deliver a message to every subscriber of a topic.
+/// @return 0 on success, -ENOMEM.
+static int ramfs_fanout(rfs__ramfs_t* fs,
+                        uint32_t idx,
+                        const void* buf,
+                        uint32_t count) {
+  rfs__ramfs_node_t* topic = &(fs->nodes[idx]);
+  rfs__ramfs_data_t* msg = malloc(sizeof(rfs__ramfs_data_t) + count);
+
+  if(msg == NULL)
+    return -ENOMEM;
+
+  msg->refs = 1;
+  msg->cap = count;
+  memcpy(msg->bytes, buf, count);
+
+  topic->vers++;
+  topic->mtime = ramfs_now();
+
+  // completing a read of a clunked fid destroys it, which may change the
+  // tree, so the reads are only completed once every subscriber is visited
+  rfs__srv_req_t* ready = NULL;
+  int cut = 0;
+
+  for(ramfs_sub_t* sub = topic->u.topic.subs; sub != NULL; sub = sub->next) {
+    rfs__srv_req_t* req;
+
+    if(sub->state != RAMFS_SUB_LIVE) {
+      sub->dropped++;
+    }
+    else if((req = ramfs_sub_read(sub)) != NULL) {
+      sub->delivered++;
+      req->data = ready;
+      ready = req;
+    }
+    else {
+      ramfs_sub_queue(topic, sub, msg);
+      cut |= (sub->state == RAMFS_SUB_CUT);
+    }
+  }
+
+  // hanging up may too, and either may release the last reference to the
+  // topic
+  topic->refs++;
+
+  while(ready != NULL) {
+    rfs__srv_req_t* req = ready;
+
+    ready = req->data;
+    msg->refs++;
+    ramfs_sub_reply(req, msg);
+  }
+
+  ramfs_data_unref(msg);
+
+  // hanging up flushes the connection's requests, which may unsubscribe
+  // anything, so the subscribers are searched from the start each time
+  while(cut) {
+    ramfs_sub_t* sub = topic->u.topic.subs;
+
+    while(sub != NULL && sub->state != RAMFS_SUB_CUT)
+      sub = sub->next;
+
+    if(sub == NULL)
+      break;
+
+    sub->state = RAMFS_SUB_HUNGUP;
+    rfs__srv_disconnect(sub->conn);
+  }
+
+  ramfs_node_unref(fs, idx);
+
+  return 0;
+}
+
+/// @brief Publish a message to a topic, unless it must wait.
+/// @return 0 on success, -EAGAIN, -ENOMEM.
+static int ramfs_publish(rfs__ramfs_t* fs,
+                         uint32_t idx,
+                         const void* buf,
+                         uint32_t count) {
+  const rfs__ramfs_node_t* topic = &(fs->nodes[idx]);
+
+  if(count == 0)
+    return 0;
+
+  // messages are published in the order they're written
+  if(topic->u.topic.writes != NULL || ramfs_topic_blocked(topic))
+    return -EAGAIN;
+
+  return ramfs_fanout(fs, idx, buf, count);
+}
+
+/// @brief Double the size of a directory's index and children.
+static int ramfs_dir_grow(rfs__ramfs_node_t* dir) {
+  uint32_t mask = dir->u.dir.mask;
+  uint32_t nslots = (mask == 0 ? RAMFS_MINSLOTS : (mask + 1) * 2);
+  rfs__ramfs_slot_t* slots = malloc(sizeof(rfs__ramfs_slot_t) * nslots);
+  uint32_t* children = realloc(dir->u.dir.children,
+                               sizeof(uint32_t) * (nslots / 2));
+
+  if(children != NULL)
+    dir->u.dir.children = children;
+
+  if(children == NULL || slots == NULL) {
+    free(slots);
+    return -ENOMEM;
+  }
+
+  for(uint32_t i = 0; i < nslots; ++i)
+    slots[i].node = RFS__RAMFS_NIL;
+
+  for(uint32_t i = 0; mask != 0 && i <= mask; ++i) {
+    rfs__ramfs_slot_t* slot = &(dir->u.dir.slots[i]);
+
+    if(slot->node == RFS__RAMFS_NIL)
+      continue;
+
+    uint32_t j = slot->hash & (nslots - 1);
+    while(slots[j].node != RFS__RAMFS_NIL)
+      j = (j + 1) & (nslots - 1);
+
+    slots[j] = *slot;
+  }
+
+  free(dir->u.dir.slots);
+  dir->u.dir.slots = slots;
+  dir->u.dir.mask = nslots - 1;
+
+  return 0;
+}
+
+/// @brief Add a node to a directory.
+static int ramfs_link(rfs__ramfs_t* fs, uint32_t d, uint32_t c) {
+  rfs__ramfs_node_t* dir = &(fs->nodes[d]);
+  rfs__ramfs_node_t* child = &(fs->nodes[c]);
+
+  // the index is kept at most half full, and the children fill half of it
+  if(dir->u.dir.nchildren + 1 > (dir->u.dir.mask + 1) / 2
+  && ramfs_dir_grow(dir) < 0)
+    return -ENOMEM;
+
+  uint32_t mask = dir->u.dir.mask;
+  uint32_t i = child->name->hash & mask;
+
+  while(dir->u.dir.slots[i].node != RFS__RAMFS_NIL)
+    i = (i + 1) & mask;
+
+  dir->u.dir.slots[i].hash = child->name->hash;
+  dir->u.dir.slots[i].node = c;
+
+  child->parent = d;
+  child->pos = dir->u.dir.nchildren;
+  dir->u.dir.children[dir->u.dir.nchildren++] = c;
+
+  return 0;
+}
+
+/// @brief Remove a node from its directory.
+static void ramfs_unlink(rfs__ramfs_t* fs, uint32_t c) {
+  rfs__ramfs_node_t* child = &(fs->nodes[c]);
+  rfs__ramfs_node_t* dir = &(fs->nodes[child->parent]);
+  rfs__ramfs_slot_t* slots = dir->u.dir.slots;
+  uint32_t mask = dir->u.dir.mask;
+  uint32_t i = child->name->hash & mask;
+
+  while(slots[i].node != c)
+    i = (i + 1) & mask;
+
+  for(uint32_t j = (i + 1) & mask; slots[j].node != RFS__RAMFS_NIL;
+      j = (j + 1) & mask) {
+    if(ramfs_shiftable(slots[j].hash & mask, i, j, mask)) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+
+  slots[i].node = RFS__RAMFS_NIL;
+
+  // the last child takes the removed one's place
+  uint32_t last = dir->u.dir.children[--dir->u.dir.nchildren];
+  dir->u.dir.children[child->pos] = last;
+  fs->nodes[last].pos = child->pos;
+  child->pos = RFS__RAMFS_NIL;
+}
+
+/// @brief Check whether a name may be given to a file.
+static int ramfs_name_valid(const char* str, uint16_t len) {
+  if(len == 0 || (len == 1 && str[0] == '.')
+  || (len == 2 && str[0] == '.' && str[1] == '.'))
+    return 0;
+
+  return (memchr(str, '/', len) == NULL && memchr(str, '\0', len) == NULL);
+}
+
+int rfs__ramfs_init(rfs__ramfs_t* fs, const char* owner) {
+  assert(fs != NULL);
+  assert(owner != NULL);
+
+  fs->nodes = malloc(sizeof(rfs__ramfs_node_t) * RAMFS_MINNODES);
+  fs->names = calloc(RAMFS_MINNAMES, sizeof(rfs__ramfs_name_t*));
+  fs->owner = strdup(owner);
+
+  fs->cap = RAMFS_MINNODES;
+  fs->nnodes = 0;
+  fs->free = RFS__RAMFS_NIL;
+  fs->namemask = RAMFS_MINNAMES - 1;
+  fs->nnames = 0;
+  fs->depth = RFS__RAMFS_DEPTH;
+  fs->policy = RFS__RAMFS_DROP_OLDEST;
+
+  rfs__ramfs_name_t* name = NULL;
+
+  if(fs->nodes == NULL || fs->names == NULL || fs->owner == NULL
+  || (name = ramfs_name_get(fs, "/", 1)) == NULL) {
+    free(fs->nodes);
+    free(fs->names);
+    free(fs->owner);
+    return -ENOMEM;
+  }
+
+  uint32_t idx = ramfs_node_new(fs);
+  rfs__ramfs_node_t* root = &(fs->nodes[idx]);
+
+  assert(idx == RFS__RAMFS_ROOT);
+
+  root->name = name;
+  root->vers = 0;
+  root->mode = RFS_DMDIR | 0777;
+  root->atime = root->mtime = ramfs_now();
+  root->parent = RFS__RAMFS_ROOT;
+  root->pos = 0;
+  root->refs = 1;
+  root->u.dir.children = NULL;
+  root->u.dir.slots = NULL;
+  root->u.dir.nchildren = 0;
+  root->u.dir.mask = 0;
+
+  return 0;
+}
+
+void rfs__ramfs_free(rfs__ramfs_t* fs) {
+  assert(fs != NULL);
+
+  for(uint32_t i = 0; i < fs->nnodes; ++i) {
+    rfs__ramfs_node_t* node = &(fs->nodes[i]);
+
+    if(node->name == NULL)
+      continue;
+
+    if(node->mode & RFS_DMDIR) {
+      free(node->u.dir.children);
+      free(node->u.dir.slots);
+    }
+    else if(ramfs_isfile(node)) {
+      ramfs_data_unref(node->u.file.data);
+    }
+  }
+
+  for(uint32_t i = 0; i <= fs->namemask; ++i)
+    free(fs->names[i]);
+
+  free(fs->nodes);
+  free(fs->names);
+  free(fs->owner);
+  fs->nodes = NULL;
+  fs->names = NULL;
+  fs->owner = NULL;
+  fs->nnodes = 0;
+}
+
+rfs_qid_t rfs__ramfs_qid(const rfs__ramfs_t* fs, uint32_t idx) {
+  assert(fs != NULL);
+  assert(idx < fs->nnodes && fs->nodes[idx].name != NULL);
+
+  const rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  // the qid type bits are the top byte of the mode
+  rfs_qid_t qid = {
+    .path = ((uint64_t) node->gen << 32) | idx,
+    .vers = node->vers,
+    .type = (uint8_t) (node->mode >> 24)
+  };
+
+  return qid;
+}
+
+uint32_t rfs__ramfs_lookup(const rfs__ramfs_t* fs,
+                           uint32_t d,
+                           const char* str,
+                           uint16_t len) {
+  assert(fs != NULL);
+  assert(d < fs->nnodes);
+
+  const rfs__ramfs_node_t* dir = &(fs->nodes[d]);
+
+  if(!(dir->mode & RFS_DMDIR) || dir->u.dir.nchildren == 0)
+    return RFS__RAMFS_NIL;
+
+  // a name which isn't interned can't belong to any node
+  const rfs__ramfs_name_t* name = ramfs_name_find(fs, str, len,
+                                                  ramfs_hash(str, len));
+
+  if(name == NULL)
+    return RFS__RAMFS_NIL;
+
+  uint32_t mask = dir->u.dir.mask;
+
+  for(uint32_t i = name->hash & mask;; i = (i + 1) & mask) {
+    const rfs__ramfs_slot_t* slot = &(dir->u.dir.slots[i]);
+
+    if(slot->node == RFS__RAMFS_NIL)
+      return RFS__RAMFS_NIL;
+
+    if(slot->hash == name->hash && fs->nodes[slot->node].name == name)
+      return slot->node;
+  }
+}
+
+int rfs__ramfs_create(rfs__ramfs_t* fs,
+                      uint32_t d,
+                      const char* str,
+                      uint16_t len,
+                      uint32_t perm,
+                      uint32_t* out) {
+  assert(fs != NULL);
+  assert(d < fs->nnodes);
+
+  if(!(fs->nodes[d].mode & RFS_DMDIR))
+    return -ENOTDIR;
+
+  if(fs->nodes[d].pos == RFS__RAMFS_NIL)
+    return -ENOENT;
+
+  // a node is of at most one kind
+  uint32_t type = perm & RAMFS_DMTYPE;
+
+  if(!ramfs_name_valid(str, len) || (type & (type - 1)) != 0)
+    return -EINVAL;
+
+  if(rfs__ramfs_lookup(fs, d, str, len) != RFS__RAMFS_NIL)
+    return -EEXIST;
+
+  rfs__ramfs_name_t* name = ramfs_name_get(fs, str, len);
+
+  if(name == NULL)
+    return -ENOMEM;
+
+  uint32_t idx = ramfs_node_new(fs);
+
+  if(idx == RFS__RAMFS_NIL) {
+    ramfs_name_put(fs, name);
+    return -ENOMEM;
+  }
+
+  // taking a slot may have moved the slab
+  rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  node->name = name;
+  node->vers = 0;
+  node->mode = perm;
+  node->atime = node->mtime = ramfs_now();
+  node->parent = d;
+  node->pos = RFS__RAMFS_NIL;
+  node->refs = 1;
+
+  if(perm & RFS_DMDIR) {
+    node->u.dir.children = NULL;
+    node->u.dir.slots = NULL;
+    node->u.dir.nchildren = 0;
+    node->u.dir.mask = 0;
+  }
+  else if(perm & RFS__RAMFS_DMTOPIC) {
+    node->u.topic.subs = NULL;
+    node->u.topic.writes = NULL;
+    node->u.topic.depth = fs->depth;
+    node->u.topic.policy = (uint8_t) fs->policy;
+  }
+  else {
+    node->u.file.data = NULL;
+    node->u.file.length = 0;
+  }
+
+  if(ramfs_link(fs, d, idx) < 0) {
+    ramfs_node_unref(fs, idx);
+    return -ENOMEM;
+  }
+
+  fs->nodes[d].vers++;
+  fs->nodes[d].mtime = node->mtime;
+
+  if(out != NULL)
+    *out = idx;
+
+  return 0;
+}
+
+int rfs__ramfs_write(rfs__ramfs_t* fs,
+                     uint32_t idx,
+                     uint64_t offset,
+                     const void* buf,
+                     uint32_t count) {
+  assert(fs != NULL);
+  assert(idx < fs->nnodes);
+
+  rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  if(node->mode & RFS_DMDIR)
+    return -EISDIR;
+
+  if(node->mode & RFS__RAMFS_DMTOPIC)
+    return ramfs_publish(fs, idx, buf, count);
+
+  if(node->mode & RFS__RAMFS_DMSTATS)
+    return -EPERM;
+
+  uint64_t length = node->u.file.length;
+
+  if(node->mode & RFS_DMAPPEND)
+    offset = length;
+
+  if(offset > RAMFS_MAXFILE || count > RAMFS_MAXFILE - offset)
+    return -EFBIG;
+
+  if(count == 0)
+    return 0;
+
+  uint64_t end = offset + count;
+
+  if(ramfs_reserve(node, (end > length ? end : length)) < 0)
+    return -ENOMEM;
+
+  unsigned char* bytes = node->u.file.data->bytes;
+
+  if(offset > length)
+    memset(bytes + length, 0, (size_t) (offset - length));
+
+  memcpy(bytes + offset, buf, count);
+
+  if(end > length)
+    node->u.file.length = end;
+
+  node->vers++;
+  node->mtime = ramfs_now();
+
+  return 0;
+}
+
+int rfs__ramfs_remove(rfs__ramfs_t* fs, uint32_t idx) {
+  assert(fs != NULL);
+  assert(idx < fs->nnodes);
+
+  rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  if(idx == RFS__RAMFS_ROOT)
+    return -EPERM;
+
+  if(node->pos == RFS__RAMFS_NIL)
+    return -ENOENT;
+
+  if((node->mode & RFS_DMDIR) && node->u.dir.nchildren > 0)
+    return -ENOTEMPTY;
+
+  rfs__ramfs_node_t* dir = &(fs->nodes[node->parent]);
+
+  ramfs_unlink(fs, idx);
+  dir->vers++;
+  dir->mtime = ramfs_now();
+
+  // nothing more will be published to a removed topic, so reads waiting on
+  // it return the end of the file; as when publishing, they're completed
+  // once every subscriber has been visited
+  rfs__srv_req_t* ready = NULL;
+
+  if(node->mode & RFS__RAMFS_DMTOPIC) {
+    ramfs_sub_t* sub = node->u.topic.subs;
+
+    for(; sub != NULL; sub = sub->next) {
+      rfs__srv_req_t* req;
+
+      while((req = ramfs_sub_read(sub)) != NULL) {
+        req->data = ready;
+        ready = req;
+      }
+    }
+  }
+
+  ramfs_node_unref(fs, idx);
+
+  while(ready != NULL) {
+    rfs__srv_req_t* req = ready;
+
+    ready = req->data;
+    ramfs_sub_reply(req, NULL);
+  }
+
+  return 0;
+}
+
+int rfs__ramfs_topic_policy(rfs__ramfs_t* fs,
+                            uint32_t idx,
+                            rfs__ramfs_policy_t policy,
+                            uint32_t depth) {
+  assert(fs != NULL);
+  assert(idx < fs->nnodes);
+
+  rfs__ramfs_node_t* topic = &(fs->nodes[idx]);
+
+  if(!(topic->mode & RFS__RAMFS_DMTOPIC) || depth == 0)
+    return -EINVAL;
+
+  topic->u.topic.policy = (uint8_t) policy;
+  topic->u.topic.depth = depth;
+
+  // the writes waiting may now be published
+  ramfs_unblock(fs, idx);
+
+  return 0;
+}
+
+/// @brief Translate an error into the string sent in Rerror.
+static const char* ramfs_error(int err) {
+  switch(err) {
+    case -ENOENT:
+      return "file does not exist";
+    case -EEXIST:
+      return "file exists";
+    case -ENOTDIR:
+      return "not a directory";
+    case -EISDIR:
+      return "is a directory";
+    case -ENOTEMPTY:
+      return "directory not empty";
+    case -EPERM:
+      return "permission denied";
+    case -EINVAL:
+      return "bad file name";
+    case -EFBIG:
+      return "file too large";
+    case -ENOMEM:
+      return "out of memory";
+  }
+
+  return "i/o error";
+}
+
+/// @brief Describe a node.
+/// The strings reference the tree, so the stat is only valid until it's
+/// next changed.
+static void ramfs_describe(const rfs__ramfs_t* fs,
+                           uint32_t idx,
+                           rfs__9p_stat_t* stat) {
+  const rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+
+  stat->type = 0;
+  stat->dev = 0;
+  stat->qid = rfs__ramfs_qid(fs, idx);
+  stat->mode = node->mode;
+  stat->atime = node->atime;
+  stat->mtime = node->mtime;
+  stat->length = (ramfs_isfile(node) ? node->u.file.length : 0);
+  stat->name.str = node->name->str;
+  stat->name.len = node->name->len;
+  stat->uid = rfs__9p_str(fs->owner);
+  stat->gid = stat->uid;
+  stat->muid = stat->uid;
+}
+
+static rfs__ramfs_t* ramfs_of(const rfs__srv_req_t* req) {
+  return req->conn->srv->data;
+}
+
+/// @brief Create the state of a fid referring to a node.
+/// @return The state; NULL if out of memory.
+static ramfs_fid_t* ramfs_fid_new(rfs__ramfs_t* fs, uint32_t idx) {
+  ramfs_fid_t* f = malloc(sizeof(ramfs_fid_t));
+
+  if(f == NULL)
+    return NULL;
+
+  f->node = idx;
+  f->dirpos = 0;
+  f->diroff = 0;
+  f->sub = NULL;
+  f->snap = NULL;
+  fs->nodes[idx].refs++;
+
+  return f;
+}
+
+/// @brief Make a fid refer to another node.
+static void ramfs_fid_move(rfs__ramfs_t* fs, ramfs_fid_t* f, uint32_t idx) {
+  fs->nodes[idx].refs++;
+  ramfs_node_unref(fs, f->node);
+
+  f->node = idx;
+  f->dirpos = 0;
+  f->diroff = 0;
+}
+
+/// @brief Subscribe a fid to the topic it has opened for reading.
+/// @param [in] fs The tree holding the topic.
+/// @param [in] fid The fid.
+/// @param [in] sub The subscriber, zero filled; the fid takes ownership.
+static void ramfs_subscribe(rfs__ramfs_t* fs,
+                            rfs__srv_fid_t* fid,
+                            ramfs_sub_t* sub) {
+  ramfs_fid_t* f = fid->aux;
+  rfs__ramfs_node_t* topic = &(fs->nodes[f->node]);
+
+  sub->topic = f->node;
+  sub->fid = fid->fid;
+  sub->conn = fid->conn;
+  sub->next = topic->u.topic.subs;
+
+  if(sub->next != NULL)
+    sub->next->prev = sub;
+
+  topic->u.topic.subs = sub;
+  f->sub = sub;
+}
+
+/// @brief Unsubscribe a fid, dropping the messages pending for it.
+static void ramfs_unsubscribe(rfs__ramfs_t* fs, ramfs_fid_t* f) {
+  ramfs_sub_t* sub = f->sub;
+  uint32_t topic = sub->topic;
+  rfs__ramfs_data_t* msg;
+
+  // each read holds its fid, so none can be waiting once it's destroyed
+  assert(sub->reads == NULL);
+
+  if(sub->prev != NULL)
+    sub->prev->next = sub->next;
+  else
+    fs->nodes[sub->topic].u.topic.subs = sub->next;
+
+  if(sub->next != NULL)
+    sub->next->prev = sub->prev;
+
+  while((msg = ramfs_sub_pop(sub)) != NULL)
+    ramfs_data_unref(msg);
+
+  free(sub->queue);
+  free(sub);
+  f->sub = NULL;
+
+  // the writes waiting may have been waiting for it
+  ramfs_unblock(fs, topic);
+}
+
+/// @brief Describe the subscribers of every topic in a directory.
+/// @return The description, with one reference; NULL if out of memory.
+static rfs__ramfs_data_t* ramfs_stats(const rfs__ramfs_t* fs, uint32_t d) {
+  const rfs__ramfs_node_t* dir = &(fs->nodes[d]);
+  size_t size = 0;
+
+  for(uint32_t i = 0; i < dir->u.dir.nchildren; ++i) {
+    const rfs__ramfs_node_t* node = &(fs->nodes[dir->u.dir.children[i]]);
+
+    if(!(node->mode & RFS__RAMFS_DMTOPIC))
+      continue;
+
+    const ramfs_sub_t* sub = node->u.topic.subs;
+
+    for(; sub != NULL; sub = sub->next)
+      size += node->name->len + RAMFS_STATLINE;
+  }
+
+  // with room for the null snprintf() ends the last line with
+  rfs__ramfs_data_t* snap = malloc(sizeof(rfs__ramfs_data_t) + size + 1);
+  size_t n = 0;
+
+  if(snap == NULL)
+    return NULL;
+
+  for(uint32_t i = 0; i < dir->u.dir.nchildren; ++i) {
+    const rfs__ramfs_node_t* node = &(fs->nodes[dir->u.dir.children[i]]);
+
+    if(!(node->mode & RFS__RAMFS_DMTOPIC))
+      continue;
+
+    const ramfs_sub_t* sub = node->u.topic.subs;
+
+    for(; sub != NULL; sub = sub->next) {
+      n += (size_t) snprintf((char*) snap->bytes + n, size + 1 - n,
+                             "%s %u %u %u %llu %llu\n",
+                             node->name->str, sub->fid, sub->len, sub->hwm,
+                             (unsigned long long) sub->delivered,
+                             (unsigned long long) sub->dropped);
+    }
+  }
+
+  // the description is read like a file's contents, as far as its length
+  snap->refs = 1;
+  snap->cap = n;
+
+  return snap;
+}
+
+/// @brief Check whether an open mode allows reading.
+static int ramfs_readable(uint8_t mode) {
+  return ((mode & 3) != RFS__9P_OWRITE);
+}
+
+static void ramfs_attach(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+
+  if((req->fid->aux = ramfs_fid_new(fs, RFS__RAMFS_ROOT)) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  req->ofcall.params.rattach.qid = rfs__ramfs_qid(fs, RFS__RAMFS_ROOT);
+  rfs__srv_respond(req, NULL);
+}
+
+static void ramfs_walk(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  const rfs__9p_msg_t* in = req->ifcall;
+  rfs__9p_msg_t* out = &(req->ofcall);
+  ramfs_fid_t* from = req->fid->aux;
+  uint32_t idx = from->node;
+
+  for(uint16_t i = 0; i < in->params.twalk.nwname; ++i) {
+    const rfs__ramfs_node_t* node = &(fs->nodes[idx]);
+    const rfs__9p_str_t* name = &(in->params.twalk.wname[i]);
+    uint32_t next;
+
+    if(!(node->mode & RFS_DMDIR))
+      break;
+
+    // the root is its own parent, and a removed directory has none
+    if(name->len == 2 && name->str[0] == '.' && name->str[1] == '.')
+      next = (node->pos == RFS__RAMFS_NIL ? RFS__RAMFS_NIL : node->parent);
+    else
+      next = rfs__ramfs_lookup(fs, idx, name->str, name->len);
+
+    if(next == RFS__RAMFS_NIL)
+      break;
+
+    out->params.rwalk.wqid[out->params.rwalk.nwqid++]
+      = rfs__ramfs_qid(fs, next);
+    idx = next;
+  }
+
+  if(out->params.rwalk.nwqid == in->params.twalk.nwname) {
+    if(req->newfid == req->fid) {
+      ramfs_fid_move(fs, from, idx);
+    }
+    else if((req->newfid->aux = ramfs_fid_new(fs, idx)) == NULL) {
+      rfs__srv_respond(req, "out of memory");
+      return;
+    }
+  }
+
+  rfs__srv_respond(req, NULL);
+}
+
+static void ramfs_open(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  ramfs_fid_t* f = req->fid->aux;
+  rfs__ramfs_node_t* node = &(fs->nodes[f->node]);
+  uint8_t mode = req->ifcall->params.topen.mode;
+
+  if(node->pos == RFS__RAMFS_NIL) {
+    rfs__srv_respond(req, "file does not exist");
+    return;
+  }
+
+  if((node->mode & RFS__RAMFS_DMSTATS) && (mode & 3) != RFS__9P_OREAD) {
+    rfs__srv_respond(req, "permission denied");
+    return;
+  }
+
+  if(node->mode & RFS__RAMFS_DMSTATS) {
+    if((f->snap = ramfs_stats(fs, node->parent)) == NULL) {
+      rfs__srv_respond(req, "out of memory");
+      return;
+    }
+  }
+  else if((node->mode & RFS__RAMFS_DMTOPIC) && ramfs_readable(mode)) {
+    ramfs_sub_t* sub = calloc(1, sizeof(ramfs_sub_t));
+
+    if(sub == NULL) {
+      rfs__srv_respond(req, "out of memory");
+      return;
+    }
+
+    ramfs_subscribe(fs, req->fid, sub);
+  }
+
+  if((mode & RFS__9P_OTRUNC) && ramfs_isfile(node)
+  && ((mode & 3) == RFS__9P_OWRITE || (mode & 3) == RFS__9P_ORDWR))
+    ramfs_truncate(node, 0);
+
+  f->dirpos = 0;
+  f->diroff = 0;
+
+  req->ofcall.params.ropen.qid = rfs__ramfs_qid(fs, f->node);
+  rfs__srv_respond(req, NULL);
+}
+
+static void ramfs_create(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  ramfs_fid_t* f = req->fid->aux;
+  const rfs__9p_msg_t* in = req->ifcall;
+  uint32_t perm = in->params.tcreate.perm;
+  uint32_t dirmode = fs->nodes[f->node].mode;
+  uint8_t mode = in->params.tcreate.mode;
+  uint32_t type = perm & RAMFS_DMTYPE;
+  ramfs_sub_t* sub = NULL;
+  rfs__ramfs_data_t* snap = NULL;
+  uint32_t idx;
+
+  if((type & (type - 1)) != 0) {
+    rfs__srv_respond(req, "bad file mode");
+    return;
+  }
+
+  if((perm & RFS_DMDIR)
+  && ((mode & 3) != RFS__9P_OREAD || (mode & RFS__9P_OTRUNC))) {
+    rfs__srv_respond(req, "is a directory");
+    return;
+  }
+
+  if((perm & RFS__RAMFS_DMSTATS) && (mode & 3) != RFS__9P_OREAD) {
+    rfs__srv_respond(req, "permission denied");
+    return;
+  }
+
+  // what the fid reads is prepared first, so that nothing fails once the
+  // file exists; creating a stats file doesn't change what it describes
+  if((perm & RFS__RAMFS_DMTOPIC) && ramfs_readable(mode)
+  && (sub = calloc(1, sizeof(ramfs_sub_t))) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  if((perm & RFS__RAMFS_DMSTATS)
+  && (snap = ramfs_stats(fs, f->node)) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  // a new file can't have permissions its directory doesn't
+  if(perm & RFS_DMDIR)
+    perm &= ~0777U | (dirmode & 0777);
+  else
+    perm &= ~0666U | (dirmode & 0666);
+
+  int ret = rfs__ramfs_create(fs, f->node, in->params.tcreate.name.str,
+                              in->params.tcreate.name.len, perm, &idx);
+
+  if(ret < 0) {
+    free(sub);
+    ramfs_data_unref(snap);
+    rfs__srv_respond(req, ramfs_error(ret));
+    return;
+  }
+
+  ramfs_fid_move(fs, f, idx);
+  f->snap = snap;
+
+  if(sub != NULL)
+    ramfs_subscribe(fs, req->fid, sub);
+
+  req->ofcall.params.rcreate.qid = rfs__ramfs_qid(fs, idx);
+  req->ofcall.params.rcreate.iounit = 0;
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Read the stats of a directory's children.
+/// Children removed during a read are skipped, and the child which took a
+/// removed one's place may be skipped too.
+static void ramfs_readdir(rfs__srv_req_t* req,
+                          rfs__ramfs_t* fs,
+                          ramfs_fid_t* f) {
+  const rfs__ramfs_node_t* dir = &(fs->nodes[f->node]);
+  uint64_t offset = req->ifcall->params.tread.offset;
+  uint32_t count = req->ifcall->params.tread.count;
+  unsigned char* buf = NULL;
+  size_t n = 0;
+
+  if(offset == 0) {
+    f->dirpos = 0;
+    f->diroff = 0;
+  }
+  else if(offset != f->diroff) {
+    rfs__srv_respond(req, "bad offset in directory read");
+    return;
+  }
+
+  if(count > 0 && f->dirpos < dir->u.dir.nchildren) {
+    if((buf = malloc(count)) == NULL) {
+      rfs__srv_respond(req, "out of memory");
+      return;
+    }
+
+    while(f->dirpos < dir->u.dir.nchildren) {
+      rfs__9p_stat_t stat;
+      ramfs_describe(fs, dir->u.dir.children[f->dirpos], &stat);
+
+      size_t len = rfs__9p_stat_pack(&stat, buf + n, count - n);
+
+      if(len == 0)
+        break;
+
+      n += len;
+      f->dirpos++;
+    }
+
+    if(n == 0) {
+      free(buf);
+      rfs__srv_respond(req, "directory entry too large");
+      return;
+    }
+  }
+
+  f->diroff += n;
+
+  req->ofcall.params.rread.count = (uint32_t) n;
+  req->ofcall.params.rread.data = buf;
+  req->release = free;
+  req->release_data = buf;
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Add a request to the end of a list linked through its data.
+static void ramfs_req_append(rfs__srv_req_t** list, rfs__srv_req_t* req) {
+  req->data = NULL;
+
+  if(*list == NULL) {
+    *list = req;
+    return;
+  }
+
+  rfs__srv_req_t* last = *list;
+
+  while(last->data != NULL)
+    last = last->data;
+
+  last->data = req;
+}
+
+/// @brief Remove a request from a list linked through its data.
+/// @return 1 if it was in the list, otherwise 0.
+static int ramfs_req_unlink(rfs__srv_req_t** list, rfs__srv_req_t* req) {
+  rfs__srv_req_t* prev = NULL;
+  rfs__srv_req_t* r = *list;
+
+  while(r != NULL && r != req) {
+    prev = r;
+    r = r->data;
+  }
+
+  if(r == NULL)
+    return 0;
+
+  if(prev == NULL)
+    *list = req->data;
+  else
+    prev->data = req->data;
+
+  return 1;
+}
+
+/// @brief Read the next message of a topic, waiting for one to be published
+/// if none is pending.
+static void ramfs_topic_read(rfs__srv_req_t* req,
+                             rfs__ramfs_t* fs,
+                             ramfs_fid_t* f) {
+  ramfs_sub_t* sub = f->sub;
+  uint32_t idx = f->node;
+
+  // the server only passes reads of fids opened for reading
+  assert(sub != NULL);
+
+  rfs__ramfs_data_t* msg = ramfs_sub_pop(sub);
+
+  if(msg == NULL && fs->nodes[idx].pos != RFS__RAMFS_NIL) {
+    ramfs_req_append(&(sub->reads), req);
+    return;
+  }
+
+  if(msg != NULL)
+    sub->delivered++;
+
+  // replying may destroy the fid, but not the topic it was waiting on
+  ramfs_sub_reply(req, msg);
+
+  if(msg != NULL)
+    ramfs_unblock(fs, idx);
+}
+
+/// @brief Read part of a file's contents or a stats file's description.
+/// @param [in] req The read.
+/// @param [in] data The contents; NULL if there are none.
+/// @param [in] length The number of bytes of data to read from.
+static void ramfs_read_data(rfs__srv_req_t* req,
+                            rfs__ramfs_data_t* data,
+                            uint64_t length) {
+  uint64_t offset = req->ifcall->params.tread.offset;
+  uint32_t count = req->ifcall->params.tread.count;
+
+  if(offset >= length)
+    count = 0;
+  else if(count > length - offset)
+    count = (uint32_t) (length - offset);
+
+  req->ofcall.params.rread.count = count;
+
+  // the reply references the contents until it's sent
+  if(count > 0) {
+    data->refs++;
+    req->ofcall.params.rread.data = data->bytes + offset;
+    req->release = ramfs_data_unref;
+    req->release_data = data;
+  }
+
+  rfs__srv_respond(req, NULL);
+}
+
+static void ramfs_read(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  ramfs_fid_t* f = req->fid->aux;
+  rfs__ramfs_node_t* node = &(fs->nodes[f->node]);
+
+  node->atime = ramfs_now();
+
+  if(node->mode & RFS_DMDIR) {
+    ramfs_readdir(req, fs, f);
+    return;
+  }
+
+  if(node->mode & RFS__RAMFS_DMTOPIC) {
+    ramfs_topic_read(req, fs, f);
+    return;
+  }
+
+  if(node->mode & RFS__RAMFS_DMSTATS) {
+    // a stats file can only be opened for reading, which takes the snapshot
+    assert(f->snap != NULL);
+    ramfs_read_data(req, f->snap, f->snap->cap);
+    return;
+  }
+
+  ramfs_read_data(req, node->u.file.data, node->u.file.length);
+}
+
+/// @brief Complete a write.
+/// @param [in] req The write.
+/// @param [in] ret The result of writing.
+static void ramfs_wrote(rfs__srv_req_t* req, int ret) {
+  if(ret < 0) {
+    rfs__srv_respond(req, ramfs_error(ret));
+    return;
+  }
+
+  req->ofcall.params.rwrite.count = req->ifcall->params.twrite.count;
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Publish the writes waiting on a topic, as far as there's room.
+static void ramfs_unblock(rfs__ramfs_t* fs, uint32_t idx) {
+  rfs__ramfs_node_t* topic = &(fs->nodes[idx]);
+
+  if(topic->name == NULL || !(topic->mode & RFS__RAMFS_DMTOPIC)
+  || topic->u.topic.writes == NULL)
+    return;
+
+  // completing a write may destroy the last fid referring to the topic
+  topic->refs++;
+
+  while(topic->u.topic.writes != NULL && !ramfs_topic_blocked(topic)) {
+    rfs__srv_req_t* req = topic->u.topic.writes;
+    const rfs__9p_msg_t* in = req->ifcall;
+
+    topic->u.topic.writes = req->data;
+    ramfs_wrote(req, ramfs_fanout(fs, idx, in->params.twrite.data,
+                                  in->params.twrite.count));
+  }
+
+  ramfs_node_unref(fs, idx);
+}
+
+static void ramfs_write(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  const rfs__9p_msg_t* in = req->ifcall;
+  ramfs_fid_t* f = req->fid->aux;
+
+  int ret = rfs__ramfs_write(fs, f->node, in->params.twrite.offset,
+                             in->params.twrite.data,
+                             in->params.twrite.count);
+
+  // a publisher waits for room, holding its message until then
+  if(ret == -EAGAIN) {
+    ramfs_req_append(&(fs->nodes[f->node].u.topic.writes), req);
+    return;
+  }
+
+  ramfs_wrote(req, ret);
+}
+
+static void ramfs_stat(rfs__srv_req_t* req) {
+  ramfs_fid_t* f = req->fid->aux;
+
+  ramfs_describe(ramfs_of(req), f->node, req->ofcall.params.rstat.stat);
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Check whether a counted string equals a null terminated one.
+static int ramfs_streq(const rfs__9p_str_t* s, const char* cstr) {
+  return (strlen(cstr) == s->len && memcmp(cstr, s->str, s->len) == 0);
+}
+
+static void ramfs_wstat(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  ramfs_fid_t* f = req->fid->aux;
+  rfs__ramfs_node_t* node = &(fs->nodes[f->node]);
+  const rfs__9p_stat_t* st = req->ifcall->params.twstat.stat;
+  int isdir = (node->mode & RFS_DMDIR) != 0;
+  int isfile = ramfs_isfile(node);
+  int newname = (st->name.len > 0
+             && !(st->name.len == node->name->len
+               && memcmp(st->name.str, node->name->str, st->name.len) == 0));
+  const char* error = NULL;
+
+  // everything is checked first, so that a wstat is all or nothing
+  if(st->mode != ~0U && ((st->mode ^ node->mode) & RAMFS_DMTYPE))
+    error = "can't change a file's type";
+  else if(st->length != ~0ULL && !isfile && st->length != 0)
+    error = (isdir ? "is a directory" : "permission denied");
+  else if(st->length != ~0ULL && st->length > RAMFS_MAXFILE)
+    error = "file too large";
+  else if((st->uid.len > 0 && !ramfs_streq(&(st->uid), fs->owner))
+       || (st->gid.len > 0 && !ramfs_streq(&(st->gid), fs->owner)))
+    error = "permission denied";
+  else if(newname && (f->node == RFS__RAMFS_ROOT
+                  || node->pos == RFS__RAMFS_NIL))
+    error = "permission denied";
+  else if(newname && !ramfs_name_valid(st->name.str, st->name.len))
+    error = "bad file name";
+  else if(newname && rfs__ramfs_lookup(fs, node->parent, st->name.str,
+                                      st->name.len) != RFS__RAMFS_NIL)
+    error = "file exists";
+
+  if(error != NULL) {
+    rfs__srv_respond(req, error);
+    return;
+  }
+
+  rfs__ramfs_name_t* name = NULL;
+
+  if(newname && (name = ramfs_name_get(fs, st->name.str,
+                                      st->name.len)) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  if(st->length != ~0ULL && isfile && st->length != node->u.file.length
+  && ramfs_truncate(node, st->length) < 0) {
+    if(name != NULL)
+      ramfs_name_put(fs, name);
+
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  // the directory had room for the node, so relinking it can't fail
+  if(name != NULL) {
+    ramfs_unlink(fs, f->node);
+    ramfs_name_put(fs, node->name);
+    node->name = name;
+
+    int ret = ramfs_link(fs, node->parent, f->node);
+    assert(ret == 0);
+    (void) ret;
+
+    // clients caching walks see the directory has changed by its version
+    fs->nodes[node->parent].vers++;
+    fs->nodes[node->parent].mtime = ramfs_now();
+  }
+
+  if(st->mode != ~0U)
+    node->mode = (node->mode & RAMFS_DMTYPE) | (st->mode & ~RAMFS_DMTYPE);
+
+  if(st->mtime != ~0U)
+    node->mtime = st->mtime;
+
+  rfs__srv_respond(req, NULL);
+}
+
+static void ramfs_remove(rfs__srv_req_t* req) {
+  ramfs_fid_t* f = req->fid->aux;
+  int ret = rfs__ramfs_remove(ramfs_of(req), f->node);
+
+  rfs__srv_respond(req, (ret < 0 ? ramfs_error(ret) : NULL));
+}
+
+static void ramfs_destroyfid(rfs__srv_fid_t* fid) {
+  ramfs_fid_t* f = fid->aux;
+
+  // the fid failed to attach or walk
+  if(f == NULL)
+    return;
+
+  rfs__ramfs_t* fs = fid->conn->srv->data;
+
+  if(f->sub != NULL)
+    ramfs_unsubscribe(fs, f);
+
+  ramfs_data_unref(f->snap);
+
+  if(fid->omode != -1 && (fid->omode & RFS__9P_ORCLOSE))
+    rfs__ramfs_remove(fs, f->node);
+
+  ramfs_node_unref(fs, f->node);
+  free(f);
+}
+
+/// @brief Abandon a read waiting on a topic or a write waiting to publish
+/// to one; nothing else waits.
+static void ramfs_flush(rfs__srv_req_t* req) {
+  rfs__ramfs_t* fs = ramfs_of(req);
+  ramfs_fid_t* f = req->fid->aux;
+  rfs__srv_req_t** list;
+
+  if(req->ifcall->type == RFS__9P_TREAD && f->sub != NULL)
+    list = &(f->sub->reads);
+  else if(req->ifcall->type == RFS__9P_TWRITE
+       && (fs->nodes[f->node].mode & RFS__RAMFS_DMTOPIC))
+    list = &(fs->nodes[f->node].u.topic.writes);
+  else
+    list = NULL;
+
+  // hanging up from a handler flushes the request being handled, which
+  // responds once it's done
+  if(list != NULL && ramfs_req_unlink(list, req))
+    rfs__srv_respond(req, "interrupted");
+}
+
+const rfs__srv_ops_t rfs__ramfs_ops = {
+  .attach = ramfs_attach,
+  .walk = ramfs_walk,
+  .open = ramfs_open,
+  .create = ramfs_create,
+  .read = ramfs_read,
+  .write = ramfs_write,
+  .stat = ramfs_stat,
+  .wstat = ramfs_wstat,
+  .remove = ramfs_remove,
+  .flush = ramfs_flush,
+  .destroyfid = ramfs_destroyfid
+};
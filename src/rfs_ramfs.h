@@ -0,0 +1,240 @@
+#ifndef RFS_RAMFS_H
+#define RFS_RAMFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs/types.h"
+#include "rfs_srv.h"
+
+/// @file An in-memory file tree, served by rfs__srv_t.
+/// Nodes live in one slab and are numbered by their index in it, which is
+/// the low 32 bits of their qid path; the high 32 bits are the slot's
+/// generation, bumped each time it's reused, so a stale qid never matches a
+/// new file. A directory keeps its children in a dense array, which is what
+/// directory reads walk, and indexes them by name in an open-addressed hash
+/// table. Names are interned once per tree, so finding a child is one
+/// probe sequence compared by pointer, however large the directory is.
+///
+/// File contents are refcounted, so an Rread references them until its
+/// write completes rather than copying them; a write to contents which are
+/// still being sent copies them first.
+///
+/// A topic is a file created with RFS__RAMFS_DMTOPIC, which stores nothing:
+/// each write to it publishes one message, and every fid which has it open
+/// for reading is a subscriber, whose reads return the messages published
+/// since it was opened, one per read, in order. A read with no message
+/// pending blocks until one is published. A message is copied once, when
+/// published; every subscriber's Rread then references the same buffer.
+///
+/// Each subscriber may have at most its topic's depth of messages pending,
+/// and the topic's policy decides what happens to a message for which a
+/// subscriber has no room. How far behind each subscriber is can be read
+/// from a stats file, created with RFS__RAMFS_DMSTATS, which lists the
+/// subscribers of every topic in its directory. Each is described on a line
+/// of space separated fields: the topic's name, the subscriber's fid, the
+/// number of messages it has pending, the most it has had pending, and the
+/// number of messages delivered to it and dropped for it. The contents are
+/// taken when the file is opened.
+///
+/// A tree is owned by the loop serving it and is not locked. Files have
+/// one owner, and nothing is checked beyond what the protocol requires.
+
+/// @brief The index which refers to no node.
+#define RFS__RAMFS_NIL UINT32_MAX
+
+/// @brief The index of the root directory.
+#define RFS__RAMFS_ROOT 0
+
+/// @brief The mode bit of a topic; not one of the protocol's, so clients
+/// which don't know it see a file which reads as a stream of messages.
+#define RFS__RAMFS_DMTOPIC 0x00100000U
+
+/// @brief The mode bit of a stats file, which is read only.
+#define RFS__RAMFS_DMSTATS 0x00080000U
+
+/// @brief The number of messages a subscriber may have pending, unless the
+/// tree or topic says otherwise.
+#define RFS__RAMFS_DEPTH 1024
+
+/// @brief What happens to a message published to a subscriber which
+/// already has its topic's depth of messages pending.
+typedef enum rfs__ramfs_policy {
+  RFS__RAMFS_BLOCK, ///< The publisher waits until there's room.
+  RFS__RAMFS_DROP_OLDEST, ///< The oldest message pending is dropped.
+  RFS__RAMFS_DROP_NEWEST, ///< The message published is dropped.
+  RFS__RAMFS_DISCONNECT ///< The subscriber's connection is closed.
+} rfs__ramfs_policy_t;
+
+struct rfs__ramfs_sub;
+
+/// @brief An interned name.
+typedef struct rfs__ramfs_name {
+  uint32_t hash; ///< The hash of the string.
+  uint32_t refs; ///< The number of nodes with the name.
+  uint16_t len; ///< The length of the string.
+  char str[]; ///< The string, null terminated.
+} rfs__ramfs_name_t;
+
+/// @brief The contents of a file, or a message published to a topic.
+typedef struct rfs__ramfs_data {
+  /// @brief Held by the file or each subscriber the message is pending for,
+  /// and by each Rread still being sent.
+  uint32_t refs;
+  size_t cap; ///< The size of bytes; a message's length.
+  unsigned char bytes[]; ///< The contents.
+} rfs__ramfs_data_t;
+
+/// @brief A slot of a directory's name index.
+typedef struct rfs__ramfs_slot {
+  uint32_t hash; ///< The hash of the child's name.
+  uint32_t node; ///< The child; RFS__RAMFS_NIL if the slot is empty.
+} rfs__ramfs_slot_t;
+
+/// @brief A file or directory.
+typedef struct rfs__ramfs_node {
+  rfs__ramfs_name_t* name; ///< The last element of its path; NULL if free.
+  uint32_t gen; ///< The high 32 bits of its qid path.
+  uint32_t vers; ///< Its qid version, bumped when its contents change.
+  uint32_t mode; ///< Its permissions and RFS_DM* bits.
+  uint32_t atime; ///< The last time it was read.
+  uint32_t mtime; ///< The last time it was changed.
+  uint32_t parent; ///< The directory holding it; if free, the next free.
+  uint32_t pos; ///< Its index in its parent's children; NIL if removed.
+  uint32_t refs; ///< One while linked into the tree, plus one per fid.
+
+  union {
+    struct {
+      rfs__ramfs_data_t* data; ///< The contents; NULL until written.
+      uint64_t length; ///< The number of bytes in the file.
+    } file; ///< For files.
+
+    struct {
+      uint32_t* children; ///< The children, in the order they're read.
+      rfs__ramfs_slot_t* slots; ///< The name index of the children.
+      uint32_t nchildren; ///< The number of children.
+      uint32_t mask; ///< The number of slots minus 1; 0 if there are none.
+    } dir; ///< For directories.
+
+    struct {
+      struct rfs__ramfs_sub* subs; ///< The fids subscribed to it.
+
+      /// @brief The writes waiting for room to publish, oldest first,
+      /// linked through their data.
+      rfs__srv_req_t* writes;
+
+      uint32_t depth; ///< The most messages a subscriber may have pending.
+      uint8_t policy; ///< The rfs__ramfs_policy_t applied at the depth.
+    } topic; ///< For topics.
+  } u;
+} rfs__ramfs_node_t;
+
+/// @brief The tree structure.
+typedef struct rfs__ramfs {
+  rfs__ramfs_node_t* nodes; ///< The slab of nodes.
+  uint32_t nnodes; ///< The number of slots of the slab ever used.
+  uint32_t cap; ///< The number of slots in the slab.
+  uint32_t free; ///< The first free slot; NIL if there isn't one.
+
+  rfs__ramfs_name_t** names; ///< The interned names' hash table.
+  uint32_t namemask; ///< The number of name slots minus 1.
+  uint32_t nnames; ///< The number of interned names.
+
+  char* owner; ///< The uid and gid of every file.
+
+  uint32_t depth; ///< The depth new topics are given.
+  rfs__ramfs_policy_t policy; ///< The policy new topics are given.
+} rfs__ramfs_t;
+
+/// @brief The handlers serving a tree; the server's data must be the tree.
+extern const rfs__srv_ops_t rfs__ramfs_ops;
+
+/// @brief Initialize a tree holding an empty root directory.
+/// New topics' subscribers may have RFS__RAMFS_DEPTH messages pending,
+/// dropping the oldest beyond that.
+/// @param [in] fs The tree to initialize.
+/// @param [in] owner The name of the user owning every file.
+/// @return 0 on success, -errno on failure.
+int rfs__ramfs_init(rfs__ramfs_t* fs, const char* owner);
+
+/// @brief Free a tree and everything in it.
+/// Contents still referenced by Rreads being sent are freed once sent.
+/// @param [in] fs The tree to free.
+void rfs__ramfs_free(rfs__ramfs_t* fs);
+
+/// @brief Find the qid of a node.
+/// @param [in] fs The tree holding the node.
+/// @param [in] node The node.
+/// @return The qid.
+rfs_qid_t rfs__ramfs_qid(const rfs__ramfs_t* fs, uint32_t node);
+
+/// @brief Find a child of a directory by name.
+/// @param [in] fs The tree to search.
+/// @param [in] dir The directory to search.
+/// @param [in] name The name of the child; need not be null terminated.
+/// @param [in] len The length of name.
+/// @return The child; RFS__RAMFS_NIL if there is none.
+uint32_t rfs__ramfs_lookup(const rfs__ramfs_t* fs,
+                           uint32_t dir,
+                           const char* name,
+                           uint16_t len);
+
+/// @brief Create a file or directory.
+/// @param [in] fs The tree to add to.
+/// @param [in] dir The directory to create it in.
+/// @param [in] name The name of the new node; need not be null terminated.
+/// @param [in] len The length of name.
+/// @param [in] perm Its permissions; with RFS_DMDIR set for a directory,
+/// RFS__RAMFS_DMTOPIC for a topic or RFS__RAMFS_DMSTATS for a stats file.
+/// @param [out] node The new node; may be NULL.
+/// @return 0 on success; -ENOTDIR if dir isn't a directory; -ENOENT if it
+/// has been removed; -EINVAL if the name or perm isn't valid; -EEXIST if
+/// dir already has a child with the name; -ENOMEM.
+int rfs__ramfs_create(rfs__ramfs_t* fs,
+                      uint32_t dir,
+                      const char* name,
+                      uint16_t len,
+                      uint32_t perm,
+                      uint32_t* node);
+
+/// @brief Write to a file, extending it if required, or publish a message.
+/// Messages are delivered to blocked subscribers before this returns; an
+/// empty message isn't published.
+/// @param [in] fs The tree holding the file.
+/// @param [in] node The file or topic.
+/// @param [in] offset Where to write; ignored for append-only files and
+/// topics.
+/// @param [in] buf The bytes to write.
+/// @param [in] count The number of bytes to write.
+/// @return 0 on success; -EISDIR; -EPERM for a stats file; -EFBIG if the
+/// file would be too large; -EAGAIN if the topic's policy is to block and a
+/// subscriber has no room, or other writes are already waiting; -ENOMEM.
+int rfs__ramfs_write(rfs__ramfs_t* fs,
+                     uint32_t node,
+                     uint64_t offset,
+                     const void* buf,
+                     uint32_t count);
+
+/// @brief Set what happens when a topic's subscribers fall behind.
+/// @param [in] fs The tree holding the topic.
+/// @param [in] node The topic.
+/// @param [in] policy What to do with a message for a subscriber with no
+/// room.
+/// @param [in] depth The most messages a subscriber may have pending; a
+/// subscriber which already has more keeps them.
+/// @return 0 on success; -EINVAL if node isn't a topic or depth is 0.
+int rfs__ramfs_topic_policy(rfs__ramfs_t* fs,
+                            uint32_t node,
+                            rfs__ramfs_policy_t policy,
+                            uint32_t depth);
+
+/// @brief Remove a node from its directory.
+/// The node is freed once no fid refers to it. A removed topic's
+/// subscribers read what is pending and then the end of the file.
+/// @param [in] fs The tree holding the node.
+/// @param [in] node The node to remove.
+/// @return 0 on success; -EPERM for the root; -ENOTEMPTY for a directory
+/// with children; -ENOENT if it has already been removed.
+int rfs__ramfs_remove(rfs__ramfs_t* fs, uint32_t node);
+
+#endif
@@ -0,0 +1,379 @@
+#include "rfs_readahead.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief Get a buffer of the stream.
+/// @param [in] ra The read-ahead.
+/// @param [in] i The position of the buffer in the stream; 0 is the head.
+static rfs__readahead_buf_t* ra_buf(rfs__readahead_t* ra, uint32_t i) {
+  return &(ra->bufs[(ra->head + i) % ra->nbufs]);
+}
+
+/// @brief Remove buffers from the end of the stream.
+/// Treads still in flight are left to complete, and their replies discarded.
+/// @param [in] ra The read-ahead.
+/// @param [in] keep The number of buffers to leave in the stream.
+static void ra_truncate(rfs__readahead_t* ra, uint32_t keep) {
+  for(uint32_t i = keep; i < ra->queued; ++i) {
+    rfs__readahead_buf_t* b = ra_buf(ra, i);
+    b->state = (b->state == RFS__READAHEAD_SENT ? RFS__READAHEAD_STALE
+                                                : RFS__READAHEAD_FREE);
+  }
+
+  ra->queued = keep;
+}
+
+/// @brief Restart the stream from a new offset.
+static void ra_restart(rfs__readahead_t* ra, uint64_t offset) {
+  ra_truncate(ra, 0);
+  ra->expect = offset;
+  ra->next = offset;
+  ra->eof = 0;
+}
+
+/// @brief Release the read-ahead's memory and report it closed.
+static void ra_finish(rfs__readahead_t* ra) {
+  for(uint32_t i = 0; i < ra->nbufs; ++i)
+    free(ra->bufs[i].data);
+
+  free(ra->bufs);
+  ra->bufs = NULL;
+
+  if(ra->close_cb != NULL)
+    ra->close_cb(ra);
+}
+
+static void ra_on_read(rfs__9p_call_t* call,
+                       int ret,
+                       const rfs__9p_msg_t* reply);
+
+/// @brief Send Treads until the stream is as deep as it should be.
+/// @param [in] ra The read-ahead.
+/// @param [in] count The size of the waiting read, if the reader isn't
+/// reading sequentially; 0 if nothing is waiting.
+/// @return 0 on success, -errno if a Tread couldn't be sent.
+static int ra_pump(rfs__readahead_t* ra, size_t count) {
+  int streaming = (ra->run >= RFS__READAHEAD_TRIGGER);
+  uint32_t want = (streaming ? ra->depth : (count > 0 ? 1 : 0));
+
+  // past the end of the file, only the head is read, to see if it has grown
+  if(ra->eof)
+    want = (ra->queued == 0 ? 1 : 0);
+
+  while(ra->queued < want) {
+    rfs__readahead_buf_t* b = ra_buf(ra, ra->queued);
+
+    // the reply to a Tread from before a restart is still to come
+    if(b->state != RFS__READAHEAD_FREE)
+      break;
+
+    if(b->data == NULL && (b->data = malloc(ra->chunk)) == NULL)
+      return -ENOMEM;
+
+    rfs__9p_msg_init(&(b->msg));
+    b->msg.type = RFS__9P_TREAD;
+    b->msg.params.tread.fid = ra->fid;
+    b->msg.params.tread.offset = ra->next;
+    b->msg.params.tread.count = ra->chunk;
+
+    // a read which may not be followed by another only asks for what it needs
+    if(!streaming && count < ra->chunk)
+      b->msg.params.tread.count = (uint32_t) count;
+
+    b->call.data = ra;
+    b->sent = uv_hrtime();
+
+    int ret = rfs__9p_session_rpc(ra->session, &(b->call), &(b->msg),
+                                  ra_on_read);
+
+    if(ret < 0)
+      return ret;
+
+    b->state = RFS__READAHEAD_SENT;
+    b->len = 0;
+    b->pos = 0;
+    ra->inflight++;
+    ra->queued++;
+    ra->next += b->msg.params.tread.count;
+    ra->eof = 0;
+  }
+
+  return 0;
+}
+
+/// @brief Copy what the stream holds at its head into a read's buffer.
+/// @param [in] ra The read-ahead.
+/// @param [out] buf The buffer to read into.
+/// @param [in] count The size of buf.
+/// @param [out] nread Set to the number of bytes read.
+/// @return 1 if the read is complete; 0 if it must wait for a reply;
+/// -errno if the Tread at the head failed.
+static int ra_take(rfs__readahead_t* ra,
+                   unsigned char* buf,
+                   size_t count,
+                   size_t* nread) {
+  size_t done = 0;
+
+  while(ra->queued > 0 && done < count) {
+    rfs__readahead_buf_t* b = ra_buf(ra, 0);
+
+    if(b->state != RFS__READAHEAD_DONE)
+      break;
+
+    // data already read is returned first; the error is for the next read
+    if(b->ret < 0) {
+      if(done > 0)
+        break;
+
+      int ret = b->ret;
+      ra_restart(ra, ra->expect);
+      ra->run = 0;
+      return ret;
+    }
+
+    size_t n = b->len - b->pos;
+
+    if(n > count - done)
+      n = count - done;
+
+    memcpy(buf + done, b->data + b->pos, n);
+    b->pos += (uint32_t) n;
+    done += n;
+    ra->expect += n;
+
+    if(b->pos < b->len)
+      break;
+
+    int shortread = (b->len < b->msg.params.tread.count);
+
+    b->state = RFS__READAHEAD_FREE;
+    ra->head = (ra->head + 1) % ra->nbufs;
+    ra->queued--;
+
+    // the end of the file is returned as a read on its own
+    if(shortread) {
+      *nread = done;
+      return 1;
+    }
+  }
+
+  *nread = done;
+  return (done > 0 ? 1 : 0);
+}
+
+/// @brief Top the stream up, and complete the waiting read if the stream
+/// now allows it.
+/// The read's callback is invoked last, since it may close the read-ahead.
+static void ra_kick(rfs__readahead_t* ra) {
+  size_t n = 0;
+  int ret = 0;
+
+  if(ra->cb != NULL)
+    ret = ra_take(ra, ra->buf, ra->count, &n);
+
+  int err = ra_pump(ra, ra->cb != NULL && ret == 0 ? ra->count : 0);
+
+  // a waiting read with nothing in flight for it would never complete
+  if(ret == 0 && err < 0 && ra->queued == 0)
+    ret = err;
+
+  if(ra->cb != NULL && ret != 0) {
+    rfs__readahead_cb cb = ra->cb;
+    ra->cb = NULL;
+    cb(ra, ret < 0 ? ret : 0, ret < 0 ? 0 : n);
+  }
+}
+
+/// @brief Record the reply to a Tread.
+static void ra_on_read(rfs__9p_call_t* call,
+                       int ret,
+                       const rfs__9p_msg_t* reply) {
+  rfs__readahead_buf_t* b = (rfs__readahead_buf_t*) call;
+  rfs__readahead_t* ra = call->data;
+
+  ra->inflight--;
+
+  if(b->state == RFS__READAHEAD_STALE) {
+    b->state = RFS__READAHEAD_FREE;
+
+    if(ra->closing) {
+      if(ra->inflight == 0)
+        ra_finish(ra);
+    }
+    else {
+      ra_kick(ra);
+    }
+
+    return;
+  }
+
+  uint64_t rtt = uv_hrtime() - b->sent;
+  ra->srtt = (ra->srtt == 0 ? rtt : (ra->srtt * 7 + rtt) / 8);
+
+  if(ret == 0 && reply->type == RFS__9P_RERROR)
+    ret = -EIO;
+
+  if(ret == 0) {
+    b->len = reply->params.rread.count;
+
+    if(b->len > b->msg.params.tread.count)
+      ret = -EBADMSG;
+    else
+      memcpy(b->data, reply->params.rread.data, b->len);
+  }
+
+  b->ret = ret;
+  b->state = RFS__READAHEAD_DONE;
+
+  // everything sent after a short read is past the end of the file
+  if(ret == 0 && b->len < b->msg.params.tread.count) {
+    uint32_t pos = (uint32_t) (b - ra->bufs + ra->nbufs - ra->head)
+                 % ra->nbufs;
+
+    ra_truncate(ra, pos + 1);
+    ra->next = b->msg.params.tread.offset + b->len;
+    ra->eof = 1;
+  }
+
+  ra_kick(ra);
+}
+
+int rfs__readahead_init(rfs__readahead_t* ra,
+                        rfs__9p_session_t* session,
+                        uint32_t fid,
+                        uint32_t iounit,
+                        uint32_t msize,
+                        uint32_t depth) {
+  assert(ra != NULL);
+  assert(session != NULL);
+  assert(msize > RFS__9P_IOHDRSZ);
+  assert(depth > 0);
+
+  ra->bufs = calloc(depth, sizeof(rfs__readahead_buf_t));
+
+  if(ra->bufs == NULL)
+    return -ENOMEM;
+
+  // an iounit of 0 means the server leaves it to the msize
+  ra->chunk = msize - RFS__9P_IOHDRSZ;
+
+  if(iounit > 0 && iounit < ra->chunk)
+    ra->chunk = iounit;
+
+  ra->session = session;
+  ra->fid = fid;
+  ra->nbufs = depth;
+  ra->head = 0;
+  ra->queued = 0;
+  ra->inflight = 0;
+  ra->depth = (depth < 2 ? depth : 2);
+  ra->run = 0;
+  ra->expect = 0;
+  ra->next = 0;
+  ra->eof = 0;
+  ra->srtt = 0;
+  ra->space = 0;
+  ra->last = 0;
+  ra->cb = NULL;
+  ra->buf = NULL;
+  ra->count = 0;
+  ra->close_cb = NULL;
+  ra->closing = 0;
+
+  return 0;
+}
+
+void rfs__readahead_close(rfs__readahead_t* ra, rfs__readahead_close_cb cb) {
+  assert(ra != NULL);
+  assert(!ra->closing);
+
+  ra->closing = 1;
+  ra->close_cb = cb;
+
+  if(ra->cb != NULL) {
+    rfs__readahead_cb rcb = ra->cb;
+    ra->cb = NULL;
+    rcb(ra, -ECANCELED, 0);
+  }
+
+  ra_truncate(ra, 0);
+
+  if(ra->inflight == 0)
+    ra_finish(ra);
+}
+
+/// @brief Update the depth of the stream from the reader's latest read.
+static void ra_adapt(rfs__readahead_t* ra, size_t count) {
+  uint64_t now = uv_hrtime();
+
+  if(ra->last != 0 && count > 0) {
+    // the time the reader takes per chunk, however much it reads at a time
+    uint64_t space = (now - ra->last) * ra->chunk / count;
+    ra->space = (ra->space == 0 ? space : (ra->space * 7 + space) / 8);
+  }
+
+  ra->last = now;
+
+  if(ra->srtt == 0 || ra->space == 0)
+    return;
+
+  // enough Treads to cover a round trip at the rate the reader consumes
+  // them, and one more for the reader to consume meanwhile
+  uint64_t depth = 1 + (ra->srtt + ra->space - 1) / ra->space;
+
+  ra->depth = (depth < ra->nbufs ? (uint32_t) depth : ra->nbufs);
+}
+
+int rfs__readahead_read(rfs__readahead_t* ra,
+                        uint64_t offset,
+                        void* buf,
+                        size_t count,
+                        size_t* nread,
+                        rfs__readahead_cb cb) {
+  assert(ra != NULL);
+  assert(!ra->closing);
+  assert(buf != NULL || count == 0);
+  assert(nread != NULL);
+  assert(cb != NULL);
+
+  if(ra->cb != NULL)
+    return -EBUSY;
+
+  if(offset == ra->expect) {
+    if(ra->run < RFS__READAHEAD_TRIGGER)
+      ra->run++;
+
+    ra_adapt(ra, count);
+  }
+  else {
+    ra_restart(ra, offset);
+    ra->run = 1;
+    ra->last = 0;
+  }
+
+  if(count == 0) {
+    *nread = 0;
+    return 1;
+  }
+
+  int ret = ra_take(ra, buf, count, nread);
+
+  if(ret != 0) {
+    ra_pump(ra, 0);
+    return ret;
+  }
+
+  ret = ra_pump(ra, count);
+
+  if(ret < 0 && ra->queued == 0)
+    return ret;
+
+  ra->cb = cb;
+  ra->buf = buf;
+  ra->count = count;
+
+  return 0;
+}
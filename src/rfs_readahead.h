@@ -0,0 +1,142 @@
+#ifndef RFS_READAHEAD_H
+#define RFS_READAHEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs_9p_session.h"
+
+/// @file Read-ahead for a fid open for reading.
+/// Reads are made through a stream of iounit-sized Treads. Once the reader
+/// has read sequentially a few times, further Treads are kept in flight
+/// ahead of it, so that a large file is streamed at the rate the link can
+/// carry rather than one round trip per read.
+/// The number kept in flight follows Little's law: it is the measured round
+/// trip time divided by the time the reader takes to consume each Tread's
+/// worth of data, plus one. A reader which keeps up with the server gets as
+/// deep a stream as it's allowed; a slow one gets a shallow stream, so
+/// little is read that may never be used.
+/// Reading anywhere else restarts the stream from that offset; replies to
+/// Treads already sent for the old position are discarded.
+/// Like the session it uses, read-ahead belongs to the session's loop.
+
+/// @brief The default greatest number of Treads kept in flight for a fid.
+#define RFS__READAHEAD_DEPTH      16
+
+/// @brief The number of sequential reads after which read-ahead starts.
+#define RFS__READAHEAD_TRIGGER    2
+
+struct rfs__readahead;
+
+/// @brief Called when a read which couldn't be satisfied at once completes.
+/// @param [in] ra The read-ahead the read was made through.
+/// @param [in] ret 0 on success; -EIO if the server replied with Rerror;
+/// -ECANCELED if the read-ahead was closed first; otherwise the error which
+/// failed the Tread.
+/// @param [in] count The number of bytes read; 0 at the end of the file.
+typedef void (*rfs__readahead_cb)(struct rfs__readahead* ra,
+                                  int ret,
+                                  size_t count);
+
+/// @brief Called once a closed read-ahead may be freed.
+/// @param [in] ra The read-ahead which has closed.
+typedef void (*rfs__readahead_close_cb)(struct rfs__readahead* ra);
+
+/// @brief A Tread in the stream, and the data it returned.
+typedef struct rfs__readahead_buf {
+  rfs__9p_call_t call; ///< The request made on the session.
+  rfs__9p_msg_t msg; ///< The Tread.
+  uint64_t sent; ///< The time the Tread was sent, from uv_hrtime().
+  unsigned char* data; ///< The data returned; allocated on first use.
+  uint32_t len; ///< The number of bytes returned.
+  uint32_t pos; ///< The number of bytes already read by the reader.
+  int state; ///< One of RFS__READAHEAD_*.
+  int ret; ///< The result of the Tread, once complete.
+} rfs__readahead_buf_t;
+
+enum {
+  RFS__READAHEAD_FREE, ///< Unused.
+  RFS__READAHEAD_SENT, ///< In flight, as part of the stream.
+  RFS__READAHEAD_DONE, ///< Complete, and waiting to be read.
+  RFS__READAHEAD_STALE ///< In flight, but no longer part of the stream.
+};
+
+/// @brief The read-ahead structure.
+typedef struct rfs__readahead {
+  void* data; ///< Available for the caller's use.
+
+  // private
+  rfs__9p_session_t* session; ///< The session the fid belongs to.
+  uint32_t fid; ///< The fid being read.
+  uint32_t chunk; ///< The count of every Tread.
+
+  /// @brief A ring of Treads; the stream is the queued buffers from head.
+  rfs__readahead_buf_t* bufs;
+  uint32_t nbufs; ///< The size of the ring; the greatest depth.
+  uint32_t head; ///< The buffer holding the data the reader wants next.
+  uint32_t queued; ///< The number of buffers in the stream.
+  uint32_t inflight; ///< The number of Treads awaiting replies.
+
+  uint32_t depth; ///< The number of buffers the stream should have.
+  uint32_t run; ///< The number of sequential reads in a row.
+  uint64_t expect; ///< The offset the reader is expected to read next.
+  uint64_t next; ///< The offset of the next Tread to send.
+  int eof; ///< Set when the stream reached the end of the file.
+
+  uint64_t srtt; ///< The smoothed round trip time in ns; 0 if unknown.
+  uint64_t space; ///< The smoothed ns taken to consume a chunk.
+  uint64_t last; ///< The time of the reader's last read.
+
+  rfs__readahead_cb cb; ///< The callback of the waiting read, if any.
+  unsigned char* buf; ///< The buffer of the waiting read.
+  size_t count; ///< The size of buf.
+
+  rfs__readahead_close_cb close_cb; ///< Called once closed.
+  int closing; ///< Set once closed.
+} rfs__readahead_t;
+
+/// @brief Start read-ahead for an open fid.
+/// @param [in] ra The read-ahead to initialize.
+/// @param [in] session The session the fid belongs to.
+/// @param [in] fid The fid, which must be open for reading.
+/// @param [in] iounit The iounit returned when the fid was opened.
+/// @param [in] msize The msize of the session.
+/// @param [in] depth The greatest number of Treads to keep in flight.
+/// @return 0 on success, -errno on failure.
+int rfs__readahead_init(rfs__readahead_t* ra,
+                        rfs__9p_session_t* session,
+                        uint32_t fid,
+                        uint32_t iounit,
+                        uint32_t msize,
+                        uint32_t depth);
+
+/// @brief Close a read-ahead.
+/// A waiting read completes with -ECANCELED. The read-ahead's memory must
+/// remain valid until cb is called, which may be before this returns.
+/// The fid itself is left open.
+/// @param [in] ra The read-ahead to close.
+/// @param [in] cb Called once the read-ahead has closed; may be NULL.
+void rfs__readahead_close(rfs__readahead_t* ra, rfs__readahead_close_cb cb);
+
+/// @brief Read from the fid.
+/// Like a Tread, fewer bytes than requested may be returned.
+/// @param [in] ra The read-ahead to read through.
+/// @param [in] offset The offset to read from.
+/// @param [out] buf The buffer to read into; it must remain valid until the
+/// read completes.
+/// @param [in] count The size of buf.
+/// @param [out] nread Set to the number of bytes read if the read completed
+/// at once.
+/// @param [in] cb Called when the read completes, unless it completed at
+/// once.
+/// @return 1 if the read completed at once; 0 if cb will be called;
+/// -EBUSY if a read is already waiting; otherwise the error which failed
+/// the Tread.
+int rfs__readahead_read(rfs__readahead_t* ra,
+                        uint64_t offset,
+                        void* buf,
+                        size_t count,
+                        size_t* nread,
+                        rfs__readahead_cb cb);
+
+#endif
@@ -0,0 +1,1122 @@
+#include "rfs_srv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/// @brief The initial number of fid table chains; a power of 2.
+#define SRV_FIDBUCKETS 16
+
+/// @brief The largest message accepted before the msize is negotiated.
+#define SRV_MINMSIZE 8192
+
+/// @brief The arena chunk size of decoded T-messages. Larger frames are
+/// given a chunk of their own, which isn't kept when the request is reused.
+#define SRV_MSGCHUNK 8192
+
+static void srv_conn_close(rfs__srv_conn_t* conn);
+
+/// @brief Check whether a descriptor is a TCP socket rather than a unix
+/// socket or pipe.
+static int srv_fd_is_tcp(int fd) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+
+  if(getsockname(fd, (struct sockaddr*) &addr, &len) < 0)
+    return 0;
+
+  return (addr.ss_family == AF_INET || addr.ss_family == AF_INET6);
+}
+
+/// @brief Close the server once everything it owns has closed.
+static void srv_maybe_closed(rfs__srv_t* srv) {
+  if(!srv->closing || srv->listening || srv->conns != NULL)
+    return;
+
+  while(srv->free != NULL) {
+    rfs__srv_req_t* req = srv->free;
+    srv->free = req->next;
+    free(req);
+  }
+
+  srv->nfree = 0;
+  rfs__9p_pool_free(&(srv->msgs));
+  rfs__bufpool_free(&(srv->bufs));
+
+  if(srv->close_cb != NULL)
+    srv->close_cb(srv);
+}
+
+/// @brief Find the chain a fid belongs in.
+static rfs__srv_fid_t** srv_fid_chain(rfs__srv_conn_t* conn, uint32_t fid) {
+  return &(conn->fids[(fid ^ (fid >> 16)) & conn->fidmask]);
+}
+
+/// @brief Find a fid in a connection's table.
+/// @return The fid; NULL if the client hasn't established it.
+static rfs__srv_fid_t* srv_fid_find(rfs__srv_conn_t* conn, uint32_t fid) {
+  rfs__srv_fid_t* f = *srv_fid_chain(conn, fid);
+
+  while(f != NULL && f->fid != fid)
+    f = f->next;
+
+  return f;
+}
+
+/// @brief Double the number of chains in a connection's fid table.
+/// This is best effort; if there's no memory the chains just grow longer.
+static void srv_fid_grow(rfs__srv_conn_t* conn) {
+  uint32_t n = (conn->fidmask + 1) * 2;
+  rfs__srv_fid_t** fids = calloc(n, sizeof(rfs__srv_fid_t*));
+
+  if(fids == NULL)
+    return;
+
+  rfs__srv_fid_t** old = conn->fids;
+  uint32_t oldn = conn->fidmask + 1;
+
+  conn->fids = fids;
+  conn->fidmask = n - 1;
+
+  for(uint32_t i = 0; i < oldn; ++i) {
+    while(old[i] != NULL) {
+      rfs__srv_fid_t* f = old[i];
+      rfs__srv_fid_t** chain = srv_fid_chain(conn, f->fid);
+
+      old[i] = f->next;
+      f->next = *chain;
+      *chain = f;
+    }
+  }
+
+  free(old);
+}
+
+/// @brief Add a fid to a connection's table; it mustn't already be there.
+/// @return The fid, referenced by the table; NULL if out of memory.
+static rfs__srv_fid_t* srv_fid_new(rfs__srv_conn_t* conn, uint32_t fid) {
+  rfs__srv_fid_t* f = malloc(sizeof(rfs__srv_fid_t));
+
+  if(f == NULL)
+    return NULL;
+
+  if(conn->nfids > conn->fidmask)
+    srv_fid_grow(conn);
+
+  rfs__srv_fid_t** chain = srv_fid_chain(conn, fid);
+
+  memset(&(f->qid), 0, sizeof(f->qid));
+  f->fid = fid;
+  f->aux = NULL;
+  f->omode = -1;
+  f->conn = conn;
+  f->ref = 1;
+  f->removed = 0;
+  f->next = *chain;
+  *chain = f;
+  conn->nfids++;
+
+  return f;
+}
+
+/// @brief Drop a reference to a fid, destroying it with the last.
+static void srv_fid_unref(rfs__srv_fid_t* f) {
+  if(--f->ref > 0)
+    return;
+
+  const rfs__srv_ops_t* ops = f->conn->srv->ops;
+
+  if(ops->destroyfid != NULL)
+    ops->destroyfid(f);
+
+  free(f);
+}
+
+/// @brief Clunk a fid, removing it from its connection's table.
+/// A fid Tversion has already cleared is left alone, since its number may
+/// since have been reused; a request still holding it may complete later.
+static void srv_fid_remove(rfs__srv_conn_t* conn, rfs__srv_fid_t* f) {
+  if(f->removed)
+    return;
+
+  rfs__srv_fid_t** link = srv_fid_chain(conn, f->fid);
+
+  while(*link != f)
+    link = &((*link)->next);
+
+  *link = f->next;
+  f->next = NULL;
+  f->removed = 1;
+  conn->nfids--;
+
+  srv_fid_unref(f);
+}
+
+/// @brief Clunk every fid of a connection.
+static void srv_fids_clear(rfs__srv_conn_t* conn) {
+  for(uint32_t i = 0; i <= conn->fidmask; ++i) {
+    while(conn->fids[i] != NULL)
+      srv_fid_remove(conn, conn->fids[i]);
+  }
+}
+
+/// @brief Drop a reference to a connection, freeing it with the last.
+static void srv_conn_unref(rfs__srv_conn_t* conn) {
+  if(--conn->refs > 0)
+    return;
+
+  rfs__srv_t* srv = conn->srv;
+
+  srv_fids_clear(conn);
+  free(conn->fids);
+  rfs__9p_decoder_reset(&(conn->dec));
+  rfs__bufpool_put(&(srv->bufs), conn->rbuf, RFS__SRV_READSZ);
+
+  if(conn->prev != NULL)
+    conn->prev->next = conn->next;
+  else
+    srv->conns = conn->next;
+
+  if(conn->next != NULL)
+    conn->next->prev = conn->prev;
+
+  free(conn);
+  srv_maybe_closed(srv);
+}
+
+static void srv_on_alloc(uv_handle_t* handle, size_t hint, uv_buf_t* buf);
+static void srv_on_read(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf);
+
+/// @brief Start reading from a connection again once enough of its
+/// requests have completed.
+static void srv_conn_resume(rfs__srv_conn_t* conn) {
+  if(conn->reading || conn->closing || conn->nreqs > RFS__SRV_MAXREQS / 2)
+    return;
+
+  if(uv_read_start(&(conn->h.stream), srv_on_alloc, srv_on_read) < 0)
+    srv_conn_close(conn);
+  else
+    conn->reading = 1;
+}
+
+/// @brief Take a request for a connection and add it to the outstanding
+/// requests.
+/// @return The request; NULL if out of memory.
+static rfs__srv_req_t* srv_req_get(rfs__srv_conn_t* conn) {
+  rfs__srv_t* srv = conn->srv;
+  rfs__srv_req_t* req = srv->free;
+
+  if(req != NULL) {
+    srv->free = req->next;
+    srv->nfree--;
+  }
+  else if((req = malloc(sizeof(rfs__srv_req_t))) == NULL) {
+    return NULL;
+  }
+
+  if((req->in = rfs__9p_pool_get(&(srv->msgs))) == NULL) {
+    free(req);
+    return NULL;
+  }
+
+  req->data = NULL;
+  req->ifcall = &(req->in->msg);
+  rfs__9p_msg_init(&(req->ofcall));
+  rfs__9p_stat_init(&(req->stat));
+  req->conn = conn;
+  req->fid = NULL;
+  req->newfid = NULL;
+  req->release = NULL;
+  req->release_data = NULL;
+  req->framelen = 0;
+  req->buf = req->hdr;
+  req->bufsize = 0;
+  req->flush = NULL;
+  req->responded = 0;
+  req->flushed = 0;
+
+  req->prev = NULL;
+  req->next = conn->reqs;
+
+  if(conn->reqs != NULL)
+    conn->reqs->prev = req;
+
+  conn->reqs = req;
+  conn->nreqs++;
+  conn->refs++;
+
+  return req;
+}
+
+/// @brief Remove a request from its connection's outstanding requests.
+static void srv_req_unlink(rfs__srv_req_t* req) {
+  rfs__srv_conn_t* conn = req->conn;
+
+  if(req->prev != NULL)
+    req->prev->next = req->next;
+  else
+    conn->reqs = req->next;
+
+  if(req->next != NULL)
+    req->next->prev = req->prev;
+
+  req->prev = NULL;
+  req->next = NULL;
+}
+
+/// @brief Release a request which has been responded to.
+static void srv_req_free(rfs__srv_req_t* req) {
+  rfs__srv_conn_t* conn = req->conn;
+  rfs__srv_t* srv = conn->srv;
+
+  if(req->release != NULL)
+    req->release(req->release_data);
+
+  if(req->buf != req->hdr)
+    rfs__bufpool_put(&(srv->bufs), req->buf, req->bufsize);
+
+  if(req->fid != NULL)
+    srv_fid_unref(req->fid);
+
+  if(req->newfid != NULL)
+    srv_fid_unref(req->newfid);
+
+  // don't keep a chunk sized for one large Twrite in the pool
+  if(req->framelen > SRV_MSGCHUNK)
+    rfs__arena_free(&(req->in->arena));
+
+  rfs__9p_pool_put(&(srv->msgs), req->in);
+
+  if(srv->nfree < RFS__SRV_MAXFREE) {
+    req->next = srv->free;
+    srv->free = req;
+    srv->nfree++;
+  }
+  else {
+    free(req);
+  }
+
+  conn->nreqs--;
+  srv_conn_resume(conn);
+  srv_conn_unref(conn);
+}
+
+/// @brief Called once a reply has been written.
+static void srv_on_write(uv_write_t* write, int status) {
+  rfs__srv_req_t* req = write->data;
+
+  if(status < 0)
+    srv_conn_close(req->conn);
+
+  srv_req_free(req);
+}
+
+/// @brief Pack a reply and write it to the connection.
+/// @return 0 on success, -errno on failure.
+static int srv_send(rfs__srv_req_t* req) {
+  rfs__srv_conn_t* conn = req->conn;
+
+  // payloads are referenced rather than copied, so only replies with a
+  // large string argument (such as a long Rerror) need a bigger buffer
+  struct iovec iov[2];
+  int n = rfs__9p_msg_pack_iov(&(req->ofcall), req->hdr, sizeof(req->hdr),
+                               iov);
+
+  if(n == 0) {
+    uint32_t size = rfs__9p_msg_size(&(req->ofcall));
+
+    if(size == 0)
+      return -EINVAL;
+
+    if((req->buf = rfs__bufpool_get(&(conn->srv->bufs), size)) == NULL) {
+      req->buf = req->hdr;
+      return -ENOMEM;
+    }
+
+    req->bufsize = size;
+    n = rfs__9p_msg_pack_iov(&(req->ofcall), req->buf, size, iov);
+    assert(n > 0);
+  }
+
+  uv_buf_t bufs[2];
+  for(int i = 0; i < n; ++i)
+    bufs[i] = uv_buf_init(iov[i].iov_base, (unsigned int) iov[i].iov_len);
+
+  req->write.data = req;
+
+  return uv_write(&(req->write), &(conn->h.stream), bufs, (unsigned int) n,
+                  srv_on_write);
+}
+
+/// @brief Ask the file tree to abandon a request, if it hasn't already been.
+static void srv_req_flush(rfs__srv_req_t* req) {
+  const rfs__srv_ops_t* ops = req->conn->srv->ops;
+
+  // a Tflush is answered along with the request it waits for
+  if(req->flushed || req->ifcall->type == RFS__9P_TFLUSH)
+    return;
+
+  req->flushed = 1;
+
+  if(ops->flush != NULL)
+    ops->flush(req);
+}
+
+/// @brief Release a connection's transport's reference once it has closed.
+static void srv_on_conn_close(uv_handle_t* handle) {
+  srv_conn_unref(handle->data);
+}
+
+/// @brief Stop serving a connection.
+/// Requests still with the file tree are flushed, and their replies are
+/// discarded; the connection is freed once they have all been released.
+static void srv_conn_close(rfs__srv_conn_t* conn) {
+  if(conn->closing)
+    return;
+
+  conn->closing = 1;
+
+  if(conn->reading) {
+    uv_read_stop(&(conn->h.stream));
+    conn->reading = 0;
+  }
+
+  // flushing may complete any number of requests, so start from the
+  // beginning of the list each time
+  for(;;) {
+    rfs__srv_req_t* req = conn->reqs;
+
+    while(req != NULL
+       && (req->flushed || req->ifcall->type == RFS__9P_TFLUSH))
+      req = req->next;
+
+    if(req == NULL)
+      break;
+
+    srv_req_flush(req);
+  }
+
+  uv_close(&(conn->h.handle), srv_on_conn_close);
+}
+
+/// @brief Finish a walk, keeping newfid only if every name was walked.
+/// @return The error to respond with; NULL if the walk succeeded.
+static const char* srv_walked(rfs__srv_req_t* req, const char* error) {
+  uint16_t nwname = req->ifcall->params.twalk.nwname;
+  uint16_t nwqid = req->ofcall.params.rwalk.nwqid;
+
+  // failing to walk the first name is an error rather than an empty Rwalk
+  if(error == NULL && nwqid == 0 && nwname > 0)
+    error = "file does not exist";
+
+  if(req->newfid == NULL)
+    return error;
+
+  if(error != NULL || nwqid < nwname) {
+    if(req->newfid != req->fid)
+      srv_fid_remove(req->conn, req->newfid);
+  }
+  else if(nwname > 0 && !req->newfid->removed) {
+    req->newfid->qid = req->ofcall.params.rwalk.wqid[nwqid - 1];
+  }
+
+  return error;
+}
+
+void rfs__srv_respond(rfs__srv_req_t* req, const char* error) {
+  assert(req != NULL);
+  assert(!req->responded);
+
+  rfs__srv_conn_t* conn = req->conn;
+  const rfs__9p_msg_t* in = req->ifcall;
+
+  req->responded = 1;
+  srv_req_unlink(req);
+
+  // requests which failed the protocol's checks may not have a fid yet,
+  // and a fid Tversion cleared while its request was with the tree keeps
+  // whatever state it had
+  switch(req->fid != NULL ? in->type : 0) {
+    case RFS__9P_TATTACH:
+      if(error != NULL)
+        srv_fid_remove(conn, req->fid);
+      else if(!req->fid->removed)
+        req->fid->qid = req->ofcall.params.rattach.qid;
+      break;
+
+    case RFS__9P_TWALK:
+      error = srv_walked(req, error);
+      break;
+
+    case RFS__9P_TOPEN:
+      if(error == NULL && !req->fid->removed) {
+        req->fid->qid = req->ofcall.params.ropen.qid;
+        req->fid->omode = in->params.topen.mode;
+      }
+      break;
+
+    case RFS__9P_TCREATE:
+      if(error == NULL && !req->fid->removed) {
+        req->fid->qid = req->ofcall.params.rcreate.qid;
+        req->fid->omode = in->params.tcreate.mode;
+      }
+      break;
+
+    case RFS__9P_TREAD:
+      assert(error != NULL
+          || req->ofcall.params.rread.count <= in->params.tread.count);
+      break;
+  }
+
+  if(error != NULL) {
+    req->ofcall.type = RFS__9P_RERROR;
+    req->ofcall.params.rerror.ename = rfs__9p_str(error);
+  }
+
+  rfs__srv_req_t* flush = req->flush;
+  req->flush = NULL;
+
+  // the reply is packed before this returns, so the error string is copied
+  if(conn->closing) {
+    srv_req_free(req);
+  }
+  else if(srv_send(req) < 0) {
+    srv_conn_close(conn);
+    srv_req_free(req);
+  }
+
+  // an Rflush must follow the reply to the request it flushed
+  while(flush != NULL) {
+    rfs__srv_req_t* next = flush->flush;
+    flush->flush = NULL;
+    rfs__srv_respond(flush, NULL);
+    flush = next;
+  }
+}
+
+/// @brief Pass a request to a file tree handler.
+static void srv_call(rfs__srv_req_t* req, void (*op)(rfs__srv_req_t*)) {
+  if(op == NULL)
+    rfs__srv_respond(req, "operation not supported");
+  else
+    op(req);
+}
+
+/// @brief Find the fid a request is on, holding it for the request.
+/// @return The fid; NULL if the client hasn't established it, in which case
+/// the request has been responded to.
+static rfs__srv_fid_t* srv_req_fid(rfs__srv_req_t* req, uint32_t fid) {
+  rfs__srv_fid_t* f = srv_fid_find(req->conn, fid);
+
+  if(f == NULL) {
+    rfs__srv_respond(req, "unknown fid");
+    return NULL;
+  }
+
+  f->ref++;
+  req->fid = f;
+
+  return f;
+}
+
+/// @brief Agree on an msize and version, aborting everything outstanding.
+static void srv_version(rfs__srv_req_t* req) {
+  static const char version[] = RFS__SRV_VERSION;
+
+  rfs__srv_conn_t* conn = req->conn;
+  const rfs__9p_str_t* v = &(req->ifcall->params.version.version);
+  uint32_t msize = req->ifcall->params.version.msize;
+
+  if(msize > conn->srv->msize)
+    msize = conn->srv->msize;
+
+  if(msize <= RFS__9P_IOHDRSZ) {
+    rfs__srv_respond(req, "msize too small");
+    return;
+  }
+
+  // Tversion starts a new session, so nothing from the old one survives
+  for(;;) {
+    rfs__srv_req_t* r = conn->reqs;
+
+    while(r != NULL && (r == req || r->flushed
+                     || r->ifcall->type == RFS__9P_TFLUSH))
+      r = r->next;
+
+    if(r == NULL)
+      break;
+
+    srv_req_flush(r);
+  }
+
+  srv_fids_clear(conn);
+
+  req->ofcall.params.version.msize = msize;
+
+  // a version with a suffix (such as 9P2000.u) is answered with the base
+  if(v->len >= sizeof(version) - 1
+  && memcmp(v->str, version, sizeof(version) - 1) == 0
+  && (v->len == sizeof(version) - 1 || v->str[sizeof(version) - 1] == '.')) {
+    conn->msize = msize;
+    conn->dec.msize = msize;
+    req->ofcall.params.version.version = rfs__9p_str(version);
+  }
+  else {
+    conn->msize = 0;
+    req->ofcall.params.version.version = rfs__9p_str("unknown");
+  }
+
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Wait for the request being flushed, asking the tree to abandon it.
+static void srv_flush(rfs__srv_req_t* req) {
+  uint16_t oldtag = req->ifcall->params.tflush.oldtag;
+  rfs__srv_req_t* old = req->conn->reqs;
+
+  while(old != NULL && (old == req || old->ifcall->tag != oldtag))
+    old = old->next;
+
+  if(old == NULL) {
+    rfs__srv_respond(req, NULL);
+    return;
+  }
+
+  req->flush = old->flush;
+  old->flush = req;
+
+  srv_req_flush(old);
+}
+
+static void srv_attach(rfs__srv_req_t* req) {
+  rfs__srv_conn_t* conn = req->conn;
+  uint32_t fid = req->ifcall->params.tattach.fid;
+
+  if(req->ifcall->params.tattach.afid != RFS__9P_NOFID) {
+    rfs__srv_respond(req, "authentication not required");
+    return;
+  }
+
+  if(srv_fid_find(conn, fid) != NULL) {
+    rfs__srv_respond(req, "fid in use");
+    return;
+  }
+
+  if((req->fid = srv_fid_new(conn, fid)) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+
+  req->fid->ref++;
+  srv_call(req, conn->srv->ops->attach);
+}
+
+static void srv_walk(rfs__srv_req_t* req) {
+  rfs__srv_conn_t* conn = req->conn;
+  uint32_t newfid = req->ifcall->params.twalk.newfid;
+  uint16_t nwname = req->ifcall->params.twalk.nwname;
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.twalk.fid);
+
+  if(f == NULL)
+    return;
+
+  if(f->omode != -1) {
+    rfs__srv_respond(req, "fid is open");
+    return;
+  }
+
+  if(nwname > 0 && !(f->qid.type & RFS_QTDIR)) {
+    rfs__srv_respond(req, "not a directory");
+    return;
+  }
+
+  if(newfid == f->fid) {
+    req->newfid = f;
+  }
+  else if(srv_fid_find(conn, newfid) != NULL) {
+    rfs__srv_respond(req, "fid in use");
+    return;
+  }
+  else if((req->newfid = srv_fid_new(conn, newfid)) == NULL) {
+    rfs__srv_respond(req, "out of memory");
+    return;
+  }
+  else {
+    req->newfid->qid = f->qid;
+  }
+
+  req->newfid->ref++;
+
+  if(req->newfid == f && nwname == 0)
+    rfs__srv_respond(req, NULL);
+  else
+    srv_call(req, conn->srv->ops->walk);
+}
+
+static void srv_open(rfs__srv_req_t* req) {
+  uint8_t mode = req->ifcall->params.topen.mode;
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.topen.fid);
+
+  if(f == NULL)
+    return;
+
+  if(f->omode != -1) {
+    rfs__srv_respond(req, "fid already open");
+    return;
+  }
+
+  if((f->qid.type & RFS_QTDIR)
+  && (((mode & 3) != RFS__9P_OREAD && (mode & 3) != RFS__9P_OEXEC)
+   || (mode & RFS__9P_OTRUNC))) {
+    rfs__srv_respond(req, "is a directory");
+    return;
+  }
+
+  req->ofcall.params.ropen.qid = f->qid;
+  req->ofcall.params.ropen.iounit = 0;
+
+  if(req->conn->srv->ops->open == NULL)
+    rfs__srv_respond(req, NULL);
+  else
+    req->conn->srv->ops->open(req);
+}
+
+static void srv_create(rfs__srv_req_t* req) {
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.tcreate.fid);
+
+  if(f == NULL)
+    return;
+
+  if(f->omode != -1) {
+    rfs__srv_respond(req, "fid already open");
+    return;
+  }
+
+  if(!(f->qid.type & RFS_QTDIR)) {
+    rfs__srv_respond(req, "not a directory");
+    return;
+  }
+
+  srv_call(req, req->conn->srv->ops->create);
+}
+
+static void srv_read(rfs__srv_req_t* req) {
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.tread.fid);
+
+  if(f == NULL)
+    return;
+
+  if(f->omode == -1 || (f->omode & 3) == RFS__9P_OWRITE) {
+    rfs__srv_respond(req, "fid not open for reading");
+    return;
+  }
+
+  // the reply must fit in the msize
+  uint32_t max = req->conn->msize - RFS__9P_IOHDRSZ;
+
+  if(req->in->msg.params.tread.count > max)
+    req->in->msg.params.tread.count = max;
+
+  srv_call(req, req->conn->srv->ops->read);
+}
+
+static void srv_write(rfs__srv_req_t* req) {
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.twrite.fid);
+
+  if(f == NULL)
+    return;
+
+  if((f->omode & 3) != RFS__9P_OWRITE && (f->omode & 3) != RFS__9P_ORDWR) {
+    rfs__srv_respond(req, "fid not open for writing");
+    return;
+  }
+
+  srv_call(req, req->conn->srv->ops->write);
+}
+
+static void srv_clunk(rfs__srv_req_t* req) {
+  rfs__srv_fid_t* f = srv_fid_find(req->conn, req->ifcall->params.tclunk.fid);
+
+  if(f == NULL) {
+    rfs__srv_respond(req, "unknown fid");
+    return;
+  }
+
+  srv_fid_remove(req->conn, f);
+  rfs__srv_respond(req, NULL);
+}
+
+static void srv_remove(rfs__srv_req_t* req) {
+  rfs__srv_fid_t* f = srv_req_fid(req, req->ifcall->params.tremove.fid);
+
+  if(f == NULL)
+    return;
+
+  srv_fid_remove(req->conn, f);
+  srv_call(req, req->conn->srv->ops->remove);
+}
+
+static void srv_stat(rfs__srv_req_t* req) {
+  if(srv_req_fid(req, req->ifcall->params.tstat.fid) == NULL)
+    return;
+
+  req->ofcall.params.rstat.stat = &(req->stat);
+  srv_call(req, req->conn->srv->ops->stat);
+}
+
+static void srv_wstat(rfs__srv_req_t* req) {
+  if(srv_req_fid(req, req->ifcall->params.twstat.fid) == NULL)
+    return;
+
+  srv_call(req, req->conn->srv->ops->wstat);
+}
+
+/// @brief Decode a frame and dispatch the request.
+static void srv_dispatch(rfs__srv_conn_t* conn,
+                         const unsigned char* frame,
+                         size_t framelen) {
+  rfs__srv_req_t* req = srv_req_get(conn);
+
+  if(req == NULL) {
+    srv_conn_close(conn);
+    return;
+  }
+
+  req->framelen = framelen;
+
+  // without a tag there's no way to answer a message which can't be decoded
+  if(rfs__9p_req_unpack(req->in, frame, framelen) < 0) {
+    req->responded = 1;
+    srv_req_unlink(req);
+    srv_conn_close(conn);
+    srv_req_free(req);
+    return;
+  }
+
+  req->ofcall.type = (uint8_t) (req->ifcall->type + 1);
+  req->ofcall.tag = req->ifcall->tag;
+
+  if(conn->msize == 0 && req->ifcall->type != RFS__9P_TVERSION) {
+    rfs__srv_respond(req, "version not negotiated");
+    return;
+  }
+
+  switch(req->ifcall->type) {
+    case RFS__9P_TVERSION:
+      srv_version(req);
+      break;
+
+    case RFS__9P_TAUTH:
+      rfs__srv_respond(req, "authentication not required");
+      break;
+
+    case RFS__9P_TFLUSH:
+      srv_flush(req);
+      break;
+
+    case RFS__9P_TATTACH:
+      srv_attach(req);
+      break;
+
+    case RFS__9P_TWALK:
+      srv_walk(req);
+      break;
+
+    case RFS__9P_TOPEN:
+      srv_open(req);
+      break;
+
+    case RFS__9P_TCREATE:
+      srv_create(req);
+      break;
+
+    case RFS__9P_TREAD:
+      srv_read(req);
+      break;
+
+    case RFS__9P_TWRITE:
+      srv_write(req);
+      break;
+
+    case RFS__9P_TCLUNK:
+      srv_clunk(req);
+      break;
+
+    case RFS__9P_TREMOVE:
+      srv_remove(req);
+      break;
+
+    case RFS__9P_TSTAT:
+      srv_stat(req);
+      break;
+
+    case RFS__9P_TWSTAT:
+      srv_wstat(req);
+      break;
+
+    default:
+      rfs__srv_respond(req, "bad message type");
+      break;
+  }
+}
+
+/// @brief Provide libuv with the buffer to read into.
+/// While a frame larger than the read buffer is arriving, the rest of it is
+/// read straight into the decoder rather than copied there.
+static void srv_on_alloc(uv_handle_t* handle, size_t hint, uv_buf_t* buf) {
+  (void) hint;
+
+  rfs__srv_conn_t* conn = handle->data;
+  unsigned char* space;
+  size_t len = rfs__9p_decoder_space(&(conn->dec), &space);
+
+  if(len >= RFS__SRV_READSZ)
+    *buf = uv_buf_init((char*) space, (unsigned int) len);
+  else
+    *buf = uv_buf_init((char*) conn->rbuf, RFS__SRV_READSZ);
+}
+
+/// @brief Dispatch every request in the bytes read from a connection.
+static void srv_on_read(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  rfs__srv_conn_t* conn = stream->data;
+
+  if(nread < 0) {
+    srv_conn_close(conn);
+    return;
+  }
+
+  if(buf->base != (char*) conn->rbuf)
+    rfs__9p_decoder_fill(&(conn->dec), (size_t) nread);
+  else
+    rfs__9p_decoder_feed(&(conn->dec), (const unsigned char*) buf->base,
+                         (size_t) nread);
+
+  while(!conn->closing) {
+    const unsigned char* frame;
+    size_t framelen;
+    int ret = rfs__9p_decoder_next(&(conn->dec), &frame, &framelen);
+
+    if(ret == 0)
+      break;
+
+    if(ret < 0) {
+      srv_conn_close(conn);
+      return;
+    }
+
+    srv_dispatch(conn, frame, framelen);
+  }
+
+  // stop reading from a client which isn't reading its replies
+  if(conn->reading && conn->nreqs >= RFS__SRV_MAXREQS) {
+    uv_read_stop(&(conn->h.stream));
+    conn->reading = 0;
+  }
+}
+
+/// @brief Create a connection; its transport is initialized by the caller.
+/// @return The connection; NULL if out of memory.
+static rfs__srv_conn_t* srv_conn_new(rfs__srv_t* srv) {
+  rfs__srv_conn_t* conn = malloc(sizeof(rfs__srv_conn_t));
+
+  if(conn == NULL)
+    return NULL;
+
+  conn->fids = calloc(SRV_FIDBUCKETS, sizeof(rfs__srv_fid_t*));
+  conn->rbuf = rfs__bufpool_get(&(srv->bufs), RFS__SRV_READSZ);
+
+  if(conn->fids == NULL || conn->rbuf == NULL) {
+    free(conn->fids);
+    rfs__bufpool_put(&(srv->bufs), conn->rbuf, RFS__SRV_READSZ);
+    free(conn);
+    return NULL;
+  }
+
+  conn->data = NULL;
+  conn->srv = srv;
+  rfs__9p_decoder_init(&(conn->dec), SRV_MINMSIZE);
+  conn->dec.pool = &(srv->bufs);
+  conn->msize = 0;
+  conn->fidmask = SRV_FIDBUCKETS - 1;
+  conn->nfids = 0;
+  conn->reqs = NULL;
+  conn->nreqs = 0;
+  conn->refs = 1;
+  conn->reading = 0;
+  conn->closing = 0;
+
+  conn->prev = NULL;
+  conn->next = srv->conns;
+
+  if(srv->conns != NULL)
+    srv->conns->prev = conn;
+
+  srv->conns = conn;
+
+  return conn;
+}
+
+/// @brief Start reading requests from a connection.
+/// @return 0 on success, -errno on failure.
+static int srv_conn_start(rfs__srv_conn_t* conn) {
+  // replies are small and latency bound, so don't let Nagle hold them
+  if(conn->h.handle.type == UV_TCP)
+    uv_tcp_nodelay(&(conn->h.tcp), 1);
+
+  int ret = uv_read_start(&(conn->h.stream), srv_on_alloc, srv_on_read);
+
+  if(ret == 0)
+    conn->reading = 1;
+
+  return ret;
+}
+
+/// @brief Accept a connection from the listener.
+static void srv_on_connection(uv_stream_t* listener, int status) {
+  rfs__srv_t* srv = listener->data;
+
+  if(status < 0 || srv->closing)
+    return;
+
+  rfs__srv_conn_t* conn = srv_conn_new(srv);
+
+  if(conn == NULL)
+    return;
+
+  if(listener->type == UV_TCP)
+    uv_tcp_init(srv->loop, &(conn->h.tcp));
+  else
+    uv_pipe_init(srv->loop, &(conn->h.pipe), 0);
+
+  conn->h.handle.data = conn;
+
+  if(uv_accept(listener, &(conn->h.stream)) < 0 || srv_conn_start(conn) < 0)
+    srv_conn_close(conn);
+}
+
+/// @brief Note that the listener has closed.
+static void srv_on_listener_close(uv_handle_t* handle) {
+  rfs__srv_t* srv = handle->data;
+
+  srv->listening = 0;
+  srv_maybe_closed(srv);
+}
+
+void rfs__srv_init(rfs__srv_t* srv,
+                   uv_loop_t* loop,
+                   const rfs__srv_ops_t* ops,
+                   uint32_t msize) {
+  assert(srv != NULL);
+  assert(loop != NULL);
+  assert(ops != NULL);
+  assert(msize > RFS__9P_IOHDRSZ && msize <= RFS__BUFPOOL_MAXSZ);
+
+  srv->loop = loop;
+  srv->ops = ops;
+  srv->msize = msize;
+  srv->listening = 0;
+  srv->conns = NULL;
+
+  rfs__bufpool_init(&(srv->bufs), RFS__SRV_MAXFREE, RFS__BUFPOOL_HUGE);
+  rfs__9p_pool_init(&(srv->msgs), RFS__SRV_MAXFREE, SRV_MSGCHUNK);
+
+  srv->free = NULL;
+  srv->nfree = 0;
+  srv->closing = 0;
+  srv->close_cb = NULL;
+}
+
+int rfs__srv_listen(rfs__srv_t* srv, int fd) {
+  assert(srv != NULL);
+  assert(!srv->listening && !srv->closing);
+
+  int ret;
+
+  if(srv_fd_is_tcp(fd)) {
+    uv_tcp_init(srv->loop, &(srv->listener.tcp));
+    ret = uv_tcp_open(&(srv->listener.tcp), fd);
+  }
+  else {
+    uv_pipe_init(srv->loop, &(srv->listener.pipe), 0);
+    ret = uv_pipe_open(&(srv->listener.pipe), fd);
+  }
+
+  srv->listener.handle.data = srv;
+  srv->listening = 1;
+
+  if(ret < 0)
+    close(fd);
+  else
+    ret = uv_listen(&(srv->listener.stream), SOMAXCONN, srv_on_connection);
+
+  if(ret < 0)
+    uv_close(&(srv->listener.handle), srv_on_listener_close);
+
+  return ret;
+}
+
+int rfs__srv_accept(rfs__srv_t* srv, int fd) {
+  assert(srv != NULL);
+  assert(!srv->closing);
+
+  rfs__srv_conn_t* conn = srv_conn_new(srv);
+
+  if(conn == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+
+  int ret;
+
+  if(srv_fd_is_tcp(fd)) {
+    uv_tcp_init(srv->loop, &(conn->h.tcp));
+    ret = uv_tcp_open(&(conn->h.tcp), fd);
+  }
+  else {
+    uv_pipe_init(srv->loop, &(conn->h.pipe), 0);
+    ret = uv_pipe_open(&(conn->h.pipe), fd);
+  }
+
+  conn->h.handle.data = conn;
+
+  if(ret < 0)
+    close(fd);
+  else
+    ret = srv_conn_start(conn);
+
+  if(ret < 0)
+    srv_conn_close(conn);
+
+  return ret;
+}
+
+void rfs__srv_close(rfs__srv_t* srv, rfs__srv_close_cb cb) {
+  assert(srv != NULL);
+  assert(!srv->closing);
+
+  srv->closing = 1;
+  srv->close_cb = cb;
+
+  if(srv->listening)
+    uv_close(&(srv->listener.handle), srv_on_listener_close);
+
+  // connections are only freed once their transport has closed, so the
+  // list can't change underneath this
+  for(rfs__srv_conn_t* conn = srv->conns; conn != NULL; conn = conn->next)
+    srv_conn_close(conn);
+
+  srv_maybe_closed(srv);
+}
+
+void rfs__srv_disconnect(rfs__srv_conn_t* conn) {
+  assert(conn != NULL);
+
+  srv_conn_close(conn);
+}
@@ -0,0 +1,265 @@
+#ifndef RFS_SRV_H
+#define RFS_SRV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "rfs_9p_pool.h"
+#include "rfs_9p_wire.h"
+#include "rfs_bufpool.h"
+
+/// @file A 9P server.
+/// A server runs on one event loop, accepting connections from a listening
+/// socket or taking already connected descriptors. Each connection splits
+/// its byte stream into frames, decodes every frame into a pooled request
+/// and dispatches it to the handlers of a file tree. The protocol's
+/// bookkeeping (version negotiation, the fid table, open modes, Tflush and
+/// Tclunk) is done here, so a file tree only implements file operations.
+///
+/// A handler completes its request with rfs__srv_respond(), either before
+/// returning or later from the same loop; this is how a read blocks until
+/// there is something to return. Rread payloads are referenced rather than
+/// copied, and the tree is told when the write of the reply has finished
+/// with them.
+///
+/// Everything is owned by the loop's thread, so nothing here is locked.
+
+/// @brief The default msize offered to clients.
+#define RFS__SRV_MSIZE ((8 << 20) + RFS__9P_IOHDRSZ)
+
+/// @brief The size of the buffer each read from a connection is made into.
+#define RFS__SRV_READSZ 65536
+
+/// @brief The most requests a connection may have outstanding before the
+/// server stops reading from it.
+#define RFS__SRV_MAXREQS 256
+
+/// @brief The most idle requests and buffers the server keeps for reuse.
+#define RFS__SRV_MAXFREE 64
+
+/// @brief The version the server speaks.
+#define RFS__SRV_VERSION "9P2000"
+
+struct rfs__srv;
+struct rfs__srv_conn;
+struct rfs__srv_req;
+
+/// @brief A fid of a connection.
+typedef struct rfs__srv_fid {
+  uint32_t fid; ///< The client's number for it.
+  rfs_qid_t qid; ///< The file it refers to.
+  void* aux; ///< The file tree's state for the fid; NULL until set.
+  int omode; ///< The mode it was opened with; -1 if it isn't open.
+  struct rfs__srv_conn* conn; ///< The connection it belongs to.
+
+  // private
+  uint32_t ref; ///< Held by the fid table and each request using it.
+  int removed; ///< Set once clunked, or cleared by Tversion.
+  struct rfs__srv_fid* next; ///< The next fid in the hash chain.
+} rfs__srv_fid_t;
+
+/// @brief Called once the reply carrying a payload has been written.
+/// @param [in] data The data the release was registered with.
+typedef void (*rfs__srv_release_cb)(void* data);
+
+/// @brief A request being served.
+/// The file tree fills in ofcall and calls rfs__srv_respond(). Everything
+/// the server presets in ofcall is already valid; only what the operation
+/// returns needs to be set.
+typedef struct rfs__srv_req {
+  void* data; ///< Available for the file tree's use.
+
+  const rfs__9p_msg_t* ifcall; ///< The T-message; valid until responded.
+  rfs__9p_msg_t ofcall; ///< The reply.
+  rfs__9p_stat_t stat; ///< Storage for the stat of an Rstat.
+  struct rfs__srv_conn* conn; ///< The connection it arrived on.
+
+  /// @brief The fid the request is on; NULL for version, auth and flush.
+  rfs__srv_fid_t* fid;
+
+  /// @brief For Twalk, the fid the result is stored in; the same as fid if
+  /// the client walks the fid itself.
+  rfs__srv_fid_t* newfid;
+
+  /// @brief Called once the reply has been written, so that an Rread's
+  /// data may be released; may be NULL.
+  rfs__srv_release_cb release;
+  void* release_data; ///< Passed to release.
+
+  // private
+  rfs__9p_req_t* in; ///< The decoded T-message and its frame.
+  size_t framelen; ///< The size of the T-message's frame.
+  uv_write_t write; ///< Writes the reply.
+  unsigned char* buf; ///< The packed reply; hdr unless it didn't fit.
+  uint32_t bufsize; ///< The size buf was taken from the pool with.
+  struct rfs__srv_req* prev; ///< The previous outstanding request.
+  struct rfs__srv_req* next; ///< The next outstanding or free request.
+  struct rfs__srv_req* flush; ///< The first Tflush waiting for the reply.
+  int responded; ///< Set once rfs__srv_respond() has been called.
+  int flushed; ///< Set once the tree has been asked to abandon it.
+
+  /// @brief Inline storage, sized to hold every reply without a large
+  /// string or payload.
+  unsigned char hdr[256];
+} rfs__srv_req_t;
+
+/// @brief The handlers of a file tree.
+/// Each is called with a request which has passed the protocol's checks,
+/// and must eventually respond to it. A NULL handler responds with an
+/// error, except for those noted.
+typedef struct rfs__srv_ops {
+  /// @brief Attach req->fid to the root of the tree named by the aname,
+  /// setting its aux and ofcall.rattach.qid.
+  void (*attach)(rfs__srv_req_t* req);
+
+  /// @brief Walk from req->fid through ifcall.twalk's names.
+  /// The qid of each element walked is added to ofcall.rwalk. Only if all
+  /// of them are walked (which includes walking none, to clone the fid)
+  /// should req->newfid's aux be set; the server then sets its qid.
+  void (*walk)(rfs__srv_req_t* req);
+
+  /// @brief Open req->fid. ofcall.ropen is preset to its qid and an iounit
+  /// of 0. May be NULL, in which case every open succeeds.
+  void (*open)(rfs__srv_req_t* req);
+
+  /// @brief Create a file in the directory req->fid, which then refers to
+  /// the new file; the tree sets its aux and ofcall.rcreate.qid.
+  void (*create)(rfs__srv_req_t* req);
+
+  /// @brief Read from req->fid, pointing ofcall.rread at the data.
+  /// ifcall.tread.count has already been limited by the msize.
+  void (*read)(rfs__srv_req_t* req);
+
+  /// @brief Write to req->fid, setting ofcall.rwrite.count.
+  void (*write)(rfs__srv_req_t* req);
+
+  /// @brief Describe req->fid's file in ofcall.rstat.stat, which is preset
+  /// to point at req->stat.
+  void (*stat)(rfs__srv_req_t* req);
+
+  /// @brief Change req->fid's file as ifcall.twstat describes.
+  void (*wstat)(rfs__srv_req_t* req);
+
+  /// @brief Remove req->fid's file. The fid is clunked whatever the result.
+  void (*remove)(rfs__srv_req_t* req);
+
+  /// @brief Abandon a request the tree hasn't responded to, such as a
+  /// blocked read, because it was flushed or its connection closed. The
+  /// tree should respond to it promptly, with an error if it did nothing.
+  /// May be NULL if the tree always responds immediately.
+  void (*flush)(rfs__srv_req_t* req);
+
+  /// @brief Release a fid's aux; called once the fid is clunked and no
+  /// request refers to it. May be NULL.
+  void (*destroyfid)(rfs__srv_fid_t* fid);
+} rfs__srv_ops_t;
+
+/// @brief Called once a server has closed.
+/// @param [in] srv The server which has closed.
+typedef void (*rfs__srv_close_cb)(struct rfs__srv* srv);
+
+/// @brief A libuv stream which may be a TCP socket or a pipe.
+typedef union rfs__srv_stream {
+  uv_handle_t handle; ///< The handle.
+  uv_stream_t stream; ///< The stream.
+  uv_tcp_t tcp; ///< For TCP sockets.
+  uv_pipe_t pipe; ///< For unix sockets and pipes.
+} rfs__srv_stream_t;
+
+/// @brief A connection to a client.
+typedef struct rfs__srv_conn {
+  void* data; ///< Available for the file tree's use.
+  struct rfs__srv* srv; ///< The server it was accepted by.
+
+  // private
+  rfs__srv_stream_t h; ///< The transport.
+  rfs__9p_decoder_t dec; ///< Splits the transport's byte stream into frames.
+  unsigned char* rbuf; ///< The buffer transport reads are made into.
+  uint32_t msize; ///< The negotiated msize; 0 until Tversion.
+
+  rfs__srv_fid_t** fids; ///< The fid table's hash chains.
+  uint32_t fidmask; ///< The number of chains minus 1.
+  uint32_t nfids; ///< The number of fids in the table.
+
+  rfs__srv_req_t* reqs; ///< The requests which haven't been responded to.
+  uint32_t nreqs; ///< The number of requests which haven't been freed.
+  uint32_t refs; ///< One for the transport plus one per request.
+  int reading; ///< Set while the transport is being read.
+  int closing; ///< Set once the connection is closing.
+
+  struct rfs__srv_conn* prev; ///< The previous connection of the server.
+  struct rfs__srv_conn* next; ///< The next connection of the server.
+} rfs__srv_conn_t;
+
+/// @brief The server structure.
+typedef struct rfs__srv {
+  void* data; ///< Available for the file tree's use.
+
+  // private
+  uv_loop_t* loop; ///< The loop the server runs on.
+  const rfs__srv_ops_t* ops; ///< The file tree's handlers.
+  uint32_t msize; ///< The largest msize offered.
+
+  rfs__srv_stream_t listener; ///< Accepts connections.
+  int listening; ///< Set while the listener is open.
+  rfs__srv_conn_t* conns; ///< The open connections.
+
+  rfs__bufpool_t bufs; ///< Read buffers, frames and large replies.
+  rfs__9p_pool_t msgs; ///< Decoded T-messages.
+  rfs__srv_req_t* free; ///< Idle requests.
+  uint32_t nfree; ///< The number of idle requests.
+
+  int closing; ///< Set once the server is closing.
+  rfs__srv_close_cb close_cb; ///< Called once the server has closed.
+} rfs__srv_t;
+
+/// @brief Initialize a server.
+/// @param [in] srv The server to initialize.
+/// @param [in] loop The loop which will run the server.
+/// @param [in] ops The file tree's handlers; must outlive the server.
+/// @param [in] msize The largest msize to agree to; at most
+/// RFS__BUFPOOL_MAXSZ.
+void rfs__srv_init(rfs__srv_t* srv,
+                   uv_loop_t* loop,
+                   const rfs__srv_ops_t* ops,
+                   uint32_t msize);
+
+/// @brief Start accepting connections.
+/// @param [in] srv The server to accept connections for.
+/// @param [in] fd A bound TCP or unix stream socket; the server owns it,
+/// and closes it if this fails.
+/// @return 0 on success, -errno on failure.
+int rfs__srv_listen(rfs__srv_t* srv, int fd);
+
+/// @brief Serve a connection which has already been established.
+/// @param [in] srv The server to serve the connection.
+/// @param [in] fd The connected socket or pipe; the server owns it, and
+/// closes it if this fails.
+/// @return 0 on success, -errno on failure.
+int rfs__srv_accept(rfs__srv_t* srv, int fd);
+
+/// @brief Close a server and every connection to it.
+/// Outstanding requests are flushed; the server's memory must remain valid
+/// until cb is called.
+/// @param [in] srv The server to close.
+/// @param [in] cb Called once everything has closed; may be NULL.
+void rfs__srv_close(rfs__srv_t* srv, rfs__srv_close_cb cb);
+
+/// @brief Hang up on a client, as though it had hung up.
+/// Requests still with the file tree are flushed, and once they have been
+/// responded to its fids are destroyed; this may be called from a handler,
+/// including one for a request of the same connection.
+/// @param [in] conn The connection to close.
+void rfs__srv_disconnect(rfs__srv_conn_t* conn);
+
+/// @brief Complete a request.
+/// The reply is sent unless the connection has closed, and the request must
+/// not be touched afterwards. Any Tflush waiting on it is answered too.
+/// @param [in] req The request to complete.
+/// @param [in] error NULL on success; otherwise the error string returned
+/// in Rerror, which need only be valid for the duration of the call.
+void rfs__srv_respond(rfs__srv_req_t* req, const char* error);
+
+#endif
@@ -0,0 +1,375 @@
+#include "rfs_srv_group.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "rfs_util.h"
+
+/// @brief How long to stop accepting for when out of descriptors, in ms.
+#define GROUP_BACKOFF_MS 100
+
+/// @brief Carry a descriptor through a ring, which can't hold NULL.
+#define GROUP_FD_PTR(fd) ((void*) (intptr_t) ((fd) + 1))
+#define GROUP_PTR_FD(p) ((int) ((intptr_t) (p) - 1))
+
+/// @brief Find the address a TCP socket with SO_REUSEPORT set is bound to.
+/// @param [in] fd The socket.
+/// @param [out] addr The address it's bound to.
+/// @param [out] len The length of addr.
+/// @return 1 if fd is such a socket, otherwise 0.
+static int group_fd_reuseport(int fd,
+                              struct sockaddr_storage* addr,
+                              socklen_t* len) {
+#ifdef SO_REUSEPORT
+  int on = 0;
+  socklen_t onlen = sizeof(on);
+
+  *len = sizeof(*addr);
+
+  if(getsockname(fd, (struct sockaddr*) addr, len) < 0
+  || (addr->ss_family != AF_INET && addr->ss_family != AF_INET6))
+    return 0;
+
+  return (getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, &onlen) == 0
+       && on != 0);
+#else
+  (void) fd;
+  (void) addr;
+  (void) len;
+  return 0;
+#endif
+}
+
+/// @brief Create another socket bound to the address of a reused port.
+/// @return The socket on success, -errno on failure.
+static int group_fd_clone(const struct sockaddr_storage* addr,
+                          socklen_t len) {
+#ifdef SO_REUSEPORT
+  int fd = socket(addr->ss_family, SOCK_STREAM, 0);
+  int on = 1;
+
+  if(fd < 0)
+    return -errno;
+
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+  || bind(fd, (const struct sockaddr*) addr, len) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  return fd;
+#else
+  (void) addr;
+  (void) len;
+  return -ENOTSUP;
+#endif
+}
+
+/// @brief Hand a connected descriptor to the next shard.
+/// @return 0 on success, -errno on failure, in which case fd is closed.
+static int group_handoff(rfs__srv_group_t* group, int fd) {
+  uint32_t next = __atomic_fetch_add(&(group->next), 1, __ATOMIC_RELAXED);
+  rfs__srv_shard_t* shard = &(group->shards[next % group->nshards]);
+
+  int ret = rfs__mpsc_push(&(shard->ring), GROUP_FD_PTR(fd));
+
+  if(ret < 0) {
+    close(fd);
+    return ret;
+  }
+
+  uv_async_send(&(shard->doorbell));
+
+  return 0;
+}
+
+static void group_on_acceptor_close(uv_handle_t* handle) {
+  rfs__srv_group_t* group = handle->data;
+
+  close(group->acceptfd);
+  group->acceptfd = -1;
+}
+
+/// @brief Stop accepting connections to hand off.
+static void group_acceptor_close(rfs__srv_group_t* group) {
+  uv_close((uv_handle_t*) &(group->backoff), NULL);
+  uv_close((uv_handle_t*) &(group->acceptor), group_on_acceptor_close);
+}
+
+static void group_on_acceptable(uv_poll_t* poll, int status, int events);
+
+/// @brief Resume accepting once the backoff has passed.
+static void group_on_backoff(uv_timer_t* timer) {
+  rfs__srv_group_t* group = timer->data;
+
+  uv_poll_start(&(group->acceptor), UV_READABLE, group_on_acceptable);
+}
+
+/// @brief Accept every connection waiting on the handed off listener.
+static void group_on_acceptable(uv_poll_t* poll, int status, int events) {
+  rfs__srv_group_t* group = poll->data;
+  (void) events;
+
+  if(status < 0)
+    return;
+
+  for(;;) {
+    int fd = accept(group->acceptfd, NULL, NULL);
+
+    if(fd >= 0) {
+      group_handoff(group, fd);
+      continue;
+    }
+
+    if(errno == EINTR || errno == ECONNABORTED)
+      continue;
+
+    // out of descriptors (EMFILE, ENFILE) or memory, the connection stays
+    // queued and the listener stays readable, so rather than spin, stop
+    // polling it for a while
+    if(errno != EAGAIN && errno != EWOULDBLOCK) {
+      __atomic_add_fetch(&(group->backoffs), 1, __ATOMIC_RELAXED);
+      uv_poll_stop(poll);
+      uv_timer_start(&(group->backoff), group_on_backoff,
+                     GROUP_BACKOFF_MS, 0);
+    }
+
+    break;
+  }
+}
+
+/// @brief Serve the descriptors handed to a shard, and close it once the
+/// group is stopping.
+static void group_on_doorbell(uv_async_t* doorbell) {
+  rfs__srv_shard_t* shard = doorbell->data;
+  rfs__srv_group_t* group = shard->group;
+  int stopping = __atomic_load_n(&(group->stopping), __ATOMIC_ACQUIRE);
+  void* p;
+
+  while((p = rfs__mpsc_pop(&(shard->ring))) != NULL) {
+    if(stopping)
+      close(GROUP_PTR_FD(p));
+    else
+      rfs__srv_accept(&(shard->srv), GROUP_PTR_FD(p));
+  }
+
+  if(!stopping)
+    return;
+
+  if(shard->index == 0 && group->acceptfd >= 0)
+    group_acceptor_close(group);
+
+  rfs__srv_close(&(shard->srv), NULL);
+  uv_close((uv_handle_t*) doorbell, NULL);
+}
+
+/// @brief Run a shard's thread until the group stops.
+static void group_run(void* arg) {
+  rfs__srv_shard_t* shard = arg;
+
+  // pinning is advisory; the shard works either way
+  if(shard->group->flags & RFS__SRV_GROUP_PIN)
+    rfs__setaffinity(shard->index);
+
+  uv_run(&(shard->loop), UV_RUN_DEFAULT);
+}
+
+/// @brief Set up a shard's loop, server and ring.
+/// @return 0 on success, -errno on failure, in which case nothing is left
+/// to free.
+static int group_shard_init(rfs__srv_group_t* group,
+                            uint32_t index,
+                            const rfs__srv_ops_t* ops,
+                            uint32_t msize) {
+  rfs__srv_shard_t* shard = &(group->shards[index]);
+
+  shard->group = group;
+  shard->index = index;
+
+  int ret = rfs__mpsc_init(&(shard->ring), RFS__SRV_GROUP_RING_SIZE);
+
+  if(ret < 0)
+    return ret;
+
+  if((ret = uv_loop_init(&(shard->loop))) < 0) {
+    rfs__mpsc_free(&(shard->ring));
+    return ret;
+  }
+
+  uv_async_init(&(shard->loop), &(shard->doorbell), group_on_doorbell);
+  shard->doorbell.data = shard;
+
+  rfs__srv_init(&(shard->srv), &(shard->loop), ops, msize);
+  shard->srv.data = group->data;
+
+  return 0;
+}
+
+/// @brief Free a shard once its loop has stopped, or if it never ran.
+static void group_shard_free(rfs__srv_shard_t* shard) {
+  // a shard which never ran still has its handles open
+  if(!uv_is_closing((uv_handle_t*) &(shard->doorbell))) {
+    rfs__srv_close(&(shard->srv), NULL);
+    uv_close((uv_handle_t*) &(shard->doorbell), NULL);
+    uv_run(&(shard->loop), UV_RUN_DEFAULT);
+  }
+
+  uv_loop_close(&(shard->loop));
+
+  // anything pushed as the group stopped is still owned here
+  void* p;
+  while((p = rfs__mpsc_pop(&(shard->ring))) != NULL)
+    close(GROUP_PTR_FD(p));
+
+  rfs__mpsc_free(&(shard->ring));
+}
+
+/// @brief Stop the first nstarted shards' threads and free every shard.
+static void group_free(rfs__srv_group_t* group, uint32_t nstarted) {
+  __atomic_store_n(&(group->stopping), 1, __ATOMIC_RELEASE);
+
+  for(uint32_t i = 0; i < nstarted; ++i)
+    uv_async_send(&(group->shards[i].doorbell));
+
+  for(uint32_t i = 0; i < nstarted; ++i)
+    uv_thread_join(&(group->shards[i].thread));
+
+  // shard 0 never ran, so its acceptor is still open
+  if(nstarted == 0 && group->acceptfd >= 0) {
+    group_acceptor_close(group);
+    uv_run(&(group->shards[0].loop), UV_RUN_DEFAULT);
+  }
+
+  for(uint32_t i = 0; i < group->nshards; ++i)
+    group_shard_free(&(group->shards[i]));
+
+  free(group->shards);
+  group->shards = NULL;
+  group->nshards = 0;
+}
+
+/// @brief Have every shard listen on a socket of its own bound to the same
+/// reused port as fd.
+static int group_listen_reuseport(rfs__srv_group_t* group,
+                                  int fd,
+                                  const struct sockaddr_storage* addr,
+                                  socklen_t len) {
+  int ret = rfs__srv_listen(&(group->shards[0].srv), fd);
+
+  for(uint32_t i = 1; i < group->nshards && ret == 0; ++i) {
+    fd = group_fd_clone(addr, len);
+    ret = (fd < 0 ? fd : rfs__srv_listen(&(group->shards[i].srv), fd));
+  }
+
+  return ret;
+}
+
+/// @brief Have shard 0 accept every connection on fd and hand them off.
+static int group_listen_handoff(rfs__srv_group_t* group, int fd) {
+  int flags = fcntl(fd, F_GETFL);
+
+  if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0
+  || listen(fd, SOMAXCONN) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  group->acceptfd = fd;
+
+  uv_poll_init(&(group->shards[0].loop), &(group->acceptor), fd);
+  group->acceptor.data = group;
+  uv_timer_init(&(group->shards[0].loop), &(group->backoff));
+  group->backoff.data = group;
+
+  return uv_poll_start(&(group->acceptor), UV_READABLE, group_on_acceptable);
+}
+
+int rfs__srv_group_start(rfs__srv_group_t* group,
+                         uint32_t nshards,
+                         const rfs__srv_ops_t* ops,
+                         uint32_t msize,
+                         int fd,
+                         int flags) {
+  assert(group != NULL);
+  assert(ops != NULL);
+
+  if(nshards == 0)
+    nshards = rfs__ncpus();
+
+  group->flags = flags;
+  group->next = 0;
+  group->acceptfd = -1;
+  group->backoffs = 0;
+  group->stopping = 0;
+  group->nshards = 0;
+  group->shards = calloc(nshards, sizeof(rfs__srv_shard_t));
+
+  int ret = -ENOMEM;
+
+  if(group->shards == NULL) {
+    if(fd >= 0)
+      close(fd);
+
+    return ret;
+  }
+
+  for(; group->nshards < nshards; group->nshards++) {
+    if((ret = group_shard_init(group, group->nshards, ops, msize)) < 0) {
+      if(fd >= 0)
+        close(fd);
+
+      group_free(group, 0);
+      return ret;
+    }
+  }
+
+  struct sockaddr_storage addr;
+  socklen_t len;
+
+  if(fd < 0)
+    ret = 0;
+  else if(group_fd_reuseport(fd, &addr, &len))
+    ret = group_listen_reuseport(group, fd, &addr, len);
+  else
+    ret = group_listen_handoff(group, fd);
+
+  if(ret < 0) {
+    group_free(group, 0);
+    return ret;
+  }
+
+  for(uint32_t i = 0; i < nshards; ++i) {
+    rfs__srv_shard_t* shard = &(group->shards[i]);
+
+    if((ret = uv_thread_create(&(shard->thread), group_run, shard)) < 0) {
+      group_free(group, i);
+      return ret;
+    }
+  }
+
+  return 0;
+}
+
+int rfs__srv_group_accept(rfs__srv_group_t* group, int fd) {
+  assert(group != NULL);
+
+  if(__atomic_load_n(&(group->stopping), __ATOMIC_ACQUIRE)) {
+    close(fd);
+    return -ESHUTDOWN;
+  }
+
+  return group_handoff(group, fd);
+}
+
+void rfs__srv_group_stop(rfs__srv_group_t* group) {
+  assert(group != NULL);
+
+  group_free(group, group->nshards);
+}
@@ -0,0 +1,104 @@
+#ifndef RFS_SRV_GROUP_H
+#define RFS_SRV_GROUP_H
+
+#include <stdint.h>
+
+#include <uv.h>
+
+#include "rfs_mpsc.h"
+#include "rfs_srv.h"
+
+/// @file A 9P server sharded across event loops.
+/// A group runs one server per shard, each on its own loop and thread, and
+/// spreads connections across them. Once accepted, a connection and every
+/// request on it stay on one shard, so the request path takes no locks.
+///
+/// Connections reach the shards in one of two ways. If the listening socket
+/// is a TCP socket with SO_REUSEPORT set, every shard listens on a socket
+/// of its own bound to the same address, and the kernel balances incoming
+/// connections between them. Otherwise the first shard accepts every
+/// connection and hands them to the shards round-robin, through a ring per
+/// shard.
+///
+/// The file tree's handlers are shared by every shard and are called from
+/// each shard's thread, so any state they share must be safe to use from
+/// several threads; state kept in a connection's data is only touched by
+/// its shard.
+
+/// @brief The most connections which may be waiting to be handed to a shard.
+#define RFS__SRV_GROUP_RING_SIZE 1024
+
+/// @brief Flags changing how a group runs.
+enum {
+  /// @brief Pin each shard's thread to a CPU, shard i to the i-th of the
+  /// CPUs the group may run on, modulo their number; ignored where threads
+  /// can't be pinned.
+  RFS__SRV_GROUP_PIN = 1
+};
+
+struct rfs__srv_group;
+
+/// @brief One loop of a group.
+typedef struct rfs__srv_shard {
+  rfs__srv_t srv; ///< The shard's server; srv.data is the group's data.
+
+  // private
+  struct rfs__srv_group* group; ///< The group the shard belongs to.
+  uint32_t index; ///< The shard's position in the group.
+  uv_loop_t loop; ///< The shard's loop.
+  uv_thread_t thread; ///< Runs the loop.
+  uv_async_t doorbell; ///< Signalled after a push to the ring, or to stop.
+  rfs__mpsc_t ring; ///< Connected descriptors handed to the shard.
+} rfs__srv_shard_t;
+
+/// @brief The group structure.
+typedef struct rfs__srv_group {
+  void* data; ///< Available for the file tree's use.
+
+  // private
+  rfs__srv_shard_t* shards; ///< The shards.
+  uint32_t nshards; ///< The number of shards.
+  int flags; ///< The RFS__SRV_GROUP_* flags the group was started with.
+  uint32_t next; ///< The shard the next handed off connection goes to.
+
+  uv_poll_t acceptor; ///< Accepts connections to hand off; on shard 0.
+  uv_timer_t backoff; ///< Restarts acceptor once descriptors may be free.
+  uint32_t backoffs; ///< The number of times accepting has backed off.
+  int acceptfd; ///< The socket acceptor polls; -1 if there is none.
+  int stopping; ///< Set once the group is stopping.
+} rfs__srv_group_t;
+
+/// @brief Start a group.
+/// The shards are set up and listening before their threads start, so
+/// connections may be made as soon as this returns.
+/// @param [in] group The group to start; its data must already be set.
+/// @param [in] nshards The number of shards; 0 for one per CPU.
+/// @param [in] ops The file tree's handlers; must outlive the group.
+/// @param [in] msize The largest msize to agree to.
+/// @param [in] fd A bound TCP or unix stream socket to accept connections
+/// from, which the group owns even if this fails; -1 to only serve
+/// connections passed to rfs__srv_group_accept().
+/// @param [in] flags Any RFS__SRV_GROUP_* flags.
+/// @return 0 on success, -errno on failure.
+int rfs__srv_group_start(rfs__srv_group_t* group,
+                         uint32_t nshards,
+                         const rfs__srv_ops_t* ops,
+                         uint32_t msize,
+                         int fd,
+                         int flags);
+
+/// @brief Serve a connection which has already been established on the
+/// next shard. This may be called from any thread.
+/// @param [in] group The group to serve the connection.
+/// @param [in] fd The connected socket or pipe; the group owns it, and
+/// closes it if this fails.
+/// @return 0 on success; -EAGAIN if the shard's ring is full; -ESHUTDOWN if
+/// the group is stopping.
+int rfs__srv_group_accept(rfs__srv_group_t* group, int fd);
+
+/// @brief Stop a group, closing every connection, and wait for its threads
+/// to exit. This must not be called from a shard's thread.
+/// @param [in] group The group to stop.
+void rfs__srv_group_stop(rfs__srv_group_t* group);
+
+#endif
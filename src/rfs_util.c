@@ -1,7 +1,15 @@
+#if defined(__linux__)
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#endif
+
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
 #if defined(__linux__)
+#include <linux/futex.h>
 #include <sys/syscall.h>
 #endif
 
@@ -21,3 +29,65 @@ long int rfs__gettid(void) {
 #endif
 }
 
+void rfs__futex_wait(uint32_t* addr, uint32_t val) {
+#if defined(__linux__)
+  syscall(__NR_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+  /// @todo Use __ulock_wait on Apple and _umtx_op on FreeBSD.
+  if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+    sched_yield();
+#endif
+}
+
+void rfs__futex_wake(uint32_t* addr) {
+#if defined(__linux__)
+  syscall(__NR_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#else
+  (void) addr;
+#endif
+}
+
+unsigned rfs__ncpus(void) {
+#if defined(__linux__)
+  cpu_set_t set;
+
+  if(sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+    return (unsigned) CPU_COUNT(&set);
+#endif
+
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n < 1 ? 1 : (unsigned) n);
+}
+
+int rfs__setaffinity(unsigned n) {
+#if defined(__linux__)
+  cpu_set_t allowed;
+  cpu_set_t set;
+
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -errno;
+
+  int count = CPU_COUNT(&allowed);
+
+  if(count == 0)
+    return -EINVAL;
+
+  // find the n-th CPU of the mask, which needn't start at 0 or be dense
+  n %= (unsigned) count;
+
+  for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if(!CPU_ISSET(cpu, &allowed) || n-- > 0)
+      continue;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+
+  return -EINVAL;
+#else
+  (void) n;
+  return -ENOTSUP;
+#endif
+}
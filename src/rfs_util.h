@@ -1,6 +1,8 @@
 #ifndef RFS_UTIL_H
 #define RFS_UTIL_H
 
+#include <stdint.h>
+
 /// @brief Platform-independent function to retrieve the process ID.
 /// @return Process ID of current process.
 long int rfs__getpid(void);
@@ -9,5 +11,28 @@ long int rfs__getpid(void);
 /// @return Thread ID of the current thread.
 long int rfs__gettid(void);
 
-#endif
+/// @brief Block the current thread while *addr is equal to val.
+/// This may return spuriously; callers must re-check *addr in a loop.
+/// @param [in] addr The word to wait on.
+/// @param [in] val The value of addr which the caller expects.
+void rfs__futex_wait(uint32_t* addr, uint32_t val);
+
+/// @brief Wake all threads blocked in rfs__futex_wait() on addr.
+/// @param [in] addr The word being waited on.
+void rfs__futex_wake(uint32_t* addr);
 
+/// @brief Find the number of CPUs the current thread may run on, which
+/// under a cpuset or affinity mask may be fewer than are online.
+/// @return The number of CPUs; at least 1.
+unsigned rfs__ncpus(void);
+
+/// @brief Restrict the current thread to running on one of the CPUs it may
+/// run on.
+/// @param [in] n Which of those CPUs to run on, counting from 0 in CPU
+/// order, modulo their number; CPUs outside the thread's affinity mask
+/// aren't counted, so distinct n less than rfs__ncpus() give distinct CPUs.
+/// @return 0 on success, -errno on failure; -ENOTSUP where threads can't
+/// be pinned.
+int rfs__setaffinity(unsigned n);
+
+#endif
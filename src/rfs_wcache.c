@@ -0,0 +1,350 @@
+#include "rfs_wcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief The index used to terminate hash chains and the free list.
+#define WCACHE_NIL UINT32_MAX
+
+/// @brief The FNV-1a offset basis and prime.
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/// @brief Begin hashing a path within a mount.
+static uint64_t wcache_hash_init(uint64_t mnt) {
+  return (FNV_OFFSET ^ mnt) * FNV_PRIME;
+}
+
+/// @brief Add a byte of the path to a hash.
+static uint64_t wcache_hash_byte(uint64_t hash, char c) {
+  return (hash ^ (unsigned char) c) * FNV_PRIME;
+}
+
+int rfs__wcache_init(rfs__wcache_t* cache, uint32_t cap) {
+  assert(cache != NULL);
+  assert(cap > 0 && cap < WCACHE_NIL);
+
+  uint32_t buckets = 1;
+  while(buckets < cap * 2 && buckets < (1U << 31))
+    buckets <<= 1;
+
+  cache->ents = calloc(cap, sizeof(rfs__wcache_ent_t));
+  cache->buckets = malloc(sizeof(uint32_t) * buckets);
+
+  if(cache->ents == NULL || cache->buckets == NULL) {
+    free(cache->ents);
+    free(cache->buckets);
+    return -ENOMEM;
+  }
+
+  for(uint32_t i = 0; i < buckets; ++i)
+    cache->buckets[i] = WCACHE_NIL;
+
+  for(uint32_t i = 0; i < cap; ++i)
+    cache->ents[i].next = (i + 1 < cap ? i + 1 : WCACHE_NIL);
+
+  cache->cap = cap;
+  cache->mask = buckets - 1;
+  cache->free = 0;
+  cache->hand = 0;
+  cache->count = 0;
+
+  return 0;
+}
+
+void rfs__wcache_free(rfs__wcache_t* cache) {
+  assert(cache != NULL);
+
+  for(uint32_t i = 0; i < cache->cap; ++i)
+    free(cache->ents[i].path);
+
+  free(cache->ents);
+  free(cache->buckets);
+  cache->ents = NULL;
+  cache->buckets = NULL;
+  cache->cap = 0;
+  cache->count = 0;
+}
+
+/// @brief Find the entry for a path.
+/// @return The index of the entry; WCACHE_NIL if there isn't one.
+static uint32_t wcache_find(const rfs__wcache_t* cache,
+                            uint64_t mnt,
+                            uint64_t hash,
+                            const char* path,
+                            size_t len) {
+  uint32_t idx = cache->buckets[hash & cache->mask];
+
+  while(idx != WCACHE_NIL) {
+    const rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+
+    if(ent->hash == hash && ent->mnt == mnt && ent->len == len
+    && memcmp(ent->path, path, len) == 0)
+      return idx;
+
+    idx = ent->next;
+  }
+
+  return WCACHE_NIL;
+}
+
+/// @brief Remove an entry from its hash chain and add it to the free list.
+static void wcache_remove(rfs__wcache_t* cache, uint32_t idx) {
+  rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+  uint32_t* link = &(cache->buckets[ent->hash & cache->mask]);
+
+  while(*link != idx)
+    link = &(cache->ents[*link].next);
+
+  *link = ent->next;
+
+  free(ent->path);
+  ent->path = NULL;
+  ent->mnt = 0;
+  ent->next = cache->free;
+  cache->free = idx;
+  cache->count--;
+}
+
+/// @brief Take an unused entry, evicting one if there are none.
+/// New entries start without their reference bit set, so an entry which is
+/// never used again after being added is the first to go.
+/// @return The index of the entry.
+static uint32_t wcache_alloc(rfs__wcache_t* cache) {
+  // the hand always finds a victim within two revolutions, since it clears
+  // the reference bits it passes
+  while(cache->free == WCACHE_NIL) {
+    uint32_t idx = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->cap;
+
+    if(cache->ents[idx].ref)
+      cache->ents[idx].ref = 0;
+    else
+      wcache_remove(cache, idx);
+  }
+
+  uint32_t idx = cache->free;
+  cache->free = cache->ents[idx].next;
+
+  return idx;
+}
+
+/// @brief Check an entry is still current.
+/// Stale entries are removed.
+/// @param [in] cache The cache holding the entry.
+/// @param [in] mnt The mount the entry should belong to.
+/// @param [in] idx The index of the entry.
+/// @param [in] parent The index of the parent's entry; WCACHE_NIL for the
+/// root, which has no parent.
+/// @return 1 if the entry is current, 0 if it was removed.
+static int wcache_check(rfs__wcache_t* cache,
+                        const rfs__ns_mnt_t* mnt,
+                        uint32_t idx,
+                        uint32_t parent) {
+  const rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+
+  if(ent->gen == mnt->gen
+  && (parent == WCACHE_NIL || ent->pvers == cache->ents[parent].qid.vers))
+    return 1;
+
+  wcache_remove(cache, idx);
+  return 0;
+}
+
+/// @brief Find the entry of the parent of a path, checking that it and each
+/// of its ancestors are current.
+/// Every ancestor counts as used, so directories stay cached while anything
+/// beneath them is.
+/// @param [in] cache The cache to search.
+/// @param [in] mnt The mount the path is in.
+/// @param [in] path The cleaned path.
+/// @param [in] len The length of path.
+/// @param [out] hash Set to the hash of the whole path.
+/// @param [out] parent Set to the index of the parent's entry; WCACHE_NIL
+/// for the root, which has no parent.
+/// @return 1 if the parent is current (or path is the root); 0 otherwise.
+static int wcache_parent(rfs__wcache_t* cache,
+                         const rfs__ns_mnt_t* mnt,
+                         const char* path,
+                         size_t len,
+                         uint64_t* hash,
+                         uint32_t* parent) {
+  uint64_t h = wcache_hash_init(mnt->id);
+  uint32_t prev = WCACHE_NIL;
+  int ok = 1;
+
+  // hash every prefix in one pass over the path, checking each directory
+  // from the root down as its name ends
+  for(size_t i = 0; i < len; ++i) {
+    if(ok && (i == 1 || (i > 1 && path[i] == '/'))) {
+      uint32_t idx = wcache_find(cache, mnt->id, h, path, i);
+
+      if(idx == WCACHE_NIL || cache->ents[idx].negative
+      || !wcache_check(cache, mnt, idx, prev))
+        ok = 0;
+      else {
+        cache->ents[idx].ref = 1;
+        prev = idx;
+      }
+    }
+
+    h = wcache_hash_byte(h, path[i]);
+  }
+
+  *hash = h;
+  *parent = prev;
+
+  return ok;
+}
+
+int rfs__wcache_get(rfs__wcache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const char* path,
+                    size_t len,
+                    rfs_qid_t* qid) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(path != NULL && len > 0);
+  assert(qid != NULL);
+
+  uint64_t hash;
+  uint32_t parent;
+
+  if(!wcache_parent(cache, mnt, path, len, &hash, &parent))
+    return 0;
+
+  uint32_t idx = wcache_find(cache, mnt->id, hash, path, len);
+
+  if(idx == WCACHE_NIL || !wcache_check(cache, mnt, idx, parent))
+    return 0;
+
+  rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+  ent->ref = 1;
+
+  if(ent->negative)
+    return -ENOENT;
+
+  *qid = ent->qid;
+  return 1;
+}
+
+int rfs__wcache_put(rfs__wcache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const char* path,
+                    size_t len,
+                    const rfs_qid_t* qid) {
+  assert(cache != NULL);
+  assert(mnt != NULL);
+  assert(path != NULL && len > 0);
+
+  uint64_t hash;
+  uint32_t parent;
+  int valid = wcache_parent(cache, mnt, path, len, &hash, &parent);
+  uint32_t idx = wcache_find(cache, mnt->id, hash, path, len);
+
+  // without a current parent the entry could never be validated
+  if(!valid) {
+    if(idx != WCACHE_NIL)
+      wcache_remove(cache, idx);
+
+    return 0;
+  }
+
+  if(idx == WCACHE_NIL) {
+    char* copy = malloc(len);
+
+    if(copy == NULL)
+      return -ENOMEM;
+
+    memcpy(copy, path, len);
+
+    idx = wcache_alloc(cache);
+
+    // the parent may have been the entry evicted to make room
+    if(idx == parent) {
+      cache->ents[idx].next = cache->free;
+      cache->free = idx;
+      free(copy);
+      return 0;
+    }
+
+    rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+    ent->mnt = mnt->id;
+    ent->hash = hash;
+    ent->path = copy;
+    ent->len = len;
+    ent->ref = 0;
+    ent->next = cache->buckets[hash & cache->mask];
+    cache->buckets[hash & cache->mask] = idx;
+    cache->count++;
+  }
+
+  rfs__wcache_ent_t* ent = &(cache->ents[idx]);
+  ent->gen = mnt->gen;
+  ent->pvers = (parent != WCACHE_NIL ? cache->ents[parent].qid.vers : 0);
+  ent->negative = (qid == NULL);
+
+  if(qid != NULL)
+    ent->qid = *qid;
+
+  return 0;
+}
+
+int rfs__wcache_walked(rfs__wcache_t* cache,
+                       const rfs__ns_mnt_t* mnt,
+                       const char* base,
+                       const rfs__9p_msg_t* tw,
+                       const rfs__9p_msg_t* rw) {
+  assert(cache != NULL);
+  assert(base != NULL);
+  assert(tw != NULL && tw->type == RFS__9P_TWALK);
+  assert(rw != NULL && rw->type == RFS__9P_RWALK);
+
+  uint16_t nwqid = rw->params.rwalk.nwqid;
+  uint16_t nwname = tw->params.twalk.nwname;
+
+  if(nwqid > nwname)
+    return -EBADMSG;
+
+  // room for the base, each name and its slash, and rfs__ns_clean()
+  size_t size = strlen(base) + 2;
+  for(uint16_t i = 0; i < nwname; ++i)
+    size += tw->params.twalk.wname[i].len + 1U;
+
+  char* path = malloc(size);
+  char* scratch = malloc(size);
+
+  if(path == NULL || scratch == NULL) {
+    free(path);
+    free(scratch);
+    return -ENOMEM;
+  }
+
+  size_t len = strlen(base);
+  memcpy(path, base, len);
+
+  int ret = 0;
+
+  for(uint16_t i = 0; i <= nwqid && i < nwname && ret == 0; ++i) {
+    const rfs__9p_str_t* name = &(tw->params.twalk.wname[i]);
+
+    path[len++] = '/';
+    memcpy(path + len, name->str, name->len);
+    len += name->len;
+
+    // names may be ".." so the cached key has to be cleaned
+    memcpy(scratch, path, len);
+    scratch[len] = '\0';
+    size_t clean = rfs__ns_clean(scratch);
+
+    ret = rfs__wcache_put(cache, mnt, scratch, clean,
+                          i < nwqid ? &(rw->params.rwalk.wqid[i]) : NULL);
+  }
+
+  free(path);
+  free(scratch);
+
+  return ret;
+}
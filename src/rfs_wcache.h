@@ -0,0 +1,104 @@
+#ifndef RFS_WCACHE_H
+#define RFS_WCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs/types.h"
+#include "rfs_9p_wire.h"
+#include "rfs_ns.h"
+
+/// @file A cache of walk results.
+/// This maps a path within a mounted server to the qid a walk to it returned,
+/// or records that the walk found nothing there. Entries are dropped when:
+///  - the mount is unmounted (its generation changes),
+///  - the directory containing the entry is seen with a new version, since
+///    that means entries may have been created, removed or renamed in it,
+///  - they are evicted to make room; the cache holds a fixed number of
+///    entries and evicts with the CLOCK algorithm.
+/// The client worker has no walk path yet, so nothing calls the cache; it
+/// is meant to be driven from that path once it exists. The cache isn't
+/// synchronized; it is only meant for the client worker.
+
+/// @brief A cached walk result.
+typedef struct rfs__wcache_ent {
+  uint64_t mnt; ///< The id of the mount; 0 if the entry is unused.
+  uint32_t gen; ///< The generation of the mount when cached.
+  uint32_t pvers; ///< The version of the parent directory when cached.
+  uint64_t hash; ///< The hash of mnt and path.
+  char* path; ///< The cleaned path within the mount.
+  size_t len; ///< The length of path.
+  rfs_qid_t qid; ///< The qid of the file, if it exists.
+  uint8_t negative; ///< Nonzero if the walk found nothing at path.
+  uint8_t ref; ///< Set on use; cleared as the CLOCK hand passes.
+  uint32_t next; ///< The next entry in the hash chain or the free list.
+} rfs__wcache_ent_t;
+
+/// @brief The cache structure.
+typedef struct rfs__wcache {
+  rfs__wcache_ent_t* ents; ///< The entries.
+  uint32_t cap; ///< The number of entries.
+  uint32_t* buckets; ///< The first entry in each hash chain.
+  uint32_t mask; ///< The number of buckets minus 1.
+  uint32_t free; ///< The first unused entry.
+  uint32_t hand; ///< The position of the CLOCK hand.
+  uint32_t count; ///< The number of entries in use.
+} rfs__wcache_t;
+
+/// @brief Initialize a cache.
+/// @param [in] cache The cache to initialize.
+/// @param [in] cap The most entries to hold.
+/// @return 0 on success, -errno on failure.
+int rfs__wcache_init(rfs__wcache_t* cache, uint32_t cap);
+
+/// @brief Free a cache.
+/// @param [in] cache The cache to free.
+void rfs__wcache_free(rfs__wcache_t* cache);
+
+/// @brief Look up the result of walking to a path.
+/// @param [in] cache The cache to search.
+/// @param [in] mnt The mount the path is in.
+/// @param [in] path The cleaned path within the mount.
+/// @param [in] len The length of path.
+/// @param [out] qid Set to the qid of the file on a positive hit.
+/// @return 1 if the file is known to exist, -ENOENT if it is known not to,
+/// or 0 if the result must be fetched from the server.
+int rfs__wcache_get(rfs__wcache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const char* path,
+                    size_t len,
+                    rfs_qid_t* qid);
+
+/// @brief Record the result of walking to a path.
+/// This must be called whenever a fresh qid for a path is seen, so a change
+/// of version is noticed. The parent directory should already be cached;
+/// entries whose parent isn't cached can't be validated, and are missed.
+/// @param [in] cache The cache to add to.
+/// @param [in] mnt The mount the path is in.
+/// @param [in] path The cleaned path within the mount.
+/// @param [in] len The length of path.
+/// @param [in] qid The qid of the file; NULL if the file doesn't exist.
+/// @return 0 on success, -errno on failure.
+int rfs__wcache_put(rfs__wcache_t* cache,
+                    const rfs__ns_mnt_t* mnt,
+                    const char* path,
+                    size_t len,
+                    const rfs_qid_t* qid);
+
+/// @brief Record the results of a walk.
+/// Each successive prefix of the walk is cached with the qid returned for
+/// it. If the walk stopped short, the first element not walked is cached as
+/// not existing.
+/// @param [in] cache The cache to add to.
+/// @param [in] mnt The mount walked in.
+/// @param [in] base The cleaned path the walk started from.
+/// @param [in] tw The Twalk message sent.
+/// @param [in] rw The Rwalk message received.
+/// @return 0 on success, -errno on failure.
+int rfs__wcache_walked(rfs__wcache_t* cache,
+                       const rfs__ns_mnt_t* mnt,
+                       const char* base,
+                       const rfs__9p_msg_t* tw,
+                       const rfs__9p_msg_t* rw);
+
+#endif
@@ -0,0 +1,388 @@
+#include "rfs_writebehind.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// @brief Record a failure, to be reported by the next write or flush.
+static void wb_fail(rfs__writebehind_t* wb, int error) {
+  if(wb->error == 0)
+    wb->error = error;
+}
+
+/// @brief Stop a buffer taking writes, so it's sent.
+static void wb_seal(rfs__writebehind_t* wb) {
+  if(wb->fill == wb->nbufs)
+    return;
+
+  wb->bufs[wb->fill].state = RFS__WRITEBEHIND_READY;
+  wb->fill = wb->nbufs;
+}
+
+/// @brief Release the write-behind's memory and report it closed.
+static void wb_finish(rfs__writebehind_t* wb) {
+  for(uint32_t i = 0; i < wb->nbufs; ++i)
+    free(wb->bufs[i].data);
+
+  free(wb->bufs);
+  wb->bufs = NULL;
+
+  if(wb->close_cb != NULL)
+    wb->close_cb(wb);
+}
+
+static void wb_on_write(rfs__9p_call_t* call,
+                        int ret,
+                        const rfs__9p_msg_t* reply);
+
+/// @brief Send the part of a buffer the server hasn't acknowledged.
+/// @return 0 on success, -errno on failure.
+static int wb_send(rfs__writebehind_t* wb, rfs__writebehind_buf_t* b) {
+  rfs__9p_msg_init(&(b->msg));
+  b->msg.type = RFS__9P_TWRITE;
+  b->msg.params.twrite.fid = wb->fid;
+  b->msg.params.twrite.offset = b->offset + b->done;
+  b->msg.params.twrite.count = b->len - b->done;
+  b->msg.params.twrite.data = b->data + b->done;
+  b->call.data = wb;
+
+  int ret = rfs__9p_session_rpc(wb->session, &(b->call), &(b->msg),
+                                wb_on_write);
+
+  if(ret < 0)
+    return ret;
+
+  b->state = RFS__WRITEBEHIND_SENT;
+  wb->inflight++;
+
+  return 0;
+}
+
+/// @brief Check whether a buffer must wait for another it overlaps.
+/// Overlapping Twrites in flight together could be applied in either order,
+/// so a buffer waits for any it overlaps which is in flight or older.
+static int wb_blocked(const rfs__writebehind_t* wb,
+                      const rfs__writebehind_buf_t* b) {
+  for(uint32_t i = 0; i < wb->nbufs; ++i) {
+    const rfs__writebehind_buf_t* o = &(wb->bufs[i]);
+
+    if((o->state == RFS__WRITEBEHIND_SENT
+     || (o->state == RFS__WRITEBEHIND_READY && o->seq < b->seq))
+    && o->offset < b->offset + b->len && b->offset < o->offset + o->len)
+      return 1;
+  }
+
+  return 0;
+}
+
+/// @brief Send every buffer which is ready, oldest first.
+static void wb_pump(rfs__writebehind_t* wb) {
+  // a partly filled buffer waits while there's a reply to wait for
+  if(wb->inflight == 0 && wb->fill != wb->nbufs
+  && wb->bufs[wb->fill].len > 0)
+    wb_seal(wb);
+
+  for(;;) {
+    rfs__writebehind_buf_t* next = NULL;
+
+    for(uint32_t i = 0; i < wb->nbufs; ++i) {
+      rfs__writebehind_buf_t* b = &(wb->bufs[i]);
+
+      if(b->state == RFS__WRITEBEHIND_READY && !wb_blocked(wb, b)
+      && (next == NULL || b->seq < next->seq))
+        next = b;
+    }
+
+    if(next == NULL)
+      return;
+
+    int ret = wb_send(wb, next);
+
+    // the data is lost; the failure is reported in its place
+    if(ret < 0) {
+      next->state = RFS__WRITEBEHIND_FREE;
+      wb_fail(wb, ret);
+    }
+  }
+}
+
+/// @brief Copy as much of the waiting write as fits into the buffers.
+/// @return 1 if all of it was copied; 0 if it must wait for a buffer;
+/// -ENOMEM if a buffer couldn't be allocated.
+static int wb_copy(rfs__writebehind_t* wb) {
+  while(wb->left > 0) {
+    if(wb->fill != wb->nbufs) {
+      rfs__writebehind_buf_t* b = &(wb->bufs[wb->fill]);
+
+      // only contiguous writes can share a Twrite
+      if(b->offset + b->len != wb->offset || b->len == wb->chunk) {
+        wb_seal(wb);
+        continue;
+      }
+    }
+    else {
+      uint32_t i = 0;
+
+      while(i < wb->nbufs && wb->bufs[i].state != RFS__WRITEBEHIND_FREE)
+        i++;
+
+      if(i == wb->nbufs)
+        return 0;
+
+      rfs__writebehind_buf_t* b = &(wb->bufs[i]);
+
+      if(b->data == NULL && (b->data = malloc(wb->chunk)) == NULL)
+        return -ENOMEM;
+
+      b->offset = wb->offset;
+      b->seq = ++wb->seqs;
+      b->len = 0;
+      b->done = 0;
+      b->state = RFS__WRITEBEHIND_FILLING;
+      wb->fill = i;
+    }
+
+    rfs__writebehind_buf_t* b = &(wb->bufs[wb->fill]);
+    size_t n = wb->chunk - b->len;
+
+    if(n > wb->left)
+      n = wb->left;
+
+    memcpy(b->data + b->len, wb->src, n);
+    b->len += (uint32_t) n;
+    wb->src += n;
+    wb->offset += n;
+    wb->left -= n;
+
+    if(b->len == wb->chunk)
+      wb_seal(wb);
+  }
+
+  return 1;
+}
+
+/// @brief Check whether everything the waiting flush covers is done.
+static int wb_flushed(const rfs__writebehind_t* wb) {
+  for(uint32_t i = 0; i < wb->nbufs; ++i) {
+    const rfs__writebehind_buf_t* b = &(wb->bufs[i]);
+
+    if(b->state != RFS__WRITEBEHIND_FREE && b->seq <= wb->barrier)
+      return 0;
+  }
+
+  return 1;
+}
+
+/// @brief Take the failure to report, clearing it.
+static int wb_take_error(rfs__writebehind_t* wb) {
+  int error = wb->error;
+
+  wb->error = 0;
+
+  return error;
+}
+
+/// @brief Make progress after a Twrite completes, and complete the waiting
+/// write and flush if they now can.
+/// The callbacks are invoked last, since they may close the write-behind.
+static void wb_kick(rfs__writebehind_t* wb) {
+  rfs__writebehind_cb cb = NULL;
+  rfs__writebehind_cb flush_cb = NULL;
+  int ret = 0;
+  int flush_ret = 0;
+
+  if(wb->cb != NULL) {
+    ret = (wb->error != 0 ? wb_take_error(wb) : wb_copy(wb));
+
+    if(ret != 0) {
+      cb = wb->cb;
+      wb->cb = NULL;
+    }
+  }
+
+  wb_pump(wb);
+
+  if(wb->flush_cb != NULL && wb_flushed(wb)) {
+    flush_cb = wb->flush_cb;
+    flush_ret = wb_take_error(wb);
+    wb->flush_cb = NULL;
+  }
+
+  if(cb != NULL)
+    cb(wb, ret < 0 ? ret : 0);
+
+  if(flush_cb != NULL)
+    flush_cb(wb, flush_ret);
+}
+
+/// @brief Record the reply to a Twrite.
+static void wb_on_write(rfs__9p_call_t* call,
+                        int ret,
+                        const rfs__9p_msg_t* reply) {
+  rfs__writebehind_buf_t* b = (rfs__writebehind_buf_t*) call;
+  rfs__writebehind_t* wb = call->data;
+
+  wb->inflight--;
+
+  if(wb->closing) {
+    b->state = RFS__WRITEBEHIND_FREE;
+
+    if(wb->inflight == 0)
+      wb_finish(wb);
+
+    return;
+  }
+
+  if(ret == 0 && reply->type == RFS__9P_RERROR)
+    ret = -EIO;
+
+  if(ret == 0) {
+    uint32_t count = reply->params.rwrite.count;
+
+    if(count == 0 || count > b->len - b->done)
+      ret = -EIO;
+    else
+      b->done += count;
+  }
+
+  // the server may write less than asked; the rest is sent again
+  if(ret == 0 && b->done < b->len)
+    ret = wb_send(wb, b);
+  else
+    b->state = RFS__WRITEBEHIND_FREE;
+
+  if(ret < 0) {
+    b->state = RFS__WRITEBEHIND_FREE;
+    wb_fail(wb, ret);
+  }
+
+  wb_kick(wb);
+}
+
+int rfs__writebehind_init(rfs__writebehind_t* wb,
+                          rfs__9p_session_t* session,
+                          uint32_t fid,
+                          uint32_t iounit,
+                          uint32_t msize,
+                          uint32_t depth) {
+  assert(wb != NULL);
+  assert(session != NULL);
+  assert(msize > RFS__9P_IOHDRSZ);
+  assert(depth > 0);
+
+  wb->bufs = calloc(depth, sizeof(rfs__writebehind_buf_t));
+
+  if(wb->bufs == NULL)
+    return -ENOMEM;
+
+  // an iounit of 0 means the server leaves it to the msize
+  wb->chunk = msize - RFS__9P_IOHDRSZ;
+
+  if(iounit > 0 && iounit < wb->chunk)
+    wb->chunk = iounit;
+
+  wb->session = session;
+  wb->fid = fid;
+  wb->nbufs = depth;
+  wb->fill = depth;
+  wb->inflight = 0;
+  wb->seqs = 0;
+  wb->error = 0;
+  wb->cb = NULL;
+  wb->src = NULL;
+  wb->offset = 0;
+  wb->left = 0;
+  wb->flush_cb = NULL;
+  wb->barrier = 0;
+  wb->close_cb = NULL;
+  wb->closing = 0;
+
+  return 0;
+}
+
+void rfs__writebehind_close(rfs__writebehind_t* wb,
+                            rfs__writebehind_close_cb cb) {
+  assert(wb != NULL);
+  assert(!wb->closing);
+
+  wb->closing = 1;
+  wb->close_cb = cb;
+
+  for(uint32_t i = 0; i < wb->nbufs; ++i) {
+    if(wb->bufs[i].state != RFS__WRITEBEHIND_SENT)
+      wb->bufs[i].state = RFS__WRITEBEHIND_FREE;
+  }
+
+  wb->fill = wb->nbufs;
+
+  rfs__writebehind_cb wcb = wb->cb;
+  rfs__writebehind_cb fcb = wb->flush_cb;
+
+  wb->cb = NULL;
+  wb->flush_cb = NULL;
+
+  if(wcb != NULL)
+    wcb(wb, -ECANCELED);
+
+  if(fcb != NULL)
+    fcb(wb, -ECANCELED);
+
+  if(wb->inflight == 0)
+    wb_finish(wb);
+}
+
+int rfs__writebehind_write(rfs__writebehind_t* wb,
+                           uint64_t offset,
+                           const void* data,
+                           size_t count,
+                           rfs__writebehind_cb cb) {
+  assert(wb != NULL);
+  assert(!wb->closing);
+  assert(data != NULL || count == 0);
+  assert(cb != NULL);
+
+  if(wb->cb != NULL)
+    return -EBUSY;
+
+  if(wb->error != 0)
+    return wb_take_error(wb);
+
+  wb->src = data;
+  wb->offset = offset;
+  wb->left = count;
+
+  int ret = wb_copy(wb);
+
+  wb_pump(wb);
+
+  if(ret != 0)
+    return ret;
+
+  wb->cb = cb;
+
+  return 0;
+}
+
+int rfs__writebehind_flush(rfs__writebehind_t* wb, rfs__writebehind_cb cb) {
+  assert(wb != NULL);
+  assert(!wb->closing);
+  assert(cb != NULL);
+
+  if(wb->flush_cb != NULL)
+    return -EBUSY;
+
+  wb_seal(wb);
+  wb_pump(wb);
+
+  wb->barrier = wb->seqs;
+
+  if(wb_flushed(wb)) {
+    int error = wb_take_error(wb);
+    return (error != 0 ? error : 1);
+  }
+
+  wb->flush_cb = cb;
+
+  return 0;
+}
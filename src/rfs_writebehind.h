@@ -0,0 +1,139 @@
+#ifndef RFS_WRITEBEHIND_H
+#define RFS_WRITEBEHIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rfs_9p_session.h"
+
+/// @file Write-behind for a fid open for writing.
+/// Writes are copied into iounit-sized buffers and acknowledged at once;
+/// the buffers are sent as Twrites in the background, several at a time.
+/// Contiguous writes are coalesced: a buffer is sent as soon as it's full,
+/// and a partly filled one only once no other Twrite is in flight, as in
+/// Nagle's algorithm. A lone small write therefore goes out immediately,
+/// while a burst of them rides along in as few Twrites as possible.
+/// The buffers bound the data which may be unacknowledged; a write which
+/// finds them all in use waits for a Twrite to complete.
+/// Since writes are acknowledged before they reach the server, a failed
+/// Twrite is reported by the next write or flush. A flush is a barrier:
+/// it completes once everything written before it has been acknowledged.
+/// Like the session it uses, write-behind belongs to the session's loop.
+
+/// @brief The default number of buffers for a fid.
+#define RFS__WRITEBEHIND_DEPTH    8
+
+struct rfs__writebehind;
+
+/// @brief Called when a write or flush which couldn't complete at once
+/// completes.
+/// @param [in] wb The write-behind the write or flush was made through.
+/// @param [in] ret 0 on success; -EIO if the server replied to a Twrite with
+/// Rerror or wrote nothing; -ECANCELED if the write-behind was closed first;
+/// otherwise the error which failed a Twrite.
+typedef void (*rfs__writebehind_cb)(struct rfs__writebehind* wb, int ret);
+
+/// @brief Called once a closed write-behind may be freed.
+/// @param [in] wb The write-behind which has closed.
+typedef void (*rfs__writebehind_close_cb)(struct rfs__writebehind* wb);
+
+/// @brief A buffer of data to be written.
+typedef struct rfs__writebehind_buf {
+  rfs__9p_call_t call; ///< The request made on the session.
+  rfs__9p_msg_t msg; ///< The Twrite.
+  unsigned char* data; ///< The data; allocated on first use.
+  uint64_t offset; ///< The offset the data is to be written at.
+  uint64_t seq; ///< Orders the buffers by when they started filling.
+  uint32_t len; ///< The number of bytes of data.
+  uint32_t done; ///< The number of bytes the server has acknowledged.
+  int state; ///< One of RFS__WRITEBEHIND_*.
+} rfs__writebehind_buf_t;
+
+enum {
+  RFS__WRITEBEHIND_FREE, ///< Unused.
+  RFS__WRITEBEHIND_FILLING, ///< Taking writes.
+  RFS__WRITEBEHIND_READY, ///< Waiting to be sent.
+  RFS__WRITEBEHIND_SENT ///< In flight.
+};
+
+/// @brief The write-behind structure.
+typedef struct rfs__writebehind {
+  void* data; ///< Available for the caller's use.
+
+  // private
+  rfs__9p_session_t* session; ///< The session the fid belongs to.
+  uint32_t fid; ///< The fid being written.
+  uint32_t chunk; ///< The size of each buffer.
+
+  rfs__writebehind_buf_t* bufs; ///< The buffers.
+  uint32_t nbufs; ///< The number of buffers.
+  uint32_t fill; ///< The buffer taking writes; nbufs if there isn't one.
+  uint32_t inflight; ///< The number of Twrites awaiting replies.
+  uint64_t seqs; ///< The last sequence number handed to a buffer.
+  int error; ///< The first failure not yet reported; 0 if none.
+
+  rfs__writebehind_cb cb; ///< The callback of the waiting write, if any.
+  const unsigned char* src; ///< The part of the waiting write not copied.
+  uint64_t offset; ///< The offset of src.
+  size_t left; ///< The number of bytes of src.
+
+  rfs__writebehind_cb flush_cb; ///< The callback of the waiting flush.
+  uint64_t barrier; ///< The last buffer the waiting flush covers.
+
+  rfs__writebehind_close_cb close_cb; ///< Called once closed.
+  int closing; ///< Set once closed.
+} rfs__writebehind_t;
+
+/// @brief Start write-behind for an open fid.
+/// @param [in] wb The write-behind to initialize.
+/// @param [in] session The session the fid belongs to.
+/// @param [in] fid The fid, which must be open for writing.
+/// @param [in] iounit The iounit returned when the fid was opened.
+/// @param [in] msize The msize of the session.
+/// @param [in] depth The number of buffers; this many times the chunk size
+/// may be written but unacknowledged.
+/// @return 0 on success, -errno on failure.
+int rfs__writebehind_init(rfs__writebehind_t* wb,
+                          rfs__9p_session_t* session,
+                          uint32_t fid,
+                          uint32_t iounit,
+                          uint32_t msize,
+                          uint32_t depth);
+
+/// @brief Close a write-behind.
+/// A waiting write or flush completes with -ECANCELED, and data not yet
+/// sent is discarded, so this should normally follow a flush. The memory
+/// must remain valid until cb is called, which may be before this returns.
+/// The fid itself is left open.
+/// @param [in] wb The write-behind to close.
+/// @param [in] cb Called once the write-behind has closed; may be NULL.
+void rfs__writebehind_close(rfs__writebehind_t* wb,
+                            rfs__writebehind_close_cb cb);
+
+/// @brief Write to the fid.
+/// @param [in] wb The write-behind to write through.
+/// @param [in] offset The offset to write at.
+/// @param [in] data The data to write; it must remain valid until the write
+/// completes.
+/// @param [in] count The number of bytes of data.
+/// @param [in] cb Called when the write completes, unless it completed at
+/// once.
+/// @return 1 if the data was buffered at once; 0 if cb will be called;
+/// -EBUSY if a write is already waiting; otherwise the error which failed
+/// an earlier Twrite, in which case nothing was written.
+int rfs__writebehind_write(rfs__writebehind_t* wb,
+                           uint64_t offset,
+                           const void* data,
+                           size_t count,
+                           rfs__writebehind_cb cb);
+
+/// @brief Wait for everything written so far to be acknowledged.
+/// @param [in] wb The write-behind to flush.
+/// @param [in] cb Called when the flush completes, unless it completed at
+/// once.
+/// @return 1 if nothing was waiting to be acknowledged; 0 if cb will be
+/// called; -EBUSY if a flush is already waiting; otherwise the error which
+/// failed an earlier Twrite.
+int rfs__writebehind_flush(rfs__writebehind_t* wb, rfs__writebehind_cb cb);
+
+#endif
@@ -0,0 +1,406 @@
+#include "src/rfs_9p_wire.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// @file Microbenchmarks of the 9P wire codec.
+/// Every T and R message type is packed, unpacked and sized repeatedly, as
+/// are the stat and directory read functions. Results are written to stdout
+/// as CSV, one line per benchmark:
+///   case,op,iterations,bytes,ns_per_op,mb_per_s
+/// where bytes is the serialized size of the message being processed.
+/// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+///
+/// Usage: rfs_9p_bench [min_ms_per_benchmark]
+
+/// @brief The size of the payload of the data carrying messages.
+#define BENCH_PAYLOAD (64 * 1024)
+
+/// @brief The size of the payload of the small data carrying messages.
+#define BENCH_SMALL_PAYLOAD 128
+
+/// @brief The number of stat records in the directory read benchmark.
+#define BENCH_DIRENTS 500
+
+/// @brief The minimum time each benchmark runs for, in nanoseconds.
+static uint64_t _min_ns = 100 * 1000 * 1000;
+
+/// @brief Written to so the compiler can't elide the benchmarked calls.
+static volatile size_t _sink;
+
+/// @brief One message to benchmark.
+typedef struct bench_case {
+  const char* name; ///< The name printed in the results.
+  rfs__9p_msg_t msg; ///< The message to pack, unpack and size.
+} bench_case_t;
+
+static unsigned char _payload[BENCH_PAYLOAD];
+static rfs__9p_stat_t _stat;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void report(const char* name,
+                   const char* op,
+                   uint64_t iters,
+                   size_t bytes,
+                   uint64_t elapsed) {
+  double ns_per_op = (double) elapsed / (double) iters;
+  double mb_per_s = ((double) bytes * (double) iters)
+                  / ((double) elapsed / 1e9) / (1024.0 * 1024.0);
+
+  printf("%s,%s,%" PRIu64 ",%zu,%.1f,%.1f\n",
+         name, op, iters, bytes, ns_per_op, mb_per_s);
+}
+
+/// @brief Run op in batches until the minimum benchmark time has passed.
+/// @param [in] name The name of the case being benchmarked.
+/// @param [in] opname The name of the operation being benchmarked.
+/// @param [in] bytes The number of bytes processed by one operation.
+/// @param [in] op The operation to benchmark.
+/// @param [in] arg The argument to pass to op.
+static void run(const char* name,
+                const char* opname,
+                size_t bytes,
+                size_t (*op)(void*),
+                void* arg) {
+  uint64_t iters = 0;
+  uint64_t batch = 64;
+  uint64_t start = now_ns();
+  uint64_t elapsed;
+
+  do {
+    for(uint64_t i = 0; i < batch; ++i)
+      _sink += op(arg);
+
+    iters += batch;
+    elapsed = now_ns() - start;
+
+    if(batch < (1 << 20))
+      batch *= 2;
+  } while(elapsed < _min_ns);
+
+  report(name, opname, iters, bytes, elapsed);
+}
+
+/// @brief The state shared by the message operations.
+typedef struct bench_msg_ctx {
+  rfs__9p_msg_t* msg; ///< The message being benchmarked.
+  unsigned char* buf; ///< The buffer holding the packed message.
+  size_t bufsize; ///< The size of buf.
+  unsigned char hdr[RFS__9P_IOHDRSZ]; ///< The header for pack_iov.
+} bench_msg_ctx_t;
+
+static size_t op_msg_size(void* arg) {
+  bench_msg_ctx_t* ctx = arg;
+  return rfs__9p_msg_size(ctx->msg);
+}
+
+static size_t op_msg_pack(void* arg) {
+  bench_msg_ctx_t* ctx = arg;
+  return rfs__9p_msg_pack(ctx->msg, ctx->buf, ctx->bufsize);
+}
+
+static size_t op_msg_pack_iov(void* arg) {
+  bench_msg_ctx_t* ctx = arg;
+  struct iovec iov[2];
+  return (size_t) rfs__9p_msg_pack_iov(ctx->msg, ctx->hdr, sizeof(ctx->hdr),
+                                       iov);
+}
+
+static size_t op_msg_unpack(void* arg) {
+  bench_msg_ctx_t* ctx = arg;
+  rfs__9p_stat_t stat;
+  rfs__9p_msg_t msg;
+  rfs__9p_msg_init(&msg);
+
+  // Rstat and Twstat keep their stat pointers at different offsets
+  msg.params.rstat.stat = &stat;
+  msg.params.twstat.stat = &stat;
+
+  return rfs__9p_msg_unpack(ctx->buf, ctx->bufsize, &msg);
+}
+
+static void bench_msg(bench_case_t* bc) {
+  bench_msg_ctx_t ctx;
+  ctx.msg = &(bc->msg);
+  ctx.bufsize = rfs__9p_msg_size(&(bc->msg));
+  ctx.buf = malloc(ctx.bufsize);
+  assert(ctx.buf != NULL);
+  assert(rfs__9p_msg_pack(&(bc->msg), ctx.buf, ctx.bufsize) == ctx.bufsize);
+
+  run(bc->name, "size", ctx.bufsize, op_msg_size, &ctx);
+  run(bc->name, "pack", ctx.bufsize, op_msg_pack, &ctx);
+
+  if(bc->msg.type == RFS__9P_TWRITE || bc->msg.type == RFS__9P_RREAD)
+    run(bc->name, "pack_iov", ctx.bufsize, op_msg_pack_iov, &ctx);
+
+  run(bc->name, "unpack", ctx.bufsize, op_msg_unpack, &ctx);
+
+  free(ctx.buf);
+}
+
+/// @brief The state shared by the stat operations.
+typedef struct bench_stat_ctx {
+  unsigned char buf[512]; ///< The buffer holding the packed stat.
+  size_t len; ///< The size of the packed stat.
+} bench_stat_ctx_t;
+
+static size_t op_stat_size(void* arg) {
+  (void) arg;
+  return rfs__9p_stat_size(&_stat);
+}
+
+static size_t op_stat_pack(void* arg) {
+  bench_stat_ctx_t* ctx = arg;
+  return rfs__9p_stat_pack(&_stat, ctx->buf, sizeof(ctx->buf));
+}
+
+static size_t op_stat_unpack(void* arg) {
+  bench_stat_ctx_t* ctx = arg;
+  rfs__9p_stat_t stat;
+  return rfs__9p_stat_unpack(ctx->buf, ctx->len, &stat);
+}
+
+static void bench_stat(void) {
+  bench_stat_ctx_t ctx;
+  ctx.len = rfs__9p_stat_pack(&_stat, ctx.buf, sizeof(ctx.buf));
+  assert(ctx.len > 0);
+
+  run("stat", "size", ctx.len, op_stat_size, &ctx);
+  run("stat", "pack", ctx.len, op_stat_pack, &ctx);
+  run("stat", "unpack", ctx.len, op_stat_unpack, &ctx);
+}
+
+/// @brief The state shared by the directory read operations.
+typedef struct bench_dirent_ctx {
+  unsigned char* buf; ///< The concatenated stat records.
+  size_t len; ///< The size of buf.
+  rfs_dirent_t ents[BENCH_DIRENTS]; ///< The decoded entries.
+  char* arena; ///< The storage for the entries' strings.
+  size_t arenasize; ///< The size of arena.
+} bench_dirent_ctx_t;
+
+static size_t op_dirent_count(void* arg) {
+  bench_dirent_ctx_t* ctx = arg;
+  size_t strsize;
+  return (size_t) rfs__9p_dirent_count(ctx->buf, ctx->len, &strsize);
+}
+
+static size_t op_dirent_unpack(void* arg) {
+  bench_dirent_ctx_t* ctx = arg;
+  size_t used;
+  return (size_t) rfs__9p_dirent_unpack(ctx->buf, ctx->len, ctx->ents,
+                                        BENCH_DIRENTS, ctx->arena,
+                                        ctx->arenasize, &used);
+}
+
+static void bench_dirent(void) {
+  static bench_dirent_ctx_t ctx;
+  size_t bufsize = BENCH_DIRENTS * 128;
+  ctx.buf = malloc(bufsize);
+  assert(ctx.buf != NULL);
+  ctx.len = 0;
+
+  for(int i = 0; i < BENCH_DIRENTS; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "topic-%04d", i);
+
+    rfs__9p_stat_t stat = _stat;
+    stat.name = rfs__9p_str(name);
+    stat.qid.path = (uint64_t) i;
+    ctx.len += rfs__9p_stat_pack(&stat, ctx.buf + ctx.len, bufsize - ctx.len);
+  }
+
+  assert(rfs__9p_dirent_count(ctx.buf, ctx.len, &(ctx.arenasize))
+         == BENCH_DIRENTS);
+  ctx.arena = malloc(ctx.arenasize);
+  assert(ctx.arena != NULL);
+
+  run("dirent", "count", ctx.len, op_dirent_count, &ctx);
+  run("dirent", "unpack", ctx.len, op_dirent_unpack, &ctx);
+
+  free(ctx.arena);
+  free(ctx.buf);
+}
+
+int main(int argc, char* argv[]) {
+  if(argc > 1)
+    _min_ns = strtoull(argv[1], NULL, 10) * 1000 * 1000;
+
+  for(size_t i = 0; i < sizeof(_payload); ++i)
+    _payload[i] = (unsigned char) i;
+
+  rfs__9p_stat_init(&_stat);
+  _stat.type = 1;
+  _stat.dev = 2;
+  _stat.qid.path = 0x123456789ULL;
+  _stat.qid.vers = 17;
+  _stat.mode = 0644;
+  _stat.atime = _stat.mtime = 1700000000;
+  _stat.length = 4096;
+  _stat.name = rfs__9p_str("temperature");
+  _stat.uid = rfs__9p_str("sensor-daemon");
+  _stat.gid = rfs__9p_str("sensors");
+  _stat.muid = rfs__9p_str("sensor-daemon");
+
+  static const char* const path[RFS__9P_MAXWELEM] = {
+    "srv", "rfs", "topics", "building", "floor-3", "room-301", "hvac",
+    "zone-a", "sensors", "air", "temperature", "celsius", "raw", "v1",
+    "samples", "latest"
+  };
+
+  rfs_qid_t qid = { .path = 0x1000, .vers = 3, .type = RFS_QTFILE };
+
+  bench_case_t cases[32];
+  size_t ncases = 0;
+  rfs__9p_msg_t* m;
+
+#define ADD_CASE(N, T) \
+  do { \
+    cases[ncases].name = (N); \
+    m = &(cases[ncases].msg); \
+    ncases++; \
+    rfs__9p_msg_init(m); \
+    m->type = (T); \
+    m->tag = 1; \
+  } while(0)
+
+  ADD_CASE("Tversion", RFS__9P_TVERSION);
+  m->tag = RFS__9P_NOTAG;
+  m->params.version.msize = 8192 + RFS__9P_IOHDRSZ;
+  m->params.version.version = rfs__9p_str("9P2000");
+
+  ADD_CASE("Rversion", RFS__9P_RVERSION);
+  m->tag = RFS__9P_NOTAG;
+  m->params.version.msize = 8192 + RFS__9P_IOHDRSZ;
+  m->params.version.version = rfs__9p_str("9P2000");
+
+  ADD_CASE("Tauth", RFS__9P_TAUTH);
+  m->params.tauth.afid = 1;
+  m->params.tauth.uname = rfs__9p_str("sensor-daemon");
+  m->params.tauth.aname = rfs__9p_str("topics");
+
+  ADD_CASE("Rauth", RFS__9P_RAUTH);
+  m->params.rauth.aqid = qid;
+
+  ADD_CASE("Rerror", RFS__9P_RERROR);
+  m->params.rerror.ename = rfs__9p_str("file does not exist");
+
+  ADD_CASE("Tflush", RFS__9P_TFLUSH);
+  m->params.tflush.oldtag = 7;
+
+  ADD_CASE("Rflush", RFS__9P_RFLUSH);
+
+  ADD_CASE("Tattach", RFS__9P_TATTACH);
+  m->params.tattach.fid = 1;
+  m->params.tattach.afid = RFS__9P_NOFID;
+  m->params.tattach.uname = rfs__9p_str("sensor-daemon");
+  m->params.tattach.aname = rfs__9p_str("topics");
+
+  ADD_CASE("Rattach", RFS__9P_RATTACH);
+  m->params.rattach.qid = qid;
+
+  ADD_CASE("Twalk1", RFS__9P_TWALK);
+  m->params.twalk.fid = 1;
+  m->params.twalk.newfid = 2;
+  m->params.twalk.nwname = 1;
+  m->params.twalk.wname[0] = rfs__9p_str(path[0]);
+
+  ADD_CASE("Twalk16", RFS__9P_TWALK);
+  m->params.twalk.fid = 1;
+  m->params.twalk.newfid = 2;
+  m->params.twalk.nwname = RFS__9P_MAXWELEM;
+  for(int i = 0; i < RFS__9P_MAXWELEM; ++i)
+    m->params.twalk.wname[i] = rfs__9p_str(path[i]);
+
+  ADD_CASE("Rwalk16", RFS__9P_RWALK);
+  m->params.rwalk.nwqid = RFS__9P_MAXWELEM;
+  for(int i = 0; i < RFS__9P_MAXWELEM; ++i)
+    m->params.rwalk.wqid[i] = qid;
+
+  ADD_CASE("Topen", RFS__9P_TOPEN);
+  m->params.topen.fid = 2;
+
+  ADD_CASE("Ropen", RFS__9P_ROPEN);
+  m->params.ropen.qid = qid;
+  m->params.ropen.iounit = 8192;
+
+  ADD_CASE("Tcreate", RFS__9P_TCREATE);
+  m->params.tcreate.fid = 2;
+  m->params.tcreate.name = rfs__9p_str("subscriber-0001");
+  m->params.tcreate.perm = 0644;
+
+  ADD_CASE("Rcreate", RFS__9P_RCREATE);
+  m->params.rcreate.qid = qid;
+  m->params.rcreate.iounit = 8192;
+
+  ADD_CASE("Tread", RFS__9P_TREAD);
+  m->params.tread.fid = 2;
+  m->params.tread.offset = 65536;
+  m->params.tread.count = BENCH_PAYLOAD;
+
+  ADD_CASE("Rread128", RFS__9P_RREAD);
+  m->params.rread.count = BENCH_SMALL_PAYLOAD;
+  m->params.rread.data = _payload;
+
+  ADD_CASE("Rread64k", RFS__9P_RREAD);
+  m->params.rread.count = BENCH_PAYLOAD;
+  m->params.rread.data = _payload;
+
+  ADD_CASE("Twrite128", RFS__9P_TWRITE);
+  m->params.twrite.fid = 2;
+  m->params.twrite.count = BENCH_SMALL_PAYLOAD;
+  m->params.twrite.data = _payload;
+
+  ADD_CASE("Twrite64k", RFS__9P_TWRITE);
+  m->params.twrite.fid = 2;
+  m->params.twrite.count = BENCH_PAYLOAD;
+  m->params.twrite.data = _payload;
+
+  ADD_CASE("Rwrite", RFS__9P_RWRITE);
+  m->params.rwrite.count = BENCH_PAYLOAD;
+
+  ADD_CASE("Tclunk", RFS__9P_TCLUNK);
+  m->params.tclunk.fid = 2;
+
+  ADD_CASE("Rclunk", RFS__9P_RCLUNK);
+
+  ADD_CASE("Tremove", RFS__9P_TREMOVE);
+  m->params.tremove.fid = 2;
+
+  ADD_CASE("Rremove", RFS__9P_RREMOVE);
+
+  ADD_CASE("Tstat", RFS__9P_TSTAT);
+  m->params.tstat.fid = 2;
+
+  ADD_CASE("Rstat", RFS__9P_RSTAT);
+  m->params.rstat.stat = &_stat;
+
+  ADD_CASE("Twstat", RFS__9P_TWSTAT);
+  m->params.twstat.fid = 2;
+  m->params.twstat.stat = &_stat;
+
+  ADD_CASE("Rwstat", RFS__9P_RWSTAT);
+
+#undef ADD_CASE
+
+  assert(ncases <= sizeof(cases) / sizeof(cases[0]));
+
+  printf("case,op,iterations,bytes,ns_per_op,mb_per_s\n");
+
+  for(size_t i = 0; i < ncases; ++i)
+    bench_msg(&(cases[i]));
+
+  bench_stat();
+  bench_dirent();
+
+  return (_sink == 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,371 @@
+#include "src/rfs_9p_session.h"
+#include "src/rfs_bufpool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The number of requests made in total.
+#define CALLS 64
+
+/// @brief The number of requests the client keeps outstanding.
+#define WINDOW 8
+
+/// @brief The fid the server answers with Rerror.
+#define ERROR_FID 5
+
+/// @brief The msize the client proposes, and the one the server agrees to.
+#define PROPOSED_MSIZE (4 << 20)
+#define AGREED_MSIZE (2 << 20)
+
+/// @brief The size of the read answered in full, and of the one which is
+/// answered with more than the agreed msize.
+#define BIG_READ (1 << 20)
+#define HUGE_READ (3 << 20)
+
+static rfs__9p_session_t _session;
+static rfs__9p_call_t _calls[CALLS];
+static rfs__9p_msg_t _msgs[CALLS];
+static size_t _completed = 0;
+static int _closed = 0;
+
+/// @brief A server which reads a full window of requests and then answers
+/// them in reverse order, so every reply arrives out of order.
+static void run_server(void* arg) {
+  int fd = *(int*) arg;
+  unsigned char rbuf[4096];
+  unsigned char wbuf[256];
+
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 8192);
+
+  rfs__9p_msg_t reqs[WINDOW];
+  size_t nreqs = 0;
+  size_t total = 0;
+
+  for(;;) {
+    ssize_t nread = read(fd, rbuf, sizeof(rbuf));
+
+    if(nread <= 0)
+      break;
+
+    rfs__9p_decoder_feed(&dec, rbuf, (size_t) nread);
+
+    const unsigned char* frame;
+    size_t framelen;
+
+    while(rfs__9p_decoder_next(&dec, &frame, &framelen) == 1) {
+      rfs__9p_msg_init(&reqs[nreqs]);
+      assert(rfs__9p_msg_unpack(frame, framelen, &reqs[nreqs]) == framelen);
+      assert(reqs[nreqs].type == RFS__9P_TSTAT);
+      assert(reqs[nreqs].tag < WINDOW);
+      nreqs++;
+      total++;
+
+      if(nreqs < WINDOW && total < CALLS)
+        continue;
+
+      while(nreqs > 0) {
+        rfs__9p_msg_t* req = &reqs[--nreqs];
+        rfs__9p_stat_t stat;
+        rfs__9p_msg_t reply;
+
+        rfs__9p_stat_init(&stat);
+        stat.qid.path = req->params.tstat.fid;
+        stat.name = rfs__9p_str("file");
+
+        rfs__9p_msg_init(&reply);
+        reply.tag = req->tag;
+
+        if(req->params.tstat.fid == ERROR_FID) {
+          reply.type = RFS__9P_RERROR;
+          reply.params.rerror.ename = rfs__9p_str("no such file");
+        }
+        else {
+          reply.type = RFS__9P_RSTAT;
+          reply.params.rstat.stat = &stat;
+        }
+
+        size_t len = rfs__9p_msg_pack(&reply, wbuf, sizeof(wbuf));
+        assert(len > 0);
+
+        // the request made just before the client closes can't be answered
+        if(write(fd, wbuf, len) != (ssize_t) len)
+          goto done;
+      }
+    }
+  }
+
+done:
+  rfs__9p_decoder_reset(&dec);
+  close(fd);
+}
+
+/// @brief Write a whole buffer, as a reply may not fit in the socket.
+/// @return 0 on success, -1 if the client has gone away.
+static int write_all(int fd, const unsigned char* buf, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(fd, buf, len);
+
+    if(n <= 0)
+      return -1;
+
+    buf += n;
+    len -= (size_t) n;
+  }
+
+  return 0;
+}
+
+/// @brief A server which agrees to a smaller msize than proposed, then
+/// answers every Tread with as many bytes as asked for.
+static void run_version_server(void* arg) {
+  int fd = *(int*) arg;
+  unsigned char rbuf[4096];
+
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 8192);
+
+  for(;;) {
+    ssize_t nread = read(fd, rbuf, sizeof(rbuf));
+
+    if(nread <= 0)
+      break;
+
+    rfs__9p_decoder_feed(&dec, rbuf, (size_t) nread);
+
+    const unsigned char* frame;
+    size_t framelen;
+
+    while(rfs__9p_decoder_next(&dec, &frame, &framelen) == 1) {
+      rfs__9p_msg_t req;
+      rfs__9p_msg_t reply;
+      unsigned char* data = NULL;
+
+      rfs__9p_msg_init(&req);
+      assert(rfs__9p_msg_unpack(frame, framelen, &req) == framelen);
+
+      rfs__9p_msg_init(&reply);
+      reply.tag = req.tag;
+
+      if(req.type == RFS__9P_TVERSION) {
+        assert(req.tag == RFS__9P_NOTAG);
+        assert(req.params.version.msize == PROPOSED_MSIZE);
+        reply.type = RFS__9P_RVERSION;
+        reply.params.version.msize = AGREED_MSIZE;
+        reply.params.version.version = rfs__9p_str("9P2000");
+      }
+      else {
+        assert(req.type == RFS__9P_TREAD);
+        data = malloc(req.params.tread.count);
+        assert(data != NULL);
+
+        for(size_t i = 0; i < req.params.tread.count; ++i)
+          data[i] = (unsigned char) (i * 7);
+
+        reply.type = RFS__9P_RREAD;
+        reply.params.rread.count = req.params.tread.count;
+        reply.params.rread.data = data;
+      }
+
+      uint32_t size = rfs__9p_msg_size(&reply);
+      unsigned char* wbuf = malloc(size);
+      assert(wbuf != NULL);
+      assert(rfs__9p_msg_pack(&reply, wbuf, size) == size);
+
+      int ret = write_all(fd, wbuf, size);
+      free(wbuf);
+      free(data);
+
+      // the client hangs up on the reply larger than the msize
+      if(ret < 0)
+        goto done;
+    }
+  }
+
+done:
+  rfs__9p_decoder_reset(&dec);
+  close(fd);
+}
+
+static rfs__9p_session_t _vsession;
+static rfs__bufpool_t _pool;
+static int _versioned = 0;
+static int _big = 0;
+static int _huge = 0;
+
+static void on_vclose(rfs__9p_session_t* session) {
+  assert(session == &_vsession);
+  _closed = 1;
+}
+
+static void on_version(rfs__9p_session_t* session, int ret) {
+  assert(session == &_vsession);
+  assert(ret == 0);
+  assert(session->msize == AGREED_MSIZE);
+  _versioned = 1;
+}
+
+static void on_huge_read(rfs__9p_call_t* call, int ret,
+                         const rfs__9p_msg_t* reply) {
+  (void) call;
+  assert(ret == -EMSGSIZE);
+  assert(reply == NULL);
+  _huge = 1;
+
+  rfs__9p_session_close(&_vsession, on_vclose);
+}
+
+static void on_big_read(rfs__9p_call_t* call, int ret,
+                        const rfs__9p_msg_t* reply) {
+  (void) call;
+  assert(_versioned);
+  assert(ret == 0);
+  assert(reply->type == RFS__9P_RREAD);
+  assert(reply->params.rread.count == BIG_READ);
+
+  for(size_t i = 0; i < BIG_READ; ++i)
+    assert(reply->params.rread.data[i] == (unsigned char) (i * 7));
+
+  _big = 1;
+}
+
+/// @brief Negotiate a smaller msize than proposed, then receive a reply
+/// which only just fits and one which doesn't.
+static void test_version(void) {
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_version_server, &fds[1]) == 0);
+
+  uv_loop_t loop;
+  assert(uv_loop_init(&loop) == 0);
+  rfs__bufpool_init(&_pool, 4, RFS__BUFPOOL_HUGE);
+  assert(rfs__9p_session_init(&_vsession, &loop, fds[0], WINDOW,
+                              PROPOSED_MSIZE, &_pool) == 0);
+  assert(rfs__9p_session_version(&_vsession, on_version) == 0);
+
+  // both reads wait for the Rversion, and are then sent in order
+  rfs__9p_call_t calls[2];
+  rfs__9p_msg_t msgs[2];
+  uint32_t counts[2] = { BIG_READ, HUGE_READ };
+  rfs__9p_call_cb cbs[2] = { on_big_read, on_huge_read };
+
+  for(size_t i = 0; i < 2; ++i) {
+    rfs__9p_msg_init(&msgs[i]);
+    msgs[i].type = RFS__9P_TREAD;
+    msgs[i].params.tread.fid = 1;
+    msgs[i].params.tread.count = counts[i];
+    assert(rfs__9p_session_rpc(&_vsession, &calls[i], &msgs[i], cbs[i]) == 0);
+  }
+
+  assert(_vsession.inflight == 0);
+
+  _closed = 0;
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  assert(_versioned && _big && _huge && _closed);
+  assert(uv_loop_close(&loop) == 0);
+  uv_thread_join(&server);
+
+  // the big reply was reassembled in a pooled buffer, which was returned
+  size_t cap = rfs__bufpool_size(BIG_READ + RFS__9P_IOHDRSZ);
+  size_t c = 0;
+
+  while(((size_t) 1 << (RFS__BUFPOOL_MINSHIFT + c)) < cap)
+    c++;
+
+  assert(_pool.nfree[c] == 1);
+  rfs__bufpool_free(&_pool);
+
+  printf("negotiated an msize of %d and read %d bytes in one Rread\n",
+         AGREED_MSIZE, BIG_READ);
+}
+
+static void on_close(rfs__9p_session_t* session) {
+  assert(session == &_session);
+  _closed = 1;
+}
+
+static void on_cancelled(rfs__9p_call_t* call, int ret,
+                         const rfs__9p_msg_t* reply) {
+  assert(call->data == &_session);
+  assert(ret == -ECANCELED);
+  assert(reply == NULL);
+  _completed++;
+}
+
+static void on_stat(rfs__9p_call_t* call, int ret, const rfs__9p_msg_t* reply) {
+  size_t idx = (size_t) (call - _calls);
+
+  assert(ret == 0);
+  assert(reply != NULL);
+  assert(reply->tag == _msgs[idx].tag);
+
+  if(idx == ERROR_FID) {
+    assert(reply->type == RFS__9P_RERROR);
+  }
+  else {
+    assert(reply->type == RFS__9P_RSTAT);
+    assert(reply->params.rstat.stat->qid.path == idx);
+  }
+
+  if(++_completed < CALLS)
+    return;
+
+  // once everything has been answered, a request still waiting at close
+  // must be cancelled
+  _completed = 0;
+  _calls[0].data = &_session;
+  assert(rfs__9p_session_rpc(&_session, &_calls[0], &_msgs[0],
+                             on_cancelled) == 0);
+  rfs__9p_session_close(&_session, on_close);
+  assert(_completed == 1);
+  assert(rfs__9p_session_rpc(&_session, &_calls[0], &_msgs[0],
+                             on_cancelled) == -ECANCELED);
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  uv_loop_t loop;
+  assert(uv_loop_init(&loop) == 0);
+  assert(rfs__9p_session_init(&_session, &loop, fds[0], WINDOW, 8192,
+                              NULL) == 0);
+
+  for(size_t i = 0; i < CALLS; ++i) {
+    rfs__9p_msg_init(&_msgs[i]);
+    _msgs[i].type = RFS__9P_TSTAT;
+    _msgs[i].params.tstat.fid = (uint32_t) i;
+
+    assert(rfs__9p_session_rpc(&_session, &_calls[i], &_msgs[i], on_stat) == 0);
+  }
+
+  assert(_session.inflight == WINDOW);
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  assert(_closed);
+  assert(uv_loop_close(&loop) == 0);
+  uv_thread_join(&server);
+
+  printf("%d requests completed over a window of %d\n", CALLS, WINDOW);
+
+  test_version();
+
+  return EXIT_SUCCESS;
+}
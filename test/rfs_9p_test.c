@@ -1,12 +1,21 @@
+#include "src/rfs_9p_ids.h"
+#include "src/rfs_bufpool.h"
+#include "src/rfs_9p_pool.h"
 #include "src/rfs_9p_wire.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <uv.h>
+
+/// @brief Expand a counted string into the arguments for a %.*s format.
+#define STR_ARG(S) (int) (S).len, (S).str
+
 static void print_qid(rfs_qid_t* qid) {
   printf("Path: %" PRIu64 ", Version: %" PRIu32 ", Type: %" PRIu8 "\n",
          qid->path, qid->vers, qid->type);
@@ -14,8 +23,8 @@ static void print_qid(rfs_qid_t* qid) {
 
 static void print_stat(rfs__9p_stat_t* stat) {
   printf("----- File info -----\n");
-  printf("Name: '%s'\n", stat->name);
-  printf("Owner: '%s'/'%s'\n", stat->uid, stat->gid);
+  printf("Name: '%.*s'\n", STR_ARG(stat->name));
+  printf("Owner: '%.*s'/'%.*s'\n", STR_ARG(stat->uid), STR_ARG(stat->gid));
   printf("Type: %" PRIu16 ", Device: %" PRIu32 ", Mode: %" PRIu32 "\n",
          stat->type, stat->dev, stat->mode);
   printf("Size: %" PRIu64 " bytes\n", stat->length);
@@ -23,7 +32,7 @@ static void print_stat(rfs__9p_stat_t* stat) {
 
   time_t mtime = (time_t) stat->mtime;
   time_t atime = (time_t) stat->atime;
-  printf("Last modified by '%s' on %s", stat->muid, ctime(&mtime));
+  printf("Last modified by '%.*s' on %s", STR_ARG(stat->muid), ctime(&mtime));
   printf("File created at %s", ctime(&atime));
   printf("-----\n\n");
 }
@@ -36,8 +45,8 @@ static void print_msg(rfs__9p_msg_t* msg) {
   switch(msg->type) {
     case RFS__9P_TVERSION:
     case RFS__9P_RVERSION:
-      printf("Max size: %" PRIu32 ", Version: '%s'\n",
-             msg->params.version.msize, msg->params.version.version);
+      printf("Max size: %" PRIu32 ", Version: '%.*s'\n",
+             msg->params.version.msize, STR_ARG(msg->params.version.version));
       break;
 
     case RFS__9P_TWALK:
@@ -47,7 +56,7 @@ static void print_msg(rfs__9p_msg_t* msg) {
 
       printf("Path: ");
       for(uint16_t i = 0; i < msg->params.twalk.nwname; ++i) {
-        printf("%s", msg->params.twalk.wname[i]);
+        printf("%.*s", STR_ARG(msg->params.twalk.wname[i]));
 
         if((i - 1) != msg->params.twalk.nwname)
           printf("/");
@@ -92,10 +101,10 @@ static void test_stat(void) {
   stat.mode = 654321;
   stat.atime = stat.mtime = time(NULL);
   stat.length = 123123412345;
-  stat.name = strdup("test_file");
-  stat.uid = strdup("user@localhost");
-  stat.gid = strdup("group@localhost");
-  stat.muid = strdup("moduser@localhost");
+  stat.name = rfs__9p_str("test_file");
+  stat.uid = rfs__9p_str("user@localhost");
+  stat.gid = rfs__9p_str("group@localhost");
+  stat.muid = rfs__9p_str("moduser@localhost");
 
   print_stat(&stat);
 
@@ -129,7 +138,7 @@ static void test_msg_version(void) {
   msg.type = RFS__9P_TVERSION;
   msg.tag = RFS__9P_NOTAG;
   msg.params.version.msize = UINT8_MAX;
-  msg.params.version.version = strdup("9P2000");
+  msg.params.version.version = rfs__9p_str("9P2000");
 
   print_msg(&msg);
 
@@ -167,12 +176,12 @@ static void test_msg_twalk(void) {
   msg.params.twalk.fid = 15243;
   msg.params.twalk.newfid = 15243;
   msg.params.twalk.nwname = 6;
-  msg.params.twalk.wname[0] = strdup("");
-  msg.params.twalk.wname[1] = strdup("home");
-  msg.params.twalk.wname[2] = strdup("robert");
-  msg.params.twalk.wname[3] = strdup("Documents");
-  msg.params.twalk.wname[4] = strdup("repos");
-  msg.params.twalk.wname[5] = strdup("rfs");
+  msg.params.twalk.wname[0] = rfs__9p_str("");
+  msg.params.twalk.wname[1] = rfs__9p_str("home");
+  msg.params.twalk.wname[2] = rfs__9p_str("robert");
+  msg.params.twalk.wname[3] = rfs__9p_str("Documents");
+  msg.params.twalk.wname[4] = rfs__9p_str("repos");
+  msg.params.twalk.wname[5] = rfs__9p_str("rfs");
 
   print_msg(&msg);
 
@@ -193,6 +202,19 @@ static void test_msg_twalk(void) {
 
   printf("After deserializing, there were %zu bytes parsed\n\n", unpack);
 
+  // unpacking doesn't modify the buffer, so it can be decoded again
+  rfs__9p_msg_t again;
+  rfs__9p_msg_init(&again);
+  assert(rfs__9p_msg_unpack(buf, slen, &again) == unpack);
+  assert(again.params.twalk.nwname == ret.params.twalk.nwname);
+
+  for(uint16_t i = 0; i < again.params.twalk.nwname; ++i) {
+    assert(again.params.twalk.wname[i].len == ret.params.twalk.wname[i].len);
+    assert(memcmp(again.params.twalk.wname[i].str,
+                  ret.params.twalk.wname[i].str,
+                  again.params.twalk.wname[i].len) == 0);
+  }
+
   print_msg(&ret);
   free(buf);
 }
@@ -237,11 +259,490 @@ static void test_msg_rwalk(void) {
   free(buf);
 }
 
+static void test_msg_sizes(void) {
+  printf("----- Testing message sizing -----\n\n");
+
+  rfs__9p_msg_t msg;
+  rfs__9p_msg_init(&msg);
+
+  // the size of a qid on the wire is 13 bytes, not sizeof(rfs_qid_t)
+  rfs_qid_t qid = { .path = 42, .vers = 1, .type = RFS_QTAUTH };
+  msg.type = RFS__9P_RAUTH;
+  msg.tag = 3;
+  msg.params.rauth.aqid = qid;
+  assert(rfs__9p_msg_size(&msg) == RFS__9P_HDRSZ + 13);
+
+  msg.type = RFS__9P_TCREATE;
+  msg.params.tcreate.fid = 9;
+  msg.params.tcreate.name = rfs__9p_str("subscriber");
+  msg.params.tcreate.perm = 0644;
+  msg.params.tcreate.mode = 1;
+
+  uint32_t size = rfs__9p_msg_size(&msg);
+  unsigned char buf[64];
+  assert(size <= sizeof(buf));
+
+  // a buffer which is too small must be rejected without being overrun
+  memset(buf, 0xAA, sizeof(buf));
+  assert(rfs__9p_msg_pack(&msg, buf, size - 1) == 0);
+  assert(buf[size - 1] == 0xAA);
+
+  assert(rfs__9p_msg_pack(&msg, buf, sizeof(buf)) == size);
+  printf("Tcreate packed into %" PRIu32 " bytes\n", size);
+
+  printf("-----\n\n");
+}
+
+static void test_dirent(void) {
+  printf("----- Testing directory read decoding -----\n\n");
+
+  const size_t nstats = 1000;
+  size_t bufsize = nstats * 128;
+  unsigned char* buf = malloc(bufsize);
+  assert(buf != NULL);
+
+  size_t len = 0;
+  for(size_t i = 0; i < nstats; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "topic-%zu", i);
+
+    rfs__9p_stat_t stat;
+    rfs__9p_stat_init(&stat);
+    stat.qid.path = i;
+    stat.qid.vers = (uint32_t) i * 2;
+    stat.length = i * 10;
+    stat.name = rfs__9p_str(name);
+    stat.uid = rfs__9p_str("glenda");
+    stat.gid = rfs__9p_str("sys");
+    stat.muid = rfs__9p_str("");
+
+    size_t ret = rfs__9p_stat_pack(&stat, buf + len, bufsize - len);
+    assert(ret > 0);
+    len += ret;
+  }
+
+  size_t strsize;
+  assert(rfs__9p_dirent_count(buf, len, &strsize) == (int) nstats);
+
+  rfs_dirent_t* ents = malloc(sizeof(rfs_dirent_t) * nstats);
+  char* arena = malloc(strsize);
+  assert(ents != NULL && arena != NULL);
+
+  size_t used;
+  int count = rfs__9p_dirent_unpack(buf, len, ents, nstats,
+                                    arena, strsize, &used);
+  assert(count == (int) nstats);
+  assert(used == len);
+
+  for(size_t i = 0; i < nstats; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "topic-%zu", i);
+
+    assert(strcmp(ents[i].name, name) == 0);
+    assert(strcmp(ents[i].uid, "glenda") == 0);
+    assert(strcmp(ents[i].muid, "") == 0);
+    assert(ents[i].qid.path == i);
+    assert(ents[i].length == i * 10);
+  }
+
+  printf("Decoded %d entries with %zu bytes of strings\n", count, strsize);
+
+  // a short arena stops decoding at an entry boundary
+  count = rfs__9p_dirent_unpack(buf, len, ents, nstats, arena, 39, &used);
+  assert(count == 1);
+  assert(rfs__9p_dirent_unpack(buf + used, len - used, ents, nstats,
+                               arena, strsize, &used) == (int) nstats - 1);
+
+  // a truncated record is rejected
+  assert(rfs__9p_dirent_count(buf, len - 1, &strsize) == -EBADMSG);
+
+  free(arena);
+  free(ents);
+  free(buf);
+  printf("-----\n\n");
+}
+
+/// @brief Feed a stream of frames to a decoder in chunks of varying size.
+/// @param [in] stream The packed frames.
+/// @param [in] len The size of stream.
+/// @param [in] maxchunk The largest chunk to feed; chunk sizes cycle from 1.
+/// @param [in] types The expected types of the frames, in order.
+/// @param [in] ntypes The number of expected frames.
+static void decode_chunked(const unsigned char* stream,
+                           size_t len,
+                           size_t maxchunk,
+                           const uint8_t* types,
+                           size_t ntypes) {
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 8192);
+
+  size_t off = 0;
+  size_t chunk = 1;
+  size_t frames = 0;
+
+  while(off < len) {
+    size_t clen = (len - off < chunk ? len - off : chunk);
+    rfs__9p_decoder_feed(&dec, stream + off, clen);
+    off += clen;
+    chunk = (chunk % maxchunk) + 1;
+
+    const unsigned char* frame;
+    size_t framelen;
+    int ret;
+
+    while((ret = rfs__9p_decoder_next(&dec, &frame, &framelen)) == 1) {
+      assert(frames < ntypes);
+
+      rfs__9p_msg_t msg;
+      rfs__9p_msg_init(&msg);
+      assert(rfs__9p_msg_unpack(frame, framelen, &msg) == framelen);
+      assert(msg.type == types[frames]);
+      frames++;
+    }
+
+    assert(ret == 0);
+  }
+
+  assert(frames == ntypes);
+  printf("Decoded %zu frames from %zu bytes in chunks of up to %zu bytes\n",
+         frames, len, maxchunk);
+
+  rfs__9p_decoder_reset(&dec);
+}
+
+static void test_decoder(void) {
+  printf("----- Testing streaming frame decoding -----\n\n");
+
+  unsigned char stream[1024];
+  size_t len = 0;
+  const uint8_t types[] = { RFS__9P_TVERSION, RFS__9P_TWALK, RFS__9P_RWALK };
+
+  rfs__9p_msg_t msg;
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TVERSION;
+  msg.tag = RFS__9P_NOTAG;
+  msg.params.version.msize = 8192;
+  msg.params.version.version = rfs__9p_str("9P2000");
+  len += rfs__9p_msg_pack(&msg, stream + len, sizeof(stream) - len);
+  rfs__9p_msg_reset(&msg);
+
+  msg.type = RFS__9P_TWALK;
+  msg.tag = 1;
+  msg.params.twalk.fid = 1;
+  msg.params.twalk.newfid = 2;
+  msg.params.twalk.nwname = 2;
+  msg.params.twalk.wname[0] = rfs__9p_str("topics");
+  msg.params.twalk.wname[1] = rfs__9p_str("weather");
+  len += rfs__9p_msg_pack(&msg, stream + len, sizeof(stream) - len);
+  rfs__9p_msg_reset(&msg);
+
+  rfs_qid_t qid = { .path = 1, .vers = 2, .type = RFS_QTDIR };
+  msg.type = RFS__9P_RWALK;
+  msg.tag = 1;
+  msg.params.rwalk.nwqid = 1;
+  msg.params.rwalk.wqid[0] = qid;
+  len += rfs__9p_msg_pack(&msg, stream + len, sizeof(stream) - len);
+  rfs__9p_msg_reset(&msg);
+
+  decode_chunked(stream, len, len, types, 3);
+  decode_chunked(stream, len, 1, types, 3);
+  decode_chunked(stream, len, 5, types, 3);
+  decode_chunked(stream, len, 13, types, 3);
+
+  // a frame larger than the limit must be rejected
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 16);
+  rfs__9p_decoder_feed(&dec, stream, len);
+
+  const unsigned char* frame;
+  size_t framelen;
+  assert(rfs__9p_decoder_next(&dec, &frame, &framelen) == -EMSGSIZE);
+  rfs__9p_decoder_reset(&dec);
+
+  printf("-----\n\n");
+}
+
+static void test_msg_pack_iov(void) {
+  printf("----- Testing scatter/gather packing -----\n\n");
+
+  size_t datalen = 64 * 1024;
+  unsigned char* data = malloc(datalen);
+  assert(data != NULL);
+
+  for(size_t i = 0; i < datalen; ++i)
+    data[i] = (unsigned char) i;
+
+  const uint8_t types[] = { RFS__9P_TWRITE, RFS__9P_RREAD };
+
+  for(size_t t = 0; t < sizeof(types); ++t) {
+    rfs__9p_msg_t msg;
+    rfs__9p_msg_init(&msg);
+    msg.type = types[t];
+    msg.tag = 7;
+
+    if(msg.type == RFS__9P_TWRITE) {
+      msg.params.twrite.fid = 3;
+      msg.params.twrite.offset = 4096;
+      msg.params.twrite.count = datalen;
+      msg.params.twrite.data = data;
+    }
+    else {
+      msg.params.rread.count = datalen;
+      msg.params.rread.data = data;
+    }
+
+    unsigned char hdr[RFS__9P_IOHDRSZ];
+    struct iovec iov[2];
+    int niov = rfs__9p_msg_pack_iov(&msg, hdr, sizeof(hdr), iov);
+
+    assert(niov == 2);
+    assert(iov[1].iov_base == data);
+    assert(iov[0].iov_len + iov[1].iov_len == msg.size);
+
+    // the vector must describe exactly what the copying pack produces
+    unsigned char* flat = malloc(msg.size);
+    assert(flat != NULL);
+    assert(rfs__9p_msg_pack(&msg, flat, msg.size) == msg.size);
+    assert(memcmp(flat, iov[0].iov_base, iov[0].iov_len) == 0);
+    assert(memcmp(flat + iov[0].iov_len, iov[1].iov_base,
+                  iov[1].iov_len) == 0);
+
+    printf("Type %" PRIu8 ": %zu header bytes, %zu payload bytes referenced\n",
+           msg.type, iov[0].iov_len, iov[1].iov_len);
+    free(flat);
+  }
+
+  free(data);
+  printf("-----\n\n");
+}
+
+static void test_pool(void) {
+  printf("----- Testing pooled request decoding -----\n\n");
+
+  rfs__arena_t arena;
+  rfs__arena_init(&arena, 64);
+
+  // allocations are aligned, spill into new chunks, and larger-than-chunk
+  // requests get a chunk of their own
+  unsigned char* a = rfs__arena_alloc(&arena, 3);
+  unsigned char* b = rfs__arena_alloc(&arena, 40);
+  unsigned char* c = rfs__arena_alloc(&arena, 500);
+  assert(a != NULL && b != NULL && c != NULL);
+  assert(((uintptr_t) a % RFS__ARENA_ALIGN) == 0);
+  assert(((uintptr_t) b % RFS__ARENA_ALIGN) == 0);
+  assert(b == a + RFS__ARENA_ALIGN);
+  memset(c, 0xff, 500);
+
+  // after a reset the same memory is handed out again
+  rfs__arena_reset(&arena);
+  assert(rfs__arena_alloc(&arena, 3) == a);
+  rfs__arena_free(&arena);
+
+  rfs__9p_stat_t stat;
+  rfs__9p_stat_init(&stat);
+  stat.qid.path = 42;
+  stat.name = rfs__9p_str("weather");
+  stat.uid = rfs__9p_str("glenda");
+  stat.gid = rfs__9p_str("glenda");
+  stat.muid = rfs__9p_str("glenda");
+
+  rfs__9p_msg_t msg;
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_RSTAT;
+  msg.tag = 7;
+  msg.params.rstat.stat = &stat;
+
+  unsigned char frame[256];
+  size_t framelen = rfs__9p_msg_pack(&msg, frame, sizeof(frame));
+  assert(framelen > 0);
+
+  rfs__9p_pool_t pool;
+  rfs__9p_pool_init(&pool, 1, 128);
+
+  rfs__9p_req_t* req = rfs__9p_pool_get(&pool);
+  assert(req != NULL);
+  assert(rfs__9p_req_unpack(req, frame, framelen) == 0);
+
+  // the request must not reference the caller's buffer
+  memset(frame, 0, sizeof(frame));
+  assert(req->msg.type == RFS__9P_RSTAT);
+  assert(req->msg.params.rstat.stat == &(req->stat));
+  assert(req->stat.qid.path == 42);
+  assert(req->stat.name.len == 7);
+  assert(memcmp(req->stat.name.str, "weather", 7) == 0);
+
+  // a returned request is reused, and the pool keeps no more than maxfree
+  rfs__9p_req_t* other = rfs__9p_pool_get(&pool);
+  assert(other != NULL && other != req);
+  rfs__9p_pool_put(&pool, req);
+  rfs__9p_pool_put(&pool, other);
+  assert(pool.nfree == 1);
+  assert(rfs__9p_pool_get(&pool) == req);
+  assert(rfs__9p_req_unpack(req, frame, 3) == -EBADMSG);
+  rfs__9p_pool_put(&pool, req);
+
+  rfs__9p_pool_free(&pool);
+
+  printf("-----\n\n");
+}
+
+static void test_bufpool(void) {
+  printf("----- Testing pooled frame buffers -----\n\n");
+
+  assert(rfs__bufpool_size(0) == 4096);
+  assert(rfs__bufpool_size(4097) == 8192);
+  assert(rfs__bufpool_size(RFS__BUFPOOL_MAXSZ) == RFS__BUFPOOL_MAXSZ);
+  assert(rfs__bufpool_size(RFS__BUFPOOL_MAXSZ + 1) == 0);
+
+  rfs__bufpool_t pool;
+  rfs__bufpool_init(&pool, 1, RFS__BUFPOOL_HUGE);
+
+  // buffers are page aligned, both malloc'd and mapped, and reused
+  unsigned char* a = rfs__bufpool_get(&pool, 100);
+  unsigned char* b = rfs__bufpool_get(&pool, 4096);
+  unsigned char* c = rfs__bufpool_get(&pool, RFS__BUFPOOL_HUGESZ + 1);
+  assert(a != NULL && b != NULL && c != NULL);
+  assert(((uintptr_t) a % 4096) == 0);
+  assert(((uintptr_t) c % 4096) == 0);
+  memset(c, 0xff, 2 * RFS__BUFPOOL_HUGESZ);
+
+  rfs__bufpool_put(&pool, a, 100);
+  rfs__bufpool_put(&pool, b, 4096);
+  assert(pool.nfree[0] == 1);
+  assert(rfs__bufpool_get(&pool, 10) == a);
+  rfs__bufpool_put(&pool, a, 4096);
+  rfs__bufpool_put(&pool, c, RFS__BUFPOOL_HUGESZ + 1);
+  assert(rfs__bufpool_get(&pool, 3 * (RFS__BUFPOOL_HUGESZ / 2)) == c);
+  rfs__bufpool_put(&pool, c, 2 * RFS__BUFPOOL_HUGESZ);
+  assert(rfs__bufpool_get(&pool, RFS__BUFPOOL_MAXSZ + 1) == NULL);
+
+  // a split frame is read straight into the decoder's pooled buffer
+  unsigned char frame[10000];
+  rfs__9p_msg_t msg;
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_RREAD;
+  msg.tag = 3;
+  msg.params.rread.count = sizeof(frame) - 11;
+  msg.params.rread.data = frame + 11;
+
+  for(size_t i = 0; i < sizeof(frame); ++i)
+    frame[i] = (unsigned char) i;
+
+  assert(rfs__9p_msg_pack(&msg, frame, sizeof(frame)) == sizeof(frame));
+
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 16384);
+  dec.pool = &pool;
+
+  unsigned char* space;
+  const unsigned char* out;
+  size_t outlen;
+  assert(rfs__9p_decoder_space(&dec, &space) == 0);
+  rfs__9p_decoder_feed(&dec, frame, 100);
+  assert(rfs__9p_decoder_next(&dec, &out, &outlen) == 0);
+  assert(rfs__9p_decoder_space(&dec, &space) == sizeof(frame) - 100);
+  memcpy(space, frame + 100, sizeof(frame) - 100);
+  rfs__9p_decoder_fill(&dec, sizeof(frame) - 100);
+  assert(rfs__9p_decoder_space(&dec, &space) == 0);
+  assert(rfs__9p_decoder_next(&dec, &out, &outlen) == 1);
+  assert(outlen == sizeof(frame));
+  assert(memcmp(out, frame, sizeof(frame)) == 0);
+
+  // the buffer goes back to the pool once the frame is done with
+  assert(rfs__9p_decoder_next(&dec, &out, &outlen) == 0);
+  assert(pool.nfree[2] == 1);
+  rfs__9p_decoder_reset(&dec);
+
+  rfs__bufpool_free(&pool);
+
+  printf("-----\n\n");
+}
+
+/// @brief The number of threads allocating fids concurrently.
+#define FID_THREADS 4
+
+/// @brief The number of fids each thread holds at once.
+#define FID_HELD 256
+
+static void fid_worker(void* arg) {
+  rfs__9p_fids_t* fids = arg;
+  uint32_t held[FID_HELD];
+
+  for(int round = 0; round < 200; ++round) {
+    for(size_t i = 0; i < FID_HELD; ++i) {
+      held[i] = rfs__9p_fid_acquire(fids);
+      assert(held[i] != RFS__9P_NOFID);
+    }
+
+    for(size_t i = 0; i < FID_HELD; ++i)
+      rfs__9p_fid_release(fids, held[i]);
+  }
+}
+
+static void test_ids(void) {
+  printf("----- Testing tag and fid allocation -----\n\n");
+
+  rfs__9p_tags_t* tags = malloc(sizeof(rfs__9p_tags_t));
+  assert(tags != NULL);
+  rfs__9p_tags_init(tags);
+
+  // every tag but NOTAG can be allocated, lowest first
+  for(uint32_t i = 0; i < RFS__9P_NOTAG; ++i)
+    assert(rfs__9p_tag_acquire(tags) == i);
+
+  assert(tags->used == RFS__9P_NOTAG);
+  assert(rfs__9p_tag_acquire(tags) == RFS__9P_NOTAG);
+
+  rfs__9p_tag_release(tags, 4097);
+  rfs__9p_tag_release(tags, 12);
+  assert(rfs__9p_tag_acquire(tags) == 12);
+  assert(rfs__9p_tag_acquire(tags) == 4097);
+  assert(rfs__9p_tag_acquire(tags) == RFS__9P_NOTAG);
+  free(tags);
+
+  // a range which isn't a multiple of the word size is honoured exactly
+  rfs__9p_fids_t fids;
+  assert(rfs__9p_fids_init(&fids, 100) == 0);
+
+  for(uint32_t i = 0; i < 100; ++i)
+    assert(rfs__9p_fid_acquire(&fids) == i);
+
+  assert(rfs__9p_fid_acquire(&fids) == RFS__9P_NOFID);
+  rfs__9p_fid_release(&fids, 3);
+  assert(rfs__9p_fid_acquire(&fids) == 3);
+  rfs__9p_fids_free(&fids);
+
+  // threads holding exactly the whole range between them must never fail
+  // to allocate, and so never be handed a fid another thread holds
+  assert(rfs__9p_fids_init(&fids, FID_THREADS * FID_HELD) == 0);
+
+  uv_thread_t threads[FID_THREADS];
+  for(size_t i = 0; i < FID_THREADS; ++i)
+    assert(uv_thread_create(&threads[i], fid_worker, &fids) == 0);
+
+  for(size_t i = 0; i < FID_THREADS; ++i)
+    uv_thread_join(&threads[i]);
+
+  for(size_t i = 0; i < fids.nwords; ++i)
+    assert(fids.words[i] == 0);
+
+  rfs__9p_fids_free(&fids);
+
+  printf("-----\n\n");
+}
+
 int main(void) {
   test_stat();
   test_msg_version();
   test_msg_twalk();
   test_msg_rwalk();
+  test_msg_sizes();
+  test_dirent();
+  test_decoder();
+  test_msg_pack_iov();
+  test_pool();
+  test_bufpool();
+  test_ids();
 
   return EXIT_SUCCESS;
 }
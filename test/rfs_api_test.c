@@ -1,14 +1,107 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "rfs/rfs.h"
 
+/// @brief The number of asynchronous requests to keep in flight.
+#define ASYNC_REQS 100
+
+static int _completed = 0;
+
+static void on_bind(int ret, void* data) {
+  if(ret != 0)
+    fprintf(stdout, "rfs_bind_async %ld returned %d\n", (long) data, ret);
+
+  __atomic_add_fetch(&_completed, 1, __ATOMIC_RELEASE);
+}
+
+/// @brief The number of asynchronous binds the racing thread submitted.
+static int _raced = 0;
+
+/// @brief The number of raced binds which were run or cancelled.
+static int _settled = 0;
+
+static void on_raced(int ret, void* data) {
+  (void) ret;
+  (void) data;
+
+  __atomic_add_fetch(&_settled, 1, __ATOMIC_RELEASE);
+}
+
+/// @brief Submit asynchronous binds until the client has shut down, so that
+/// some are in flight while rfs_deinit() stops the worker.
+static void* race_deinit(void* arg) {
+  (void) arg;
+
+  for(;;) {
+    int ret = rfs_bind_async("race", "file b", 0, on_raced, NULL);
+
+    if(ret == 0)
+      __atomic_add_fetch(&_raced, 1, __ATOMIC_RELAXED);
+    else if(ret != -EAGAIN)
+      break;
+  }
+
+  return NULL;
+}
+
 int main(void) {
   rfs_init();
   int ret = rfs_bind("file a", "file b", 0);
   fprintf(stdout, "rfs_bind returned %d\n", ret);
+
+  for(long i = 0; i < ASYNC_REQS; ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "async %ld", i);
+
+    ret = rfs_bind_async(name, "file b", 0, on_bind, (void*) i);
+
+    if(ret != 0)
+      fprintf(stdout, "rfs_bind_async returned %d\n", ret);
+  }
+
+  while(__atomic_load_n(&_completed, __ATOMIC_ACQUIRE) < ASYNC_REQS)
+    usleep(1000);
+
+  fprintf(stdout, "%d async binds completed\n", _completed);
+
+  rfs_batch_t* batch = rfs_batch_new();
+
+  int idx = rfs_batch_bind(batch, "batch a", "file b", RFS_MAFTER);
+  rfs_batch_bind(batch, "batch b", "file b", RFS_MAFTER);
+  rfs_batch_unmount(batch, "batch a", "file b");
+
+  ret = rfs_batch_submit(batch);
+  fprintf(stdout, "rfs_batch_submit returned %d, first bind returned %d\n",
+          ret, rfs_batch_ret(batch, idx));
+  rfs_batch_free(batch);
+
+  int fds[2];
+  if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+    ret = rfs_mount(fds[0], -1, "/n/srv", RFS_MREPL, "");
+    fprintf(stdout, "rfs_mount returned %d\n", ret);
+
+    ret = rfs_unmount(NULL, "/n/srv");
+    fprintf(stdout, "rfs_unmount returned %d\n", ret);
+
+    close(fds[1]);
+  }
+
+  pthread_t racer;
+  int raced = (pthread_create(&racer, NULL, race_deinit, NULL) == 0);
+
   rfs_deinit();
+
+  if(raced) {
+    pthread_join(racer, NULL);
+
+    // every accepted request is either run or cancelled, never dropped
+    fprintf(stdout, "%d of %d raced binds completed\n",
+            __atomic_load_n(&_settled, __ATOMIC_ACQUIRE), _raced);
+  }
  
   return 0;
 }
-
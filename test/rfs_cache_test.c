@@ -0,0 +1,420 @@
+#include "src/rfs_acache.h"
+#include "src/rfs_bcache.h"
+#include "src/rfs_dcache.h"
+#include "src/rfs_wcache.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rfs/rfs.h"
+
+static rfs_qid_t make_qid(uint64_t path, uint32_t vers, uint8_t type) {
+  rfs_qid_t qid = { .path = path, .vers = vers, .type = type };
+  return qid;
+}
+
+static int get(rfs__wcache_t* cache, rfs__ns_mnt_t* mnt, const char* path,
+               rfs_qid_t* qid) {
+  return rfs__wcache_get(cache, mnt, path, strlen(path), qid);
+}
+
+static void put(rfs__wcache_t* cache, rfs__ns_mnt_t* mnt, const char* path,
+                const rfs_qid_t* qid) {
+  assert(rfs__wcache_put(cache, mnt, path, strlen(path), qid) == 0);
+}
+
+static void test_wcache(void) {
+  printf("----- Testing the walk cache -----\n\n");
+
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, NULL);
+
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(0, "", NULL);
+  rfs__ns_mnt_t* other = rfs__ns_mnt_new(0, "", NULL);
+  assert(mnt != NULL && other != NULL);
+
+  rfs__wcache_t cache;
+  assert(rfs__wcache_init(&cache, 64) == 0);
+
+  rfs_qid_t root = make_qid(1, 0, RFS_QTDIR);
+  rfs_qid_t qid;
+
+  // nothing below an uncached directory can be cached
+  put(&cache, mnt, "/topics", &root);
+  assert(get(&cache, mnt, "/topics", &qid) == 0);
+
+  put(&cache, mnt, "/", &root);
+  assert(get(&cache, mnt, "/", &qid) == 1 && qid.path == 1);
+  assert(get(&cache, other, "/", &qid) == 0);
+
+  // a walk caches every prefix, and the element it stopped at as missing
+  rfs__9p_msg_t tw;
+  rfs__9p_msg_init(&tw);
+  tw.type = RFS__9P_TWALK;
+  tw.params.twalk.nwname = 3;
+  tw.params.twalk.wname[0] = rfs__9p_str("topics");
+  tw.params.twalk.wname[1] = rfs__9p_str("weather");
+  tw.params.twalk.wname[2] = rfs__9p_str("rain");
+
+  rfs__9p_msg_t rw;
+  rfs__9p_msg_init(&rw);
+  rw.type = RFS__9P_RWALK;
+  rw.params.rwalk.nwqid = 2;
+  rw.params.rwalk.wqid[0] = make_qid(2, 0, RFS_QTDIR);
+  rw.params.rwalk.wqid[1] = make_qid(3, 7, RFS_QTDIR);
+
+  assert(rfs__wcache_walked(&cache, mnt, "/", &tw, &rw) == 0);
+  assert(get(&cache, mnt, "/topics", &qid) == 1 && qid.path == 2);
+  assert(get(&cache, mnt, "/topics/weather", &qid) == 1 && qid.vers == 7);
+  assert(get(&cache, mnt, "/topics/weather/rain", &qid) == -ENOENT);
+  assert(get(&cache, mnt, "/topics/news", &qid) == 0);
+
+  // ".." is resolved before caching
+  tw.params.twalk.nwname = 2;
+  tw.params.twalk.wname[0] = rfs__9p_str("..");
+  tw.params.twalk.wname[1] = rfs__9p_str("news");
+  rw.params.rwalk.nwqid = 2;
+  rw.params.rwalk.wqid[0] = root;
+  rw.params.rwalk.wqid[1] = make_qid(4, 0, RFS_QTDIR);
+  assert(rfs__wcache_walked(&cache, mnt, "/topics", &tw, &rw) == 0);
+  assert(get(&cache, mnt, "/news", &qid) == 1 && qid.path == 4);
+
+  // a new version of a directory invalidates everything beneath it
+  put(&cache, mnt, "/topics/weather/snow", NULL);
+  put(&cache, mnt, "/topics", &((rfs_qid_t) { .path = 2, .vers = 1,
+                                              .type = RFS_QTDIR }));
+  assert(get(&cache, mnt, "/topics", &qid) == 1 && qid.vers == 1);
+  assert(get(&cache, mnt, "/topics/weather", &qid) == 0);
+  assert(get(&cache, mnt, "/topics/weather/snow", &qid) == 0);
+  assert(get(&cache, mnt, "/news", &qid) == 1);
+
+  // unmounting invalidates everything about the mount
+  assert(rfs__ns_mount(&ns, mnt, "/n", RFS_MREPL) == 0);
+  assert(rfs__ns_unmount(&ns, NULL, "/n") == 0);
+  assert(get(&cache, mnt, "/", &qid) == 0);
+  assert(get(&cache, mnt, "/news", &qid) == 0);
+
+  // eviction keeps the cache bounded
+  put(&cache, mnt, "/", &root);
+  char path[32];
+
+  for(int i = 0; i < 200; ++i) {
+    snprintf(path, sizeof(path), "/f%d", i);
+    put(&cache, mnt, path, &root);
+    assert(cache.count <= cache.cap);
+  }
+
+  assert(get(&cache, mnt, "/f199", &qid) == 1);
+
+  rfs__wcache_free(&cache);
+  rfs__ns_mnt_unref(&ns, mnt);
+  rfs__ns_mnt_unref(&ns, other);
+  rfs__ns_free(&ns);
+
+  printf("-----\n\n");
+}
+
+static void test_bcache(void) {
+  printf("----- Testing the content cache -----\n\n");
+
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, NULL);
+
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(RFS_MCACHE, "", NULL);
+  rfs__ns_mnt_t* nocache = rfs__ns_mnt_new(0, "", NULL);
+  assert(mnt != NULL && nocache != NULL);
+
+  rfs__bcache_t cache;
+  assert(rfs__bcache_init(&cache, 4 * 64, 64) == 0);
+
+  unsigned char file[200];
+  for(size_t i = 0; i < sizeof(file); ++i)
+    file[i] = (unsigned char) i;
+
+  rfs_qid_t qid = make_qid(9, 1, RFS_QTFILE);
+  unsigned char buf[256];
+  int eof;
+
+  // the whole file in one short read: 3 whole blocks and the final part
+  rfs__bcache_validate(&cache, mnt, &qid, NULL);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 10, &eof) == 0);
+  rfs__bcache_fill(&cache, mnt, &qid, 0, file, sizeof(file), 256);
+
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 256, &eof) == 200);
+  assert(eof == 1);
+  assert(memcmp(buf, file, sizeof(file)) == 0);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 70, buf, 10, &eof) == 10);
+  assert(eof == 0 && buf[0] == 70);
+
+  // mounts without RFS_MCACHE never use the cache
+  rfs__bcache_fill(&cache, nocache, &qid, 0, file, sizeof(file), 256);
+  assert(rfs__bcache_read(&cache, nocache, &qid, 0, buf, 10, &eof) == 0);
+
+  // writes are applied to the cached content, including past the end
+  unsigned char patch[8] = { 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa, 0xaa };
+  rfs__bcache_write(&cache, mnt, &qid, 60, patch, sizeof(patch));
+  rfs__bcache_write(&cache, mnt, &qid, 204, patch, 4);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 56, buf, 16, &eof) == 16);
+  assert(buf[3] == 59 && buf[4] == 0xaa && buf[11] == 0xaa && buf[12] == 68);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 196, buf, 64, &eof) == 12);
+  assert(eof == 1);
+  assert(buf[3] == 199 && buf[4] == 0 && buf[7] == 0 && buf[8] == 0xaa);
+
+  // a new version discards the file's content
+  qid.vers = 2;
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 10, &eof) == 0);
+  rfs__bcache_validate(&cache, mnt, &qid, NULL);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 10, &eof) == 0);
+
+  // reads which don't line up with blocks only cache the whole blocks
+  rfs__bcache_fill(&cache, mnt, &qid, 10, file + 10, 150, 150);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 10, buf, 100, &eof) == 0);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 64, buf, 100, &eof) == 64);
+  assert(eof == 0);
+
+  // unmounting discards everything cached for the mount
+  assert(rfs__ns_mount(&ns, mnt, "/n", RFS_MREPL | RFS_MCACHE) == 0);
+  assert(rfs__ns_unmount(&ns, NULL, "/n") == 0);
+  assert(rfs__bcache_read(&cache, mnt, &qid, 64, buf, 100, &eof) == 0);
+
+  // memory is bounded; older blocks make way for newer ones
+  for(uint64_t path = 100; path < 110; ++path) {
+    qid = make_qid(path, 0, RFS_QTFILE);
+    rfs__bcache_fill(&cache, mnt, &qid, 0, file, 128, 128);
+  }
+
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 128, &eof) == 128);
+  qid.path = 100;
+  assert(rfs__bcache_read(&cache, mnt, &qid, 0, buf, 128, &eof) == 0);
+
+  rfs__bcache_free(&cache);
+  rfs__ns_mnt_unref(&ns, mnt);
+  rfs__ns_mnt_unref(&ns, nocache);
+  rfs__ns_free(&ns);
+
+  printf("-----\n\n");
+}
+
+static void test_dcache(void) {
+  printf("----- Testing the persistent content cache -----\n\n");
+
+  char path[] = "/tmp/rfs_dcache_XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd >= 0);
+  close(fd);
+
+  rfs__dcache_t disk;
+  rfs__dcache_t reader;
+  rfs_qid_t qid = make_qid(9, 1, RFS_QTFILE);
+  unsigned char block[64];
+  unsigned char buf[64];
+  size_t len;
+  int eof;
+
+  for(size_t i = 0; i < sizeof(block); ++i)
+    block[i] = (unsigned char) (i * 3);
+
+  // a read-only handle can't lay out an empty file
+  assert(rfs__dcache_open(&reader, path, 0, 0, 0) == -EINVAL);
+  assert(rfs__dcache_open(&disk, path, 16 * 64, 64, 1) == 0);
+  assert(rfs__dcache_open(&reader, path, 0, 0, 0) == 0);
+  assert(reader.bsize == 64 && reader.nsets == disk.nsets);
+
+  uint64_t srv = rfs__dcache_key("addr", 4, "");
+  assert(srv != 0 && srv != rfs__dcache_key("addr", 4, "other"));
+
+  // content is shared between every handle; versions must match
+  assert(rfs__dcache_get(&reader, srv, &qid, 0, buf, &len, &eof) == 0);
+  rfs__dcache_put(&disk, srv, &qid, 0, block, sizeof(block), 0);
+  rfs__dcache_put(&disk, srv, &qid, 1, block, 10, 1);
+  assert(rfs__dcache_get(&reader, srv, &qid, 0, buf, &len, &eof) == 1);
+  assert(len == 64 && eof == 0 && memcmp(buf, block, 64) == 0);
+  assert(rfs__dcache_get(&reader, srv, &qid, 1, buf, &len, &eof) == 1);
+  assert(len == 10 && eof == 1);
+  assert(rfs__dcache_get(&reader, srv + 1, &qid, 0, buf, &len, &eof) == 0);
+
+  qid.vers = 2;
+  assert(rfs__dcache_get(&reader, srv, &qid, 0, buf, &len, &eof) == 0);
+  qid.vers = 1;
+
+  // read-only handles never change the file
+  rfs__dcache_drop(&reader, srv, &qid, 0);
+  assert(rfs__dcache_get(&disk, srv, &qid, 0, buf, &len, &eof) == 1);
+  rfs__dcache_drop(&disk, srv, &qid, 1);
+  assert(rfs__dcache_get(&reader, srv, &qid, 1, buf, &len, &eof) == 0);
+
+  // filling a set replaces older blocks rather than failing
+  for(uint64_t blkno = 0; blkno < 1000; ++blkno)
+    rfs__dcache_put(&disk, srv, &qid, blkno, block, sizeof(block), 0);
+  assert(rfs__dcache_get(&disk, srv, &qid, 999, buf, &len, &eof) == 1);
+
+  rfs__dcache_close(&reader);
+  rfs__dcache_close(&disk);
+
+  // content outlives the handles; a different layout discards it
+  assert(rfs__dcache_open(&disk, path, 16 * 64, 64, 1) == 0);
+  assert(rfs__dcache_get(&disk, srv, &qid, 999, buf, &len, &eof) == 1);
+  rfs__dcache_close(&disk);
+  assert(rfs__dcache_open(&disk, path, 32 * 64, 64, 1) == 0);
+  assert(rfs__dcache_get(&disk, srv, &qid, 999, buf, &len, &eof) == 0);
+
+  // a new layout replaces the file rather than resizing it, so handles
+  // which mapped the old one keep working, apart from the new one
+  rfs__dcache_t fresh;
+  rfs__dcache_put(&disk, srv, &qid, 7, block, sizeof(block), 0);
+  assert(rfs__dcache_open(&fresh, path, 8 * 64, 64, 1) == 0);
+  assert(fresh.nsets != disk.nsets);
+  assert(rfs__dcache_get(&fresh, srv, &qid, 7, buf, &len, &eof) == 0);
+
+  rfs__dcache_put(&disk, srv, &qid, 8, block, 20, 1);
+  assert(rfs__dcache_get(&disk, srv, &qid, 7, buf, &len, &eof) == 1);
+  assert(len == 64 && memcmp(buf, block, 64) == 0);
+  assert(rfs__dcache_get(&disk, srv, &qid, 8, buf, &len, &eof) == 1);
+  assert(len == 20 && eof == 1);
+  assert(rfs__dcache_get(&fresh, srv, &qid, 8, buf, &len, &eof) == 0);
+
+  assert(rfs__dcache_open(&reader, path, 0, 0, 0) == 0);
+  assert(reader.nsets == fresh.nsets);
+  rfs__dcache_put(&fresh, srv, &qid, 9, block, 30, 0);
+  assert(rfs__dcache_get(&reader, srv, &qid, 9, buf, &len, &eof) == 1);
+  assert(len == 30);
+  rfs__dcache_close(&reader);
+  rfs__dcache_close(&fresh);
+
+  // a memory cache picks up what an earlier one saved to disk
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, NULL);
+
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(RFS_MCACHE, "", NULL);
+  assert(mnt != NULL);
+  mnt->srvkey = srv;
+
+  unsigned char file[100];
+  unsigned char out[128];
+  for(size_t i = 0; i < sizeof(file); ++i)
+    file[i] = (unsigned char) (255 - i);
+
+  rfs__bcache_t first;
+  rfs__bcache_t second;
+  assert(rfs__bcache_init(&first, 4 * 64, 64) == 0);
+  assert(rfs__bcache_init(&second, 4 * 64, 64) == 0);
+  rfs__bcache_set_disk(&first, &disk);
+  rfs__bcache_set_disk(&second, &disk);
+
+  rfs__bcache_fill(&first, mnt, &qid, 0, file, sizeof(file), 128);
+  assert(rfs__bcache_read(&second, mnt, &qid, 0, out, 128, &eof) == 100);
+  assert(eof == 1 && memcmp(out, file, sizeof(file)) == 0);
+
+  // writes reach the disk too
+  unsigned char patch[4] = { 1, 2, 3, 4 };
+  rfs__bcache_write(&first, mnt, &qid, 62, patch, sizeof(patch));
+  rfs__bcache_free(&second);
+  assert(rfs__bcache_init(&second, 4 * 64, 64) == 0);
+  rfs__bcache_set_disk(&second, &disk);
+  assert(rfs__bcache_read(&second, mnt, &qid, 60, out, 8, &eof) == 8);
+  assert(out[1] == file[61] && out[2] == 1 && out[5] == 4);
+  assert(out[6] == file[66]);
+
+  rfs__bcache_free(&first);
+  rfs__bcache_free(&second);
+  rfs__dcache_close(&disk);
+  rfs__ns_mnt_unref(&ns, mnt);
+  rfs__ns_free(&ns);
+  unlink(path);
+
+  printf("-----\n\n");
+}
+
+static void test_acache(void) {
+  printf("----- Testing the attribute cache -----\n\n");
+
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, NULL);
+
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(RFS_MCACHE, "", NULL);
+  rfs__ns_mnt_t* nocache = rfs__ns_mnt_new(0, "", NULL);
+  assert(mnt != NULL && nocache != NULL);
+  mnt->attrttl = 100;
+
+  rfs__acache_t cache;
+  assert(rfs__acache_init(&cache, 4) == 0);
+
+  rfs__9p_stat_t stat;
+  rfs__9p_stat_init(&stat);
+  stat.qid = make_qid(7, 1, RFS_QTFILE);
+  stat.length = 1234;
+  stat.name = rfs__9p_str("file");
+  stat.uid = rfs__9p_str("glenda");
+
+  uint64_t ms = 1000000;
+  uint64_t now = 5000 * ms;
+
+  // attributes last for the mount's time-to-live
+  assert(rfs__acache_get(&cache, mnt, 7, now) == NULL);
+  assert(rfs__acache_put(&cache, mnt, &stat, now) == 0);
+
+  const rfs_dirent_t* dirent = rfs__acache_get(&cache, mnt, 7, now + 99 * ms);
+  assert(dirent != NULL);
+  assert(dirent->length == 1234 && dirent->qid.vers == 1);
+  assert(strcmp(dirent->name, "file") == 0);
+  assert(strcmp(dirent->uid, "glenda") == 0);
+  assert(strcmp(dirent->gid, "") == 0);
+  assert(rfs__acache_get(&cache, mnt, 7, now + 100 * ms) == NULL);
+  assert(cache.count == 0);
+
+  // mounts without a time-to-live aren't cached
+  assert(rfs__acache_put(&cache, nocache, &stat, now) == 0);
+  assert(rfs__acache_get(&cache, nocache, 7, now) == NULL);
+
+  // a new version of the file drops its attributes; the same one doesn't
+  assert(rfs__acache_put(&cache, mnt, &stat, now) == 0);
+  rfs_qid_t qid = make_qid(7, 1, RFS_QTFILE);
+  rfs__acache_validate(&cache, mnt, &qid);
+  assert(rfs__acache_get(&cache, mnt, 7, now) != NULL);
+  qid.vers = 2;
+  rfs__acache_validate(&cache, mnt, &qid);
+  assert(rfs__acache_get(&cache, mnt, 7, now) == NULL);
+
+  // so do the client's own changes
+  assert(rfs__acache_put(&cache, mnt, &stat, now) == 0);
+  rfs__acache_drop(&cache, mnt, 7);
+  assert(rfs__acache_get(&cache, mnt, 7, now) == NULL);
+
+  // a full cache evicts, preferring entries which haven't been used
+  for(uint64_t path = 100; path < 104; ++path) {
+    stat.qid.path = path;
+    assert(rfs__acache_put(&cache, mnt, &stat, now) == 0);
+  }
+
+  assert(rfs__acache_get(&cache, mnt, 100, now) != NULL);
+  stat.qid.path = 104;
+  assert(rfs__acache_put(&cache, mnt, &stat, now) == 0);
+  assert(cache.count == 4);
+  assert(rfs__acache_get(&cache, mnt, 100, now) != NULL);
+  assert(rfs__acache_get(&cache, mnt, 101, now) == NULL);
+
+  // unmounting drops everything cached for the mount
+  assert(rfs__ns_mount(&ns, mnt, "/n", RFS_MREPL | RFS_MCACHE) == 0);
+  assert(rfs__ns_unmount(&ns, NULL, "/n") == 0);
+  assert(rfs__acache_get(&cache, mnt, 100, now) == NULL);
+
+  rfs__acache_free(&cache);
+  rfs__ns_mnt_unref(&ns, mnt);
+  rfs__ns_mnt_unref(&ns, nocache);
+  rfs__ns_free(&ns);
+
+  printf("-----\n\n");
+}
+
+int main(void) {
+  test_wcache();
+  test_bcache();
+  test_dcache();
+  test_acache();
+
+  return EXIT_SUCCESS;
+}
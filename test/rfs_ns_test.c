@@ -0,0 +1,189 @@
+#include "src/rfs_ns.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rfs/rfs.h"
+
+/// @brief The number of mount points created by the scaling test.
+#define POINTS 5000
+
+static int _released = 0;
+
+static void on_release(rfs__ns_mnt_t* mnt) {
+  assert(mnt->data == &_released);
+  _released++;
+}
+
+static void check_clean(const char* in, const char* out) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%s", in);
+
+  size_t len = rfs__ns_clean(buf);
+  printf("'%s' -> '%s'\n", in, buf);
+
+  assert(strcmp(buf, out) == 0);
+  assert(len == strlen(out));
+}
+
+/// @brief Check that a path resolves to a mount point with the given union.
+/// @param [in] point The expected mount point; NULL if none.
+/// @param [in] rest The expected remainder.
+/// @param [in] ... The expected target paths, terminated with NULL.
+static void check_lookup(rfs__ns_t* ns,
+                         const char* path,
+                         const char* point,
+                         const char* rest,
+                         ...) {
+  size_t off = 0;
+  const rfs__ns_point_t* found = rfs__ns_lookup(ns, path, strlen(path), &off);
+
+  if(point == NULL) {
+    assert(found == NULL);
+    return;
+  }
+
+  assert(found != NULL);
+  assert(strcmp(found->path, point) == 0);
+  assert(strcmp(path + off, rest) == 0);
+
+  va_list args;
+  va_start(args, rest);
+
+  for(size_t i = 0; i < found->count; ++i) {
+    const char* target = va_arg(args, const char*);
+    assert(target != NULL);
+    assert(strcmp(found->targets[i].path, target) == 0);
+  }
+
+  assert(va_arg(args, const char*) == NULL);
+  va_end(args);
+}
+
+static void test_clean(void) {
+  printf("----- Testing path cleaning -----\n\n");
+
+  check_clean("", "/");
+  check_clean("/", "/");
+  check_clean("a//b/./c/../d", "/a/b/d");
+  check_clean("/../x/", "/x");
+  check_clean("/a/b/../..", "/");
+  check_clean("/a/./b/.", "/a/b");
+
+  printf("-----\n\n");
+}
+
+static void test_union(void) {
+  printf("----- Testing union directories -----\n\n");
+
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, on_release);
+
+  assert(rfs__ns_bind(&ns, "/srv/a", "/x", RFS_MREPL) == 0);
+  check_lookup(&ns, "/x/y", "/x", "/y", "/srv/a", NULL);
+  check_lookup(&ns, "/x", "/x", "", "/srv/a", NULL);
+  check_lookup(&ns, "/xy", NULL, NULL);
+
+  assert(rfs__ns_bind(&ns, "/b", "/x", RFS_MBEFORE) == 0);
+  assert(rfs__ns_bind(&ns, "/c", "/x", RFS_MAFTER | RFS_MCREATE) == 0);
+  check_lookup(&ns, "/x/y", "/x", "/y", "/b", "/srv/a", "/c", NULL);
+
+  // a new union includes what was at the mount point
+  assert(rfs__ns_bind(&ns, "/new", "/u", RFS_MAFTER) == 0);
+  check_lookup(&ns, "/u", "/u", "", "/u", "/new", NULL);
+
+  // names are resolved through the namespace when bound
+  assert(rfs__ns_bind(&ns, "/x/y", "/z", 0) == 0);
+  check_lookup(&ns, "/z/q", "/z", "/q", "/b/y", "/srv/a/y", "/c/y", NULL);
+
+  // names given to unmount are resolved in the same way
+  assert(rfs__ns_unmount(&ns, "/b", "/x") == 0);
+  check_lookup(&ns, "/x/y", "/x", "/y", "/srv/a", "/c", NULL);
+
+  // the longest mount point wins, but only on whole elements
+  assert(rfs__ns_bind(&ns, "/r", "/", RFS_MREPL) == 0);
+  check_lookup(&ns, "/xy", "/", "/xy", "/r", NULL);
+  check_lookup(&ns, "/", "/", "", "/r", NULL);
+  check_lookup(&ns, "/x/q", "/x", "/q", "/srv/a", "/c", NULL);
+
+  assert(rfs__ns_bind(&ns, "/d", "/x", RFS_MBEFORE | RFS_MAFTER) == -EINVAL);
+  assert(rfs__ns_unmount(&ns, "/nothere", "/x") == -ENOENT);
+  assert(rfs__ns_unmount(&ns, NULL, "/nothere") == -ENOENT);
+
+  assert(rfs__ns_unmount(&ns, NULL, "/x") == 0);
+  check_lookup(&ns, "/x/y", "/", "/x/y", "/r", NULL);
+  check_lookup(&ns, "/z", "/z", "", "/b/y", "/srv/a/y", "/c/y", NULL);
+
+  // mounts are kept alive by every target referring to them
+  rfs__ns_mnt_t* mnt = rfs__ns_mnt_new(RFS_MCACHE, "main", &_released);
+  assert(mnt != NULL);
+  assert(rfs__ns_mount(&ns, mnt, "/n/srv", RFS_MREPL) == 0);
+  assert(rfs__ns_bind(&ns, "/n/srv/sub", "/m", RFS_MREPL) == 0);
+  assert(mnt->refs == 3);
+  rfs__ns_mnt_unref(&ns, mnt);
+
+  size_t off;
+  const rfs__ns_point_t* point = rfs__ns_lookup(&ns, "/m/f", 4, &off);
+  assert(point != NULL && point->targets[0].mnt == mnt);
+  assert(strcmp(point->targets[0].path, "/sub") == 0);
+
+  assert(rfs__ns_unmount(&ns, NULL, "/n/srv") == 0);
+  assert(_released == 0);
+  assert(ns.npoints == 4);
+
+  rfs__ns_free(&ns);
+  assert(_released == 1);
+
+  printf("-----\n\n");
+}
+
+static void test_scale(void) {
+  printf("----- Testing %d mount points -----\n\n", POINTS);
+
+  rfs__ns_t ns;
+  rfs__ns_init(&ns, NULL);
+
+  char old[64];
+  char name[64];
+  char path[64];
+
+  for(int i = 0; i < POINTS; ++i) {
+    snprintf(old, sizeof(old), "/p/%d", i);
+    snprintf(name, sizeof(name), "/t/%d", i);
+    assert(rfs__ns_bind(&ns, name, old, RFS_MREPL) == 0);
+  }
+
+  assert(ns.npoints == POINTS);
+
+  for(int i = 0; i < POINTS; i += 2) {
+    snprintf(old, sizeof(old), "/p/%d", i);
+    assert(rfs__ns_unmount(&ns, NULL, old) == 0);
+  }
+
+  for(int i = 0; i < POINTS; ++i) {
+    snprintf(path, sizeof(path), "/p/%d/file", i);
+    snprintf(old, sizeof(old), "/p/%d", i);
+    snprintf(name, sizeof(name), "/t/%d", i);
+
+    if(i % 2 == 0)
+      check_lookup(&ns, path, NULL, NULL);
+    else
+      check_lookup(&ns, path, old, "/file", name, NULL);
+  }
+
+  rfs__ns_free(&ns);
+
+  printf("-----\n\n");
+}
+
+int main(void) {
+  test_clean();
+  test_union();
+  test_scale();
+
+  return EXIT_SUCCESS;
+}
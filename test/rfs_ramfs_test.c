@@ -0,0 +1,826 @@
+#include "src/rfs_9p_session.h"
+#include "src/rfs_ramfs.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The number of entries in the large directory.
+#define BIGDIR 100000
+
+/// @brief The number of subscribers each message is fanned out to.
+#define NSUBS 1000
+
+/// @brief The number of connections the subscribers are spread over, so that
+/// none has more reads waiting than the server reads requests for.
+#define NSUBCONNS 4
+
+/// @brief The client's state; requests are sent on _session.
+static uv_loop_t _loop;
+static rfs__9p_session_t _sessions[1 + NSUBCONNS];
+static rfs__9p_session_t* _session = &_sessions[0];
+static int _done;
+
+/// @brief The subscribers' reads, and what each should return.
+static rfs__9p_call_t _reads[NSUBS];
+static rfs__9p_msg_t _readmsgs[NSUBS];
+static const char* _expect;
+static size_t _delivered;
+
+/// @brief The number of writes held back by a blocked topic which have
+/// completed.
+static size_t _wrote;
+
+/// @brief The parts of the last reply the tests look at.
+static struct {
+  uint8_t type;
+  uint16_t nwqid;
+  rfs_qid_t qid;
+  uint32_t count;
+  char ename[128];
+  unsigned char data[8192];
+  rfs__9p_stat_t stat;
+  char name[64];
+  char uid[64];
+} _r;
+
+/// @brief What the server thread serves.
+typedef struct server {
+  rfs__ramfs_t* fs;
+  const int* fds;
+  size_t nfds;
+} server_t;
+
+static void test_bigdir(void) {
+  rfs__ramfs_t fs;
+  uint32_t dir;
+  uint32_t other;
+  char name[16];
+
+  assert(rfs__ramfs_init(&fs, "glenda") == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "big", 3, RFS_DMDIR | 0755,
+                           &dir) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "other", 5,
+                           RFS_DMDIR | 0755, &other) == 0);
+
+  for(uint32_t i = 0; i < BIGDIR; ++i) {
+    int len = snprintf(name, sizeof(name), "f%06u", i);
+    assert(rfs__ramfs_create(&fs, dir, name, (uint16_t) len, 0644,
+                             NULL) == 0);
+  }
+
+  assert(fs.nodes[dir].u.dir.nchildren == BIGDIR);
+  assert(rfs__ramfs_create(&fs, dir, "f000000", 7, 0644, NULL) == -EEXIST);
+  assert(rfs__ramfs_create(&fs, dir, "..", 2, 0644, NULL) == -EINVAL);
+  assert(rfs__ramfs_create(&fs, dir, "a/b", 3, 0644, NULL) == -EINVAL);
+
+  uint64_t start = uv_hrtime();
+
+  for(uint32_t i = 0; i < BIGDIR; ++i) {
+    int len = snprintf(name, sizeof(name), "f%06u", i);
+    uint32_t idx = rfs__ramfs_lookup(&fs, dir, name, (uint16_t) len);
+    assert(idx != RFS__RAMFS_NIL);
+    assert(fs.nodes[idx].name->len == len);
+    assert(memcmp(fs.nodes[idx].name->str, name, (size_t) len) == 0);
+  }
+
+  printf("%u lookups in a directory of %u: %.0f ns each\n", BIGDIR, BIGDIR,
+         (double) (uv_hrtime() - start) / BIGDIR);
+
+  assert(rfs__ramfs_lookup(&fs, dir, "missing", 7) == RFS__RAMFS_NIL);
+  assert(rfs__ramfs_lookup(&fs, other, "f000001", 7) == RFS__RAMFS_NIL);
+
+  // the same name in another directory shares the interned string
+  uint32_t nnames = fs.nnames;
+  uint32_t same;
+  assert(rfs__ramfs_create(&fs, other, "f000001", 7, 0644, &same) == 0);
+  assert(fs.nnames == nnames);
+  assert(fs.nodes[same].name
+         == fs.nodes[rfs__ramfs_lookup(&fs, dir, "f000001", 7)].name);
+
+  // remove every other entry; the rest are still found, and the names
+  // only this directory used are released
+  rfs_qid_t qid = rfs__ramfs_qid(&fs, rfs__ramfs_lookup(&fs, dir,
+                                                         "f000000", 7));
+
+  for(uint32_t i = 0; i < BIGDIR; i += 2) {
+    int len = snprintf(name, sizeof(name), "f%06u", i);
+    uint32_t idx = rfs__ramfs_lookup(&fs, dir, name, (uint16_t) len);
+    assert(rfs__ramfs_remove(&fs, idx) == 0);
+  }
+
+  assert(fs.nodes[dir].u.dir.nchildren == BIGDIR / 2);
+  assert(fs.nnames == nnames - BIGDIR / 2);
+
+  for(uint32_t i = 0; i < BIGDIR; ++i) {
+    int len = snprintf(name, sizeof(name), "f%06u", i);
+    uint32_t idx = rfs__ramfs_lookup(&fs, dir, name, (uint16_t) len);
+    assert((idx == RFS__RAMFS_NIL) == (i % 2 == 0));
+  }
+
+  // a reused slot has a new qid
+  uint32_t reused;
+  assert(rfs__ramfs_create(&fs, dir, "new", 3, 0644, &reused) == 0);
+  assert(rfs__ramfs_qid(&fs, reused).path != qid.path);
+  assert(rfs__ramfs_remove(&fs, reused) == 0);
+  assert(rfs__ramfs_remove(&fs, reused) == -ENOENT);
+
+  assert(rfs__ramfs_remove(&fs, dir) == -ENOTEMPTY);
+  assert(rfs__ramfs_remove(&fs, RFS__RAMFS_ROOT) == -EPERM);
+
+  rfs__ramfs_free(&fs);
+}
+
+static void test_contents(void) {
+  rfs__ramfs_t fs;
+  uint32_t file;
+
+  assert(rfs__ramfs_init(&fs, "glenda") == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "file", 4, 0644,
+                           &file) == 0);
+  assert(rfs__ramfs_write(&fs, RFS__RAMFS_ROOT, 0, "x", 1) == -EISDIR);
+
+  // writing past the end leaves a zero filled hole
+  assert(rfs__ramfs_write(&fs, file, 4, "abcd", 4) == 0);
+  assert(fs.nodes[file].u.file.length == 8);
+  assert(memcmp(fs.nodes[file].u.file.data->bytes, "\0\0\0\0abcd", 8) == 0);
+
+  // contents an Rread still references are copied before being changed
+  rfs__ramfs_data_t* sent = fs.nodes[file].u.file.data;
+  sent->refs++;
+
+  assert(rfs__ramfs_write(&fs, file, 0, "wxyz", 4) == 0);
+  assert(fs.nodes[file].u.file.data != sent);
+  assert(memcmp(sent->bytes, "\0\0\0\0abcd", 8) == 0);
+  assert(memcmp(fs.nodes[file].u.file.data->bytes, "wxyzabcd", 8) == 0);
+  assert(sent->refs == 1);
+  free(sent);
+
+  rfs__ramfs_free(&fs);
+}
+
+static void on_reply(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply) {
+  (void) call;
+
+  // a request may be answered by its connection closing
+  if(ret < 0) {
+    _r.type = 0;
+    _done = 1;
+    return;
+  }
+
+  _r.type = reply->type;
+
+  switch(reply->type) {
+    case RFS__9P_RERROR:
+      assert(reply->params.rerror.ename.len < sizeof(_r.ename));
+      memcpy(_r.ename, reply->params.rerror.ename.str,
+             reply->params.rerror.ename.len);
+      _r.ename[reply->params.rerror.ename.len] = '\0';
+      break;
+
+    case RFS__9P_RATTACH:
+      _r.qid = reply->params.rattach.qid;
+      break;
+
+    case RFS__9P_RWALK:
+      _r.nwqid = reply->params.rwalk.nwqid;
+      if(_r.nwqid > 0)
+        _r.qid = reply->params.rwalk.wqid[_r.nwqid - 1];
+      break;
+
+    case RFS__9P_ROPEN:
+    case RFS__9P_RCREATE:
+      _r.qid = reply->params.ropen.qid;
+      break;
+
+    case RFS__9P_RREAD:
+      assert(reply->params.rread.count <= sizeof(_r.data));
+      _r.count = reply->params.rread.count;
+      memcpy(_r.data, reply->params.rread.data, _r.count);
+      break;
+
+    case RFS__9P_RWRITE:
+      _r.count = reply->params.rwrite.count;
+      break;
+
+    case RFS__9P_RSTAT:
+      _r.stat = *(reply->params.rstat.stat);
+      assert(_r.stat.name.len < sizeof(_r.name));
+      memcpy(_r.name, _r.stat.name.str, _r.stat.name.len);
+      _r.name[_r.stat.name.len] = '\0';
+      assert(_r.stat.uid.len < sizeof(_r.uid));
+      memcpy(_r.uid, _r.stat.uid.str, _r.stat.uid.len);
+      _r.uid[_r.stat.uid.len] = '\0';
+      break;
+  }
+
+  _done = 1;
+}
+
+/// @brief Send a request and wait for its reply.
+/// @return The type of the reply.
+static uint8_t rpc(rfs__9p_msg_t* msg) {
+  rfs__9p_call_t call;
+
+  _done = 0;
+  assert(rfs__9p_session_rpc(_session, &call, msg, on_reply) == 0);
+
+  while(!_done)
+    uv_run(&_loop, UV_RUN_ONCE);
+
+  return _r.type;
+}
+
+static void expect_error(uint8_t type, const char* ename) {
+  if(type != RFS__9P_RERROR || strcmp(_r.ename, ename) != 0) {
+    fprintf(stderr, "expected '%s', got %d '%s'\n", ename, type,
+            (type == RFS__9P_RERROR ? _r.ename : ""));
+    abort();
+  }
+}
+
+/// @brief Walk through a path of names separated by slashes.
+static uint8_t walk(uint32_t fid, uint32_t newfid, const char* path) {
+  char buf[256];
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TWALK;
+  msg.params.twalk.fid = fid;
+  msg.params.twalk.newfid = newfid;
+
+  snprintf(buf, sizeof(buf), "%s", path);
+
+  for(char* name = strtok(buf, "/"); name != NULL; name = strtok(NULL, "/"))
+    msg.params.twalk.wname[msg.params.twalk.nwname++] = rfs__9p_str(name);
+
+  return rpc(&msg);
+}
+
+static uint8_t fidop(uint8_t type, uint32_t fid) {
+  rfs__9p_msg_t msg;
+
+  // Tclunk, Tremove and Tstat share their layout
+  rfs__9p_msg_init(&msg);
+  msg.type = type;
+  msg.params.tclunk.fid = fid;
+
+  return rpc(&msg);
+}
+
+static uint8_t fidopen(uint32_t fid, uint8_t mode) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TOPEN;
+  msg.params.topen.fid = fid;
+  msg.params.topen.mode = mode;
+
+  return rpc(&msg);
+}
+
+static uint8_t create(uint32_t fid, const char* name, uint32_t perm,
+                      uint8_t mode) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TCREATE;
+  msg.params.tcreate.fid = fid;
+  msg.params.tcreate.name = rfs__9p_str(name);
+  msg.params.tcreate.perm = perm;
+  msg.params.tcreate.mode = mode;
+
+  return rpc(&msg);
+}
+
+static uint8_t readat(uint32_t fid, uint64_t offset, uint32_t count) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TREAD;
+  msg.params.tread.fid = fid;
+  msg.params.tread.offset = offset;
+  msg.params.tread.count = count;
+
+  return rpc(&msg);
+}
+
+static uint8_t writeat(uint32_t fid, uint64_t offset, const char* data) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TWRITE;
+  msg.params.twrite.fid = fid;
+  msg.params.twrite.offset = offset;
+  msg.params.twrite.count = (uint32_t) strlen(data);
+  msg.params.twrite.data = (const unsigned char*) data;
+
+  return rpc(&msg);
+}
+
+/// @brief Serve connections to a tree until the client hangs up.
+static void run_server(void* arg) {
+  server_t* server = arg;
+  uv_loop_t loop;
+  rfs__srv_t srv;
+
+  assert(uv_loop_init(&loop) == 0);
+  rfs__srv_init(&srv, &loop, &rfs__ramfs_ops, 65536 + RFS__9P_IOHDRSZ);
+  srv.data = server->fs;
+
+  for(size_t i = 0; i < server->nfds; ++i)
+    assert(rfs__srv_accept(&srv, server->fds[i]) == 0);
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+  rfs__srv_close(&srv, NULL);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  assert(uv_loop_close(&loop) == 0);
+}
+
+/// @brief Start serving a tree over nconns connections, each of which is
+/// attached as fid 0.
+static void serve(server_t* server,
+                  uv_thread_t* thread,
+                  rfs__ramfs_t* fs,
+                  int* fds,
+                  size_t nconns) {
+  rfs__9p_msg_t msg;
+
+  for(size_t i = 0; i < nconns; ++i) {
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    fds[i] = pair[1];
+
+    assert(rfs__9p_session_init(&_sessions[i], &_loop, pair[0],
+                                RFS__SRV_MAXREQS,
+                                65536 + RFS__9P_IOHDRSZ, NULL) == 0);
+    assert(rfs__9p_session_version(&_sessions[i], NULL) == 0);
+  }
+
+  server->fs = fs;
+  server->fds = fds;
+  server->nfds = nconns;
+  assert(uv_thread_create(thread, run_server, server) == 0);
+
+  for(size_t i = 0; i < nconns; ++i) {
+    _session = &_sessions[i];
+
+    rfs__9p_msg_init(&msg);
+    msg.type = RFS__9P_TATTACH;
+    msg.params.tattach.fid = 0;
+    msg.params.tattach.afid = RFS__9P_NOFID;
+    msg.params.tattach.uname = rfs__9p_str("glenda");
+    assert(rpc(&msg) == RFS__9P_RATTACH);
+    assert(_r.qid.type == RFS_QTDIR);
+  }
+
+  _session = &_sessions[0];
+}
+
+/// @brief Hang up every connection and wait for the server to stop.
+static void hangup(uv_thread_t* thread, size_t nconns) {
+  for(size_t i = 0; i < nconns; ++i)
+    rfs__9p_session_close(&_sessions[i], NULL);
+
+  uv_run(&_loop, UV_RUN_DEFAULT);
+  uv_thread_join(thread);
+}
+
+static void test_serve(void) {
+  rfs__ramfs_t fs;
+  rfs__9p_msg_t msg;
+  rfs__9p_stat_t wst;
+  server_t server;
+  uv_thread_t thread;
+  int fd;
+
+  assert(rfs__ramfs_init(&fs, "glenda") == 0);
+  serve(&server, &thread, &fs, &fd, 1);
+
+  // create a directory, and a file within it
+  assert(walk(0, 1, "") == RFS__9P_RWALK);
+  assert(create(1, "dir", RFS_DMDIR | 0755, RFS__9P_OREAD)
+         == RFS__9P_RCREATE);
+  assert(_r.qid.type == RFS_QTDIR);
+  expect_error(create(1, "x", 0644, RFS__9P_OREAD), "fid already open");
+
+  assert(walk(0, 2, "dir") == RFS__9P_RWALK);
+  expect_error(create(2, "dir", RFS_DMDIR | 0755, RFS__9P_OWRITE),
+               "is a directory");
+  assert(create(2, "file", 0644, RFS__9P_ORDWR) == RFS__9P_RCREATE);
+  assert(_r.qid.type == RFS_QTFILE);
+  expect_error(walk(0, 3, "missing"), "file does not exist");
+
+  // a walk failing past its first element stops short, without the fid
+  assert(walk(0, 3, "dir/missing") == RFS__9P_RWALK && _r.nwqid == 1);
+  expect_error(fidop(RFS__9P_TSTAT, 3), "unknown fid");
+
+  assert(writeat(2, 0, "hello world") == RFS__9P_RWRITE);
+  assert(_r.count == 11);
+  assert(readat(2, 6, 100) == RFS__9P_RREAD);
+  assert(_r.count == 5 && memcmp(_r.data, "world", 5) == 0);
+  assert(readat(2, 11, 100) == RFS__9P_RREAD && _r.count == 0);
+
+  assert(fidop(RFS__9P_TSTAT, 2) == RFS__9P_RSTAT);
+  assert(strcmp(_r.name, "file") == 0);
+  assert(_r.stat.length == 11 && _r.stat.mode == 0644);
+  assert(strcmp(_r.uid, "glenda") == 0);
+
+  // rename and truncate it at once, which changes the directory's version
+  assert(walk(0, 3, "dir") == RFS__9P_RWALK);
+  rfs_qid_t dirqid = _r.qid;
+
+  rfs__9p_stat_init(&wst);
+  wst.type = (uint16_t) ~0;
+  wst.dev = ~0U;
+  wst.qid.type = (uint8_t) ~0;
+  wst.qid.vers = ~0U;
+  wst.qid.path = ~0ULL;
+  wst.mode = ~0U;
+  wst.atime = wst.mtime = ~0U;
+  wst.length = 5;
+  wst.name = rfs__9p_str("renamed");
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TWSTAT;
+  msg.params.twstat.fid = 2;
+  msg.params.twstat.stat = &wst;
+  assert(rpc(&msg) == RFS__9P_RWSTAT);
+
+  assert(fidop(RFS__9P_TSTAT, 3) == RFS__9P_RSTAT);
+  assert(_r.stat.qid.path == dirqid.path);
+  assert(_r.stat.qid.vers == dirqid.vers + 1);
+  assert(fidop(RFS__9P_TCLUNK, 3) == RFS__9P_RCLUNK);
+
+  assert(walk(0, 3, "dir/file") == RFS__9P_RWALK && _r.nwqid == 1);
+  assert(walk(0, 3, "dir/renamed") == RFS__9P_RWALK);
+  assert(fidop(RFS__9P_TSTAT, 3) == RFS__9P_RSTAT);
+  assert(strcmp(_r.name, "renamed") == 0 && _r.stat.length == 5);
+  assert(fidop(RFS__9P_TCLUNK, 2) == RFS__9P_RCLUNK);
+  assert(fidop(RFS__9P_TCLUNK, 3) == RFS__9P_RCLUNK);
+
+  // a directory reads as its children's stats
+  assert(walk(0, 4, "dir") == RFS__9P_RWALK);
+  assert(fidopen(4, RFS__9P_OREAD) == RFS__9P_ROPEN);
+  assert(readat(4, 0, sizeof(_r.data)) == RFS__9P_RREAD);
+
+  uint32_t dirlen = _r.count;
+  rfs__9p_stat_t ent;
+  assert(rfs__9p_stat_unpack(_r.data, dirlen, &ent) == dirlen);
+  assert(ent.name.len == 7 && memcmp(ent.name.str, "renamed", 7) == 0);
+
+  assert(readat(4, dirlen, sizeof(_r.data)) == RFS__9P_RREAD);
+  assert(_r.count == 0);
+  expect_error(readat(4, 1, sizeof(_r.data)), "bad offset in directory read");
+  assert(fidop(RFS__9P_TCLUNK, 4) == RFS__9P_RCLUNK);
+
+  // walking up from the root stays there
+  assert(walk(0, 5, "dir/../..") == RFS__9P_RWALK);
+  assert(_r.nwqid == 3 && _r.qid.path == 0);
+  assert(fidop(RFS__9P_TCLUNK, 5) == RFS__9P_RCLUNK);
+
+  // removing clunks the fid whether or not it succeeds
+  assert(walk(0, 6, "dir") == RFS__9P_RWALK);
+  expect_error(fidop(RFS__9P_TREMOVE, 6), "directory not empty");
+  expect_error(fidop(RFS__9P_TSTAT, 6), "unknown fid");
+  assert(walk(0, 7, "dir/renamed") == RFS__9P_RWALK);
+  assert(fidop(RFS__9P_TREMOVE, 7) == RFS__9P_RREMOVE);
+  assert(walk(0, 7, "dir/renamed") == RFS__9P_RWALK && _r.nwqid == 1);
+
+  // a file created with ORCLOSE goes away when it's clunked
+  assert(walk(0, 8, "dir") == RFS__9P_RWALK);
+  assert(create(8, "tmp", 0644, RFS__9P_OWRITE | RFS__9P_ORCLOSE)
+         == RFS__9P_RCREATE);
+  assert(walk(0, 9, "dir/tmp") == RFS__9P_RWALK);
+  assert(fidop(RFS__9P_TCLUNK, 8) == RFS__9P_RCLUNK);
+  assert(walk(0, 10, "dir/tmp") == RFS__9P_RWALK && _r.nwqid == 1);
+
+  // but a fid still referring to it keeps it, unlinked, until it's clunked
+  assert(fidop(RFS__9P_TSTAT, 9) == RFS__9P_RSTAT);
+  assert(strcmp(_r.name, "tmp") == 0);
+
+  hangup(&thread, 1);
+
+  // every fid has been destroyed, leaving the root and the empty directory
+  uint32_t dir = rfs__ramfs_lookup(&fs, RFS__RAMFS_ROOT, "dir", 3);
+  assert(dir != RFS__RAMFS_NIL);
+  assert(fs.nodes[RFS__RAMFS_ROOT].refs == 1);
+  assert(fs.nodes[dir].refs == 1);
+  assert(fs.nodes[dir].u.dir.nchildren == 0);
+  assert(fs.nnames == 2);
+
+  rfs__ramfs_free(&fs);
+}
+
+static void on_message(rfs__9p_call_t* call, int ret,
+                       const rfs__9p_msg_t* reply) {
+  (void) call;
+
+  // reads still waiting when the session closes are abandoned
+  if(ret < 0)
+    return;
+
+  size_t len = strlen(_expect);
+
+  assert(reply->type == RFS__9P_RREAD);
+  assert(reply->params.rread.count == len);
+  assert(memcmp(reply->params.rread.data, _expect, len) == 0);
+
+  _delivered++;
+}
+
+/// @brief Start every subscriber's read; subscriber i reads fid 1 + i of
+/// connection 1 + i % NSUBCONNS.
+static void read_all(void) {
+  for(size_t i = 0; i < NSUBS; ++i) {
+    rfs__9p_msg_t* msg = &_readmsgs[i];
+
+    rfs__9p_msg_init(msg);
+    msg->type = RFS__9P_TREAD;
+    msg->params.tread.fid = (uint32_t) (1 + i);
+    msg->params.tread.count = 8192;
+    assert(rfs__9p_session_rpc(&_sessions[1 + i % NSUBCONNS], &_reads[i],
+                               msg, on_message) == 0);
+  }
+}
+
+static void wait_delivered(size_t n) {
+  while(_delivered < n)
+    uv_run(&_loop, UV_RUN_ONCE);
+}
+
+static void test_pubsub(void) {
+  rfs__ramfs_t fs;
+  server_t server;
+  uv_thread_t thread;
+  int fds[1 + NSUBCONNS];
+  uint32_t topic;
+
+  assert(rfs__ramfs_init(&fs, "glenda") == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "news", 4,
+                           RFS__RAMFS_DMTOPIC | 0666, &topic) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "bad", 3,
+                           RFS_DMDIR | RFS__RAMFS_DMTOPIC | 0777,
+                           NULL) == -EINVAL);
+
+  // with nobody subscribed, a message goes nowhere
+  assert(rfs__ramfs_write(&fs, topic, 0, "lost", 4) == 0);
+  assert(fs.nodes[topic].vers == 1);
+
+  serve(&server, &thread, &fs, fds, 1 + NSUBCONNS);
+
+  for(size_t i = 0; i < NSUBS; ++i) {
+    _session = &_sessions[1 + i % NSUBCONNS];
+    assert(walk(0, (uint32_t) (1 + i), "news") == RFS__9P_RWALK);
+    assert(fidopen((uint32_t) (1 + i), RFS__9P_OREAD) == RFS__9P_ROPEN);
+  }
+
+  _session = &_sessions[0];
+  assert(walk(0, 1, "news") == RFS__9P_RWALK);
+  assert(fidopen(1, RFS__9P_OWRITE) == RFS__9P_ROPEN);
+  assert(fidop(RFS__9P_TSTAT, 1) == RFS__9P_RSTAT);
+  assert(_r.stat.mode == (RFS__RAMFS_DMTOPIC | 0666));
+  assert(_r.stat.length == 0);
+
+  // every subscriber's read waits for the message, or finds it queued
+  _expect = "extra!";
+  _delivered = 0;
+
+  read_all();
+
+  uint64_t start = uv_hrtime();
+
+  assert(writeat(1, 0, "extra!") == RFS__9P_RWRITE && _r.count == 6);
+  wait_delivered(NSUBS);
+
+  printf("one message fanned out to %u subscribers in %.0f us\n", NSUBS,
+         (double) (uv_hrtime() - start) / 1000);
+
+  // a fid creating a topic to read and write subscribes to it; messages
+  // queue until they're read, and are returned one per read
+  assert(walk(0, 2, "") == RFS__9P_RWALK);
+  expect_error(create(2, "log", RFS_DMDIR | RFS__RAMFS_DMTOPIC | 0777,
+                      RFS__9P_OREAD), "bad file mode");
+  assert(create(2, "log", RFS__RAMFS_DMTOPIC | 0666, RFS__9P_ORDWR)
+         == RFS__9P_RCREATE);
+  assert(writeat(2, 0, "one") == RFS__9P_RWRITE);
+  assert(writeat(2, 0, "two") == RFS__9P_RWRITE);
+  assert(writeat(2, 0, "") == RFS__9P_RWRITE && _r.count == 0);
+  assert(readat(2, 0, 100) == RFS__9P_RREAD);
+  assert(_r.count == 3 && memcmp(_r.data, "one", 3) == 0);
+  assert(readat(2, 0, 2) == RFS__9P_RREAD);
+  assert(_r.count == 2 && memcmp(_r.data, "tw", 2) == 0);
+
+  // removing a topic ends every subscriber's file
+  _expect = "";
+  _delivered = 0;
+
+  read_all();
+  assert(fidop(RFS__9P_TREMOVE, 1) == RFS__9P_RREMOVE);
+  wait_delivered(NSUBS);
+
+  // a read still waiting is abandoned when its connection closes
+  rfs__9p_msg_t* msg = &_readmsgs[0];
+  rfs__9p_msg_init(msg);
+  msg->type = RFS__9P_TREAD;
+  msg->params.tread.fid = 2;
+  msg->params.tread.count = 8192;
+  assert(rfs__9p_session_rpc(_session, &_reads[0], msg, on_message) == 0);
+
+  hangup(&thread, 1 + NSUBCONNS);
+
+  // every subscriber is gone, and so is the removed topic
+  uint32_t log = rfs__ramfs_lookup(&fs, RFS__RAMFS_ROOT, "log", 3);
+  assert(rfs__ramfs_lookup(&fs, RFS__RAMFS_ROOT, "news", 4)
+         == RFS__RAMFS_NIL);
+  assert(log != RFS__RAMFS_NIL);
+  assert(fs.nodes[log].u.topic.subs == NULL);
+  assert(fs.nodes[log].refs == 1);
+  assert(fs.nodes[RFS__RAMFS_ROOT].refs == 1);
+
+  rfs__ramfs_free(&fs);
+}
+
+static void on_wrote(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply) {
+  (void) call;
+
+  // a write still waiting when the session closes is abandoned
+  if(ret < 0)
+    return;
+
+  assert(reply->type == RFS__9P_RWRITE);
+  _wrote++;
+}
+
+/// @brief Read the next message of a topic, expecting it to be str.
+static void expect_message(uint32_t fid, const char* str) {
+  size_t len = strlen(str);
+
+  assert(readat(fid, 0, 100) == RFS__9P_RREAD);
+  assert(_r.count == len && memcmp(_r.data, str, len) == 0);
+}
+
+static void test_backpressure(void) {
+  rfs__ramfs_t fs;
+  server_t server;
+  uv_thread_t thread;
+  int fds[2];
+  uint32_t old;
+  uint32_t new;
+  uint32_t wait;
+  uint32_t cut;
+  uint32_t lag;
+
+  assert(rfs__ramfs_init(&fs, "glenda") == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "old", 3,
+                           RFS__RAMFS_DMTOPIC | 0666, &old) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "new", 3,
+                           RFS__RAMFS_DMTOPIC | 0666, &new) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "wait", 4,
+                           RFS__RAMFS_DMTOPIC | 0666, &wait) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "cut", 3,
+                           RFS__RAMFS_DMTOPIC | 0666, &cut) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "lag", 3,
+                           RFS__RAMFS_DMSTATS | 0444, &lag) == 0);
+  assert(rfs__ramfs_create(&fs, RFS__RAMFS_ROOT, "bad", 3,
+                           RFS__RAMFS_DMTOPIC | RFS__RAMFS_DMSTATS | 0444,
+                           NULL) == -EINVAL);
+
+  assert(fs.nodes[old].u.topic.depth == RFS__RAMFS_DEPTH);
+  assert(fs.nodes[old].u.topic.policy == RFS__RAMFS_DROP_OLDEST);
+  assert(rfs__ramfs_topic_policy(&fs, old, RFS__RAMFS_DROP_OLDEST, 2) == 0);
+  assert(rfs__ramfs_topic_policy(&fs, new, RFS__RAMFS_DROP_NEWEST, 2) == 0);
+  assert(rfs__ramfs_topic_policy(&fs, wait, RFS__RAMFS_BLOCK, 2) == 0);
+  assert(rfs__ramfs_topic_policy(&fs, cut, RFS__RAMFS_DISCONNECT, 2) == 0);
+  assert(rfs__ramfs_topic_policy(&fs, lag, RFS__RAMFS_BLOCK, 2) == -EINVAL);
+  assert(rfs__ramfs_topic_policy(&fs, old, RFS__RAMFS_BLOCK, 0) == -EINVAL);
+  assert(rfs__ramfs_write(&fs, lag, 0, "x", 1) == -EPERM);
+
+  serve(&server, &thread, &fs, fds, 2);
+
+  // a subscriber with no room loses its oldest message, or the newest
+  assert(walk(0, 1, "old") == RFS__9P_RWALK);
+  assert(fidopen(1, RFS__9P_ORDWR) == RFS__9P_ROPEN);
+  assert(writeat(1, 0, "a") == RFS__9P_RWRITE);
+  assert(writeat(1, 0, "b") == RFS__9P_RWRITE);
+  assert(writeat(1, 0, "c") == RFS__9P_RWRITE);
+  expect_message(1, "b");
+  expect_message(1, "c");
+
+  assert(walk(0, 2, "new") == RFS__9P_RWALK);
+  assert(fidopen(2, RFS__9P_ORDWR) == RFS__9P_ROPEN);
+  assert(writeat(2, 0, "a") == RFS__9P_RWRITE);
+  assert(writeat(2, 0, "b") == RFS__9P_RWRITE);
+  assert(writeat(2, 0, "c") == RFS__9P_RWRITE);
+  expect_message(2, "a");
+  expect_message(2, "b");
+
+  // each subscriber's lag is described by the stats file, which can only
+  // be read
+  assert(walk(0, 3, "lag") == RFS__9P_RWALK);
+  expect_error(fidopen(3, RFS__9P_ORDWR), "permission denied");
+  assert(fidopen(3, RFS__9P_OREAD) == RFS__9P_ROPEN);
+  assert(readat(3, 0, 100) == RFS__9P_RREAD);
+
+  const char* stats = "old 1 0 2 2 1\nnew 2 0 2 2 1\n";
+  assert(_r.count == strlen(stats));
+  assert(memcmp(_r.data, stats, _r.count) == 0);
+  assert(readat(3, 4, 8) == RFS__9P_RREAD);
+  assert(_r.count == 8 && memcmp(_r.data, "1 0 2 2 ", 8) == 0);
+  assert(fidop(RFS__9P_TCLUNK, 3) == RFS__9P_RCLUNK);
+
+  // a publisher with no room waits until the subscriber reads
+  rfs__9p_call_t call;
+  rfs__9p_msg_t msg;
+
+  assert(walk(0, 4, "wait") == RFS__9P_RWALK);
+  assert(fidopen(4, RFS__9P_ORDWR) == RFS__9P_ROPEN);
+  assert(writeat(4, 0, "a") == RFS__9P_RWRITE);
+  assert(writeat(4, 0, "b") == RFS__9P_RWRITE);
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TWRITE;
+  msg.params.twrite.fid = 4;
+  msg.params.twrite.count = 1;
+  msg.params.twrite.data = (const unsigned char*) "c";
+  _wrote = 0;
+  assert(rfs__9p_session_rpc(_session, &call, &msg, on_wrote) == 0);
+
+  // requests are handled in order, so the write has been held back
+  assert(fidop(RFS__9P_TSTAT, 4) == RFS__9P_RSTAT);
+  assert(_wrote == 0);
+
+  expect_message(4, "a");
+
+  while(_wrote == 0)
+    uv_run(&_loop, UV_RUN_ONCE);
+
+  expect_message(4, "b");
+  expect_message(4, "c");
+
+  // one is left waiting when the connection closes
+  assert(writeat(4, 0, "d") == RFS__9P_RWRITE);
+  assert(writeat(4, 0, "e") == RFS__9P_RWRITE);
+  msg.params.twrite.data = (const unsigned char*) "f";
+  assert(rfs__9p_session_rpc(_session, &call, &msg, on_wrote) == 0);
+
+  // a subscriber with no room is hung up on, even by its own connection,
+  // which leaves the others working
+  _session = &_sessions[1];
+  assert(walk(0, 1, "cut") == RFS__9P_RWALK);
+  assert(fidopen(1, RFS__9P_OREAD) == RFS__9P_ROPEN);
+  assert(walk(0, 2, "cut") == RFS__9P_RWALK);
+  assert(fidopen(2, RFS__9P_OWRITE) == RFS__9P_ROPEN);
+  assert(writeat(2, 0, "x") == RFS__9P_RWRITE);
+  assert(writeat(2, 0, "y") == RFS__9P_RWRITE);
+
+  uint8_t type = writeat(2, 0, "z");
+  assert(type == RFS__9P_RWRITE || type == 0);
+
+  while(_sessions[1].error == 0)
+    uv_run(&_loop, UV_RUN_ONCE);
+
+  _session = &_sessions[0];
+  assert(fidop(RFS__9P_TSTAT, 1) == RFS__9P_RSTAT);
+
+  hangup(&thread, 2);
+
+  // nothing is left subscribed or waiting
+  assert(_wrote == 1);
+
+  for(uint32_t idx = old; idx <= cut; ++idx) {
+    assert(fs.nodes[idx].u.topic.subs == NULL);
+    assert(fs.nodes[idx].u.topic.writes == NULL);
+    assert(fs.nodes[idx].refs == 1);
+  }
+
+  assert(fs.nodes[lag].refs == 1);
+
+  rfs__ramfs_free(&fs);
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  assert(uv_loop_init(&_loop) == 0);
+
+  test_bigdir();
+  test_contents();
+  test_serve();
+  test_pubsub();
+  test_backpressure();
+
+  assert(uv_loop_close(&_loop) == 0);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,212 @@
+#include "src/rfs_readahead.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The size of the file the server serves.
+#define FILESZ (200 * 4096 + 123)
+
+/// @brief The size of each read made by the test.
+#define READSZ 3000
+
+/// @brief The time the server waits before answering each batch, in us.
+#define LATENCY 500
+
+static rfs__9p_session_t _session;
+static rfs__readahead_t _ra;
+static unsigned char _buf[READSZ];
+static uint64_t _offset = 0;
+static int _phase = 0;
+static int _closed = 0;
+
+/// @brief The highest tag the server has seen; tags are handed out lowest
+/// first, so this is one less than the most Treads in flight at once.
+static uint16_t _maxtag = 0;
+
+/// @brief The count of the last Tread the server received.
+static uint32_t _lastcount = 0;
+
+static unsigned char file_byte(uint64_t offset) {
+  return (unsigned char) (offset * 31 + 7);
+}
+
+/// @brief A server which answers every batch of Treads after a delay, so
+/// requests which are pipelined share the delay.
+static void run_server(void* arg) {
+  int fd = *(int*) arg;
+  unsigned char rbuf[4096];
+  unsigned char wbuf[4096 + 64];
+  unsigned char data[4096];
+
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 8192);
+
+  for(;;) {
+    ssize_t nread = read(fd, rbuf, sizeof(rbuf));
+
+    if(nread <= 0)
+      break;
+
+    usleep(LATENCY);
+    rfs__9p_decoder_feed(&dec, rbuf, (size_t) nread);
+
+    const unsigned char* frame;
+    size_t framelen;
+
+    while(rfs__9p_decoder_next(&dec, &frame, &framelen) == 1) {
+      rfs__9p_msg_t req;
+      rfs__9p_msg_init(&req);
+      assert(rfs__9p_msg_unpack(frame, framelen, &req) == framelen);
+      assert(req.type == RFS__9P_TREAD);
+      assert(req.params.tread.count <= sizeof(data));
+
+      if(req.tag > __atomic_load_n(&_maxtag, __ATOMIC_RELAXED))
+        __atomic_store_n(&_maxtag, req.tag, __ATOMIC_RELAXED);
+
+      __atomic_store_n(&_lastcount, req.params.tread.count, __ATOMIC_RELAXED);
+
+      uint64_t offset = req.params.tread.offset;
+      uint32_t count = 0;
+
+      while(count < req.params.tread.count && offset + count < FILESZ) {
+        data[count] = file_byte(offset + count);
+        count++;
+      }
+
+      rfs__9p_msg_t reply;
+      rfs__9p_msg_init(&reply);
+      reply.type = RFS__9P_RREAD;
+      reply.tag = req.tag;
+      reply.params.rread.count = count;
+      reply.params.rread.data = data;
+
+      size_t len = rfs__9p_msg_pack(&reply, wbuf, sizeof(wbuf));
+      assert(len > 0);
+
+      if(write(fd, wbuf, len) != (ssize_t) len)
+        goto done;
+    }
+  }
+
+done:
+  rfs__9p_decoder_reset(&dec);
+  close(fd);
+}
+
+static void on_session_close(rfs__9p_session_t* session) {
+  assert(session == &_session);
+  _closed = 1;
+}
+
+static void on_ra_close(rfs__readahead_t* ra) {
+  assert(ra == &_ra);
+  assert(ra->inflight == 0);
+  rfs__9p_session_close(&_session, on_session_close);
+}
+
+static void on_read(rfs__readahead_t* ra, int ret, size_t count);
+
+/// @brief Check the data of a read and decide what to read next.
+/// @return Nonzero to keep reading sequentially.
+static int consume(size_t count) {
+  for(size_t i = 0; i < count; ++i)
+    assert(_buf[i] == file_byte(_offset + i));
+
+  switch(_phase) {
+    case 0:
+      // stream the whole file; the end is a read of its own
+      if(count > 0) {
+        _offset += count;
+        return 1;
+      }
+
+      assert(_offset == FILESZ);
+      uint16_t maxtag = __atomic_load_n(&_maxtag, __ATOMIC_RELAXED);
+      assert(maxtag > 2);
+      assert(_ra.depth > 2);
+      printf("streamed %d bytes, up to %u Treads in flight\n", FILESZ,
+             maxtag + 1U);
+
+      // a read elsewhere only asks for what it needs
+      _phase = 1;
+      _offset = 12345;
+      return 1;
+
+    case 1:
+      assert(count == 100);
+      assert(__atomic_load_n(&_lastcount, __ATOMIC_RELAXED) == 100);
+
+      _phase = 2;
+      _offset = 0;
+      return 1;
+
+    default:
+      _offset += count;
+
+      if(_offset < 4 * READSZ)
+        return 1;
+
+      // close while read-ahead is in flight
+      assert(_ra.inflight > 0);
+      rfs__readahead_close(&_ra, on_ra_close);
+      return 0;
+  }
+}
+
+/// @brief Read until a read has to wait.
+static void read_more(void) {
+  for(;;) {
+    size_t count = (_phase == 1 ? 100 : READSZ);
+    size_t n;
+    int ret = rfs__readahead_read(&_ra, _offset, _buf, count, &n, on_read);
+
+    assert(ret >= 0);
+
+    if(ret == 0 || !consume(n))
+      return;
+  }
+}
+
+static void on_read(rfs__readahead_t* ra, int ret, size_t count) {
+  assert(ra == &_ra);
+  assert(ret == 0);
+
+  if(consume(count))
+    read_more();
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  uv_loop_t loop;
+  assert(uv_loop_init(&loop) == 0);
+  assert(rfs__9p_session_init(&_session, &loop, fds[0], 32,
+                              4096 + RFS__9P_IOHDRSZ, NULL) == 0);
+  assert(rfs__readahead_init(&_ra, &_session, 1, 0, 4096 + RFS__9P_IOHDRSZ,
+                             RFS__READAHEAD_DEPTH) == 0);
+  assert(_ra.chunk == 4096);
+
+  read_more();
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  assert(_closed);
+  assert(_phase == 2);
+  assert(uv_loop_close(&loop) == 0);
+  uv_thread_join(&server);
+
+  return EXIT_SUCCESS;
+}
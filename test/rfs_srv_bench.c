@@ -0,0 +1,395 @@
+#include "src/rfs_9p_session.h"
+#include "src/rfs_srv_group.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @file A load test of the 9P server.
+/// The server runs as a group of shards, each listening on the same loopback
+/// TCP port with SO_REUSEPORT, and serves a synthetic tree: a root
+/// directory holding BENCH_FILES files whose contents are one static buffer,
+/// so that reads are answered without copying. Each client connection runs on a thread of its own, attaches,
+/// walks to and opens a file, then keeps a window of requests outstanding
+/// for a fixed time, sending the next request as each reply arrives.
+/// Results are written to stdout as CSV, one line per case:
+///   case,shards,conns,window,size,ops,ops_per_s,mb_per_s
+/// where size is the count of each Tread (0 for Tstat).
+/// Build with -DCMAKE_BUILD_TYPE=Release for meaningful numbers.
+///
+/// Usage: rfs_srv_bench [seconds_per_case] [conns] [window] [readsize]
+///                      [shards]
+
+/// @brief The number of files in the tree.
+#define BENCH_FILES 64
+
+/// @brief The size of every file.
+#define BENCH_FILESZ (4 << 20)
+
+/// @brief The most requests a connection may keep outstanding.
+#define BENCH_MAXWINDOW 1024
+
+/// @brief The most connections.
+#define BENCH_MAXCONNS 256
+
+/// @brief The contents of every file.
+static unsigned char _data[BENCH_FILESZ];
+
+/// @brief The parameters of the run.
+static uint64_t _run_ns = 1000ULL * 1000 * 1000;
+static uint32_t _conns = 4;
+static uint32_t _window = 32;
+static uint32_t _readsize = 65536;
+static uint32_t _shards = 1;
+
+static void tree_attach(rfs__srv_req_t* req) {
+  req->ofcall.params.rattach.qid.type = RFS_QTDIR;
+  req->ofcall.params.rattach.qid.path = 0;
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_walk(rfs__srv_req_t* req) {
+  const rfs__9p_msg_t* in = req->ifcall;
+  rfs__9p_msg_t* out = &(req->ofcall);
+
+  // only the root has children, so at most one name can be walked
+  if(in->params.twalk.nwname > 0) {
+    const rfs__9p_str_t* name = &(in->params.twalk.wname[0]);
+    char buf[16];
+    char* end;
+
+    if(name->len < 6 || name->len >= sizeof(buf)
+    || memcmp(name->str, "file-", 5) != 0) {
+      rfs__srv_respond(req, NULL);
+      return;
+    }
+
+    memcpy(buf, name->str, name->len);
+    buf[name->len] = '\0';
+
+    unsigned long i = strtoul(buf + 5, &end, 10);
+
+    if(*end != '\0' || i >= BENCH_FILES) {
+      rfs__srv_respond(req, NULL);
+      return;
+    }
+
+    out->params.rwalk.wqid[0].type = RFS_QTFILE;
+    out->params.rwalk.wqid[0].path = i + 1;
+    out->params.rwalk.nwqid = 1;
+  }
+
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_read(rfs__srv_req_t* req) {
+  uint64_t offset = req->ifcall->params.tread.offset;
+  uint32_t count = req->ifcall->params.tread.count;
+
+  // the root is empty, and every file is the same buffer
+  if(req->fid->qid.path == 0 || offset >= BENCH_FILESZ)
+    count = 0;
+  else if(count > BENCH_FILESZ - offset)
+    count = (uint32_t) (BENCH_FILESZ - offset);
+
+  req->ofcall.params.rread.count = count;
+  req->ofcall.params.rread.data = _data + (count > 0 ? offset : 0);
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_stat(rfs__srv_req_t* req) {
+  rfs__9p_stat_t* stat = req->ofcall.params.rstat.stat;
+
+  stat->qid = req->fid->qid;
+  stat->mode = (req->fid->qid.path == 0 ? RFS_DMDIR | 0555 : 0444);
+  stat->length = (req->fid->qid.path == 0 ? 0 : BENCH_FILESZ);
+  stat->name = rfs__9p_str(req->fid->qid.path == 0 ? "/" : "file");
+  stat->uid = stat->gid = stat->muid = rfs__9p_str("bench");
+  rfs__srv_respond(req, NULL);
+}
+
+static const rfs__srv_ops_t _ops = {
+  .attach = tree_attach,
+  .walk = tree_walk,
+  .read = tree_read,
+  .stat = tree_stat
+};
+
+/// @brief Start the server listening on an ephemeral loopback port.
+/// @return The port.
+static uint16_t server_start(rfs__srv_group_t* group) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // every shard listens on the port, and the kernel spreads the clients
+  assert(fd >= 0);
+  assert(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0);
+  assert(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+  assert(getsockname(fd, (struct sockaddr*) &addr, &len) == 0);
+
+  group->data = NULL;
+  assert(rfs__srv_group_start(group, _shards, &_ops, RFS__SRV_MSIZE, fd,
+                              RFS__SRV_GROUP_PIN) == 0);
+
+  return ntohs(addr.sin_port);
+}
+
+/// @brief A client connection and its load.
+typedef struct bench_client {
+  uv_thread_t thread; ///< Runs the loop.
+  uv_loop_t loop; ///< The client's loop.
+  rfs__bufpool_t pool; ///< The session's buffers.
+  rfs__9p_session_t session; ///< The connection.
+  uint16_t port; ///< The port to connect to.
+  uint32_t index; ///< Selects the file to open.
+  int isread; ///< Set to send Tread rather than Tstat.
+
+  rfs__9p_call_t calls[BENCH_MAXWINDOW]; ///< The outstanding requests.
+  rfs__9p_msg_t msgs[BENCH_MAXWINDOW]; ///< Their messages.
+  int setup; ///< The next setup request to send.
+  uint64_t offset; ///< The offset of the next Tread.
+  uint64_t deadline; ///< The time to stop sending at.
+  uint32_t outstanding; ///< The number of load requests outstanding.
+  uint64_t ops; ///< The number of replies received under load.
+  uint64_t bytes; ///< The number of bytes read under load.
+} bench_client_t;
+
+static void client_send(bench_client_t* client, uint32_t i);
+
+static void on_load(rfs__9p_call_t* call, int ret,
+                    const rfs__9p_msg_t* reply) {
+  bench_client_t* client = call->data;
+
+  assert(ret == 0);
+  assert(reply->type == (client->isread ? RFS__9P_RREAD : RFS__9P_RSTAT));
+
+  client->outstanding--;
+  client->ops++;
+
+  if(client->isread)
+    client->bytes += reply->params.rread.count;
+
+  if(uv_hrtime() < client->deadline)
+    client_send(client, (uint32_t) (call - client->calls));
+  else if(client->outstanding == 0)
+    rfs__9p_session_close(&(client->session), NULL);
+}
+
+/// @brief Send the load request of a slot of the window.
+static void client_send(bench_client_t* client, uint32_t i) {
+  rfs__9p_msg_t* msg = &(client->msgs[i]);
+
+  rfs__9p_msg_init(msg);
+
+  if(client->isread) {
+    msg->type = RFS__9P_TREAD;
+    msg->params.tread.fid = 1;
+    msg->params.tread.offset = client->offset;
+    msg->params.tread.count = _readsize;
+
+    client->offset += _readsize;
+
+    if(client->offset + _readsize > BENCH_FILESZ)
+      client->offset = 0;
+  }
+  else {
+    msg->type = RFS__9P_TSTAT;
+    msg->params.tstat.fid = 1;
+  }
+
+  client->calls[i].data = client;
+  client->outstanding++;
+  assert(rfs__9p_session_rpc(&(client->session), &(client->calls[i]), msg,
+                             on_load) == 0);
+}
+
+static void on_setup(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply);
+
+/// @brief Send the next request of the setup, or start the load once the
+/// file is open.
+static void client_setup(bench_client_t* client) {
+  rfs__9p_msg_t* msg = &(client->msgs[0]);
+  char name[16];
+
+  rfs__9p_msg_init(msg);
+
+  switch(client->setup++) {
+    case 0:
+      msg->type = RFS__9P_TATTACH;
+      msg->params.tattach.fid = 0;
+      msg->params.tattach.afid = RFS__9P_NOFID;
+      msg->params.tattach.uname = rfs__9p_str("bench");
+      break;
+
+    case 1:
+      snprintf(name, sizeof(name), "file-%u", client->index % BENCH_FILES);
+      msg->type = RFS__9P_TWALK;
+      msg->params.twalk.fid = 0;
+      msg->params.twalk.newfid = 1;
+      msg->params.twalk.nwname = 1;
+      msg->params.twalk.wname[0] = rfs__9p_str(name);
+      break;
+
+    case 2:
+      msg->type = RFS__9P_TOPEN;
+      msg->params.topen.fid = 1;
+      msg->params.topen.mode = RFS__9P_OREAD;
+      break;
+
+    default:
+      client->deadline = uv_hrtime() + _run_ns;
+
+      for(uint32_t i = 0; i < _window; ++i)
+        client_send(client, i);
+
+      return;
+  }
+
+  client->calls[0].data = client;
+  assert(rfs__9p_session_rpc(&(client->session), &(client->calls[0]), msg,
+                             on_setup) == 0);
+}
+
+static void on_setup(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply) {
+  bench_client_t* client = call->data;
+
+  assert(ret == 0);
+
+  if(reply->type == RFS__9P_RERROR) {
+    fprintf(stderr, "setup failed: %.*s\n",
+            (int) reply->params.rerror.ename.len,
+            reply->params.rerror.ename.str);
+    abort();
+  }
+
+  client_setup(client);
+}
+
+static void on_version(rfs__9p_session_t* session, int ret) {
+  (void) session;
+  assert(ret == 0);
+}
+
+static void run_client(void* arg) {
+  bench_client_t* client = arg;
+  struct sockaddr_in addr;
+  int one = 1;
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(client->port);
+
+  assert(fd >= 0);
+  assert(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  assert(uv_loop_init(&(client->loop)) == 0);
+  rfs__bufpool_init(&(client->pool), _window, 0);
+  assert(rfs__9p_session_init(&(client->session), &(client->loop), fd,
+                              _window, _readsize + RFS__9P_IOHDRSZ,
+                              &(client->pool)) == 0);
+  assert(rfs__9p_session_version(&(client->session), on_version) == 0);
+
+  client->setup = 0;
+  client_setup(client);
+  uv_run(&(client->loop), UV_RUN_DEFAULT);
+
+  assert(uv_loop_close(&(client->loop)) == 0);
+  rfs__bufpool_free(&(client->pool));
+}
+
+/// @brief Run one case with every connection at once.
+static void bench(const char* name, uint16_t port, int isread) {
+  static bench_client_t clients[BENCH_MAXCONNS];
+  uint64_t ops = 0;
+  uint64_t bytes = 0;
+  uint64_t start = uv_hrtime();
+
+  for(uint32_t i = 0; i < _conns; ++i) {
+    memset(&clients[i], 0, sizeof(clients[i]));
+    clients[i].port = port;
+    clients[i].index = i;
+    clients[i].isread = isread;
+    assert(uv_thread_create(&(clients[i].thread), run_client,
+                            &clients[i]) == 0);
+  }
+
+  for(uint32_t i = 0; i < _conns; ++i) {
+    uv_thread_join(&(clients[i].thread));
+    ops += clients[i].ops;
+    bytes += clients[i].bytes;
+  }
+
+  double secs = (double) (uv_hrtime() - start) / 1e9;
+
+  printf("%s,%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu32 ",%" PRIu64
+         ",%.0f,%.1f\n", name, _shards, _conns, _window,
+         (isread ? _readsize : 0), ops,
+         (double) ops / secs, (double) bytes / secs / (1024.0 * 1024.0));
+}
+
+int main(int argc, char* argv[]) {
+  if(argc > 1)
+    _run_ns = strtoull(argv[1], NULL, 10) * 1000 * 1000 * 1000;
+
+  if(argc > 2)
+    _conns = (uint32_t) strtoul(argv[2], NULL, 10);
+
+  if(argc > 3)
+    _window = (uint32_t) strtoul(argv[3], NULL, 10);
+
+  if(argc > 4)
+    _readsize = (uint32_t) strtoul(argv[4], NULL, 10);
+
+  if(argc > 5)
+    _shards = (uint32_t) strtoul(argv[5], NULL, 10);
+
+  if(_conns == 0 || _conns > BENCH_MAXCONNS
+  || _window == 0 || _window > BENCH_MAXWINDOW
+  || _readsize == 0 || _readsize > BENCH_FILESZ) {
+    fprintf(stderr, "usage: %s [seconds] [conns<=%d] [window<=%d] "
+            "[readsize<=%d] [shards, 0 for one per CPU]\n", argv[0],
+            BENCH_MAXCONNS, BENCH_MAXWINDOW, BENCH_FILESZ);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  for(size_t i = 0; i < sizeof(_data); ++i)
+    _data[i] = (unsigned char) i;
+
+  rfs__srv_group_t group;
+  uint16_t port = server_start(&group);
+
+  if(_shards == 0)
+    _shards = group.nshards;
+
+  printf("case,shards,conns,window,size,ops,ops_per_s,mb_per_s\n");
+
+  bench("stat", port, 0);
+  bench("read", port, 1);
+
+  rfs__srv_group_stop(&group);
+
+  return EXIT_SUCCESS;
+}
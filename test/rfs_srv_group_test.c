@@ -0,0 +1,289 @@
+#include "src/rfs_9p_session.h"
+#include "src/rfs_srv_group.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The number of shards in each group.
+#define NSHARDS 4
+
+/// @brief The number of connections made to each group.
+#define NCONNS (2 * NSHARDS)
+
+/// @brief The group's data, which every shard's server should carry.
+static int _ops_data;
+
+static void tree_attach(rfs__srv_req_t* req) {
+  req->ofcall.params.rattach.qid.type = RFS_QTDIR;
+  rfs__srv_respond(req, NULL);
+}
+
+/// @brief Report the shard serving the request as the file's length.
+static void tree_stat(rfs__srv_req_t* req) {
+  // a shard's server is its first member
+  rfs__srv_shard_t* shard = (rfs__srv_shard_t*) req->conn->srv;
+  rfs__9p_stat_t* stat = req->ofcall.params.rstat.stat;
+
+  assert(req->conn->srv->data == &_ops_data);
+  stat->qid = req->fid->qid;
+  stat->length = shard->index;
+  stat->name = rfs__9p_str("/");
+  rfs__srv_respond(req, NULL);
+}
+
+static const rfs__srv_ops_t _ops = {
+  .attach = tree_attach,
+  .stat = tree_stat
+};
+
+/// @brief A client connection, which attaches, stats the root and hangs up.
+typedef struct client {
+  rfs__9p_session_t session;
+  rfs__9p_call_t call;
+  rfs__9p_msg_t msg;
+  int step;
+} client_t;
+
+static client_t _clients[NCONNS];
+static uint32_t _shards = 0;
+static size_t _done = 0;
+
+static void on_reply(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply) {
+  client_t* client = call->data;
+
+  assert(ret == 0);
+
+  if(client->step++ == 0) {
+    assert(reply->type == RFS__9P_RATTACH);
+
+    rfs__9p_msg_init(&(client->msg));
+    client->msg.type = RFS__9P_TSTAT;
+    client->msg.params.tstat.fid = 0;
+    assert(rfs__9p_session_rpc(&(client->session), &(client->call),
+                               &(client->msg), on_reply) == 0);
+    return;
+  }
+
+  assert(reply->type == RFS__9P_RSTAT);
+  assert(reply->params.rstat.stat->length < NSHARDS);
+
+  _shards |= 1u << reply->params.rstat.stat->length;
+  _done++;
+
+  rfs__9p_session_close(&(client->session), NULL);
+}
+
+/// @brief Attach and stat over every descriptor, and wait until all of
+/// them have hung up.
+static void run_clients(const int* fds) {
+  uv_loop_t loop;
+
+  assert(uv_loop_init(&loop) == 0);
+
+  _shards = 0;
+  _done = 0;
+
+  for(size_t i = 0; i < NCONNS; ++i) {
+    client_t* client = &_clients[i];
+
+    client->step = 0;
+    client->call.data = client;
+    assert(rfs__9p_session_init(&(client->session), &loop, fds[i], 4,
+                                8192 + RFS__9P_IOHDRSZ, NULL) == 0);
+    assert(rfs__9p_session_version(&(client->session), NULL) == 0);
+
+    rfs__9p_msg_init(&(client->msg));
+    client->msg.type = RFS__9P_TATTACH;
+    client->msg.params.tattach.fid = 0;
+    client->msg.params.tattach.afid = RFS__9P_NOFID;
+    client->msg.params.tattach.uname = rfs__9p_str("glenda");
+    assert(rfs__9p_session_rpc(&(client->session), &(client->call),
+                               &(client->msg), on_reply) == 0);
+  }
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+  assert(uv_loop_close(&loop) == 0);
+  assert(_done == NCONNS);
+}
+
+/// @brief Create a loopback TCP socket bound to an ephemeral port.
+static int bind_loopback(int reuseport, struct sockaddr_in* addr) {
+  socklen_t len = sizeof(*addr);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  int on = 1;
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  assert(fd >= 0);
+
+  if(reuseport)
+    assert(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0);
+
+  assert(bind(fd, (struct sockaddr*) addr, sizeof(*addr)) == 0);
+  assert(getsockname(fd, (struct sockaddr*) addr, &len) == 0);
+
+  return fd;
+}
+
+static void connect_all(const struct sockaddr_in* addr, int* fds) {
+  for(size_t i = 0; i < NCONNS; ++i) {
+    fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fds[i] >= 0);
+    assert(connect(fds[i], (const struct sockaddr*) addr,
+                   sizeof(*addr)) == 0);
+  }
+}
+
+/// @brief A listener without SO_REUSEPORT is accepted on one shard and its
+/// connections are handed round-robin to all of them.
+static void test_handoff(void) {
+  rfs__srv_group_t group;
+  struct sockaddr_in addr;
+  int fds[NCONNS];
+
+  group.data = &_ops_data;
+  assert(rfs__srv_group_start(&group, NSHARDS, &_ops, 65536,
+                              bind_loopback(0, &addr),
+                              RFS__SRV_GROUP_PIN) == 0);
+
+  connect_all(&addr, fds);
+  run_clients(fds);
+  assert(_shards == (1u << NSHARDS) - 1);
+
+  rfs__srv_group_stop(&group);
+}
+
+/// @brief With SO_REUSEPORT, every shard listens on the same port.
+static void test_reuseport(void) {
+  rfs__srv_group_t group;
+  struct sockaddr_in addr;
+  int fds[NCONNS];
+
+  group.data = &_ops_data;
+  assert(rfs__srv_group_start(&group, NSHARDS, &_ops, 65536,
+                              bind_loopback(1, &addr), 0) == 0);
+
+  connect_all(&addr, fds);
+  run_clients(fds);
+
+  // the kernel picks the shard, so only check that each one was valid
+  assert(_shards != 0);
+
+  rfs__srv_group_stop(&group);
+}
+
+/// @brief Connected descriptors may be passed in from any thread.
+static void test_accept(void) {
+  rfs__srv_group_t group;
+  int fds[NCONNS];
+
+  group.data = &_ops_data;
+  assert(rfs__srv_group_start(&group, NSHARDS, &_ops, 65536, -1, 0) == 0);
+
+  for(size_t i = 0; i < NCONNS; ++i) {
+    int pair[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0);
+    assert(rfs__srv_group_accept(&group, pair[1]) == 0);
+    fds[i] = pair[0];
+  }
+
+  run_clients(fds);
+  assert(_shards == (1u << NSHARDS) - 1);
+
+  rfs__srv_group_stop(&group);
+}
+
+/// @brief Find the CPU time the process has used, in ms.
+static uint64_t cpu_ms(void) {
+  struct rusage usage;
+
+  assert(getrusage(RUSAGE_SELF, &usage) == 0);
+
+  return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000
+       + (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+/// @brief A listener which can't accept for want of descriptors backs off
+/// rather than spinning, and accepts once descriptors are free again.
+static void test_emfile(void) {
+  rfs__srv_group_t group;
+  struct sockaddr_in addr;
+  struct rlimit limit;
+  int fds[NCONNS];
+
+  group.data = &_ops_data;
+  assert(rfs__srv_group_start(&group, NSHARDS, &_ops, 65536,
+                              bind_loopback(0, &addr), 0) == 0);
+
+  for(size_t i = 0; i < NCONNS; ++i) {
+    fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fds[i] >= 0);
+  }
+
+  // with the limit at the lowest free descriptor, every accept fails; the
+  // clients' sockets already exist, so they can still connect
+  assert(getrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+  struct rlimit lowered = limit;
+  int lowest = dup(0);
+  assert(lowest >= 0);
+  close(lowest);
+
+  lowered.rlim_cur = (rlim_t) lowest;
+  assert(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+
+  for(size_t i = 0; i < NCONNS; ++i)
+    assert(connect(fds[i], (const struct sockaddr*) &addr,
+                   sizeof(addr)) == 0);
+
+  for(int i = 0; i < 1000
+  && __atomic_load_n(&(group.backoffs), __ATOMIC_RELAXED) == 0; ++i)
+    usleep(1000);
+
+  uint32_t backoffs = __atomic_load_n(&(group.backoffs), __ATOMIC_RELAXED);
+  assert(backoffs > 0);
+
+  uint64_t start = cpu_ms();
+  usleep(300 * 1000);
+  uint64_t used = cpu_ms() - start;
+
+  backoffs = __atomic_load_n(&(group.backoffs), __ATOMIC_RELAXED) - backoffs;
+
+  assert(setrlimit(RLIMIT_NOFILE, &limit) == 0);
+
+  // each retry waits out the backoff, so a few at most fit in the window;
+  // a spinning shard would also use all of the time
+  printf("%u retries and %llu ms of CPU used while out of descriptors\n",
+         backoffs, (unsigned long long) used);
+  assert(backoffs <= 300 / 100 + 2);
+  assert(used < 100);
+
+  run_clients(fds);
+  assert(_shards == (1u << NSHARDS) - 1);
+
+  rfs__srv_group_stop(&group);
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  test_handoff();
+  test_reuseport();
+  test_accept();
+  test_emfile();
+
+  return EXIT_SUCCESS;
+}
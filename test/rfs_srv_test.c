@@ -0,0 +1,573 @@
+#include "src/rfs_9p_session.h"
+#include "src/rfs_srv.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The msize the server agrees to.
+#define SRV_MSIZE (65536 + RFS__9P_IOHDRSZ)
+
+/// @brief The qid paths of the tree's files.
+enum { ROOT = 0, HELLO = 1, SLOW = 2 };
+
+static char _hello[] = "hello, world\n";
+
+/// @brief The server's state, only touched by the server thread.
+static rfs__srv_req_t* _blocked = NULL;
+static size_t _destroyed = 0;
+static size_t _released = 0;
+
+/// @brief The client's state.
+static rfs__9p_session_t _session;
+static rfs__9p_call_t _call;
+static rfs__9p_call_t _flush_call;
+static rfs__9p_msg_t _msg;
+static rfs__9p_msg_t _flush_msg;
+static size_t _step = 0;
+static int _read_flushed = 0;
+static int _flushed = 0;
+static int _closed = 0;
+
+/// @brief Requests the tree holds until the next Tstat, even once flushed.
+static rfs__srv_req_t* _held[2];
+static size_t _nheld = 0;
+
+/// @brief Hold a request whose first name is "held".
+static int tree_hold(rfs__srv_req_t* req, const rfs__9p_str_t* name) {
+  if(name->len != 4 || memcmp(name->str, "held", 4) != 0)
+    return 0;
+
+  assert(_nheld < sizeof(_held) / sizeof(_held[0]));
+  _held[_nheld++] = req;
+
+  return 1;
+}
+
+static void tree_attach(rfs__srv_req_t* req) {
+  if(tree_hold(req, &(req->ifcall->params.tattach.uname)))
+    return;
+
+  req->fid->aux = (void*) _hello;
+  req->ofcall.params.rattach.qid.path = ROOT;
+  req->ofcall.params.rattach.qid.type = RFS_QTDIR;
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_walk(rfs__srv_req_t* req) {
+  const rfs__9p_msg_t* in = req->ifcall;
+  rfs__9p_msg_t* out = &(req->ofcall);
+
+  if(in->params.twalk.nwname > 0
+  && tree_hold(req, &(in->params.twalk.wname[0])))
+    return;
+
+  for(uint16_t i = 0; i < in->params.twalk.nwname; ++i) {
+    const rfs__9p_str_t* name = &(in->params.twalk.wname[i]);
+    rfs_qid_t qid = { .path = 0, .vers = 0, .type = RFS_QTFILE };
+
+    if(name->len == 5 && memcmp(name->str, "hello", 5) == 0)
+      qid.path = HELLO;
+    else if(name->len == 4 && memcmp(name->str, "slow", 4) == 0)
+      qid.path = SLOW;
+    else
+      break;
+
+    out->params.rwalk.wqid[out->params.rwalk.nwqid++] = qid;
+  }
+
+  if(out->params.rwalk.nwqid == in->params.twalk.nwname)
+    req->newfid->aux = (void*) _hello;
+
+  rfs__srv_respond(req, NULL);
+}
+
+static void on_release(void* data) {
+  assert(data == _hello);
+  _released++;
+}
+
+static void tree_read(rfs__srv_req_t* req) {
+  // reads of the slow file wait until they are flushed
+  if(req->fid->qid.path == SLOW) {
+    assert(_blocked == NULL);
+    _blocked = req;
+    return;
+  }
+
+  uint64_t offset = req->ifcall->params.tread.offset;
+  uint32_t count = req->ifcall->params.tread.count;
+
+  if(offset > sizeof(_hello) - 1)
+    offset = sizeof(_hello) - 1;
+
+  if(count > sizeof(_hello) - 1 - offset)
+    count = (uint32_t) (sizeof(_hello) - 1 - offset);
+
+  req->ofcall.params.rread.count = count;
+  req->ofcall.params.rread.data = (const unsigned char*) _hello + offset;
+  req->release = on_release;
+  req->release_data = (void*) _hello;
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_stat(rfs__srv_req_t* req) {
+  rfs__9p_stat_t* stat = req->ofcall.params.rstat.stat;
+
+  // a tree may answer a flushed request late, and with an error
+  while(_nheld > 0)
+    rfs__srv_respond(_held[--_nheld], "too late");
+
+  stat->qid = req->fid->qid;
+  stat->name = rfs__9p_str(req->fid->qid.path == HELLO ? "hello" : "slow");
+  stat->length = sizeof(_hello) - 1;
+  rfs__srv_respond(req, NULL);
+}
+
+static void tree_flush(rfs__srv_req_t* req) {
+  for(size_t i = 0; i < _nheld; ++i) {
+    if(_held[i] == req)
+      return;
+  }
+
+  assert(req == _blocked);
+  _blocked = NULL;
+  rfs__srv_respond(req, "interrupted");
+}
+
+static void tree_destroyfid(rfs__srv_fid_t* fid) {
+  assert(fid->aux == NULL || fid->aux == _hello);
+  _destroyed++;
+}
+
+static const rfs__srv_ops_t _ops = {
+  .attach = tree_attach,
+  .walk = tree_walk,
+  .read = tree_read,
+  .stat = tree_stat,
+  .flush = tree_flush,
+  .destroyfid = tree_destroyfid
+};
+
+/// @brief Serve one connection until the client hangs up.
+static void run_server(void* arg) {
+  int fd = *(int*) arg;
+  uv_loop_t loop;
+  rfs__srv_t srv;
+
+  assert(uv_loop_init(&loop) == 0);
+  rfs__srv_init(&srv, &loop, &_ops, SRV_MSIZE);
+  assert(rfs__srv_accept(&srv, fd) == 0);
+
+  // the loop runs out of handles once the connection has closed
+  uv_run(&loop, UV_RUN_DEFAULT);
+  rfs__srv_close(&srv, NULL);
+  uv_run(&loop, UV_RUN_DEFAULT);
+  assert(uv_loop_close(&loop) == 0);
+}
+
+/// @brief One request of the script, and the reply it should get.
+typedef struct step {
+  uint8_t type; ///< The T-message type.
+  uint32_t fid; ///< The fid it's on.
+  uint32_t newfid; ///< For Twalk, the new fid; for Tattach, the afid.
+  const char* arg; ///< The name walked, or the data written.
+  uint8_t mode; ///< For Topen, the mode.
+  uint8_t expect; ///< The type of the reply.
+  const char* ename; ///< For Rerror, the error.
+  uint64_t qpath; ///< The qid path returned, if any.
+} step_t;
+
+static const step_t _steps[] = {
+  { RFS__9P_TATTACH, 0, RFS__9P_NOFID, NULL, 0, RFS__9P_RATTACH, NULL, ROOT },
+  { RFS__9P_TATTACH, 0, RFS__9P_NOFID, NULL, 0, RFS__9P_RERROR,
+    "fid in use", 0 },
+  { RFS__9P_TATTACH, 9, 3, NULL, 0, RFS__9P_RERROR,
+    "authentication not required", 0 },
+  { RFS__9P_TWALK, 0, 1, "missing", 0, RFS__9P_RERROR,
+    "file does not exist", 0 },
+  { RFS__9P_TWALK, 0, 1, "hello", 0, RFS__9P_RWALK, NULL, HELLO },
+  { RFS__9P_TWALK, 1, 3, "hello", 0, RFS__9P_RERROR, "not a directory", 0 },
+  { RFS__9P_TREAD, 1, 0, NULL, 0, RFS__9P_RERROR,
+    "fid not open for reading", 0 },
+  { RFS__9P_TOPEN, 1, 0, NULL, RFS__9P_OREAD, RFS__9P_ROPEN, NULL, HELLO },
+  { RFS__9P_TOPEN, 1, 0, NULL, RFS__9P_OREAD, RFS__9P_RERROR,
+    "fid already open", 0 },
+  { RFS__9P_TREAD, 1, 0, NULL, 0, RFS__9P_RREAD, NULL, 0 },
+  { RFS__9P_TWRITE, 1, 0, "x", 0, RFS__9P_RERROR,
+    "fid not open for writing", 0 },
+  { RFS__9P_TSTAT, 1, 0, NULL, 0, RFS__9P_RSTAT, NULL, HELLO },
+  { RFS__9P_TWALK, 0, 2, "slow", 0, RFS__9P_RWALK, NULL, SLOW },
+  { RFS__9P_TOPEN, 0, 0, NULL, RFS__9P_OWRITE, RFS__9P_RERROR,
+    "is a directory", 0 },
+  { RFS__9P_TOPEN, 2, 0, NULL, RFS__9P_OREAD, RFS__9P_ROPEN, NULL, SLOW },
+  { RFS__9P_TCLUNK, 1, 0, NULL, 0, RFS__9P_RCLUNK, NULL, 0 },
+  { RFS__9P_TCLUNK, 1, 0, NULL, 0, RFS__9P_RERROR, "unknown fid", 0 },
+  { RFS__9P_TREMOVE, 0, 0, NULL, 0, RFS__9P_RERROR,
+    "operation not supported", 0 },
+  { RFS__9P_TSTAT, 0, 0, NULL, 0, RFS__9P_RERROR, "unknown fid", 0 }
+};
+
+#define NSTEPS (sizeof(_steps) / sizeof(_steps[0]))
+
+static void on_session_close(rfs__9p_session_t* session) {
+  assert(session == &_session);
+  _closed = 1;
+}
+
+static void send_step(void);
+
+static void on_flushed_read(rfs__9p_call_t* call, int ret,
+                            const rfs__9p_msg_t* reply) {
+  (void) call;
+  assert(ret == 0);
+  assert(!_flushed);
+  assert(reply->type == RFS__9P_RERROR);
+  assert(reply->params.rerror.ename.len == 11);
+  assert(memcmp(reply->params.rerror.ename.str, "interrupted", 11) == 0);
+  _read_flushed = 1;
+}
+
+static void on_flush(rfs__9p_call_t* call, int ret,
+                     const rfs__9p_msg_t* reply) {
+  (void) call;
+  assert(ret == 0);
+  assert(reply->type == RFS__9P_RFLUSH);
+
+  // the flushed request is answered first
+  assert(_read_flushed);
+  _flushed = 1;
+
+  send_step();
+}
+
+static void on_step(rfs__9p_call_t* call, int ret,
+                    const rfs__9p_msg_t* reply) {
+  (void) call;
+
+  const step_t* step = &_steps[_step];
+
+  assert(ret == 0);
+
+  if(reply->type != step->expect) {
+    fprintf(stderr, "step %zu: got %d, expected %d\n", _step, reply->type,
+            step->expect);
+    abort();
+  }
+
+  switch(reply->type) {
+    case RFS__9P_RERROR:
+      assert(reply->params.rerror.ename.len == strlen(step->ename));
+      assert(memcmp(reply->params.rerror.ename.str, step->ename,
+                    strlen(step->ename)) == 0);
+      break;
+
+    case RFS__9P_RATTACH:
+      assert(reply->params.rattach.qid.path == step->qpath);
+      assert(reply->params.rattach.qid.type == RFS_QTDIR);
+      break;
+
+    case RFS__9P_RWALK:
+      assert(reply->params.rwalk.nwqid == 1);
+      assert(reply->params.rwalk.wqid[0].path == step->qpath);
+      break;
+
+    case RFS__9P_ROPEN:
+      assert(reply->params.ropen.qid.path == step->qpath);
+      break;
+
+    case RFS__9P_RREAD:
+      assert(reply->params.rread.count == sizeof(_hello) - 1);
+      assert(memcmp(reply->params.rread.data, _hello,
+                    sizeof(_hello) - 1) == 0);
+      break;
+
+    case RFS__9P_RSTAT:
+      assert(reply->params.rstat.stat->qid.path == step->qpath);
+      assert(reply->params.rstat.stat->length == sizeof(_hello) - 1);
+      break;
+  }
+
+  _step++;
+
+  // a blocked read is answered once it's flushed
+  if(_steps[_step - 1].type == RFS__9P_TOPEN
+  && _steps[_step - 1].fid == 2 && !_flushed) {
+    rfs__9p_msg_init(&_msg);
+    _msg.type = RFS__9P_TREAD;
+    _msg.params.tread.fid = 2;
+    _msg.params.tread.count = 100;
+    assert(rfs__9p_session_rpc(&_session, &_call, &_msg,
+                               on_flushed_read) == 0);
+
+    rfs__9p_msg_init(&_flush_msg);
+    _flush_msg.type = RFS__9P_TFLUSH;
+    _flush_msg.params.tflush.oldtag = _msg.tag;
+    assert(rfs__9p_session_rpc(&_session, &_flush_call, &_flush_msg,
+                               on_flush) == 0);
+    return;
+  }
+
+  send_step();
+}
+
+/// @brief Send the next request of the script, or hang up after the last.
+static void send_step(void) {
+  if(_step == NSTEPS) {
+    rfs__9p_session_close(&_session, on_session_close);
+    return;
+  }
+
+  const step_t* step = &_steps[_step];
+
+  rfs__9p_msg_init(&_msg);
+  _msg.type = step->type;
+
+  switch(step->type) {
+    case RFS__9P_TATTACH:
+      _msg.params.tattach.fid = step->fid;
+      _msg.params.tattach.afid = step->newfid;
+      _msg.params.tattach.uname = rfs__9p_str("glenda");
+      break;
+
+    case RFS__9P_TWALK:
+      _msg.params.twalk.fid = step->fid;
+      _msg.params.twalk.newfid = step->newfid;
+      _msg.params.twalk.nwname = 1;
+      _msg.params.twalk.wname[0] = rfs__9p_str(step->arg);
+      break;
+
+    case RFS__9P_TOPEN:
+      _msg.params.topen.fid = step->fid;
+      _msg.params.topen.mode = step->mode;
+      break;
+
+    case RFS__9P_TREAD:
+      _msg.params.tread.fid = step->fid;
+      _msg.params.tread.count = 1 << 20;
+      break;
+
+    case RFS__9P_TWRITE:
+      _msg.params.twrite.fid = step->fid;
+      _msg.params.twrite.count = (uint32_t) strlen(step->arg);
+      _msg.params.twrite.data = (const unsigned char*) step->arg;
+      break;
+
+    default:
+      // Tclunk, Tremove and Tstat share their layout
+      _msg.params.tclunk.fid = step->fid;
+      break;
+  }
+
+  assert(rfs__9p_session_rpc(&_session, &_call, &_msg, on_step) == 0);
+}
+
+static void on_version(rfs__9p_session_t* session, int ret) {
+  assert(ret == 0);
+  assert(session->msize == SRV_MSIZE);
+}
+
+/// @brief A Twalk with more names than a message can hold is malformed, so
+/// the server hangs up rather than decoding it.
+static void test_oversized_walk(void) {
+  unsigned char frame[128];
+  uint16_t nwname = RFS__9P_MAXWELEM + 1;
+  size_t len = 17;
+  int fds[2];
+
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  // size[4] Twalk tag[2] fid[4] newfid[4] nwname[2], then a one byte name
+  // per element
+  memset(frame, 0, sizeof(frame));
+  frame[4] = RFS__9P_TWALK;
+  frame[15] = (unsigned char) (nwname & 0xff);
+  frame[16] = (unsigned char) (nwname >> 8);
+
+  for(uint16_t i = 0; i < nwname; ++i) {
+    frame[len] = 1;
+    frame[len + 2] = 'a';
+    len += 3;
+  }
+
+  assert(len <= sizeof(frame));
+  frame[0] = (unsigned char) len;
+
+  assert(write(fds[0], frame, len) == (ssize_t) len);
+
+  // the server closes the connection without replying
+  char c;
+  assert(read(fds[0], &c, 1) == 0);
+
+  close(fds[0]);
+  uv_thread_join(&server);
+}
+
+/// @brief Pack a message into a buffer of frames.
+static size_t pack(unsigned char* buf, size_t bufsize, rfs__9p_msg_t* msg,
+                   uint16_t tag) {
+  msg->tag = tag;
+
+  size_t len = rfs__9p_msg_pack(msg, buf, bufsize);
+  assert(len > 0);
+
+  return len;
+}
+
+static size_t pack_version(unsigned char* buf, size_t bufsize) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TVERSION;
+  msg.params.version.msize = SRV_MSIZE;
+  msg.params.version.version = rfs__9p_str("9P2000");
+
+  return pack(buf, bufsize, &msg, RFS__9P_NOTAG);
+}
+
+static size_t pack_attach(unsigned char* buf, size_t bufsize, uint32_t fid,
+                          const char* uname, uint16_t tag) {
+  rfs__9p_msg_t msg;
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TATTACH;
+  msg.params.tattach.fid = fid;
+  msg.params.tattach.afid = RFS__9P_NOFID;
+  msg.params.tattach.uname = rfs__9p_str(uname);
+
+  return pack(buf, bufsize, &msg, tag);
+}
+
+/// @brief Tversion clears the fids of requests the tree still holds, which
+/// it may then answer with an error after their numbers are reused.
+static void test_version_reset(void) {
+  unsigned char frames[1024];
+  unsigned char replies[4096];
+  rfs__9p_msg_t msg;
+  size_t len = 0;
+  size_t got = 0;
+  int fds[2];
+
+  _destroyed = 0;
+
+  // attach fid 0, hold a walk to fid 1 and an attach of fid 5, start a
+  // new session, reuse all three numbers, then have the tree answer the
+  // held requests
+  len += pack_version(frames + len, sizeof(frames) - len);
+  len += pack_attach(frames + len, sizeof(frames) - len, 0, "glenda", 1);
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TWALK;
+  msg.params.twalk.fid = 0;
+  msg.params.twalk.newfid = 1;
+  msg.params.twalk.nwname = 1;
+  msg.params.twalk.wname[0] = rfs__9p_str("held");
+  len += pack(frames + len, sizeof(frames) - len, &msg, 2);
+
+  len += pack_attach(frames + len, sizeof(frames) - len, 5, "held", 3);
+  len += pack_version(frames + len, sizeof(frames) - len);
+  len += pack_attach(frames + len, sizeof(frames) - len, 0, "glenda", 1);
+  len += pack_attach(frames + len, sizeof(frames) - len, 1, "glenda", 2);
+  len += pack_attach(frames + len, sizeof(frames) - len, 5, "glenda", 3);
+
+  rfs__9p_msg_init(&msg);
+  msg.type = RFS__9P_TSTAT;
+  msg.params.tstat.fid = 5;
+  len += pack(frames + len, sizeof(frames) - len, &msg, 4);
+
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  assert(write(fds[0], frames, len) == (ssize_t) len);
+  assert(shutdown(fds[0], SHUT_WR) == 0);
+
+  for(;;) {
+    ssize_t n = read(fds[0], replies + got, sizeof(replies) - got);
+    assert(n >= 0);
+
+    if(n == 0)
+      break;
+
+    got += (size_t) n;
+  }
+
+  close(fds[0]);
+  uv_thread_join(&server);
+
+  // the new session's fids kept their state, so the stat of fid 5 is of
+  // the root it was attached to
+  size_t off = 0;
+  int stated = 0;
+
+  while(off < got) {
+    rfs__9p_stat_t stat;
+
+    rfs__9p_msg_init(&msg);
+    msg.params.rstat.stat = &stat;
+
+    size_t n = rfs__9p_msg_unpack(replies + off, got - off, &msg);
+    assert(n > 0);
+
+    if(msg.type == RFS__9P_RSTAT) {
+      assert(msg.tag == 4 && stat.qid.path == ROOT);
+      assert(stat.qid.type == RFS_QTDIR);
+      stated = 1;
+    }
+
+    off += n;
+  }
+
+  assert(stated);
+
+  // fids 0, 1 and 5 of both sessions
+  assert(_nheld == 0);
+  assert(_destroyed == 6);
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  uv_loop_t loop;
+  assert(uv_loop_init(&loop) == 0);
+  assert(rfs__9p_session_init(&_session, &loop, fds[0], 8, 1 << 20,
+                              NULL) == 0);
+  assert(rfs__9p_session_version(&_session, on_version) == 0);
+
+  send_step();
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  assert(_closed && _flushed && _step == NSTEPS);
+  assert(uv_loop_close(&loop) == 0);
+  uv_thread_join(&server);
+
+  // fids 0, 1 and 2 and the newfid of the failed walk are all destroyed,
+  // and the one Rread's data was released
+  assert(_blocked == NULL);
+  assert(_destroyed == 4);
+  assert(_released == 1);
+
+  printf("%zu requests served\n", NSTEPS + 2);
+
+  test_oversized_walk();
+  test_version_reset();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,201 @@
+#include "src/rfs_writebehind.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+/// @brief The number of records written.
+#define RECORDS 10000
+
+/// @brief The size of each record.
+#define RECORDSZ 37
+
+/// @brief The fid the server answers with Rerror.
+#define ERROR_FID 2
+
+/// @brief The time the server waits before answering each batch, in us.
+#define LATENCY 200
+
+static rfs__9p_session_t _session;
+static rfs__writebehind_t _wb;
+static rfs__writebehind_t _bad;
+static unsigned char _records[RECORDS * RECORDSZ];
+static size_t _written = 0;
+static int _flushed = 0;
+static int _failed = 0;
+static int _closed = 0;
+
+/// @brief The file as written by the server, and the number of Twrites.
+static unsigned char _file[RECORDS * RECORDSZ];
+static size_t _twrites = 0;
+
+/// @brief A server which answers every batch of Twrites after a delay.
+/// The first Twrite is only half written, so the client has to send the
+/// rest again.
+static void run_server(void* arg) {
+  int fd = *(int*) arg;
+  unsigned char rbuf[8192];
+  unsigned char wbuf[64];
+
+  rfs__9p_decoder_t dec;
+  rfs__9p_decoder_init(&dec, 8192);
+
+  for(;;) {
+    ssize_t nread = read(fd, rbuf, sizeof(rbuf));
+
+    if(nread <= 0)
+      break;
+
+    usleep(LATENCY);
+    rfs__9p_decoder_feed(&dec, rbuf, (size_t) nread);
+
+    const unsigned char* frame;
+    size_t framelen;
+
+    while(rfs__9p_decoder_next(&dec, &frame, &framelen) == 1) {
+      rfs__9p_msg_t req;
+      rfs__9p_msg_init(&req);
+      assert(rfs__9p_msg_unpack(frame, framelen, &req) == framelen);
+      assert(req.type == RFS__9P_TWRITE);
+
+      rfs__9p_msg_t reply;
+      rfs__9p_msg_init(&reply);
+      reply.tag = req.tag;
+
+      if(req.params.twrite.fid == ERROR_FID) {
+        reply.type = RFS__9P_RERROR;
+        reply.params.rerror.ename = rfs__9p_str("disk full");
+      }
+      else {
+        uint64_t offset = req.params.twrite.offset;
+        uint32_t count = req.params.twrite.count;
+
+        if(__atomic_fetch_add(&_twrites, 1, __ATOMIC_RELAXED) == 0)
+          count /= 2;
+
+        assert(offset + count <= sizeof(_file));
+        memcpy(_file + offset, req.params.twrite.data, count);
+
+        reply.type = RFS__9P_RWRITE;
+        reply.params.rwrite.count = count;
+      }
+
+      size_t len = rfs__9p_msg_pack(&reply, wbuf, sizeof(wbuf));
+      assert(len > 0);
+
+      if(write(fd, wbuf, len) != (ssize_t) len)
+        goto done;
+    }
+  }
+
+done:
+  rfs__9p_decoder_reset(&dec);
+  close(fd);
+}
+
+static void on_session_close(rfs__9p_session_t* session) {
+  assert(session == &_session);
+  _closed = 1;
+}
+
+static void on_bad_close(rfs__writebehind_t* wb) {
+  assert(wb == &_bad);
+  rfs__9p_session_close(&_session, on_session_close);
+}
+
+static void on_wb_close(rfs__writebehind_t* wb) {
+  assert(wb == &_wb);
+  assert(wb->inflight == 0);
+  rfs__writebehind_close(&_bad, on_bad_close);
+}
+
+static void on_bad_flush(rfs__writebehind_t* wb, int ret) {
+  assert(wb == &_bad);
+  assert(ret == -EIO);
+  _failed = 1;
+
+  rfs__writebehind_close(&_wb, on_wb_close);
+}
+
+static void on_flush(rfs__writebehind_t* wb, int ret) {
+  assert(wb == &_wb);
+  assert(ret == 0);
+
+  size_t twrites = __atomic_load_n(&_twrites, __ATOMIC_RELAXED);
+  assert(memcmp(_file, _records, sizeof(_file)) == 0);
+  assert(twrites < RECORDS / 10);
+  printf("%d records written in %zu Twrites\n", RECORDS, twrites);
+  _flushed = 1;
+
+  // a failed Twrite is reported by the flush which follows it
+  unsigned char record[RECORDSZ] = { 0 };
+  assert(rfs__writebehind_write(&_bad, 0, record, sizeof(record),
+                                on_bad_flush) == 1);
+  assert(rfs__writebehind_flush(&_bad, on_bad_flush) == 0);
+}
+
+static void on_write(rfs__writebehind_t* wb, int ret);
+
+/// @brief Write records until a write has to wait, then flush once they
+/// have all been written.
+static void write_more(void) {
+  while(_written < RECORDS) {
+    int ret = rfs__writebehind_write(&_wb, _written * RECORDSZ,
+                                     _records + _written * RECORDSZ,
+                                     RECORDSZ, on_write);
+
+    assert(ret >= 0);
+    _written++;
+
+    if(ret == 0)
+      return;
+  }
+
+  assert(rfs__writebehind_flush(&_wb, on_flush) == 0);
+}
+
+static void on_write(rfs__writebehind_t* wb, int ret) {
+  assert(wb == &_wb);
+  assert(ret == 0);
+  write_more();
+}
+
+int main(void) {
+  signal(SIGPIPE, SIG_IGN);
+
+  for(size_t i = 0; i < sizeof(_records); ++i)
+    _records[i] = (unsigned char) (i * 13 + i / RECORDSZ);
+
+  int fds[2];
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  uv_thread_t server;
+  assert(uv_thread_create(&server, run_server, &fds[1]) == 0);
+
+  uv_loop_t loop;
+  assert(uv_loop_init(&loop) == 0);
+  assert(rfs__9p_session_init(&_session, &loop, fds[0], 32, 8192, NULL) == 0);
+
+  // a small iounit and few buffers, so writes have to wait for buffers
+  assert(rfs__writebehind_init(&_wb, &_session, 1, 4096, 8192, 4) == 0);
+  assert(rfs__writebehind_init(&_bad, &_session, ERROR_FID, 0, 8192,
+                               RFS__WRITEBEHIND_DEPTH) == 0);
+  assert(_wb.chunk == 4096);
+
+  write_more();
+  uv_run(&loop, UV_RUN_DEFAULT);
+
+  assert(_written == RECORDS);
+  assert(_flushed && _failed && _closed);
+  assert(uv_loop_close(&loop) == 0);
+  uv_thread_join(&server);
+
+  return EXIT_SUCCESS;
+}